@@ -50,6 +50,7 @@
 #include "vas.h"
 #include "vqueue.h"
 #include "vtree.h"
+#include "vtw.h"
 
 #include "vapi/vsl_int.h"
 
@@ -360,13 +361,17 @@ struct objcore {
 
 	uint16_t		oa_present;
 
-	unsigned		timer_idx;	// XXX 4Gobj limit
+	uint8_t			lru_ref;	// unlocked hint
+	uint8_t			lru_queue;
 	vtim_real		last_lru;
+	struct vtw_timer	timer;
 	VTAILQ_ENTRY(objcore)	hsh_list;
 	VTAILQ_ENTRY(objcore)	lru_list;
 	VTAILQ_ENTRY(objcore)	ban_list;
 	VSTAILQ_ENTRY(objcore)	exp_list;
 	struct ban		*ban;
+	struct xkey_hook	*xkey;
+	struct hsh_vnode	*vnode;
 };
 
 /* Busy Object structure ---------------------------------------------
@@ -476,6 +481,9 @@ struct req {
 
 	/* The busy objhead we sleep on */
 	struct objhead		*hash_objhead;
+	/* The busy object we wait for, and the one we were handed */
+	const struct objcore	*hash_busy;
+	struct objcore		*hash_oc;
 
 	/* Built Vary string */
 	uint8_t			*vary_b;
@@ -531,6 +539,7 @@ struct req {
 	struct acct_req		acct;
 
 	struct vrt_privs	privs[1];
+	struct vrt_privs	*privs_top;	/* ESI prefetch PRIV_TOP */
 
 	struct vcf		*vcf;
 };
@@ -790,6 +799,7 @@ WS_Front(const struct ws *ws)
 void RFC2616_Ttl(struct busyobj *, vtim_real now, vtim_real *t_origin,
     float *ttl, float *grace, float *keep);
 unsigned RFC2616_Req_Gzip(const struct http *);
+const char *RFC2616_Req_Codings(const struct http *);
 int RFC2616_Do_Cond(const struct req *sp);
 void RFC2616_Weaken_Etag(struct http *hp);
 void RFC2616_Vary_AE(struct http *hp);
@@ -44,6 +44,7 @@
 #include "cache_transport.h"
 #include "cache_vcl.h"
 #include "http1/cache_http1.h"
+#include "http2/cache_http2.h"
 
 #include "VSC_vbe.h"
 
@@ -104,20 +105,13 @@ VBE_Connect_Error(struct VSC_vbe *vsc, int err)
 	} while (0)
 
 /*--------------------------------------------------------------------
- * Get a connection to the backend
+ * Check that the backend can take another fetch, and set up bo->htc
  */
 
-static struct pfd *
-vbe_dir_getfd(struct worker *wrk, struct backend *bp, struct busyobj *bo,
-    unsigned force_fresh)
+static int
+vbe_dir_ready(struct backend *bp, struct busyobj *bo)
 {
-	struct pfd *pfd;
-	int *fdp, err;
-	vtim_dur tmod;
-	char abuf1[VTCP_ADDRBUFSIZE], abuf2[VTCP_ADDRBUFSIZE];
-	char pbuf1[VTCP_PORTBUFSIZE], pbuf2[VTCP_PORTBUFSIZE];
 
-	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
 	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
 	AN(bp->vsc);
@@ -127,7 +121,7 @@ vbe_dir_getfd(struct worker *wrk, struct backend *bp, struct busyobj *bo,
 		     "backend %s: unhealthy", VRT_BACKEND_string(bp->director));
 		bp->vsc->unhealthy++;
 		VSC_C_main->backend_unhealthy++;
-		return (NULL);
+		return (-1);
 	}
 
 	if (bp->max_connections > 0 && bp->n_conn >= bp->max_connections) {
@@ -135,7 +129,16 @@ vbe_dir_getfd(struct worker *wrk, struct backend *bp, struct busyobj *bo,
 		     "backend %s: busy", VRT_BACKEND_string(bp->director));
 		bp->vsc->busy++;
 		VSC_C_main->backend_busy++;
-		return (NULL);
+		return (-1);
+	}
+
+	if (bo->is_refresh && cache_param->refresh_ahead_backend > 0 &&
+	    bp->n_refresh >= cache_param->refresh_ahead_backend) {
+		VSLb(bo->vsl, SLT_FetchError,
+		     "backend %s: refresh busy",
+		     VRT_BACKEND_string(bp->director));
+		bp->vsc->refresh_busy++;
+		return (-1);
 	}
 
 	AZ(bo->htc);
@@ -143,9 +146,29 @@ vbe_dir_getfd(struct worker *wrk, struct backend *bp, struct busyobj *bo,
 	if (bo->htc == NULL) {
 		VSLb(bo->vsl, SLT_FetchError, "out of workspace");
 		/* XXX: counter ? */
-		return (NULL);
+		return (-1);
 	}
 	bo->htc->doclose = SC_NULL;
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * Get a connection to the backend
+ */
+
+static struct pfd *
+vbe_dir_getfd(struct worker *wrk, struct backend *bp, struct busyobj *bo,
+    unsigned force_fresh)
+{
+	struct pfd *pfd;
+	int *fdp, err;
+	vtim_dur tmod;
+	char abuf1[VTCP_ADDRBUFSIZE], abuf2[VTCP_ADDRBUFSIZE];
+	char pbuf1[VTCP_PORTBUFSIZE], pbuf2[VTCP_PORTBUFSIZE];
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	if (vbe_dir_ready(bp, bo))
+		return (NULL);
 
 	FIND_TMO(connect_timeout, tmod, bo, bp);
 	pfd = VTP_Get(bp->tcp_pool, tmod, wrk, force_fresh, &err);
@@ -165,6 +188,8 @@ vbe_dir_getfd(struct worker *wrk, struct backend *bp, struct busyobj *bo,
 
 	Lck_Lock(&bp->mtx);
 	bp->n_conn++;
+	if (bo->is_refresh)
+		bp->n_refresh++;
 	bp->vsc->conn++;
 	bp->vsc->req++;
 	Lck_Unlock(&bp->mtx);
@@ -187,12 +212,74 @@ vbe_dir_getfd(struct worker *wrk, struct backend *bp, struct busyobj *bo,
 	return (pfd);
 }
 
+/*--------------------------------------------------------------------
+ * Get a stream on an HTTP/2 connection to the backend
+ */
+
+static struct v2f_stream *
+vbe_dir_getstream(struct worker *wrk, struct backend *bp, struct busyobj *bo)
+{
+	struct v2f_stream *s;
+	struct pfd *pfd;
+	int *fdp, err;
+	vtim_dur tmod;
+	char abuf1[VTCP_ADDRBUFSIZE], abuf2[VTCP_ADDRBUFSIZE];
+	char pbuf1[VTCP_PORTBUFSIZE], pbuf2[VTCP_PORTBUFSIZE];
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	AN(bp->h2_pool);
+	if (vbe_dir_ready(bp, bo))
+		return (NULL);
+
+	INIT_OBJ(bo->htc, HTTP_CONN_MAGIC);
+	FIND_TMO(first_byte_timeout,
+	    bo->htc->first_byte_timeout, bo, bp);
+	FIND_TMO(between_bytes_timeout,
+	    bo->htc->between_bytes_timeout, bo, bp);
+
+	FIND_TMO(connect_timeout, tmod, bo, bp);
+	s = V2F_Open(bp->h2_pool, tmod, wrk, bo, &err);
+	if (s == NULL) {
+		VBE_Connect_Error(bp->vsc, err);
+		VSLb(bo->vsl, SLT_FetchError,
+		     "backend %s: fail errno %d (%s)",
+		     VRT_BACKEND_string(bp->director), err, vstrerror(err));
+		VSC_C_main->backend_fail++;
+		bo->htc = NULL;
+		return (NULL);
+	}
+
+	pfd = V2F_Pfd(s);
+	fdp = PFD_Fd(pfd);
+	AN(fdp);
+	assert(*fdp >= 0);
+
+	Lck_Lock(&bp->mtx);
+	bp->n_conn++;
+	if (bo->is_refresh)
+		bp->n_refresh++;
+	bp->vsc->conn++;
+	bp->vsc->req++;
+	Lck_Unlock(&bp->mtx);
+
+	PFD_LocalName(pfd, abuf1, sizeof abuf1, pbuf1, sizeof pbuf1);
+	PFD_RemoteName(pfd, abuf2, sizeof abuf2, pbuf2, sizeof pbuf2);
+	VSLb(bo->vsl, SLT_BackendOpen, "%d %s %s %s %s %s",
+	    *fdp, VRT_BACKEND_string(bp->director), abuf2, pbuf2, abuf1, pbuf1);
+
+	bo->htc->priv = s;
+	bo->htc->rfd = fdp;
+	return (s);
+}
+
 static void v_matchproto_(vdi_finish_f)
 vbe_dir_finish(VRT_CTX, VCL_BACKEND d)
 {
 	struct backend *bp;
 	struct busyobj *bo;
 	struct pfd *pfd;
+	struct v2f_stream *s;
+	int fd;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(d, DIRECTOR_MAGIC);
@@ -201,27 +288,45 @@ vbe_dir_finish(VRT_CTX, VCL_BACKEND d)
 	CAST_OBJ_NOTNULL(bp, d->priv, BACKEND_MAGIC);
 
 	CHECK_OBJ_NOTNULL(bo->htc, HTTP_CONN_MAGIC);
-	pfd = bo->htc->priv;
-	bo->htc->priv = NULL;
-	if (PFD_State(pfd) != PFD_STATE_USED)
-		assert(bo->htc->doclose == SC_TX_PIPE ||
-		    bo->htc->doclose == SC_RX_TIMEOUT);
-	if (bo->htc->doclose != SC_NULL || bp->proxy_header != 0) {
-		VSLb(bo->vsl, SLT_BackendClose, "%d %s", *PFD_Fd(pfd),
-		    VRT_BACKEND_string(bp->director));
-		VTP_Close(&pfd);
-		AZ(pfd);
+	if (bp->h2_pool != NULL) {
+		/* The connection is not ours to close or recycle */
+		s = bo->htc->priv;
+		bo->htc->priv = NULL;
+		fd = *PFD_Fd(V2F_Pfd(s));
+		if (V2F_Finish(&s))
+			VSLb(bo->vsl, SLT_BackendReuse, "%d %s", fd,
+			    VRT_BACKEND_string(bp->director));
+		else
+			VSLb(bo->vsl, SLT_BackendClose, "%d %s", fd,
+			    VRT_BACKEND_string(bp->director));
 		Lck_Lock(&bp->mtx);
 	} else {
-		assert (PFD_State(pfd) == PFD_STATE_USED);
-		VSLb(bo->vsl, SLT_BackendReuse, "%d %s", *PFD_Fd(pfd),
-		    VRT_BACKEND_string(bp->director));
-		Lck_Lock(&bp->mtx);
-		VSC_C_main->backend_recycle++;
-		VTP_Recycle(bo->wrk, &pfd);
+		pfd = bo->htc->priv;
+		bo->htc->priv = NULL;
+		if (PFD_State(pfd) != PFD_STATE_USED)
+			assert(bo->htc->doclose == SC_TX_PIPE ||
+			    bo->htc->doclose == SC_RX_TIMEOUT);
+		if (bo->htc->doclose != SC_NULL || bp->proxy_header != 0) {
+			VSLb(bo->vsl, SLT_BackendClose, "%d %s", *PFD_Fd(pfd),
+			    VRT_BACKEND_string(bp->director));
+			VTP_Close(&pfd);
+			AZ(pfd);
+			Lck_Lock(&bp->mtx);
+		} else {
+			assert (PFD_State(pfd) == PFD_STATE_USED);
+			VSLb(bo->vsl, SLT_BackendReuse, "%d %s", *PFD_Fd(pfd),
+			    VRT_BACKEND_string(bp->director));
+			Lck_Lock(&bp->mtx);
+			VSC_C_main->backend_recycle++;
+			VTP_Recycle(bo->wrk, &pfd);
+		}
 	}
 	assert(bp->n_conn > 0);
 	bp->n_conn--;
+	if (bo->is_refresh) {
+		assert(bp->n_refresh > 0);
+		bp->n_refresh--;
+	}
 	AN(bp->vsc);
 	bp->vsc->conn--;
 #define ACCT(foo)	bp->vsc->foo += bo->acct.foo;
@@ -230,6 +335,50 @@ vbe_dir_finish(VRT_CTX, VCL_BACKEND d)
 	bo->htc = NULL;
 }
 
+/*--------------------------------------------------------------------
+ * A stream refused by the backend (or caught by a GOAWAY) never got to
+ * it, so the same single retry applies as for a recycled connection.
+ */
+
+static int
+vbe_dir_gethdrs_h2(VRT_CTX, VCL_BACKEND d, struct backend *bp)
+{
+	int i, extrachance = 1;
+	struct v2f_stream *s;
+	struct busyobj *bo;
+	struct worker *wrk;
+	char abuf[VTCP_ADDRBUFSIZE], pbuf[VTCP_PORTBUFSIZE];
+
+	bo = ctx->bo;
+	wrk = bo->wrk;
+
+	do {
+		s = vbe_dir_getstream(wrk, bp, bo);
+		if (s == NULL)
+			return (-1);
+		AN(bo->htc);
+
+		PFD_RemoteName(V2F_Pfd(s), abuf, sizeof abuf,
+		    pbuf, sizeof pbuf);
+		i = V2F_GetHdrs(wrk, bo, abuf, pbuf);
+		if (i == 0) {
+			AN(bo->htc->priv);
+			return (0);
+		}
+
+		vbe_dir_finish(ctx, d);
+		AZ(bo->htc);
+		if (i < 0 || extrachance == 0)
+			break;
+		if (bo->req != NULL &&
+		    bo->req->req_body_status != REQ_BODY_NONE &&
+		    bo->req->req_body_status != REQ_BODY_CACHED)
+			break;
+		VSC_C_main->backend_retry++;
+	} while (extrachance--);
+	return (-1);
+}
+
 static int v_matchproto_(vdi_gethdrs_f)
 vbe_dir_gethdrs(VRT_CTX, VCL_BACKEND d)
 {
@@ -256,6 +405,9 @@ vbe_dir_gethdrs(VRT_CTX, VCL_BACKEND d)
 	if (!http_GetHdr(bo->bereq, H_Host, NULL) && bp->hosthdr != NULL)
 		http_PrintfHeader(bo->bereq, "Host: %s", bp->hosthdr);
 
+	if (bp->h2_pool != NULL)
+		return (vbe_dir_gethdrs_h2(ctx, d, bp));
+
 	do {
 		pfd = vbe_dir_getfd(wrk, bp, bo, extrachance == 0);
 		if (pfd == NULL)
@@ -309,13 +461,18 @@ vbe_dir_gethdrs(VRT_CTX, VCL_BACKEND d)
 static VCL_IP v_matchproto_(vdi_getip_f)
 vbe_dir_getip(VRT_CTX, VCL_BACKEND d)
 {
+	struct backend *bp;
 	struct pfd *pfd;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(d, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(bp, d->priv, BACKEND_MAGIC);
 	CHECK_OBJ_NOTNULL(ctx->bo, BUSYOBJ_MAGIC);
 	CHECK_OBJ_NOTNULL(ctx->bo->htc, HTTP_CONN_MAGIC);
-	pfd = ctx->bo->htc->priv;
+	if (bp->h2_pool != NULL)
+		pfd = V2F_Pfd(ctx->bo->htc->priv);
+	else
+		pfd = ctx->bo->htc->priv;
 
 	return (VTP_getip(pfd));
 }
@@ -346,7 +503,14 @@ vbe_dir_http1pipe(VRT_CTX, VCL_BACKEND d)
 
 	ctx->req->res_mode = RES_PIPE;
 
-	pfd = vbe_dir_getfd(ctx->req->wrk, bp, ctx->bo, 0);
+	if (bp->h2_pool != NULL) {
+		/* There is no HTTP/1 to pipe to */
+		VSLb(ctx->req->vsl, SLT_Error,
+		    "backend %s: cannot pipe to an h2c backend",
+		    VRT_BACKEND_string(bp->director));
+		pfd = NULL;
+	} else
+		pfd = vbe_dir_getfd(ctx->req->wrk, bp, ctx->bo, 0);
 
 	if (pfd == NULL) {
 		retval = SC_TX_ERROR;
@@ -403,6 +567,9 @@ vbe_destroy(const struct director *d)
 	if (be->probe != NULL)
 		VBP_Remove(be);
 
+	if (be->h2_pool != NULL)
+		V2F_DelPool(&be->h2_pool);
+
 	VSC_vbe_Destroy(&be->vsc_seg);
 	Lck_Lock(&backends_mtx);
 	if (be->cooled > 0)
@@ -567,6 +734,8 @@ VRT_new_backend_clustered(VRT_CTX, struct vsmw_cluster *vc,
 	be->tcp_pool = VTP_Ref(vrt->ipv4_suckaddr, vrt->ipv6_suckaddr,
 	    vrt->path, vbe_proto_ident);
 	AN(be->tcp_pool);
+	if (vrt->h2c)
+		be->h2_pool = V2F_NewPool(be->tcp_pool);
 
 	vbp = vrt->probe;
 	if (vbp == NULL)
@@ -597,6 +766,8 @@ VRT_new_backend_clustered(VRT_CTX, struct vsmw_cluster *vc,
 	if (vbp != NULL)
 		VBP_Remove(be);
 
+	if (be->h2_pool != NULL)
+		V2F_DelPool(&be->h2_pool);
 	VTP_Rel(&be->tcp_pool);
 
 	VSC_vbe_Destroy(&be->vsc_seg);
@@ -41,6 +41,7 @@ struct vbp_target;
 struct vrt_ctx;
 struct vrt_backend_probe;
 struct tcp_pool;
+struct v2f_pool;
 
 /*--------------------------------------------------------------------
  * An instance of a backend from a VCL program.
@@ -51,6 +52,7 @@ struct backend {
 #define BACKEND_MAGIC		0x64c4c7c6
 
 	unsigned		n_conn;
+	unsigned		n_refresh;
 
 	VTAILQ_ENTRY(backend)	list;
 	struct lock		mtx;
@@ -66,6 +68,7 @@ struct backend {
 	struct VSC_vbe		*vsc;
 
 	struct tcp_pool		*tcp_pool;
+	struct v2f_pool		*h2_pool;
 
 	VCL_BACKEND		director;
 
@@ -44,7 +44,6 @@
 
 #include "cache_varnishd.h"
 
-#include "binary_heap.h"
 #include "vcli_serve.h"
 #include "vsa.h"
 #include "vtcp.h"
@@ -56,6 +55,8 @@
 /* Default averaging rate, we want something pretty responsive */
 #define AVG_RATE			4
 
+#define VBP_TICK			0.01
+
 struct vbp_target {
 	unsigned			magic;
 #define VBP_TARGET_MAGIC		0x6b7cb656
@@ -81,13 +82,13 @@ struct vbp_target {
 
 	vtim_real			due;
 	int				running;
-	int				heap_idx;
+	struct vtw_timer		timer;
 	struct pool_task		task;
 };
 
 static struct lock			vbp_mtx;
 static pthread_cond_t			vbp_cond;
-static struct binheap			*vbp_heap;
+static struct vtw			*vbp_wheel;
 
 static const unsigned char vbp_proxy_local[] = {
 	0x0d, 0x0a, 0x0d, 0x0a, 0x00, 0x0d, 0x0a, 0x51,
@@ -428,14 +429,13 @@ vbp_task(struct worker *wrk, void *priv)
 
 	Lck_Lock(&vbp_mtx);
 	if (vt->running < 0) {
-		assert(vt->heap_idx == BINHEAP_NOIDX);
+		AZ(VTW_Armed(&vt->timer));
 		vbp_delete(vt);
 	} else {
 		vt->running = 0;
-		if (vt->heap_idx != BINHEAP_NOIDX) {
+		if (VTW_Delete(vbp_wheel, &vt->timer)) {
 			vt->due = VTIM_real() + vt->interval;
-			binheap_delete(vbp_heap, vt->heap_idx);
-			binheap_insert(vbp_heap, vt);
+			VTW_Insert(vbp_wheel, &vt->timer, vt->due);
 		}
 	}
 	Lck_Unlock(&vbp_mtx);
@@ -449,22 +449,22 @@ vbp_thread(struct worker *wrk, void *priv)
 {
 	vtim_real now, nxt;
 	struct vbp_target *vt;
+	struct vtw_timer *t;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	AZ(priv);
 	Lck_Lock(&vbp_mtx);
 	while (1) {
 		now = VTIM_real();
-		vt = binheap_root(vbp_heap);
-		if (vt == NULL) {
-			nxt = 8.192 + now;
-			(void)Lck_CondWait(&vbp_cond, &vbp_mtx, nxt);
-		} else if (vt->due > now) {
-			nxt = vt->due;
-			vt = NULL;
+		t = VTW_Due(vbp_wheel, now);
+		if (t == NULL) {
+			nxt = VTW_Next(vbp_wheel);
+			if (nxt > 8.192 + now)
+				nxt = 8.192 + now;
 			(void)Lck_CondWait(&vbp_cond, &vbp_mtx, nxt);
 		} else {
-			binheap_delete(vbp_heap, vt->heap_idx);
+			CAST_OBJ_NOTNULL(vt, t->priv, VBP_TARGET_MAGIC);
+			AN(VTW_Delete(vbp_wheel, t));
 			vt->due = now + vt->interval;
 			if (!vt->running) {
 				vt->running = 1;
@@ -473,7 +473,7 @@ vbp_thread(struct worker *wrk, void *priv)
 				if (Pool_Task_Any(&vt->task, TASK_QUEUE_REQ))
 					vt->running = 0;
 			}
-			binheap_insert(vbp_heap, vt);
+			VTW_Insert(vbp_wheel, t, vt->due);
 		}
 	}
 	NEEDLESS(Lck_Unlock(&vbp_mtx));
@@ -632,13 +632,13 @@ VBP_Control(const struct backend *be, int enable)
 
 	Lck_Lock(&vbp_mtx);
 	if (enable) {
-		assert(vt->heap_idx == BINHEAP_NOIDX);
+		AZ(VTW_Armed(&vt->timer));
 		vt->due = VTIM_real();
-		binheap_insert(vbp_heap, vt);
+		vt->timer.priv = vt;
+		VTW_Insert(vbp_wheel, &vt->timer, vt->due);
 		AZ(pthread_cond_signal(&vbp_cond));
 	} else {
-		assert(vt->heap_idx != BINHEAP_NOIDX);
-		binheap_delete(vbp_heap, vt->heap_idx);
+		AN(VTW_Delete(vbp_wheel, &vt->timer));
 	}
 	Lck_Unlock(&vbp_mtx);
 }
@@ -692,48 +692,21 @@ VBP_Remove(struct backend *be)
 	}
 	Lck_Unlock(&vbp_mtx);
 	if (vt != NULL) {
-		assert(vt->heap_idx == BINHEAP_NOIDX);
+		AZ(VTW_Armed(&vt->timer));
 		vbp_delete(vt);
 	}
 }
 
 /*-------------------------------------------------------------------*/
 
-static int v_matchproto_(binheap_cmp_t)
-vbp_cmp(void *priv, const void *a, const void *b)
-{
-	const struct vbp_target *aa, *bb;
-
-	AZ(priv);
-	CAST_OBJ_NOTNULL(aa, a, VBP_TARGET_MAGIC);
-	CAST_OBJ_NOTNULL(bb, b, VBP_TARGET_MAGIC);
-
-	if (aa->running && !bb->running)
-		return (0);
-
-	return (aa->due < bb->due);
-}
-
-static void v_matchproto_(binheap_update_t)
-vbp_update(void *priv, void *p, unsigned u)
-{
-	struct vbp_target *vt;
-
-	AZ(priv);
-	CAST_OBJ_NOTNULL(vt, p, VBP_TARGET_MAGIC);
-	vt->heap_idx = u;
-}
-
-/*-------------------------------------------------------------------*/
-
 void
 VBP_Init(void)
 {
 	pthread_t thr;
 
 	Lck_New(&vbp_mtx, lck_backend);
-	vbp_heap = binheap_new(NULL, vbp_cmp, vbp_update);
-	AN(vbp_heap);
+	vbp_wheel = VTW_New(VBP_TICK, VTIM_real());
+	AN(vbp_wheel);
 	AZ(pthread_cond_init(&vbp_cond, NULL));
 	WRK_BgThread(&thr, "backend-poller", vbp_thread, NULL);
 }
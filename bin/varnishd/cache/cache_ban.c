@@ -32,6 +32,7 @@
 
 #include <pcre.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "cache_varnishd.h"
 #include "cache_ban.h"
@@ -95,6 +96,8 @@ BAN_Free(struct ban *b)
 	AZ(b->refcount);
 	assert(VTAILQ_EMPTY(&b->objcore));
 
+	if (b->prog != NULL)
+		ban_prog_free(&b->prog);
 	if (b->spec != NULL)
 		free(b->spec);
 	FREE_OBJ(b);
@@ -411,6 +414,8 @@ ban_reload(const uint8_t *ban, unsigned len)
 	b2->spec = malloc(len);
 	AN(b2->spec);
 	memcpy(b2->spec, ban, len);
+	b2->prog = ban_prog_compile(b2->spec);
+	AN(b2->prog);
 	if (ban[BANS_FLAGS] & BANS_FLAG_REQ) {
 		VSC_C_main->bans_req++;
 		b2->flags |= BANS_FLAG_REQ;
@@ -478,123 +483,280 @@ BAN_Time(const struct ban *b)
 }
 
 /*--------------------------------------------------------------------
- * Evaluate ban-spec
+ * Compile a ban-spec into an evaluation program
+ *
+ * The tests of a ban are all and-ed, so they can be run in any order:
+ * cheap numeric comparisons go first, regular expressions last, so the
+ * common case of a non-matching object bails out as early as possible.
+ * Regular expressions are studied (and JIT compiled, if available) once,
+ * and the ban time is folded into the ttl and age arguments.
  */
 
-int
-ban_evaluate(struct worker *wrk, const uint8_t *bsarg, struct objcore *oc,
-    const struct http *reqhttp, unsigned *tests)
+#if defined(USE_PCRE_JIT)
+#  define BAN_STUDY_JIT_COMPILE PCRE_STUDY_JIT_COMPILE
+#else
+#  define BAN_STUDY_JIT_COMPILE 0
+#endif
+
+#if PCRE_MAJOR < 8 || (PCRE_MAJOR == 8 && PCRE_MINOR < 20)
+#  define pcre_free_study pcre_free
+#endif
+
+struct ban_insn {
+	uint8_t			oper;
+	uint8_t			arg1;
+	uint8_t			cost;
+	const char		*arg1_spec;
+	const char		*arg2;
+	double			arg2_double;
+	const pcre		*re;
+	pcre_extra		*re_extra;
+};
+
+struct ban_prog {
+	unsigned		magic;
+#define BAN_PROG_MAGIC		0x0c3e6b95
+	unsigned		ninsn;
+	struct ban_insn		insn[];
+};
+
+static uint8_t
+ban_insn_cost(const struct ban_insn *bi)
+{
+	uint8_t c;
+
+	if (BANS_HAS_ARG2_DOUBLE(bi->arg1))
+		return (0);
+	if (bi->arg1 == BANS_ARG_URL)
+		c = 1;
+	else
+		c = 2;
+	if (BANS_HAS_ARG2_SPEC(bi->oper))
+		c += 2;
+	return (c);
+}
+
+struct ban_prog *
+ban_prog_compile(const uint8_t *bsarg)
 {
+	struct ban_prog *bp;
+	struct ban_insn *bi, tmp;
 	struct ban_test bt;
 	const uint8_t *bs, *be;
+	const char *err;
+	unsigned n, u;
+
+	bs = bsarg + BANS_HEAD_LEN;
+	be = bsarg + ban_len(bsarg);
+	for (n = 0; bs < be; n++)
+		ban_iter(&bs, &bt);
+
+	bp = calloc(1, sizeof *bp + n * sizeof *bp->insn);
+	if (bp == NULL)
+		return (NULL);
+	bp->magic = BAN_PROG_MAGIC;
+
+	bs = bsarg + BANS_HEAD_LEN;
+	while (bs < be) {
+		ban_iter(&bs, &bt);
+		bi = &bp->insn[bp->ninsn++];
+		bi->oper = bt.oper;
+		bi->arg1 = bt.arg1;
+		bi->arg1_spec = bt.arg1_spec;
+		bi->arg2 = bt.arg2;
+		bi->arg2_double = bt.arg2_double;
+		/*
+		 * for ttl and age, fix the point in time such that banning
+		 * refers to the same point in time when the ban is evaluated
+		 *
+		 * for grace/keep, we assume that the absolute values are pola
+		 * and that users will most likely also specify a ttl
+		 * criterion if they want to fix a point in time (such as
+		 * "obj.ttl > 5h && obj.keep > 3h")
+		 */
+		if (bt.arg1 == BANS_ARG_OBJTTL)
+			bi->arg2_double += ban_time(bsarg);
+		else if (bt.arg1 == BANS_ARG_OBJAGE)
+			bi->arg2_double -= ban_time(bsarg);
+		if (BANS_HAS_ARG2_SPEC(bt.oper)) {
+			bi->re = bt.arg2_spec;
+			bi->re_extra = pcre_study(bi->re,
+			    BAN_STUDY_JIT_COMPILE, &err);
+		}
+		bi->cost = ban_insn_cost(bi);
+
+		/* Keep the program sorted by cost, stable */
+		for (u = bp->ninsn - 1; u > 0 &&
+		    bp->insn[u - 1].cost > bp->insn[u].cost; u--) {
+			tmp = bp->insn[u - 1];
+			bp->insn[u - 1] = bp->insn[u];
+			bp->insn[u] = tmp;
+		}
+	}
+	assert(bp->ninsn == n);
+	return (bp);
+}
+
+void
+ban_prog_free(struct ban_prog **bpp)
+{
+	struct ban_prog *bp;
+	unsigned u;
+
+	TAKE_OBJ_NOTNULL(bp, bpp, BAN_PROG_MAGIC);
+	for (u = 0; u < bp->ninsn; u++)
+		if (bp->insn[u].re_extra != NULL)
+			pcre_free_study(bp->insn[u].re_extra);
+	FREE_OBJ(bp);
+}
+
+/*--------------------------------------------------------------------
+ * Look up a header for a ban test, remembering it for the rest of the
+ * bans the same object is tested against.
+ */
+
+void
+ban_eval_init(struct ban_eval *be, struct worker *wrk, struct objcore *oc,
+    const struct http *reqhttp)
+{
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	INIT_OBJ(be, BAN_EVAL_MAGIC);
+	be->wrk = wrk;
+	be->oc = oc;
+	be->reqhttp = reqhttp;
+}
+
+static const char *
+ban_eval_hdr(struct ban_eval *be, uint8_t arg1, const char *hdr)
+{
 	const char *p;
+	unsigned u;
+
+	for (u = 0; u < be->nhdr; u++) {
+		if (be->hdr[u].arg1 == arg1 && be->hdr[u].spec[0] == hdr[0] &&
+		    !strcasecmp(be->hdr[u].spec + 1, hdr + 1))
+			return (be->hdr[u].val);
+	}
+
+	if (arg1 == BANS_ARG_REQHTTP) {
+		AN(be->reqhttp);
+		if (!http_GetHdr(be->reqhttp, hdr, &p))
+			p = NULL;
+	} else
+		p = HTTP_GetHdrPack(be->wrk, be->oc, hdr);
+
+	if (be->nhdr < BAN_EVAL_NHDR) {
+		be->hdr[be->nhdr].arg1 = arg1;
+		be->hdr[be->nhdr].spec = hdr;
+		be->hdr[be->nhdr].val = p;
+		be->nhdr++;
+	}
+	return (p);
+}
+
+/*--------------------------------------------------------------------
+ * Evaluate a ban's program
+ */
+
+int
+ban_evaluate(struct ban_eval *be, const struct ban *b, unsigned *tests)
+{
+	const struct ban_insn *bi, *bie;
+	const struct objcore *oc;
 	const char *arg1;
-	double darg1, darg2;
+	double darg1;
 
-	/*
-	 * for ttl and age, fix the point in time such that banning refers to
-	 * the same point in time when the ban is evaluated
-	 *
-	 * for grace/keep, we assume that the absolute values are pola and that
-	 * users will most likely also specify a ttl criterion if they want to
-	 * fix a point in time (such as "obj.ttl > 5h && obj.keep > 3h")
-	 */
+	CHECK_OBJ_NOTNULL(be, BAN_EVAL_MAGIC);
+	CHECK_OBJ_NOTNULL(b, BAN_MAGIC);
+	CHECK_OBJ_NOTNULL(b->prog, BAN_PROG_MAGIC);
+	oc = be->oc;
 
-	bs = bsarg;
-	be = bs + ban_len(bs);
-	bs += BANS_HEAD_LEN;
-	while (bs < be) {
+	bie = b->prog->insn + b->prog->ninsn;
+	for (bi = b->prog->insn; bi < bie; bi++) {
 		(*tests)++;
-		ban_iter(&bs, &bt);
 		arg1 = NULL;
-		darg1 = darg2 = nan("");
-		switch (bt.arg1) {
+		darg1 = nan("");
+		switch (bi->arg1) {
 		case BANS_ARG_URL:
-			AN(reqhttp);
-			arg1 = reqhttp->hd[HTTP_HDR_URL].b;
+			AN(be->reqhttp);
+			arg1 = be->reqhttp->hd[HTTP_HDR_URL].b;
 			break;
 		case BANS_ARG_REQHTTP:
-			AN(reqhttp);
-			(void)http_GetHdr(reqhttp, bt.arg1_spec, &p);
-			arg1 = p;
-			break;
 		case BANS_ARG_OBJHTTP:
-			arg1 = HTTP_GetHdrPack(wrk, oc, bt.arg1_spec);
+			arg1 = ban_eval_hdr(be, bi->arg1, bi->arg1_spec);
 			break;
 		case BANS_ARG_OBJSTATUS:
-			arg1 = HTTP_GetHdrPack(wrk, oc, H__Status);
+			arg1 = ban_eval_hdr(be, bi->arg1, H__Status);
 			break;
 		case BANS_ARG_OBJTTL:
 			darg1 = oc->ttl + oc->t_origin;
-			darg2 = bt.arg2_double + ban_time(bsarg);
 			break;
 		case BANS_ARG_OBJAGE:
 			darg1 = 0.0 - oc->t_origin;
-			darg2 = 0.0 - (ban_time(bsarg) - bt.arg2_double);
 			break;
 		case BANS_ARG_OBJGRACE:
 			darg1 = oc->grace;
-			darg2 = bt.arg2_double;
 			break;
 		case BANS_ARG_OBJKEEP:
 			darg1 = oc->keep;
-			darg2 = bt.arg2_double;
 			break;
 		default:
 			WRONG("Wrong BAN_ARG code");
 		}
 
-		switch (bt.oper) {
+		switch (bi->oper) {
 		case BANS_OPER_EQ:
 			if (arg1 == NULL) {
-				if (isnan(darg1) || darg1 != darg2)
+				if (isnan(darg1) || darg1 != bi->arg2_double)
 					return (0);
-			} else if (strcmp(arg1, bt.arg2)) {
+			} else if (strcmp(arg1, bi->arg2)) {
 				return (0);
 			}
 			break;
 		case BANS_OPER_NEQ:
 			if (arg1 == NULL) {
-				if (! isnan(darg1) && darg1 == darg2)
+				if (! isnan(darg1) && darg1 == bi->arg2_double)
 					return (0);
-			} else if (!strcmp(arg1, bt.arg2)) {
+			} else if (!strcmp(arg1, bi->arg2)) {
 				return (0);
 			}
 			break;
 		case BANS_OPER_MATCH:
 			if (arg1 == NULL ||
-			    pcre_exec(bt.arg2_spec, NULL, arg1, strlen(arg1),
+			    pcre_exec(bi->re, bi->re_extra, arg1, strlen(arg1),
 			    0, 0, NULL, 0) < 0)
 				return (0);
 			break;
 		case BANS_OPER_NMATCH:
 			if (arg1 != NULL &&
-			    pcre_exec(bt.arg2_spec, NULL, arg1, strlen(arg1),
+			    pcre_exec(bi->re, bi->re_extra, arg1, strlen(arg1),
 			    0, 0, NULL, 0) >= 0)
 				return (0);
 			break;
 		case BANS_OPER_GT:
 			AZ(arg1);
 			assert(! isnan(darg1));
-			if (!(darg1 > darg2))
+			if (!(darg1 > bi->arg2_double))
 				return (0);
 			break;
 		case BANS_OPER_GTE:
 			AZ(arg1);
 			assert(! isnan(darg1));
-			if (!(darg1 >= darg2))
+			if (!(darg1 >= bi->arg2_double))
 				return (0);
 			break;
 		case BANS_OPER_LT:
 			AZ(arg1);
 			assert(! isnan(darg1));
-			if (!(darg1 < darg2))
+			if (!(darg1 < bi->arg2_double))
 				return (0);
 			break;
 		case BANS_OPER_LTE:
 			AZ(arg1);
 			assert(! isnan(darg1));
-			if (!(darg1 <= darg2))
+			if (!(darg1 <= bi->arg2_double))
 				return (0);
 			break;
 		default:
@@ -620,6 +782,7 @@ BAN_CheckObject(struct worker *wrk, struct objcore *oc, struct req *req)
 	struct ban *b;
 	struct vsl_log *vsl;
 	struct ban *b0, *bn;
+	struct ban_eval be;
 	unsigned tests;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
@@ -661,11 +824,12 @@ BAN_CheckObject(struct worker *wrk, struct objcore *oc, struct req *req)
 	 * inspect the list past that ban.
 	 */
 	tests = 0;
+	ban_eval_init(&be, wrk, oc, req->http);
 	for (b = b0; b != bn; b = VTAILQ_NEXT(b, list)) {
 		CHECK_OBJ_NOTNULL(b, BAN_MAGIC);
 		if (b->flags & BANS_FLAG_COMPLETED)
 			continue;
-		if (ban_evaluate(wrk, b->spec, oc, req->http, &tests))
+		if (ban_evaluate(&be, b, &tests))
 			break;
 	}
 
@@ -984,6 +1148,7 @@ BAN_Init(void)
 	bp = BAN_Build();
 	AN(bp);
 	AZ(pthread_cond_init(&ban_lurker_cond, NULL));
+	AZ(pthread_cond_init(&ban_lurker_task_cond, NULL));
 	AZ(BAN_Commit(bp));
 	Lck_Lock(&ban_mtx);
 	ban_mark_completed(VTAILQ_FIRST(&ban_head));
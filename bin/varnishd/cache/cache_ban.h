@@ -133,6 +133,28 @@ struct ban {
 
 	VTAILQ_HEAD(,objcore)	objcore;
 	uint8_t			*spec;
+	struct ban_prog		*prog;
+};
+
+/*
+ * State for testing one object against a number of bans, headers are
+ * only looked up once for all of them.
+ */
+
+#define BAN_EVAL_NHDR		16
+
+struct ban_eval {
+	unsigned		magic;
+#define BAN_EVAL_MAGIC		0x7a1f3c2d
+	struct worker		*wrk;
+	struct objcore		*oc;
+	const struct http	*reqhttp;
+	unsigned		nhdr;
+	struct {
+		uint8_t		arg1;
+		const char	*spec;
+		const char	*val;
+	}			hdr[BAN_EVAL_NHDR];
 };
 
 VTAILQ_HEAD(banhead_s,ban);
@@ -143,6 +165,7 @@ extern int ban_shutdown;
 extern struct banhead_s ban_head;
 extern struct ban * volatile ban_start;
 extern pthread_cond_t	ban_lurker_cond;
+extern pthread_cond_t	ban_lurker_task_cond;
 extern uint64_t bans_persisted_bytes;
 extern uint64_t bans_persisted_fragmentation;
 
@@ -151,8 +174,11 @@ unsigned ban_len(const uint8_t *banspec);
 void ban_info_new(const uint8_t *ban, unsigned len);
 void ban_info_drop(const uint8_t *ban, unsigned len);
 
-int ban_evaluate(struct worker *wrk, const uint8_t *bs, struct objcore *oc,
-    const struct http *reqhttp, unsigned *tests);
+struct ban_prog *ban_prog_compile(const uint8_t *banspec);
+void ban_prog_free(struct ban_prog **);
+void ban_eval_init(struct ban_eval *, struct worker *, struct objcore *,
+    const struct http *reqhttp);
+int ban_evaluate(struct ban_eval *, const struct ban *, unsigned *tests);
 vtim_real ban_time(const uint8_t *banspec);
 int ban_equal(const uint8_t *bs1, const uint8_t *bs2);
 void BAN_Free(struct ban *b);
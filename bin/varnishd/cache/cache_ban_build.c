@@ -339,6 +339,13 @@ BAN_Commit(struct ban_proto *bp)
 	ln += BANS_HEAD_LEN;
 	vbe32enc(b->spec + BANS_LENGTH, ln);
 
+	b->prog = ban_prog_compile(b->spec);
+	if (b->prog == NULL) {
+		free(b->spec);
+		free(b);
+		return (ban_error(bp, ban_build_err_no_mem));
+	}
+
 	Lck_Lock(&ban_mtx);
 	if (ban_shutdown) {
 		/* We could have raced a shutdown */
@@ -30,6 +30,8 @@
 
 #include "config.h"
 
+#include <stdlib.h>
+
 #include "cache_varnishd.h"
 
 #include "cache_ban.h"
@@ -37,12 +39,33 @@
 
 #include "vtim.h"
 
-static struct objcore oc_mark_cnt = { .magic = OBJCORE_MAGIC, };
-static struct objcore oc_mark_end = { .magic = OBJCORE_MAGIC, };
+/*
+ * One ban's objects being tested by the lurker.  With ban_lurker_threads
+ * above one, these are handed to worker threads, each with their own
+ * markers and snapshot of the bans to test against.
+ */
+
+struct ban_lurker_task {
+	unsigned		magic;
+#define BAN_LURKER_TASK_MAGIC	0x4e2b9d17
+	struct pool_task	task;
+	struct ban		*bt;
+	struct ban		*bd;
+	int			kill;
+	unsigned		*batch;
+	unsigned		mybatch;
+	struct objcore		mark_cnt;
+	struct objcore		mark_end;
+	unsigned		nobans;
+	struct ban		*obans[];	/* oldest first */
+};
+
 static unsigned ban_batch;
 static unsigned ban_generation;
+static unsigned ban_lurker_running;
 
 pthread_cond_t	ban_lurker_cond;
+pthread_cond_t	ban_lurker_task_cond;
 
 void
 ban_kick_lurker(void)
@@ -121,24 +144,27 @@ ban_cleantail(const struct ban *victim)
  */
 
 static struct objcore *
-ban_lurker_getfirst(struct vsl_log *vsl, struct ban *bt)
+ban_lurker_getfirst(struct vsl_log *vsl, struct ban_lurker_task *lt)
 {
 	struct objhead *oh;
 	struct objcore *oc, *noc;
+	struct ban *bt;
 	int move_oc = 1;
 
+	CHECK_OBJ_NOTNULL(lt, BAN_LURKER_TASK_MAGIC);
+	bt = lt->bt;
 	Lck_Lock(&ban_mtx);
 
 	oc = VTAILQ_FIRST(&bt->objcore);
 	while (1) {
 		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
 
-		if (oc == &oc_mark_cnt) {
-			if (VTAILQ_NEXT(oc, ban_list) == &oc_mark_end) {
+		if (oc == &lt->mark_cnt) {
+			if (VTAILQ_NEXT(oc, ban_list) == &lt->mark_end) {
 				/* done with this ban's oc list */
-				VTAILQ_REMOVE(&bt->objcore, &oc_mark_cnt,
+				VTAILQ_REMOVE(&bt->objcore, &lt->mark_cnt,
 				    ban_list);
-				VTAILQ_REMOVE(&bt->objcore, &oc_mark_end,
+				VTAILQ_REMOVE(&bt->objcore, &lt->mark_end,
 				    ban_list);
 				oc = NULL;
 				break;
@@ -146,7 +172,7 @@ ban_lurker_getfirst(struct vsl_log *vsl, struct ban *bt)
 			oc = VTAILQ_NEXT(oc, ban_list);
 			CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
 			move_oc = 0;
-		} else if (oc == &oc_mark_end) {
+		} else if (oc == &lt->mark_end) {
 			assert(move_oc == 0);
 
 			/* hold off to give lookup a chance and reiterate */
@@ -157,12 +183,12 @@ ban_lurker_getfirst(struct vsl_log *vsl, struct ban *bt)
 			Lck_Lock(&ban_mtx);
 
 			oc = VTAILQ_FIRST(&bt->objcore);
-			assert(oc == &oc_mark_cnt);
+			assert(oc == &lt->mark_cnt);
 			continue;
 		}
 
-		assert(oc != &oc_mark_cnt);
-		assert(oc != &oc_mark_end);
+		assert(oc != &lt->mark_cnt);
+		assert(oc != &lt->mark_end);
 
 		oh = oc->objhead;
 		CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
@@ -188,7 +214,7 @@ ban_lurker_getfirst(struct vsl_log *vsl, struct ban *bt)
 		if (move_oc) {
 			/* contested ocs go between the two markers */
 			VTAILQ_REMOVE(&bt->objcore, oc, ban_list);
-			VTAILQ_INSERT_BEFORE(&oc_mark_end, oc, ban_list);
+			VTAILQ_INSERT_BEFORE(&lt->mark_end, oc, ban_list);
 		}
 
 		oc = noc;
@@ -198,16 +224,19 @@ ban_lurker_getfirst(struct vsl_log *vsl, struct ban *bt)
 }
 
 static void
-ban_lurker_test_ban(struct worker *wrk, struct vsl_log *vsl, struct ban *bt,
-    struct banhead_s *obans, struct ban *bd, int kill)
+ban_lurker_test_ban(struct worker *wrk, struct vsl_log *vsl,
+    struct ban_lurker_task *lt)
 {
-	struct ban *bl, *bln;
+	struct ban *bt, *bl;
+	struct ban_eval be;
 	struct objcore *oc;
-	unsigned tests;
+	unsigned tests, u;
 	int i;
 	uint64_t tested = 0, tested_tests = 0, lok = 0, lokc = 0;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(lt, BAN_LURKER_TASK_MAGIC);
+	bt = lt->bt;
 
 	/*
 	 * First see if there is anything to do, and if so, insert markers
@@ -215,19 +244,19 @@ ban_lurker_test_ban(struct worker *wrk, struct vsl_log *vsl, struct ban *bt,
 	Lck_Lock(&ban_mtx);
 	oc = VTAILQ_FIRST(&bt->objcore);
 	if (oc != NULL) {
-		VTAILQ_INSERT_TAIL(&bt->objcore, &oc_mark_cnt, ban_list);
-		VTAILQ_INSERT_TAIL(&bt->objcore, &oc_mark_end, ban_list);
+		VTAILQ_INSERT_TAIL(&bt->objcore, &lt->mark_cnt, ban_list);
+		VTAILQ_INSERT_TAIL(&bt->objcore, &lt->mark_end, ban_list);
 	}
 	Lck_Unlock(&ban_mtx);
 	if (oc == NULL)
 		return;
 
 	while (1) {
-		if (++ban_batch > cache_param->ban_lurker_batch) {
+		if (++*lt->batch > cache_param->ban_lurker_batch) {
 			VTIM_sleep(cache_param->ban_lurker_sleep);
-			ban_batch = 0;
+			*lt->batch = 0;
 		}
-		oc = ban_lurker_getfirst(vsl, bt);
+		oc = ban_lurker_getfirst(vsl, lt);
 		if (oc == NULL) {
 			if (tested == 0 && lokc == 0) {
 				AZ(tested_tests);
@@ -243,7 +272,9 @@ ban_lurker_test_ban(struct worker *wrk, struct vsl_log *vsl, struct ban *bt,
 			return;
 		}
 		i = 0;
-		VTAILQ_FOREACH_REVERSE_SAFE(bl, obans, banhead_s, l_list, bln) {
+		ban_eval_init(&be, wrk, oc, NULL);
+		for (u = 0; u < lt->nobans; u++) {
+			bl = lt->obans[u];
 			if (oc->ban != bt) {
 				/*
 				 * HSH_Lookup() grabbed this oc, killed
@@ -253,21 +284,19 @@ ban_lurker_test_ban(struct worker *wrk, struct vsl_log *vsl, struct ban *bt,
 			}
 			if (bl->flags & BANS_FLAG_COMPLETED) {
 				/* Ban was overtaken by new (dup) ban */
-				VTAILQ_REMOVE(obans, bl, l_list);
 				continue;
 			}
-			if (kill == 1)
+			if (lt->kill == 1)
 				i = 1;
 			else {
 				AZ(bl->flags & BANS_FLAG_REQ);
 				tests = 0;
-				i = ban_evaluate(wrk, bl->spec, oc, NULL,
-				    &tests);
+				i = ban_evaluate(&be, bl, &tests);
 				tested++;
 				tested_tests += tests;
 			}
 			if (i) {
-				if (kill) {
+				if (lt->kill) {
 					VSLb(vsl, SLT_ExpBan,
 					    "%u killed for lurker cutoff",
 					    ObjGetXID(wrk, oc));
@@ -292,9 +321,9 @@ ban_lurker_test_ban(struct worker *wrk, struct vsl_log *vsl, struct ban *bt,
 			if (oc->ban == bt) {
 				bt->refcount--;
 				VTAILQ_REMOVE(&bt->objcore, oc, ban_list);
-				oc->ban = bd;
-				bd->refcount++;
-				VTAILQ_INSERT_TAIL(&bd->objcore, oc, ban_list);
+				oc->ban = lt->bd;
+				lt->bd->refcount++;
+				VTAILQ_INSERT_TAIL(&lt->bd->objcore, oc, ban_list);
 				i = 1;
 			}
 			Lck_Unlock(&ban_mtx);
@@ -305,6 +334,103 @@ ban_lurker_test_ban(struct worker *wrk, struct vsl_log *vsl, struct ban *bt,
 	}
 }
 
+/*--------------------------------------------------------------------
+ * Run the test of one ban, on a worker thread if we may.
+ *
+ * The bans tested against are copied, since the lurker keeps adding to
+ * obans while the task runs.  The lurker thread waits for all tasks to
+ * finish before it cleans the tail of the ban list or marks any ban
+ * completed.
+ */
+
+static void v_matchproto_(task_func_t)
+ban_lurker_task(struct worker *wrk, void *priv)
+{
+	struct ban_lurker_task *lt;
+	struct vsl_log vsl;
+
+	CAST_OBJ_NOTNULL(lt, priv, BAN_LURKER_TASK_MAGIC);
+	VSL_Setup(&vsl, NULL, 0);
+	ban_lurker_test_ban(wrk, &vsl, lt);
+	VSL_Flush(&vsl, 0);
+	free(vsl.wlb);
+	FREE_OBJ(lt);
+
+	Lck_Lock(&ban_mtx);
+	assert(ban_lurker_running > 0);
+	ban_lurker_running--;
+	AZ(pthread_cond_signal(&ban_lurker_task_cond));
+	Lck_Unlock(&ban_mtx);
+}
+
+static void
+ban_lurker_dispatch(struct worker *wrk, struct vsl_log *vsl, struct ban *bt,
+    struct banhead_s *obans, struct ban *bd, int kill)
+{
+	struct ban_lurker_task *lt;
+	struct ban *bl, *bln;
+	unsigned n = 0;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+
+	Lck_Lock(&ban_mtx);
+	if (VTAILQ_EMPTY(&bt->objcore)) {
+		Lck_Unlock(&ban_mtx);
+		return;
+	}
+	Lck_Unlock(&ban_mtx);
+
+	VTAILQ_FOREACH_SAFE(bl, obans, l_list, bln) {
+		if (bl->flags & BANS_FLAG_COMPLETED) {
+			/* Ban was overtaken by new (dup) ban */
+			VTAILQ_REMOVE(obans, bl, l_list);
+			continue;
+		}
+		n++;
+	}
+	lt = calloc(1, sizeof *lt + n * sizeof *lt->obans);
+	AN(lt);
+	lt->magic = BAN_LURKER_TASK_MAGIC;
+	lt->bt = bt;
+	lt->bd = bd;
+	lt->kill = kill;
+	lt->mark_cnt.magic = OBJCORE_MAGIC;
+	lt->mark_end.magic = OBJCORE_MAGIC;
+	lt->nobans = 0;
+	VTAILQ_FOREACH_REVERSE(bl, obans, banhead_s, l_list)
+		lt->obans[lt->nobans++] = bl;
+	assert(lt->nobans == n);
+
+	if (cache_param->ban_lurker_threads <= 1) {
+		lt->batch = &ban_batch;
+		ban_lurker_test_ban(wrk, vsl, lt);
+		FREE_OBJ(lt);
+		return;
+	}
+
+	Lck_Lock(&ban_mtx);
+	while (ban_lurker_running >= cache_param->ban_lurker_threads)
+		(void)Lck_CondWait(&ban_lurker_task_cond, &ban_mtx, 0);
+	ban_lurker_running++;
+	Lck_Unlock(&ban_mtx);
+
+	lt->batch = &lt->mybatch;
+	lt->task.func = ban_lurker_task;
+	lt->task.priv = lt;
+	if (Pool_Task_Any(&lt->task, TASK_QUEUE_REQ))
+		ban_lurker_task(wrk, lt);
+}
+
+static void
+ban_lurker_wait(void)
+{
+
+	Lck_Lock(&ban_mtx);
+	while (ban_lurker_running > 0)
+		(void)Lck_CondWait(&ban_lurker_task_cond, &ban_mtx, 0);
+	Lck_Unlock(&ban_mtx);
+}
+
 /*--------------------------------------------------------------------
  * Ban lurker thread:
  *
@@ -342,7 +468,7 @@ ban_lurker_work(struct worker *wrk, struct vsl_log *vsl)
 	VTAILQ_INIT(&obans);
 	for (; b != NULL; b = VTAILQ_NEXT(b, list)) {
 		if (bd != NULL && bd != b)
-			ban_lurker_test_ban(wrk, vsl, b, &obans, bd,
+			ban_lurker_dispatch(wrk, vsl, b, &obans, bd,
 			    count > cutoff);
 		if (b->flags & BANS_FLAG_COMPLETED)
 			continue;
@@ -363,6 +489,8 @@ ban_lurker_work(struct worker *wrk, struct vsl_log *vsl)
 		}
 	}
 
+	ban_lurker_wait();
+
 	/*
 	 * conceptually, all obans are now completed. Remove the tail. If it
 	 * containted the first oban, all obans were on the tail and we're
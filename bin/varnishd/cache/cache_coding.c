@@ -0,0 +1,615 @@
+/*-
+ * Copyright (c) 2019 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Brotli and zstd content codings
+ *
+ * Like cache_gzip.c does for zlib, this file keeps the brotli and zstd
+ * libraries away from the rest of the code.  Both sit behind the small
+ * vcd_method interface, so the fetch processors which compress or
+ * decompress a body on its way into storage, and the delivery processors
+ * which decompress it for clients not accepting the coding, are shared.
+ *
+ * Unlike gzip, neither format can be stitched together for ESI, so
+ * ESI objects are never stored in these codings.  An object which is
+ * included by ESI gets decompressed by its VDP before ESI sees it.
+ */
+
+//lint -e{766}
+#include "config.h"
+
+#if defined(HAVE_BROTLI) || defined(HAVE_ZSTD)
+
+#include <stdlib.h>
+
+#include "cache_varnishd.h"
+#include "cache_filter.h"
+
+#ifdef HAVE_BROTLI
+#  include <brotli/decode.h>
+#  include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#endif
+
+enum vcd_dir_e { VCD_ENC, VCD_DEC };
+
+enum vcd_ret_e {
+	VCD_ERROR = -1,
+	VCD_OK = 0,
+	VCD_END = 1,
+};
+
+struct vcd;
+
+typedef int vcd_init_f(struct vcd *, ssize_t hint);
+typedef enum vcd_ret_e vcd_run_f(struct vcd *);
+typedef void vcd_fini_f(struct vcd *);
+
+struct vcd_method {
+	const char		*name;
+	const char		*coding;	/* Content-Encoding */
+	unsigned		flag;		/* OF_* */
+	vcd_init_f		*init;
+	vcd_run_f		*run;
+	vcd_fini_f		*fini;
+};
+
+struct vcd {
+	unsigned		magic;
+#define VCD_MAGIC		0x5a0c97d1
+	const struct vcd_method	*meth;
+	enum vcd_dir_e		dir;
+	int			finish;
+	int			done;
+	void			*state;
+
+	char			*m_buf;
+	ssize_t			m_sz;
+
+	const uint8_t		*next_in;
+	size_t			avail_in;
+	uint8_t			*next_out;
+	size_t			avail_out;
+};
+
+/*--------------------------------------------------------------------
+ * Brotli
+ */
+
+#ifdef HAVE_BROTLI
+
+static int v_matchproto_(vcd_init_f)
+vcd_brotli_init(struct vcd *vd, ssize_t hint)
+{
+	BrotliEncoderState *es;
+
+	if (vd->dir == VCD_DEC) {
+		VSC_C_main->n_unbrotli++;
+		vd->state = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+		return (vd->state == NULL ? -1 : 0);
+	}
+	VSC_C_main->n_brotli++;
+	es = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+	if (es == NULL)
+		return (-1);
+	AN(BrotliEncoderSetParameter(es, BROTLI_PARAM_QUALITY,
+	    cache_param->brotli_quality));
+	/* Lets the encoder size its window and tables for small bodies */
+	if (hint > 0 && hint < (1 << 30))
+		AN(BrotliEncoderSetParameter(es, BROTLI_PARAM_SIZE_HINT,
+		    (uint32_t)hint));
+	vd->state = es;
+	return (0);
+}
+
+static enum vcd_ret_e v_matchproto_(vcd_run_f)
+vcd_brotli_run(struct vcd *vd)
+{
+	BrotliDecoderResult r;
+
+	if (vd->dir == VCD_ENC) {
+		if (!BrotliEncoderCompressStream(vd->state, vd->finish ?
+		    BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+		    &vd->avail_in, &vd->next_in,
+		    &vd->avail_out, &vd->next_out, NULL))
+			return (VCD_ERROR);
+		if (BrotliEncoderIsFinished(vd->state))
+			return (VCD_END);
+		return (VCD_OK);
+	}
+	r = BrotliDecoderDecompressStream(vd->state,
+	    &vd->avail_in, &vd->next_in, &vd->avail_out, &vd->next_out, NULL);
+	if (r == BROTLI_DECODER_RESULT_ERROR)
+		return (VCD_ERROR);
+	if (r == BROTLI_DECODER_RESULT_SUCCESS)
+		return (VCD_END);
+	return (VCD_OK);
+}
+
+static void v_matchproto_(vcd_fini_f)
+vcd_brotli_fini(struct vcd *vd)
+{
+
+	if (vd->dir == VCD_ENC)
+		BrotliEncoderDestroyInstance(vd->state);
+	else
+		BrotliDecoderDestroyInstance(vd->state);
+}
+
+static const struct vcd_method vcd_brotli = {
+	.name =		"brotli",
+	.coding =	"br",
+	.flag =		OF_BROTLI,
+	.init =		vcd_brotli_init,
+	.run =		vcd_brotli_run,
+	.fini =		vcd_brotli_fini,
+};
+
+#endif /* HAVE_BROTLI */
+
+/*--------------------------------------------------------------------
+ * Zstandard
+ */
+
+#ifdef HAVE_ZSTD
+
+static int v_matchproto_(vcd_init_f)
+vcd_zstd_init(struct vcd *vd, ssize_t hint)
+{
+	ZSTD_CCtx *cc;
+
+	/*
+	 * Not pledging the size, because anything in front of us in
+	 * the fetch chain may have made Content-Length a lie.
+	 */
+	(void)hint;
+	if (vd->dir == VCD_DEC) {
+		VSC_C_main->n_unzstd++;
+		vd->state = ZSTD_createDCtx();
+		return (vd->state == NULL ? -1 : 0);
+	}
+	VSC_C_main->n_zstd++;
+	cc = ZSTD_createCCtx();
+	if (cc == NULL)
+		return (-1);
+	AZ(ZSTD_isError(ZSTD_CCtx_setParameter(cc, ZSTD_c_compressionLevel,
+	    (int)cache_param->zstd_level)));
+	vd->state = cc;
+	return (0);
+}
+
+static enum vcd_ret_e v_matchproto_(vcd_run_f)
+vcd_zstd_run(struct vcd *vd)
+{
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t r;
+
+	in.src = vd->next_in;
+	in.size = vd->avail_in;
+	in.pos = 0;
+	out.dst = vd->next_out;
+	out.size = vd->avail_out;
+	out.pos = 0;
+	if (vd->dir == VCD_ENC)
+		r = ZSTD_compressStream2(vd->state, &out, &in,
+		    vd->finish ? ZSTD_e_end : ZSTD_e_continue);
+	else
+		r = ZSTD_decompressStream(vd->state, &out, &in);
+	vd->next_in += in.pos;
+	vd->avail_in -= in.pos;
+	vd->next_out += out.pos;
+	vd->avail_out -= out.pos;
+	if (ZSTD_isError(r))
+		return (VCD_ERROR);
+	if (vd->dir == VCD_ENC)
+		return (vd->finish && r == 0 ? VCD_END : VCD_OK);
+	/* A frame is complete, but another one may follow */
+	if (r == 0 && vd->avail_in == 0)
+		return (VCD_END);
+	return (VCD_OK);
+}
+
+static void v_matchproto_(vcd_fini_f)
+vcd_zstd_fini(struct vcd *vd)
+{
+
+	if (vd->dir == VCD_ENC)
+		(void)ZSTD_freeCCtx(vd->state);
+	else
+		(void)ZSTD_freeDCtx(vd->state);
+}
+
+static const struct vcd_method vcd_zstd = {
+	.name =		"zstd",
+	.coding =	"zstd",
+	.flag =		OF_ZSTD,
+	.init =		vcd_zstd_init,
+	.run =		vcd_zstd_run,
+	.fini =		vcd_zstd_fini,
+};
+
+#endif /* HAVE_ZSTD */
+
+/*--------------------------------------------------------------------
+ */
+
+static struct vcd *
+vcd_new(const struct vcd_method *vm, enum vcd_dir_e dir, ssize_t hint)
+{
+	struct vcd *vd;
+
+	AN(vm);
+	ALLOC_OBJ(vd, VCD_MAGIC);
+	if (vd == NULL)
+		return (NULL);
+	vd->meth = vm;
+	vd->dir = dir;
+	if (vm->init(vd, hint)) {
+		FREE_OBJ(vd);
+		return (NULL);
+	}
+	AN(vd->state);
+	vd->m_sz = cache_param->gzip_buffer;
+	vd->m_buf = malloc(vd->m_sz);
+	if (vd->m_buf == NULL) {
+		vm->fini(vd);
+		FREE_OBJ(vd);
+		return (NULL);
+	}
+	return (vd);
+}
+
+static void
+vcd_destroy(struct vcd **vdp)
+{
+	struct vcd *vd;
+
+	TAKE_OBJ_NOTNULL(vd, vdp, VCD_MAGIC);
+	vd->meth->fini(vd);
+	free(vd->m_buf);
+	FREE_OBJ(vd);
+}
+
+static void
+vcd_ibuf(struct vcd *vd, const void *ptr, ssize_t len)
+{
+
+	CHECK_OBJ_NOTNULL(vd, VCD_MAGIC);
+	AZ(vd->avail_in);
+	vd->next_in = ptr;
+	vd->avail_in = len;
+}
+
+static void
+vcd_obuf(struct vcd *vd, void *ptr, ssize_t len)
+{
+
+	CHECK_OBJ_NOTNULL(vd, VCD_MAGIC);
+	vd->next_out = ptr;
+	vd->avail_out = len;
+}
+
+static enum vcd_ret_e
+vcd_run(struct vcd *vd)
+{
+	enum vcd_ret_e vr;
+
+	CHECK_OBJ_NOTNULL(vd, VCD_MAGIC);
+	if (vd->done)
+		return (VCD_END);
+	AN(vd->avail_out);
+	vr = vd->meth->run(vd);
+	if (vr == VCD_END)
+		vd->done = 1;
+	return (vr);
+}
+
+/*--------------------------------------------------------------------
+ * VFPs for (de)compressing an object as we receive it from the backend
+ */
+
+static enum vfp_status v_matchproto_(vfp_pull_f)
+vfp_vcd_enc_pull(struct vfp_ctx *vc, struct vfp_entry *vfe, void *p,
+    ssize_t *lp)
+{
+	struct vcd *vd;
+	enum vcd_ret_e vr;
+	enum vfp_status vp;
+	ssize_t l;
+
+	CHECK_OBJ_NOTNULL(vc, VFP_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(vfe, VFP_ENTRY_MAGIC);
+	CAST_OBJ_NOTNULL(vd, vfe->priv1, VCD_MAGIC);
+	AN(p);
+	AN(lp);
+	vcd_obuf(vd, p, *lp);
+	*lp = 0;
+	do {
+		if (vd->avail_in == 0 && !vd->finish) {
+			l = vd->m_sz;
+			vp = VFP_Suck(vc, vd->m_buf, &l);
+			if (vp == VFP_ERROR)
+				return (vp);
+			if (vp == VFP_END)
+				vd->finish = 1;
+			vcd_ibuf(vd, vd->m_buf, l);
+		}
+		vr = vcd_run(vd);
+		if (vr < VCD_OK)
+			return (VFP_Error(vc, "%s compression failed",
+			    vd->meth->name));
+		*lp = vd->next_out - (uint8_t *)p;
+		if (*lp > 0)
+			return (VFP_OK);
+	} while (vr != VCD_END);
+	return (VFP_END);
+}
+
+static enum vfp_status v_matchproto_(vfp_pull_f)
+vfp_vcd_dec_pull(struct vfp_ctx *vc, struct vfp_entry *vfe, void *p,
+    ssize_t *lp)
+{
+	struct vcd *vd;
+	enum vcd_ret_e vr;
+	enum vfp_status vp;
+	ssize_t l;
+
+	CHECK_OBJ_NOTNULL(vc, VFP_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(vfe, VFP_ENTRY_MAGIC);
+	CAST_OBJ_NOTNULL(vd, vfe->priv1, VCD_MAGIC);
+	AN(p);
+	AN(lp);
+	vcd_obuf(vd, p, *lp);
+	*lp = 0;
+	while (1) {
+		if (vd->avail_in == 0 && !vd->finish) {
+			l = vd->m_sz;
+			vp = VFP_Suck(vc, vd->m_buf, &l);
+			if (vp == VFP_ERROR)
+				return (vp);
+			if (vp == VFP_END)
+				vd->finish = 1;
+			vcd_ibuf(vd, vd->m_buf, l);
+		}
+		vr = vcd_run(vd);
+		if (vr < VCD_OK)
+			return (VFP_Error(vc, "Invalid %s data",
+			    vd->meth->name));
+		if (vr == VCD_END && vd->avail_in > 0)
+			return (VFP_Error(vc, "Junk after %s data",
+			    vd->meth->name));
+		*lp = vd->next_out - (uint8_t *)p;
+		if (*lp > 0)
+			return (VFP_OK);
+		if (vd->finish && vd->avail_in == 0) {
+			if (vr != VCD_END)
+				return (VFP_Error(vc, "Truncated %s data",
+				    vd->meth->name));
+			return (VFP_END);
+		}
+	}
+}
+
+static enum vfp_status v_matchproto_(vfp_init_f)
+vfp_vcd_init(struct vfp_ctx *vc, struct vfp_entry *vfe)
+{
+	const struct vcd_method *vm;
+	enum vcd_dir_e dir;
+	struct vcd *vd;
+
+	CHECK_OBJ_NOTNULL(vc, VFP_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(vfe, VFP_ENTRY_MAGIC);
+	vm = vfe->vfp->priv1;
+	AN(vm);
+	dir = vfe->vfp->pull == vfp_vcd_enc_pull ? VCD_ENC : VCD_DEC;
+
+	/* See vfp_gzip_init() */
+	if (http_GetStatus(vc->resp) == 206)
+		return (VFP_NULL);
+
+	if (dir == VCD_ENC) {
+		if (http_GetHdr(vc->resp, H_Content_Encoding, NULL))
+			return (VFP_NULL);
+	} else if (!http_HdrIs(vc->resp, H_Content_Encoding, vm->coding))
+		return (VFP_NULL);
+
+	vd = vcd_new(vm, dir, http_GetContentLength(vc->resp));
+	if (vd == NULL)
+		return (VFP_ERROR);
+	vfe->priv1 = vd;
+
+	http_Unset(vc->resp, H_Content_Encoding);
+	http_Unset(vc->resp, H_Content_Length);
+	RFC2616_Weaken_Etag(vc->resp);
+	if (dir == VCD_ENC) {
+		http_PrintfHeader(vc->resp, "Content-Encoding: %s",
+		    vm->coding);
+		RFC2616_Vary_AE(vc->resp);
+		vc->obj_flags |= vm->flag | OF_CHGCE;
+	} else {
+		vc->obj_flags &= ~vm->flag;
+		vc->obj_flags |= OF_CHGCE;
+	}
+	return (VFP_OK);
+}
+
+static void v_matchproto_(vfp_fini_f)
+vfp_vcd_fini(struct vfp_ctx *vc, struct vfp_entry *vfe)
+{
+	struct vcd *vd;
+
+	CHECK_OBJ_NOTNULL(vc, VFP_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(vfe, VFP_ENTRY_MAGIC);
+
+	if (vfe->priv1 != NULL) {
+		CAST_OBJ_NOTNULL(vd, vfe->priv1, VCD_MAGIC);
+		vfe->priv1 = NULL;
+		vcd_destroy(&vd);
+	}
+}
+
+/*--------------------------------------------------------------------
+ * VDPs for decompressing
+ */
+
+static int
+vdp_vcd_init(struct req *req, void **priv, const struct vcd_method *vm)
+{
+	struct vcd *vd;
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	vd = vcd_new(vm, VCD_DEC, -1);
+	if (vd == NULL)
+		return (-1);
+	vcd_obuf(vd, vd->m_buf, vd->m_sz);
+	*priv = vd;
+
+	http_Unset(req->resp, H_Content_Encoding);
+	req->resp_len = -1;
+	return (0);
+}
+
+static int v_matchproto_(vdp_fini_f)
+vdp_vcd_fini(struct req *req, void **priv)
+{
+	struct vcd *vd;
+
+	(void)req;
+	CAST_OBJ_NOTNULL(vd, *priv, VCD_MAGIC);
+	vcd_destroy(&vd);
+	*priv = NULL;
+	return (0);
+}
+
+static int v_matchproto_(vdp_bytes_f)
+vdp_vcd_bytes(struct req *req, enum vdp_action act, void **priv,
+    const void *ptr, ssize_t len)
+{
+	struct vcd *vd;
+	enum vcd_ret_e vr;
+	int full;
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	(void)act;
+	CAST_OBJ_NOTNULL(vd, *priv, VCD_MAGIC);
+
+	if (len == 0 || vd->done)
+		return (0);
+
+	vcd_ibuf(vd, ptr, len);
+	do {
+		vr = vcd_run(vd);
+		if (vr < VCD_OK) {
+			VSLb(req->vsl, SLT_Error, "Invalid %s data",
+			    vd->meth->name);
+			return (-1);
+		}
+		/* A full buffer may leave output behind in the decoder */
+		full = vd->avail_out == 0;
+		if (full || vr == VCD_END) {
+			if (VDP_bytes(req, VDP_FLUSH, vd->m_buf,
+			    vd->m_sz - vd->avail_out))
+				return (req->vdc->retval);
+			vcd_obuf(vd, vd->m_buf, vd->m_sz);
+		}
+	} while (vr == VCD_OK && (vd->avail_in > 0 || full));
+	/* Anything after the end is ignored */
+	vd->avail_in = 0;
+	return (0);
+}
+
+/*--------------------------------------------------------------------*/
+
+#ifdef HAVE_BROTLI
+
+static int v_matchproto_(vdp_init_f)
+vdp_unbrotli_init(struct req *req, void **priv)
+{
+
+	return (vdp_vcd_init(req, priv, &vcd_brotli));
+}
+
+const struct vfp VFP_brotli = {
+	.name =		"brotli",
+	.init =		vfp_vcd_init,
+	.pull =		vfp_vcd_enc_pull,
+	.fini =		vfp_vcd_fini,
+	.priv1 =	&vcd_brotli,
+};
+
+const struct vfp VFP_unbrotli = {
+	.name =		"unbrotli",
+	.init =		vfp_vcd_init,
+	.pull =		vfp_vcd_dec_pull,
+	.fini =		vfp_vcd_fini,
+	.priv1 =	&vcd_brotli,
+};
+
+const struct vdp VDP_unbrotli = {
+	.name =		"unbrotli",
+	.init =		vdp_unbrotli_init,
+	.bytes =	vdp_vcd_bytes,
+	.fini =		vdp_vcd_fini,
+};
+
+#endif /* HAVE_BROTLI */
+
+#ifdef HAVE_ZSTD
+
+static int v_matchproto_(vdp_init_f)
+vdp_unzstd_init(struct req *req, void **priv)
+{
+
+	return (vdp_vcd_init(req, priv, &vcd_zstd));
+}
+
+const struct vfp VFP_zstd = {
+	.name =		"zstd",
+	.init =		vfp_vcd_init,
+	.pull =		vfp_vcd_enc_pull,
+	.fini =		vfp_vcd_fini,
+	.priv1 =	&vcd_zstd,
+};
+
+const struct vfp VFP_unzstd = {
+	.name =		"unzstd",
+	.init =		vfp_vcd_init,
+	.pull =		vfp_vcd_dec_pull,
+	.fini =		vfp_vcd_fini,
+	.priv1 =	&vcd_zstd,
+};
+
+const struct vdp VDP_unzstd = {
+	.name =		"unzstd",
+	.init =		vdp_unzstd_init,
+	.bytes =	vdp_vcd_bytes,
+	.fini =		vdp_vcd_fini,
+};
+
+#endif /* HAVE_ZSTD */
+
+#endif /* defined(HAVE_BROTLI) || defined(HAVE_ZSTD) */
@@ -45,6 +45,7 @@
 
 static vtr_deliver_f ved_deliver;
 static vtr_reembark_f ved_reembark;
+static vtr_deliver_f ved_prefetch_deliver;
 
 static const uint8_t gzip_hdr[] = {
 	0x1f, 0x8b, 0x08,
@@ -67,6 +68,12 @@ struct ecx {
 	struct ecx	*pecx;
 	ssize_t		l_crc;
 	uint32_t	crc;
+
+	/* Prefetching, pf_busy and pf_stop are protected by sp->mtx */
+	const uint8_t	*pf_p;
+	unsigned	pf_ahead;
+	unsigned	pf_busy;
+	int		pf_stop;
 };
 
 static int v_matchproto_(vtr_minimal_response_f)
@@ -85,6 +92,13 @@ static const struct transport VED_transport = {
 	.minimal_response =	ved_minimal_response,
 };
 
+static const struct transport VED_prefetch_transport = {
+	.magic =		TRANSPORT_MAGIC,
+	.name =			"ESI_PREFETCH",
+	.deliver =		ved_prefetch_deliver,
+	.minimal_response =	ved_minimal_response,
+};
+
 /*--------------------------------------------------------------------*/
 
 static void v_matchproto_(vtr_reembark_f)
@@ -103,37 +117,27 @@ ved_reembark(struct worker *wrk, struct req *req)
 
 /*--------------------------------------------------------------------*/
 
-static void
-ved_include(struct req *preq, const char *src, const char *host,
-    struct ecx *ecx)
+static struct req *
+ved_new_req(struct req *preq, const char *src, const char *host,
+    const struct ecx *ecx, const char *why)
 {
 	struct worker *wrk;
-	struct sess *sp;
 	struct req *req;
-	enum req_fsm_nxt s;
 
 	CHECK_OBJ_NOTNULL(preq, REQ_MAGIC);
 	CHECK_OBJ_NOTNULL(preq->topreq, REQ_MAGIC);
-	sp = preq->sp;
-	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 	CHECK_OBJ_NOTNULL(ecx, ECX_MAGIC);
 	wrk = preq->wrk;
 
-	if (preq->esi_level >= cache_param->max_esi_depth) {
-		VSLb(preq->vsl, SLT_VCL_Error,
-		    "ESI depth limit reach (param max_esi_depth = %u)",
-		    cache_param->max_esi_depth);
-		return;
-	}
-
-	req = Req_New(wrk, sp);
+	req = Req_New(wrk, preq->sp);
 	AN(req);
-	THR_SetRequest(req);
 	AZ(req->vsl->wid);
 	req->vsl->wid = VXID_Get(wrk, VSL_CLIENTMARKER);
 
 	VSLb(req->vsl, SLT_Begin, "req %u esi", VXID(preq->vsl->wid));
 	VSLb(preq->vsl, SLT_Link, "req %u esi", VXID(req->vsl->wid));
+	if (why != NULL)
+		VSLb(req->vsl, SLT_Debug, "%s", why);
 
 	VSLb_ts_req(req, "Start", W_TIM_real(wrk));
 
@@ -178,6 +182,36 @@ ved_include(struct req *preq, const char *src, const char *host,
 
 	req->req_step = R_STP_TRANSPORT;
 	req->t_req = preq->t_req;
+	return (req);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+ved_include(struct req *preq, const char *src, const char *host,
+    struct ecx *ecx)
+{
+	struct worker *wrk;
+	struct sess *sp;
+	struct req *req;
+	enum req_fsm_nxt s;
+	vtim_mono t0;
+
+	CHECK_OBJ_NOTNULL(preq, REQ_MAGIC);
+	sp = preq->sp;
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(ecx, ECX_MAGIC);
+	wrk = preq->wrk;
+
+	if (preq->esi_level >= cache_param->max_esi_depth) {
+		VSLb(preq->vsl, SLT_VCL_Error,
+		    "ESI depth limit reach (param max_esi_depth = %u)",
+		    cache_param->max_esi_depth);
+		return;
+	}
+
+	req = ved_new_req(preq, src, host, ecx, NULL);
+	THR_SetRequest(req);
 
 	req->transport = &VED_transport;
 	req->transport_priv = ecx;
@@ -193,11 +227,16 @@ ved_include(struct req *preq, const char *src, const char *host,
 		DSL(DBG_WAITINGLIST, req->vsl->wid,
 		    "loop waiting for ESI (%d)", (int)s);
 		assert(s == REQ_FSM_DISEMBARK);
+		t0 = VTIM_mono();
 		Lck_Lock(&sp->mtx);
-		if (!ecx->woken)
+		/* Finished prefetches signal us too */
+		while (!ecx->woken)
 			(void)Lck_CondWait(
 			    &ecx->preq->wrk->cond, &sp->mtx, 0);
 		Lck_Unlock(&sp->mtx);
+		wrk->stats->esi_stall++;
+		wrk->stats->esi_stall_time +=
+		    (uint64_t)((VTIM_mono() - t0) * 1e6);
 		AZ(req->wrk);
 		CNT_Embark(wrk, req);
 	}
@@ -246,6 +285,209 @@ ved_decode_len(struct req *req, const uint8_t **pp)
 	return (l);
 }
 
+/*--------------------------------------------------------------------
+ * Prefetching of esi:includes
+ *
+ * Up to esi_prefetch includes following the one being delivered are
+ * run as separate requests on other worker threads.  These requests
+ * stop once the object has been looked up and, if it was a miss, the
+ * fetch has been started (see cnt_prefetch_done()), so by the time the
+ * include proper gets to it, the object is either in cache or busy,
+ * and the include waits for it or streams it like any other client.
+ *
+ * The prefetch requests borrow the session from the ESI delivery, which
+ * therefore waits for all of them to finish before it is done.  They
+ * have their own workspace and PRIV_TOP, so they never write to the top
+ * request, and they are not counted as hits or misses: the include
+ * proper is.  Their vcl_recv{}, vcl_hash{} and vcl_miss{} do run a
+ * second time for the include.
+ */
+
+static void v_matchproto_(vtr_deliver_f)
+ved_prefetch_deliver(struct req *req, struct boc *boc, int wantbody)
+{
+	(void)req;
+	(void)boc;
+	(void)wantbody;
+	WRONG("ESI prefetches should not deliver");
+}
+
+static void v_matchproto_(task_func_t)
+ved_prefetch_task(struct worker *wrk, void *priv)
+{
+	struct req *req;
+	struct sess *sp;
+	struct ecx *ecx;
+	int stop;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CAST_OBJ_NOTNULL(req, priv, REQ_MAGIC);
+	AN(req->esi_prefetch);
+	CAST_OBJ_NOTNULL(ecx, req->transport_priv, ECX_MAGIC);
+	sp = req->sp;
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+
+	THR_SetRequest(req);
+	if (req->req_step == R_STP_TRANSPORT) {
+		Lck_Lock(&sp->mtx);
+		stop = ecx->pf_stop;
+		Lck_Unlock(&sp->mtx);
+		if (!stop) {
+			CNT_Embark(wrk, req);
+			VCL_TaskEnter(req->vcl, req->privs);
+			VCL_TaskEnter(req->vcl, req->privs_top);
+		}
+	} else {
+		/* Back from the waiting list */
+		stop = 0;
+		CNT_Embark(wrk, req);
+	}
+
+	if (!stop && CNT_Request(req) == REQ_FSM_DISEMBARK) {
+		THR_SetRequest(NULL);
+		return;
+	}
+
+	if (req->privs_top->magic != 0)
+		VCL_TaskLeave(req->vcl, req->privs_top);
+	free(req->privs_top);
+	req->privs_top = NULL;
+	VCL_Rel(&req->vcl);
+	req->wrk = NULL;
+	Req_Cleanup(sp, wrk, req);
+	Req_Release(req);
+	THR_SetRequest(NULL);
+
+	Lck_Lock(&sp->mtx);
+	AN(ecx->pf_busy);
+	ecx->pf_busy--;
+	AZ(pthread_cond_signal(&ecx->preq->wrk->cond));
+	Lck_Unlock(&sp->mtx);
+}
+
+static const uint8_t *
+ved_next_include(struct req *req, const uint8_t *p, const uint8_t *e)
+{
+
+	while (p < e) {
+		switch (*p) {
+		case VEC_V1:
+		case VEC_V2:
+		case VEC_V8:
+		case VEC_S1:
+		case VEC_S2:
+		case VEC_S8:
+			(void)ved_decode_len(req, &p);
+			break;
+		case VEC_C1:
+		case VEC_C2:
+		case VEC_C8:
+			(void)ved_decode_len(req, &p);
+			p += 4;
+			break;
+		case VEC_INCL:
+			return (p);
+		default:
+			WRONG("ESI-codes: Illegal code");
+		}
+	}
+	return (NULL);
+}
+
+static void
+ved_prefetch(struct req *preq, struct ecx *ecx)
+{
+	struct worker *wrk;
+	struct sess *sp;
+	struct req *req;
+	const uint8_t *q, *r;
+
+	CHECK_OBJ_NOTNULL(preq, REQ_MAGIC);
+	CHECK_OBJ_NOTNULL(ecx, ECX_MAGIC);
+	wrk = preq->wrk;
+	sp = preq->sp;
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+
+	if (ecx->pf_p == NULL || ecx->pf_stop ||
+	    preq->esi_level >= cache_param->max_esi_depth)
+		return;
+
+	while (ecx->pf_ahead < cache_param->esi_prefetch) {
+		q = ved_next_include(preq, ecx->pf_p, ecx->e);
+		if (q == NULL) {
+			ecx->pf_p = ecx->e;
+			return;
+		}
+		ecx->pf_p = q;
+		assert(*ecx->pf_p == VEC_INCL);
+		q = (const uint8_t *)strchr((const char *)ecx->pf_p + 1, '\0');
+		AN(q);
+		q++;
+		r = (const uint8_t *)strchr((const char *)q, '\0');
+		AN(r);
+
+		req = ved_new_req(preq, (const char *)q,
+		    (const char *)ecx->pf_p + 1, ecx, "ESI prefetch");
+		ecx->pf_p = r + 1;
+
+		req->esi_prefetch = 1;
+		req->privs_top = calloc(1, sizeof *req->privs_top);
+		AN(req->privs_top);
+		req->transport = &VED_prefetch_transport;
+		req->transport_priv = ecx;
+		req->task.func = ved_prefetch_task;
+		req->task.priv = req;
+
+		Lck_Lock(&sp->mtx);
+		ecx->pf_busy++;
+		Lck_Unlock(&sp->mtx);
+
+		if (Pool_Task(sp->pool, &req->task, TASK_QUEUE_REQ)) {
+			wrk->stats->esi_prefetch_fail++;
+			free(req->privs_top);
+			req->privs_top = NULL;
+			VCL_Rel(&req->vcl);
+			Req_Cleanup(sp, wrk, req);
+			Req_Release(req);
+			/* Out of threads, drop what is still queued too */
+			Lck_Lock(&sp->mtx);
+			ecx->pf_busy--;
+			ecx->pf_stop = 1;
+			Lck_Unlock(&sp->mtx);
+			return;
+		}
+		wrk->stats->esi_prefetch++;
+		ecx->pf_ahead++;
+	}
+}
+
+static void
+ved_prefetch_wait(struct req *req, struct ecx *ecx)
+{
+	struct sess *sp;
+	vtim_mono t0 = 0.;
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	CHECK_OBJ_NOTNULL(ecx, ECX_MAGIC);
+	sp = req->sp;
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+
+	Lck_Lock(&sp->mtx);
+	ecx->pf_stop = 1;
+	if (ecx->pf_busy > 0) {
+		t0 = VTIM_mono();
+		do {
+			(void)Lck_CondWait(&req->wrk->cond, &sp->mtx, 0);
+		} while (ecx->pf_busy > 0);
+	}
+	Lck_Unlock(&sp->mtx);
+	if (t0 != 0.) {
+		req->wrk->stats->esi_stall++;
+		req->wrk->stats->esi_stall_time +=
+		    (uint64_t)((VTIM_mono() - t0) * 1e6);
+	}
+}
+
 /*---------------------------------------------------------------------
  */
 
@@ -281,9 +523,10 @@ ved_vdp_esi_fini(struct req *req, void **priv)
 {
 	struct ecx *ecx;
 
-	(void)req;
 	AN(priv);
 	CAST_OBJ_NOTNULL(ecx, *priv, ECX_MAGIC);
+	if (ecx->pf_p != NULL)
+		ved_prefetch_wait(req, ecx);
 	FREE_OBJ(ecx);
 	*priv = NULL;
 	return (0);
@@ -323,6 +566,10 @@ ved_vdp_esi_bytes(struct req *req, enum vdp_action act, void **priv,
 				ecx->isgzip = 1;
 				ecx->p++;
 			}
+			if (cache_param->esi_prefetch > 0) {
+				ecx->pf_p = ecx->p;
+				ved_prefetch(req, ecx);
+			}
 			ecx->state = 1;
 			break;
 		case 1:
@@ -372,6 +619,11 @@ ved_vdp_esi_bytes(struct req *req, enum vdp_action act, void **priv,
 					ecx->p = ecx->e;
 					break;
 				}
+				if (ecx->p < ecx->pf_p) {
+					AN(ecx->pf_ahead);
+					ecx->pf_ahead--;
+				}
+				ved_prefetch(req, ecx);
 				Debug("INCL [%s][%s] BEGIN\n", q, ecx->p);
 				ved_include(req,
 				    (const char*)q, (const char*)ecx->p, ecx);
@@ -37,9 +37,16 @@
 #include "cache_varnishd.h"
 #include "cache_objhead.h"
 
-#include "binary_heap.h"
 #include "vtim.h"
 
+#include "VSC_exp.h"
+
+/*
+ * The expiry machinery is split into exp_shards independent shards, each
+ * with its own inbox, timer wheel and thread.  An objcore always belongs
+ * to the same shard, so its exp_flags are protected by that shard's mtx.
+ */
+
 struct exp_priv {
 	unsigned			magic;
 #define EXP_PRIV_MAGIC			0x9db22482
@@ -47,14 +54,35 @@ struct exp_priv {
 	struct lock			mtx;
 	VSTAILQ_HEAD(,objcore)		inbox;
 	pthread_cond_t			condvar;
+	struct VSC_exp			*vsc;
+	struct vsc_seg			*vsc_seg;
+	unsigned			n_mailed;	/* for exp_mailed */
 
 	/* owned by exp thread */
 	struct worker			*wrk;
 	struct vsl_log			vsl;
-	struct binheap			*heap;
+	struct vtw			*wheel;
 };
 
-static struct exp_priv *exphdl;
+#define EXP_TICK			0.01
+
+static struct exp_priv *exp_shard;
+static unsigned exp_nshard;
+
+static struct exp_priv *
+exp_getshard(const struct objcore *oc)
+{
+	uintptr_t u;
+
+	if (exp_nshard == 1)
+		return (&exp_shard[0]);
+
+	/* Same mixing of the objcore address as for the LRU shards */
+	u = (uintptr_t)oc >> 4;
+	u ^= u >> 17;
+	u *= 0x9e3779b1U;
+	return (&exp_shard[(u >> 7) % exp_nshard]);
+}
 
 /*--------------------------------------------------------------------
  * Calculate an object's effective ttl time, taking req.ttl into account
@@ -99,25 +127,30 @@ EXP_Ttl_grace(const struct req *req, const struct objcore *oc)
 static void
 exp_mail_it(struct objcore *oc, uint8_t cmds)
 {
+	struct exp_priv *ep;
+
 	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
 	assert(oc->refcnt > 0);
 
-	Lck_Lock(&exphdl->mtx);
+	ep = exp_getshard(oc);
+	Lck_Lock(&ep->mtx);
 	if ((cmds | oc->exp_flags) & OC_EF_REFD) {
 		if (!(oc->exp_flags & OC_EF_POSTED)) {
 			if (cmds & OC_EF_REMOVE)
-				VSTAILQ_INSERT_HEAD(&exphdl->inbox,
+				VSTAILQ_INSERT_HEAD(&ep->inbox,
 				    oc, exp_list);
 			else
-				VSTAILQ_INSERT_TAIL(&exphdl->inbox,
+				VSTAILQ_INSERT_TAIL(&ep->inbox,
 				    oc, exp_list);
+			ep->vsc->g_inbox++;
 		}
 		oc->exp_flags |= cmds | OC_EF_POSTED;
 		AN(oc->exp_flags & OC_EF_REFD);
-		VSC_C_main->exp_mailed++;
-		AZ(pthread_cond_signal(&exphdl->condvar));
+		ep->n_mailed++;
+		ep->vsc->c_mailed++;
+		AZ(pthread_cond_signal(&ep->condvar));
 	}
-	Lck_Unlock(&exphdl->mtx);
+	Lck_Unlock(&ep->mtx);
 }
 
 /*--------------------------------------------------------------------
@@ -204,10 +237,10 @@ exp_inbox(struct exp_priv *ep, struct objcore *oc, unsigned flags)
 
 	if (flags & OC_EF_REMOVE) {
 		if (!(flags & OC_EF_INSERT)) {
-			assert(oc->timer_idx != BINHEAP_NOIDX);
-			binheap_delete(ep->heap, oc->timer_idx);
+			AN(VTW_Delete(ep->wheel, &oc->timer));
+			ep->vsc->g_objects--;
 		}
-		assert(oc->timer_idx == BINHEAP_NOIDX);
+		AZ(VTW_Armed(&oc->timer));
 		assert(oc->refcnt > 0);
 		AZ(oc->exp_flags);
 		ObjSendEvent(ep->wrk, oc, OEV_EXPIRE);
@@ -230,32 +263,39 @@ exp_inbox(struct exp_priv *ep, struct objcore *oc, unsigned flags)
 	 */
 
 	if (flags & OC_EF_INSERT) {
-		assert(oc->timer_idx == BINHEAP_NOIDX);
-		binheap_insert(exphdl->heap, oc);
-		assert(oc->timer_idx != BINHEAP_NOIDX);
+		AZ(VTW_Armed(&oc->timer));
+		oc->timer.priv = oc;
+		VTW_Insert(ep->wheel, &oc->timer, oc->timer_when);
+		ep->vsc->g_objects++;
 	} else if (flags & OC_EF_MOVE) {
-		assert(oc->timer_idx != BINHEAP_NOIDX);
-		binheap_reorder(exphdl->heap, oc->timer_idx);
-		assert(oc->timer_idx != BINHEAP_NOIDX);
+		AN(VTW_Delete(ep->wheel, &oc->timer));
+		VTW_Insert(ep->wheel, &oc->timer, oc->timer_when);
 	} else {
 		WRONG("Objcore state wrong in inbox");
 	}
 }
 
 /*--------------------------------------------------------------------
- * Expire stuff from the binheap
+ * Expire stuff from the timer wheel
  */
 
 static vtim_real
 exp_expire(struct exp_priv *ep, vtim_real now)
 {
 	struct objcore *oc;
+	struct vtw_timer *t;
+	vtim_real when;
 
 	CHECK_OBJ_NOTNULL(ep, EXP_PRIV_MAGIC);
 
-	oc = binheap_root(ep->heap);
-	if (oc == NULL)
-		return (now + 355./113.);
+	t = VTW_Due(ep->wheel, now);
+	if (t == NULL) {
+		when = VTW_Next(ep->wheel);
+		if (when > now + 355./113.)
+			when = now + 355./113.;
+		return (when);
+	}
+	CAST_OBJ_NOTNULL(oc, t->priv, OBJCORE_MAGIC);
 	VSLb(&ep->vsl, SLT_ExpKill, "EXP_expire p=%p e=%.6f f=0x%x", oc,
 	    oc->timer_when - now, oc->flags);
 
@@ -265,7 +305,9 @@ exp_expire(struct exp_priv *ep, vtim_real now)
 	if (oc->timer_when > now)
 		return (oc->timer_when);
 
-	VSC_C_main->n_expired++;
+	ep->wrk->stats->n_expired++;
+	ep->vsc->c_expired++;
+	ep->vsc->g_lag = (uint64_t)(1e6 * (now - oc->timer_when));
 
 	Lck_Lock(&ep->mtx);
 	if (oc->exp_flags & OC_EF_POSTED) {
@@ -279,10 +321,9 @@ exp_expire(struct exp_priv *ep, vtim_real now)
 		if (!(oc->flags & OC_F_DYING))
 			HSH_Kill(oc);
 
-		/* Remove from binheap */
-		assert(oc->timer_idx != BINHEAP_NOIDX);
-		binheap_delete(ep->heap, oc->timer_idx);
-		assert(oc->timer_idx == BINHEAP_NOIDX);
+		/* Remove from the timer wheel */
+		AN(VTW_Delete(ep->wheel, &oc->timer));
+		ep->vsc->g_objects--;
 
 		CHECK_OBJ_NOTNULL(oc->objhead, OBJHEAD_MAGIC);
 		VSLb(&ep->vsl, SLT_ExpKill, "EXP_Expired x=%u t=%.0f",
@@ -294,31 +335,10 @@ exp_expire(struct exp_priv *ep, vtim_real now)
 }
 
 /*--------------------------------------------------------------------
- * This thread monitors the root of the binary heap and whenever an
- * object expires, accounting also for graceability, it is killed.
+ * This thread turns the timer wheel and whenever an object expires,
+ * accounting also for graceability, it is killed.
  */
 
-static int v_matchproto_(binheap_cmp_t)
-object_cmp(void *priv, const void *a, const void *b)
-{
-	const struct objcore *aa, *bb;
-
-	(void)priv;
-	CAST_OBJ_NOTNULL(aa, a, OBJCORE_MAGIC);
-	CAST_OBJ_NOTNULL(bb, b, OBJCORE_MAGIC);
-	return (aa->timer_when < bb->timer_when);
-}
-
-static void v_matchproto_(binheap_update_t)
-object_update(void *priv, void *p, unsigned u)
-{
-	struct objcore *oc;
-
-	(void)priv;
-	CAST_OBJ_NOTNULL(oc, p, OBJCORE_MAGIC);
-	oc->timer_idx = u;
-}
-
 static void * v_matchproto_(bgthread_t)
 exp_thread(struct worker *wrk, void *priv)
 {
@@ -330,8 +350,8 @@ exp_thread(struct worker *wrk, void *priv)
 	CAST_OBJ_NOTNULL(ep, priv, EXP_PRIV_MAGIC);
 	ep->wrk = wrk;
 	VSL_Setup(&ep->vsl, NULL, 0);
-	ep->heap = binheap_new(NULL, object_cmp, object_update);
-	AN(ep->heap);
+	ep->wheel = VTW_New(EXP_TICK, VTIM_real());
+	AN(ep->wheel);
 	while (1) {
 
 		Lck_Lock(&ep->mtx);
@@ -340,7 +360,9 @@ exp_thread(struct worker *wrk, void *priv)
 		if (oc != NULL) {
 			assert(oc->refcnt >= 1);
 			VSTAILQ_REMOVE(&ep->inbox, oc, objcore, exp_list);
-			VSC_C_main->exp_received++;
+			wrk->stats->exp_received++;
+			ep->vsc->c_received++;
+			ep->vsc->g_inbox--;
 			tnext = 0;
 			flags = oc->exp_flags;
 			if (flags & OC_EF_REMOVE)
@@ -349,6 +371,8 @@ exp_thread(struct worker *wrk, void *priv)
 				oc->exp_flags &= OC_EF_REFD;
 		} else if (tnext > t) {
 			VSL_Flush(&ep->vsl, 0);
+			wrk->stats->exp_mailed += ep->n_mailed;
+			ep->n_mailed = 0;
 			Pool_Sumstat(wrk);
 			(void)Lck_CondWait(&ep->condvar, &ep->mtx, tnext);
 		}
@@ -371,13 +395,23 @@ EXP_Init(void)
 {
 	struct exp_priv *ep;
 	pthread_t pt;
-
-	ALLOC_OBJ(ep, EXP_PRIV_MAGIC);
-	AN(ep);
-
-	Lck_New(&ep->mtx, lck_exp);
-	AZ(pthread_cond_init(&ep->condvar, NULL));
-	VSTAILQ_INIT(&ep->inbox);
-	exphdl = ep;
-	WRK_BgThread(&pt, "cache-exp", exp_thread, ep);
+	unsigned u;
+
+	exp_nshard = cache_param->exp_shards;
+	if (exp_nshard == 0)
+		exp_nshard = 1;
+	exp_shard = calloc(exp_nshard, sizeof *exp_shard);
+	AN(exp_shard);
+
+	for (u = 0; u < exp_nshard; u++) {
+		ep = &exp_shard[u];
+		INIT_OBJ(ep, EXP_PRIV_MAGIC);
+		Lck_New(&ep->mtx, lck_exp);
+		AZ(pthread_cond_init(&ep->condvar, NULL));
+		VSTAILQ_INIT(&ep->inbox);
+		ep->vsc = VSC_exp_New(NULL, &ep->vsc_seg, "%u", u);
+		AN(ep->vsc);
+	}
+	for (u = 0; u < exp_nshard; u++)
+		WRK_BgThread(&pt, "cache-exp", exp_thread, &exp_shard[u]);
 }
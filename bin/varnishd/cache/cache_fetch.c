@@ -159,6 +159,9 @@ vbf_beresp2obj(struct busyobj *bo)
 		AZ(ObjSetDouble(bo->wrk, bo->fetch_objcore, OA_LASTMODIFIED,
 		    floor(bo->fetch_objcore->t_origin)));
 
+	if (!bo->uncacheable)
+		XKEY_Insert(bo->wrk, bo->fetch_objcore);
+
 	return (0);
 }
 
@@ -513,6 +516,7 @@ vbf_stp_fetch(struct worker *wrk, struct busyobj *bo)
 	if (bo->htc->body_status == BS_NONE || bo->htc->content_length == 0) {
 		http_Unset(bo->beresp, H_Content_Encoding);
 		bo->do_gzip = bo->do_gunzip = 0;
+		bo->do_brotli = bo->do_zstd = 0;
 		bo->do_stream = 0;
 		bo->filter_list = "";
 	} else if (bo->filter_list == NULL) {
@@ -698,6 +702,10 @@ vbf_stp_error(struct worker *wrk, struct busyobj *bo)
 	if (bo->fetch_objcore->stobj->stevedore != NULL)
 		ObjFreeObj(bo->wrk, bo->fetch_objcore);
 
+	/* The object we tried to refresh is still fresh, keep serving it */
+	if (bo->is_refresh)
+		return (F_STP_FAIL);
+
 	if (bo->storage == NULL)
 		bo->storage = STV_next();
 
@@ -910,6 +918,10 @@ VBF_Fetch(struct worker *wrk, struct req *req, struct objcore *oc,
 	case VBF_NORMAL:
 		how = "fetch";
 		break;
+	case VBF_REFRESH:
+		bo->is_refresh = 1;
+		mode = VBF_BACKGROUND;
+		/* FALLTHROUGH */
 	case VBF_BACKGROUND:
 		how = "bgfetch";
 		bo->is_bgfetch = 1;
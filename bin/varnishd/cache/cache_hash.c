@@ -76,8 +76,13 @@ static struct objhead *private_oh;
 static void hsh_rush1(const struct worker *, struct objhead *,
     struct rush *, int);
 static void hsh_rush2(struct worker *, struct rush *);
+static void hsh_handoff(const struct worker *, struct objhead *,
+    struct objcore *, struct rush *);
+static int hsh_handoff_hit(struct worker *, struct req *, struct objcore *);
 static int hsh_deref_objhead(struct worker *wrk, struct objhead **poh);
 static int hsh_deref_objhead_unlock(struct worker *wrk, struct objhead **poh);
+static void hsh_vidx_insert(struct worker *, struct objhead *,
+    struct objcore *, const uint8_t *);
 
 /*---------------------------------------------------------------------*/
 
@@ -175,6 +180,7 @@ HSH_DeleteObjHead(const struct worker *wrk, struct objhead *oh)
 	AZ(oh->refcnt);
 	assert(VTAILQ_EMPTY(&oh->objcs));
 	assert(VTAILQ_EMPTY(&oh->waitinglist));
+	AZ(oh->vidx);
 	Lck_Delete(&oh->mtx);
 	wrk->stats->n_objecthead--;
 	FREE_OBJ(oh);
@@ -280,6 +286,7 @@ HSH_Insert(struct worker *wrk, const void *digest, struct objcore *oc,
 {
 	struct objhead *oh;
 	struct rush rush;
+	const uint8_t *vary;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	AN(digest);
@@ -309,12 +316,17 @@ HSH_Insert(struct worker *wrk, const void *digest, struct objcore *oc,
 	AN(oc->ban);
 	EXP_Insert(wrk, oc);
 
+	vary = NULL;
+	if (ObjHasAttr(wrk, oc, OA_VARY))
+		vary = ObjGetAttr(wrk, oc, OA_VARY, NULL);
+
 	/* Move the object first in the oh list, unbusy it and run the
 	   waitinglist if necessary */
 	Lck_Lock(&oh->mtx);
 	VTAILQ_REMOVE(&oh->objcs, oc, hsh_list);
 	VTAILQ_INSERT_HEAD(&oh->objcs, oc, hsh_list);
 	oc->flags &= ~OC_F_BUSY;
+	hsh_vidx_insert(wrk, oh, oc, vary);
 	if (!VTAILQ_EMPTY(&oh->waitinglist))
 		hsh_rush1(wrk, oh, &rush, HSH_RUSH_POLICY);
 	Lck_Unlock(&oh->mtx);
@@ -343,6 +355,517 @@ hsh_insert_busyobj(struct worker *wrk, struct objhead *oh)
 	return (oc);
 }
 
+/*---------------------------------------------------------------------
+ * Examine an object for a lookup, as far as it can be done without
+ * looking at its TTL.
+ *
+ * Returns non-zero if the object matches the request.  Busy objects
+ * never do, but the first one we should wait for is returned in *busy.
+ */
+
+static int
+hsh_candidate(struct worker *wrk, struct req *req, struct objcore *oc,
+    struct objcore **busy)
+{
+	const uint8_t *vary;
+
+	if (oc->flags & OC_F_DYING)
+		return (0);
+	if (oc->flags & OC_F_FAILED)
+		return (0);
+
+	CHECK_OBJ_ORNULL(oc->boc, BOC_MAGIC);
+	if (oc->boc != NULL && oc->boc->state < BOS_STREAM) {
+		if (req->hash_ignore_busy)
+			return (0);
+
+		if (oc->boc->vary != NULL &&
+		    !VRY_Match(req, oc->boc->vary))
+			return (0);
+
+		if (*busy == NULL)
+			*busy = oc;
+		return (0);
+	}
+
+	if (oc->ttl <= 0.)
+		return (0);
+
+	if (BAN_CheckObject(wrk, oc, req)) {
+		oc->flags |= OC_F_DYING;
+		EXP_Remove(oc);
+		return (0);
+	}
+
+	if (ObjHasAttr(wrk, oc, OA_VARY)) {
+		vary = ObjGetAttr(wrk, oc, OA_VARY, NULL);
+		AN(vary);
+		if (!VRY_Match(req, vary))
+			return (0);
+	}
+	return (1);
+}
+
+/*---------------------------------------------------------------------
+ * Vary index
+ *
+ * Once a hash entry holds enough objects, and one of them has a Vary
+ * header, its objects are indexed by the signature of their vary
+ * string, so a lookup only examines the objects of the variant which
+ * the request matches.  Variants are grouped by the names of the
+ * headers they vary on, the request signature is computed per group.
+ *
+ * Only unbusied objects are indexed.  They are moved to the head of
+ * oh->objcs and busy objects are inserted at its tail, so the busy
+ * objects are found by walking the list backwards.  The objects of a
+ * variant are kept newest first like oh->objcs, and a sequence number
+ * orders them across variants.
+ */
+
+#define HSH_VIDX_NGROUP		8
+#define HSH_VIDX_NHASH		16
+
+struct hsh_vgroup {
+	unsigned		magic;
+#define HSH_VGROUP_MAGIC	0x3c0e8a21
+	unsigned		nobj;
+	uint64_t		names;
+	uint8_t			*vary;
+	VTAILQ_ENTRY(hsh_vgroup)	list;
+};
+
+struct hsh_variant {
+	unsigned		magic;
+#define HSH_VARIANT_MAGIC	0x1f6b49d7
+	uint64_t		sig;
+	struct hsh_vgroup	*group;
+	VTAILQ_HEAD(, hsh_vnode)	nodes;
+	VTAILQ_ENTRY(hsh_variant)	list;
+};
+
+struct hsh_vnode {
+	unsigned		magic;
+#define HSH_VNODE_MAGIC		0x6a0d2e95
+	uint64_t		seq;
+	struct objcore		*oc;
+	struct hsh_variant	*variant;
+	VTAILQ_ENTRY(hsh_vnode)	list;
+};
+
+VTAILQ_HEAD(hsh_variant_head, hsh_variant);
+
+struct hsh_vidx {
+	unsigned		magic;
+#define HSH_VIDX_MAGIC		0x5e27b0c4
+	unsigned		incomplete;
+	unsigned		nobj;
+	unsigned		ngroup;
+	unsigned		nvariant;
+	unsigned		mask;
+	uint64_t		seq;
+	struct hsh_variant_head	*hash;
+	VTAILQ_HEAD(, hsh_vgroup)	groups;
+};
+
+static void
+hsh_vidx_stat(const struct worker *wrk, unsigned nvariant, int up)
+{
+	uint64_t *g;
+
+	if (nvariant == 0)
+		return;
+	else if (nvariant <= 16)
+		g = &wrk->stats->n_vary_16;
+	else if (nvariant <= 64)
+		g = &wrk->stats->n_vary_64;
+	else if (nvariant <= 256)
+		g = &wrk->stats->n_vary_256;
+	else
+		g = &wrk->stats->n_vary_many;
+	if (up)
+		(*g)++;
+	else
+		(*g)--;
+}
+
+static struct hsh_variant *
+hsh_vidx_find(const struct hsh_vidx *vidx, const struct hsh_vgroup *vg,
+    uint64_t sig)
+{
+	struct hsh_variant *vv;
+
+	VTAILQ_FOREACH(vv, &vidx->hash[sig & vidx->mask], list) {
+		CHECK_OBJ_NOTNULL(vv, HSH_VARIANT_MAGIC);
+		if (vv->sig == sig && vv->group == vg)
+			return (vv);
+	}
+	return (NULL);
+}
+
+static void
+hsh_vidx_grow(struct hsh_vidx *vidx)
+{
+	struct hsh_variant_head *vh;
+	struct hsh_variant *vv;
+	unsigned u, mask;
+
+	mask = vidx->mask * 2 + 1;
+	vh = calloc(mask + 1L, sizeof *vh);
+	if (vh == NULL)
+		return;		/* Make do with longer chains */
+	for (u = 0; u <= mask; u++)
+		VTAILQ_INIT(&vh[u]);
+	for (u = 0; u <= vidx->mask; u++) {
+		while ((vv = VTAILQ_FIRST(&vidx->hash[u])) != NULL) {
+			VTAILQ_REMOVE(&vidx->hash[u], vv, list);
+			VTAILQ_INSERT_TAIL(&vh[vv->sig & mask], vv, list);
+		}
+	}
+	free(vidx->hash);
+	vidx->hash = vh;
+	vidx->mask = mask;
+}
+
+/*
+ * Returns non-zero if the object could not be indexed.
+ */
+
+static int
+hsh_vidx_add(const struct worker *wrk, struct hsh_vidx *vidx,
+    struct objcore *oc, const uint8_t *vary)
+{
+	struct hsh_vgroup *vg;
+	struct hsh_variant *vv;
+	struct hsh_vnode *vn;
+	uint64_t sig, names;
+
+	CHECK_OBJ_NOTNULL(vidx, HSH_VIDX_MAGIC);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	AZ(oc->vnode);
+
+	sig = VRY_Sig(vary, &names);
+	VTAILQ_FOREACH(vg, &vidx->groups, list) {
+		CHECK_OBJ_NOTNULL(vg, HSH_VGROUP_MAGIC);
+		if (vg->names == names)
+			break;
+	}
+	if (vg == NULL) {
+		if (vidx->ngroup >= HSH_VIDX_NGROUP)
+			return (1);
+		ALLOC_OBJ(vg, HSH_VGROUP_MAGIC);
+		if (vg == NULL)
+			return (1);
+		vg->names = names;
+		vg->vary = VRY_Names(vary);
+		if (vg->vary == NULL) {
+			FREE_OBJ(vg);
+			return (1);
+		}
+		VTAILQ_INSERT_TAIL(&vidx->groups, vg, list);
+		vidx->ngroup++;
+	}
+
+	ALLOC_OBJ(vn, HSH_VNODE_MAGIC);
+	if (vn == NULL)
+		return (1);
+
+	vv = hsh_vidx_find(vidx, vg, sig);
+	if (vv == NULL) {
+		ALLOC_OBJ(vv, HSH_VARIANT_MAGIC);
+		if (vv == NULL) {
+			FREE_OBJ(vn);
+			return (1);
+		}
+		vv->sig = sig;
+		vv->group = vg;
+		VTAILQ_INIT(&vv->nodes);
+		if (vidx->nvariant > 2 * vidx->mask)
+			hsh_vidx_grow(vidx);
+		VTAILQ_INSERT_HEAD(&vidx->hash[sig & vidx->mask], vv, list);
+		hsh_vidx_stat(wrk, vidx->nvariant, 0);
+		vidx->nvariant++;
+		hsh_vidx_stat(wrk, vidx->nvariant, 1);
+	}
+
+	vn->seq = ++vidx->seq;
+	vn->oc = oc;
+	vn->variant = vv;
+	VTAILQ_INSERT_HEAD(&vv->nodes, vn, list);
+	oc->vnode = vn;
+	vg->nobj++;
+	vidx->nobj++;
+	return (0);
+}
+
+static void
+hsh_vidx_new(struct worker *wrk, struct objhead *oh)
+{
+	struct hsh_vidx *vidx;
+	struct objcore *oc;
+	const uint8_t *vary;
+	unsigned u;
+
+	Lck_AssertHeld(&oh->mtx);
+	AZ(oh->vidx);
+
+	ALLOC_OBJ(vidx, HSH_VIDX_MAGIC);
+	if (vidx == NULL)
+		return;
+	vidx->mask = HSH_VIDX_NHASH - 1;
+	vidx->hash = calloc(HSH_VIDX_NHASH, sizeof *vidx->hash);
+	if (vidx->hash == NULL) {
+		FREE_OBJ(vidx);
+		return;
+	}
+	for (u = 0; u <= vidx->mask; u++)
+		VTAILQ_INIT(&vidx->hash[u]);
+	VTAILQ_INIT(&vidx->groups);
+	oh->vidx = vidx;
+	wrk->stats->n_vary_index++;
+
+	/* Oldest first, so the variants end up newest first */
+	VTAILQ_FOREACH_REVERSE(oc, &oh->objcs, objcore_head, hsh_list) {
+		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+		if (oc->flags & OC_F_BUSY)
+			continue;
+		if (oc->flags & (OC_F_DYING | OC_F_FAILED))
+			continue;
+		if (oc->stobj->stevedore == NULL) {
+			vidx->incomplete = 1;
+			continue;
+		}
+		vary = NULL;
+		if (ObjHasAttr(wrk, oc, OA_VARY))
+			vary = ObjGetAttr(wrk, oc, OA_VARY, NULL);
+		if (hsh_vidx_add(wrk, vidx, oc, vary))
+			vidx->incomplete = 1;
+	}
+}
+
+/*
+ * Called with the new object at the head of oh->objcs
+ */
+
+static void
+hsh_vidx_insert(struct worker *wrk, struct objhead *oh, struct objcore *oc,
+    const uint8_t *vary)
+{
+	struct objcore *oc2;
+	unsigned n = 0;
+
+	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+	Lck_AssertHeld(&oh->mtx);
+	assert(VTAILQ_FIRST(&oh->objcs) == oc);
+
+	if (oh->vidx != NULL) {
+		if (hsh_vidx_add(wrk, oh->vidx, oc, vary))
+			oh->vidx->incomplete = 1;
+		return;
+	}
+	if (vary == NULL || cache_param->vary_index == 0)
+		return;
+	VTAILQ_FOREACH(oc2, &oh->objcs, hsh_list) {
+		if (oc2->flags & OC_F_BUSY)
+			break;
+		if (++n >= cache_param->vary_index) {
+			hsh_vidx_new(wrk, oh);
+			break;
+		}
+	}
+}
+
+static void
+hsh_vidx_del(const struct worker *wrk, struct objhead *oh, struct objcore *oc)
+{
+	struct hsh_vidx *vidx;
+	struct hsh_vgroup *vg;
+	struct hsh_variant *vv;
+	struct hsh_vnode *vn;
+
+	Lck_AssertHeld(&oh->mtx);
+	vidx = oh->vidx;
+	CHECK_OBJ_NOTNULL(vidx, HSH_VIDX_MAGIC);
+	TAKE_OBJ_NOTNULL(vn, &oc->vnode, HSH_VNODE_MAGIC);
+	assert(vn->oc == oc);
+	vv = vn->variant;
+	CHECK_OBJ_NOTNULL(vv, HSH_VARIANT_MAGIC);
+	vg = vv->group;
+	CHECK_OBJ_NOTNULL(vg, HSH_VGROUP_MAGIC);
+
+	VTAILQ_REMOVE(&vv->nodes, vn, list);
+	FREE_OBJ(vn);
+	if (VTAILQ_EMPTY(&vv->nodes)) {
+		VTAILQ_REMOVE(&vidx->hash[vv->sig & vidx->mask], vv, list);
+		FREE_OBJ(vv);
+		hsh_vidx_stat(wrk, vidx->nvariant, 0);
+		vidx->nvariant--;
+		hsh_vidx_stat(wrk, vidx->nvariant, 1);
+	}
+	assert(vg->nobj > 0);
+	if (--vg->nobj == 0) {
+		VTAILQ_REMOVE(&vidx->groups, vg, list);
+		free(vg->vary);
+		FREE_OBJ(vg);
+		vidx->ngroup--;
+	}
+	assert(vidx->nobj > 0);
+	if (--vidx->nobj > 0)
+		return;
+
+	AZ(vidx->nvariant);
+	AZ(vidx->ngroup);
+	oh->vidx = NULL;
+	free(vidx->hash);
+	FREE_OBJ(vidx);
+	wrk->stats->n_vary_index--;
+}
+
+/*
+ * Look the request up in the vary index of the objhead, like the walk
+ * of oh->objcs in HSH_Lookup() does.
+ *
+ * Returns zero if the index cannot tell, and oh->objcs must be walked.
+ */
+
+static int
+hsh_vidx_lookup(struct worker *wrk, struct req *req, struct objhead *oh,
+    struct objcore **ocp, struct objcore **exp_ocp, struct objcore **busy)
+{
+	struct hsh_vidx *vidx;
+	struct hsh_vgroup *vg;
+	struct hsh_variant *vv;
+	struct hsh_vnode *vn[HSH_VIDX_NGROUP], *vb;
+	struct objcore *oc;
+	vtim_real exp_t_origin = 0.0;
+	uint64_t sig;
+	unsigned u, b = 0, n = 0;
+
+	Lck_AssertHeld(&oh->mtx);
+	vidx = oh->vidx;
+	CHECK_OBJ_NOTNULL(vidx, HSH_VIDX_MAGIC);
+	if (vidx->incomplete)
+		return (0);
+
+	VTAILQ_FOREACH(vg, &vidx->groups, list) {
+		CHECK_OBJ_NOTNULL(vg, HSH_VGROUP_MAGIC);
+		if (!VRY_ReqSig(req, vg->vary, &sig))
+			return (0);
+		vv = hsh_vidx_find(vidx, vg, sig);
+		if (vv != NULL) {
+			assert(n < HSH_VIDX_NGROUP);
+			vn[n++] = VTAILQ_FIRST(&vv->nodes);
+		}
+	}
+
+	*ocp = NULL;
+	*exp_ocp = NULL;
+	while (1) {
+		vb = NULL;
+		for (u = 0; u < n; u++) {
+			if (vn[u] == NULL)
+				continue;
+			if (vb == NULL || vn[u]->seq > vb->seq) {
+				vb = vn[u];
+				b = u;
+			}
+		}
+		if (vb == NULL)
+			break;
+		CHECK_OBJ_NOTNULL(vb, HSH_VNODE_MAGIC);
+		vn[b] = VTAILQ_NEXT(vb, list);
+		oc = vb->oc;
+		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+		assert(oc->objhead == oh);
+		AZ(oc->flags & OC_F_BUSY);
+
+		if (!hsh_candidate(wrk, req, oc, busy))
+			continue;
+
+		if (EXP_Ttl(req, oc) > req->t_req) {
+			*ocp = oc;
+			return (1);
+		}
+
+		if (EXP_Ttl(NULL, oc) < req->t_req && /* ignore req.ttl */
+		    oc->t_origin > exp_t_origin) {
+			/* record the newest object */
+			*exp_ocp = oc;
+			exp_t_origin = oc->t_origin;
+		}
+	}
+
+	VTAILQ_FOREACH_REVERSE(oc, &oh->objcs, objcore_head, hsh_list) {
+		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+		if (!(oc->flags & OC_F_BUSY))
+			break;
+		if (oc->flags & (OC_F_DYING | OC_F_FAILED))
+			continue;
+		if (oc->boc == NULL || oc->boc->state >= BOS_STREAM)
+			continue;
+		if (req->hash_ignore_busy)
+			continue;
+		if (oc->boc->vary != NULL && !VRY_Match(req, oc->boc->vary))
+			continue;
+		if (*busy == NULL)
+			*busy = oc;
+		break;
+	}
+	return (1);
+}
+
+/*---------------------------------------------------------------------
+ * Should a hit on this fresh object also start a background fetch to
+ * refresh it before it expires ?
+ *
+ * Busy objects are inserted at the tail of the list, so a refresh
+ * already under way is found behind the object it refreshes.
+ */
+
+static int
+hsh_refresh_ahead(struct req *req, const struct objcore *oc)
+{
+	const struct objcore *oc2;
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+
+	if (cache_param->refresh_ahead <= 0. || req->hash_ignore_busy ||
+	    req->esi_prefetch)
+		return (0);
+	if (oc->flags & OC_F_PRIVATE)
+		return (0);
+	if (oc->hits < cache_param->refresh_ahead_hits)
+		return (0);
+	if (EXP_Ttl(NULL, oc) - req->t_req >= cache_param->refresh_ahead)
+		return (0);
+
+	oc2 = oc;
+	while ((oc2 = VTAILQ_NEXT(oc2, hsh_list)) != NULL) {
+		CHECK_OBJ_NOTNULL(oc2, OBJCORE_MAGIC);
+		if (oc2->flags & (OC_F_DYING | OC_F_FAILED))
+			continue;
+		if (oc2->boc == NULL || oc2->boc->state >= BOS_STREAM)
+			continue;
+		if (oc2->boc->vary != NULL &&
+		    !VRY_Match(req, oc2->boc->vary))
+			continue;
+		return (0);
+	}
+	return (1);
+}
+
+/*---------------------------------------------------------------------
+ * ESI prefetches are not hits, the include proper is, see ved_prefetch()
+ */
+
+static inline void
+hsh_count_hit(const struct req *req, struct objcore *oc)
+{
+
+	if (!req->esi_prefetch)
+		oc->hits++;
+}
+
 /*---------------------------------------------------------------------
  */
 
@@ -355,8 +878,8 @@ HSH_Lookup(struct req *req, struct objcore **ocp, struct objcore **bocp)
 	struct objcore *exp_oc;
 	const struct vcf_return *vr;
 	vtim_real exp_t_origin;
-	int busy_found;
-	const uint8_t *vary;
+	struct objcore *busy_oc;
+	struct boc *boc;
 	unsigned xid = 0;
 	float dttl = 0.0;
 
@@ -376,6 +899,35 @@ HSH_Lookup(struct req *req, struct objcore **ocp, struct objcore **bocp)
 	if (DO_DEBUG(DBG_HASHEDGE))
 		hsh_testmagic(req->digest);
 
+	if (req->hash_oc != NULL) {
+		/*
+		 * This req was handed the object it waited for, see
+		 * hsh_handoff().  Wait for it to stream, but skip the
+		 * search if it is still good for us.
+		 */
+		oc = req->hash_oc;
+		req->hash_oc = NULL;
+		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+		boc = HSH_RefBoc(oc);
+		if (boc != NULL) {
+			ObjWaitState(oc, BOS_STREAM);
+			HSH_DerefBoc(wrk, oc);
+		}
+		oh = req->hash_objhead;
+		CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+		assert(oc->objhead == oh);
+		Lck_Lock(&oh->mtx);
+		if (hsh_handoff_hit(wrk, req, oc)) {
+			hsh_count_hit(req, oc);
+			req->hash_objhead = NULL;
+			AN(hsh_deref_objhead_unlock(wrk, &oh));
+			*ocp = oc;
+			return (HSH_HIT);
+		}
+		Lck_Unlock(&oh->mtx);
+		(void)HSH_DerefObjCore(wrk, &oc, 0);
+	}
+
 	if (req->hash_objhead != NULL) {
 		/*
 		 * This req came off the waiting list, and brings an
@@ -403,76 +955,52 @@ HSH_Lookup(struct req *req, struct objcore **ocp, struct objcore **bocp)
 	}
 
 	assert(oh->refcnt > 0);
-	busy_found = 0;
+	busy_oc = NULL;
 	exp_oc = NULL;
 	exp_t_origin = 0.0;
-	VTAILQ_FOREACH(oc, &oh->objcs, hsh_list) {
-		/* Must be at least our own ref + the objcore we examine */
-		assert(oh->refcnt > 1);
-		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
-		assert(oc->objhead == oh);
-		assert(oc->refcnt > 0);
-
-		if (oc->flags & OC_F_DYING)
-			continue;
-		if (oc->flags & OC_F_FAILED)
-			continue;
-
-		CHECK_OBJ_ORNULL(oc->boc, BOC_MAGIC);
-		if (oc->boc != NULL && oc->boc->state < BOS_STREAM) {
-			if (req->hash_ignore_busy)
-				continue;
+	if (oh->vidx != NULL && req->vcf == NULL &&
+	    cache_param->vary_index > 0 &&
+	    hsh_vidx_lookup(wrk, req, oh, &oc, &exp_oc, &busy_oc)) {
+		wrk->stats->cache_vary_index++;
+	} else {
+		VTAILQ_FOREACH(oc, &oh->objcs, hsh_list) {
+			/* At least our own ref + the objcore we examine */
+			assert(oh->refcnt > 1);
+			CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+			assert(oc->objhead == oh);
+			assert(oc->refcnt > 0);
 
-			if (oc->boc->vary != NULL &&
-			    !VRY_Match(req, oc->boc->vary))
+			if (!hsh_candidate(wrk, req, oc, &busy_oc))
 				continue;
 
-			busy_found = 1;
-			continue;
-		}
-
-		if (oc->ttl <= 0.)
-			continue;
-
-		if (BAN_CheckObject(wrk, oc, req)) {
-			oc->flags |= OC_F_DYING;
-			EXP_Remove(oc);
-			continue;
-		}
-
-		if (ObjHasAttr(wrk, oc, OA_VARY)) {
-			vary = ObjGetAttr(wrk, oc, OA_VARY, NULL);
-			AN(vary);
-			if (!VRY_Match(req, vary))
-				continue;
-		}
+			if (req->vcf != NULL) {
+				vr = req->vcf->func(req, &oc, &exp_oc, 0);
+				if (vr == VCF_CONTINUE)
+					continue;
+				if (vr == VCF_MISS) {
+					oc = NULL;
+					break;
+				}
+				if (vr == VCF_HIT)
+					break;
+				assert(vr == VCF_DEFAULT);
+			}
 
-		if (req->vcf != NULL) {
-			vr = req->vcf->func(req, &oc, &exp_oc, 0);
-			if (vr == VCF_CONTINUE)
-				continue;
-			if (vr == VCF_MISS) {
-				oc = NULL;
+			if (EXP_Ttl(req, oc) > req->t_req) {
+				assert(oh->refcnt > 1);
+				assert(oc->objhead == oh);
 				break;
 			}
-			if (vr == VCF_HIT)
-				break;
-			assert(vr == VCF_DEFAULT);
-		}
 
-		if (EXP_Ttl(req, oc) > req->t_req) {
-			assert(oh->refcnt > 1);
-			assert(oc->objhead == oh);
-			break;
-		}
-
-		if (EXP_Ttl(NULL, oc) < req->t_req && /* ignore req.ttl */
-		    oc->t_origin > exp_t_origin) {
-			/* record the newest object */
-			exp_oc = oc;
-			exp_t_origin = oc->t_origin;
-			assert(oh->refcnt > 1);
-			assert(exp_oc->objhead == oh);
+			/* ignore req.ttl */
+			if (EXP_Ttl(NULL, oc) < req->t_req &&
+			    oc->t_origin > exp_t_origin) {
+				/* record the newest object */
+				exp_oc = oc;
+				exp_t_origin = oc->t_origin;
+				assert(oh->refcnt > 1);
+				assert(exp_oc->objhead == oh);
+			}
 		}
 	}
 
@@ -483,7 +1011,8 @@ HSH_Lookup(struct req *req, struct objcore **ocp, struct objcore **bocp)
 		xid = ObjGetXID(wrk, oc);
 		dttl = EXP_Dttl(req, oc);
 		AN(hsh_deref_objhead_unlock(wrk, &oh));
-		wrk->stats->cache_hitpass++;
+		if (!req->esi_prefetch)
+			wrk->stats->cache_hitpass++;
 		VSLb(req->vsl, SLT_HitPass, "%u %.6f", xid, dttl);
 		return (HSH_HITPASS);
 	}
@@ -496,11 +1025,19 @@ HSH_Lookup(struct req *req, struct objcore **ocp, struct objcore **bocp)
 			dttl = EXP_Dttl(req, oc);
 			*bocp = hsh_insert_busyobj(wrk, oh);
 			Lck_Unlock(&oh->mtx);
-			wrk->stats->cache_hitmiss++;
+			if (!req->esi_prefetch)
+				wrk->stats->cache_hitmiss++;
 			VSLb(req->vsl, SLT_HitMiss, "%u %.6f", xid, dttl);
 			return (HSH_HITMISS);
 		}
-		oc->hits++;
+		hsh_count_hit(req, oc);
+		if (hsh_refresh_ahead(req, oc)) {
+			*bocp = hsh_insert_busyobj(wrk, oh);
+			/* NB: no deref of objhead, new object inherits reference */
+			Lck_Unlock(&oh->mtx);
+			wrk->stats->cache_hit_refresh++;
+			return (HSH_HIT);
+		}
 		AN(hsh_deref_objhead_unlock(wrk, &oh));
 		return (HSH_HIT);
 	}
@@ -516,19 +1053,20 @@ HSH_Lookup(struct req *req, struct objcore **ocp, struct objcore **bocp)
 		dttl = EXP_Dttl(req, exp_oc);
 		*bocp = hsh_insert_busyobj(wrk, oh);
 		Lck_Unlock(&oh->mtx);
-		wrk->stats->cache_hitmiss++;
+		if (!req->esi_prefetch)
+			wrk->stats->cache_hitmiss++;
 		VSLb(req->vsl, SLT_HitMiss, "%u %.6f", xid, dttl);
 		return (HSH_HITMISS);
 	}
 
-	if (!busy_found) {
+	if (busy_oc == NULL) {
 		*bocp = hsh_insert_busyobj(wrk, oh);
 
 		if (exp_oc != NULL) {
 			exp_oc->refcnt++;
 			*ocp = exp_oc;
 			if (EXP_Ttl_grace(req, exp_oc) >= req->t_req) {
-				exp_oc->hits++;
+				hsh_count_hit(req, exp_oc);
 				Lck_Unlock(&oh->mtx);
 				return (HSH_GRACE);
 			}
@@ -537,12 +1075,12 @@ HSH_Lookup(struct req *req, struct objcore **ocp, struct objcore **bocp)
 		return (HSH_MISS);
 	}
 
-	AN(busy_found);
+	AN(busy_oc);
 	if (exp_oc != NULL && EXP_Ttl_grace(req, exp_oc) >= req->t_req) {
 		/* we do not wait on the busy object if in grace */
 		exp_oc->refcnt++;
 		*ocp = exp_oc;
-		exp_oc->hits++;
+		hsh_count_hit(req, exp_oc);
 		AN(hsh_deref_objhead_unlock(wrk, &oh));
 		return (HSH_GRACE);
 	}
@@ -558,6 +1096,7 @@ HSH_Lookup(struct req *req, struct objcore **ocp, struct objcore **bocp)
 	 * calls us again
 	 */
 	req->hash_objhead = oh;
+	req->hash_busy = busy_oc;
 	req->wrk = NULL;
 	req->waitinglist = 1;
 
@@ -589,7 +1128,8 @@ hsh_rush1(const struct worker *wrk, struct objhead *oh, struct rush *r, int max)
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
 	CHECK_OBJ_NOTNULL(r, RUSH_MAGIC);
-	VTAILQ_INIT(&r->reqs);
+	if (VTAILQ_EMPTY(&r->reqs))	/* May hold handed off reqs */
+		VTAILQ_INIT(&r->reqs);
 	Lck_AssertHeld(&oh->mtx);
 	for (u = 0; u < max; u++) {
 		req = VTAILQ_FIRST(&oh->waitinglist);
@@ -601,7 +1141,94 @@ hsh_rush1(const struct worker *wrk, struct objhead *oh, struct rush *r, int max)
 		VTAILQ_REMOVE(&oh->waitinglist, req, w_list);
 		VTAILQ_INSERT_TAIL(&r->reqs, req, w_list);
 		req->waitinglist = 0;
+		req->hash_busy = NULL;
 	}
+	if (u > 0)
+		wrk->stats->busy_rush++;
+}
+
+/*---------------------------------------------------------------------
+ * Hand an unbusied object to the requests waiting for it, instead of
+ * rushing them to look it up again.  They keep their objhead reference
+ * and get one on the object, see hsh_handoff_hit().
+ */
+
+static void
+hsh_handoff(const struct worker *wrk, struct objhead *oh, struct objcore *oc,
+    struct rush *r)
+{
+	struct req *req, *req2;
+	unsigned u = 0;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	CHECK_OBJ_NOTNULL(r, RUSH_MAGIC);
+	Lck_AssertHeld(&oh->mtx);
+
+	if (!cache_param->waitinglist_handoff)
+		return;
+	if (oc->flags & (OC_F_HFM | OC_F_HFP | OC_F_PRIVATE | OC_F_DYING))
+		return;
+	if (oc->ttl <= 0.)
+		return;
+
+	VTAILQ_INIT(&r->reqs);
+	VTAILQ_FOREACH_SAFE(req, &oh->waitinglist, w_list, req2) {
+		CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+		if (req->hash_busy != oc)
+			continue;
+		assert(req->hash_objhead == oh);
+		AZ(req->hash_oc);
+		AZ(req->wrk);
+		VTAILQ_REMOVE(&oh->waitinglist, req, w_list);
+		VTAILQ_INSERT_TAIL(&r->reqs, req, w_list);
+		req->waitinglist = 0;
+		req->hash_busy = NULL;
+		oc->refcnt++;
+		req->hash_oc = oc;
+		u++;
+	}
+	if (u > 0) {
+		wrk->stats->busy_wakeup += u;
+		wrk->stats->busy_handoff += u;
+		wrk->stats->busy_rush++;
+	}
+}
+
+/*---------------------------------------------------------------------
+ * Check the object a request was handed off the waiting list, the way
+ * HSH_Lookup() would have found it.
+ */
+
+static int
+hsh_handoff_hit(struct worker *wrk, struct req *req, struct objcore *oc)
+{
+	const uint8_t *vary;
+
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	Lck_AssertHeld(&oc->objhead->mtx);
+
+	if (req->vcf != NULL)
+		return (0);
+	if (oc->flags & (OC_F_DYING | OC_F_FAILED))
+		return (0);
+	if (oc->ttl <= 0.)
+		return (0);
+
+	if (BAN_CheckObject(wrk, oc, req)) {
+		oc->flags |= OC_F_DYING;
+		EXP_Remove(oc);
+		return (0);
+	}
+
+	if (ObjHasAttr(wrk, oc, OA_VARY)) {
+		vary = ObjGetAttr(wrk, oc, OA_VARY, NULL);
+		AN(vary);
+		if (!VRY_Match(req, vary))
+			return (0);
+	}
+	return (EXP_Ttl(req, oc) > req->t_req);
 }
 
 /*---------------------------------------------------------------------
@@ -807,6 +1434,7 @@ HSH_Unbusy(struct worker *wrk, struct objcore *oc)
 {
 	struct objhead *oh;
 	struct rush rush;
+	const uint8_t *vary;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
@@ -819,9 +1447,12 @@ HSH_Unbusy(struct worker *wrk, struct objcore *oc)
 	assert(oh->refcnt > 0);
 	assert(oc->refcnt > 0);
 
+	vary = NULL;
 	if (!(oc->flags & OC_F_PRIVATE)) {
 		BAN_NewObjCore(oc);
 		AN(oc->ban);
+		if (ObjHasAttr(wrk, oc, OA_VARY))
+			vary = ObjGetAttr(wrk, oc, OA_VARY, NULL);
 	}
 
 	/* XXX: pretouch neighbors on oh->objcs to prevent page-on under mtx */
@@ -834,8 +1465,11 @@ HSH_Unbusy(struct worker *wrk, struct objcore *oc)
 	VTAILQ_REMOVE(&oh->objcs, oc, hsh_list);
 	VTAILQ_INSERT_HEAD(&oh->objcs, oc, hsh_list);
 	oc->flags &= ~OC_F_BUSY;
+	if (!(oc->flags & OC_F_PRIVATE))
+		hsh_vidx_insert(wrk, oh, oc, vary);
 	if (!VTAILQ_EMPTY(&oh->waitinglist)) {
 		assert(oh->refcnt > 1);
+		hsh_handoff(wrk, oh, oc, &rush);
 		hsh_rush1(wrk, oh, &rush, HSH_RUSH_POLICY);
 	}
 	Lck_Unlock(&oh->mtx);
@@ -990,8 +1624,11 @@ HSH_DerefObjCore(struct worker *wrk, struct objcore **ocp, int rushmax)
 	Lck_Lock(&oh->mtx);
 	assert(oh->refcnt > 0);
 	r = --oc->refcnt;
-	if (!r)
+	if (!r) {
 		VTAILQ_REMOVE(&oh->objcs, oc, hsh_list);
+		if (oc->vnode != NULL)
+			hsh_vidx_del(wrk, oh, oc);
+	}
 	if (!VTAILQ_EMPTY(&oh->waitinglist)) {
 		assert(oh->refcnt > 1);
 		hsh_rush1(wrk, oh, &rush, rushmax);
@@ -1006,6 +1643,9 @@ HSH_DerefObjCore(struct worker *wrk, struct objcore **ocp, int rushmax)
 	BAN_DestroyObj(oc);
 	AZ(oc->ban);
 
+	XKEY_DestroyObj(wrk, oc);
+	AZ(oc->xkey);
+
 	if (oc->stobj->stevedore != NULL)
 		ObjFreeObj(wrk, oc);
 	ObjDestroy(wrk, &oc);
@@ -385,6 +385,7 @@ child_main(int sigmagic, size_t altstksz)
 	EXP_Init();
 	HSH_Init(heritage.hash);
 	BAN_Init();
+	XKEY_Init();
 
 	VCA_Init();
 
@@ -29,6 +29,7 @@
  */
 
 struct hash_slinger;
+struct hsh_vidx;
 
 struct objhead {
 	unsigned		magic;
@@ -36,9 +37,10 @@ struct objhead {
 
 	int			refcnt;
 	struct lock		mtx;
-	VTAILQ_HEAD(,objcore)	objcs;
+	VTAILQ_HEAD(objcore_head, objcore) objcs;
 	uint8_t			digest[DIGEST_LEN];
 	VTAILQ_HEAD(, req)	waitinglist;
+	struct hsh_vidx		*vidx;
 
 	/*----------------------------------------------------
 	 * The fields below are for the sole private use of
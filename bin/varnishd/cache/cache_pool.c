@@ -35,16 +35,24 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(__linux__)
+#  define POOL_NUMA 1
+#  include <sched.h>
+#endif
+
 #include "cache_varnishd.h"
 #include "cache_pool.h"
 
+#include "VSC_numa.h"
+
 static pthread_t		thr_pool_herder;
 
 static struct lock		wstat_mtx;
 struct lock			pool_mtx;
-static VTAILQ_HEAD(,pool)	pools = VTAILQ_HEAD_INITIALIZER(pools);
+struct poolhead			pools = VTAILQ_HEAD_INITIALIZER(pools);
 
 /*--------------------------------------------------------------------
  * Summing of stats into global stats counters
@@ -127,6 +135,126 @@ pool_stat_summ(struct worker *wrk, void *priv)
 	wrk->pool->b_stat = src;
 }
 
+/*--------------------------------------------------------------------
+ * NUMA placement, see thread_pool_numa.
+ *
+ * Threads inherit the CPU affinity of the thread creating them, so we
+ * bind the pool herder thread to the node of a pool while we create it:
+ * the herder, worker and mempool threads of the pool all end up on the
+ * node, and with the kernels first-touch policy so do the workspaces on
+ * the worker stacks and the mempool contents.
+ */
+
+#ifdef POOL_NUMA
+
+#define POOL_MAX_NODES	64
+
+static struct pool_node {
+	cpu_set_t		cpus;
+	struct VSC_numa		*vsc;
+	struct vsc_seg		*vsc_seg;
+} pool_node[POOL_MAX_NODES];
+static unsigned pool_nnode;
+static cpu_set_t pool_allcpus;
+
+/*
+ * Read a sysfs list like "0-3,8-11" into a set, as used for both the
+ * nodes and the CPUs of a node.
+ */
+
+static int
+pool_numa_list(const char *fn, cpu_set_t *cs)
+{
+	char buf[1024], *p, *q;
+	unsigned long lo, hi;
+	FILE *f;
+
+	f = fopen(fn, "r");
+	if (f == NULL)
+		return (-1);
+	p = fgets(buf, sizeof buf, f);
+	(void)fclose(f);
+	if (p == NULL)
+		return (-1);
+	CPU_ZERO(cs);
+	while (*p != '\0' && *p != '\n') {
+		lo = strtoul(p, &q, 10);
+		if (q == p)
+			return (-1);
+		hi = lo;
+		if (*q == '-')
+			hi = strtoul(q + 1, &q, 10);
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, cs);
+		p = q;
+		if (*p == ',')
+			p++;
+	}
+	return (CPU_COUNT(cs) > 0 ? 0 : -1);
+}
+
+static void
+pool_numa_init(void)
+{
+	struct pool_node *pn;
+	cpu_set_t nodes;
+	char fn[64];
+	unsigned u;
+
+	AZ(pthread_getaffinity_np(pthread_self(), sizeof pool_allcpus,
+	    &pool_allcpus));
+	if (!cache_param->wthread_numa)
+		return;
+	/* Node numbers need not be contiguous, take what the kernel has */
+	if (pool_numa_list("/sys/devices/system/node/online", &nodes))
+		CPU_ZERO(&nodes);
+	for (u = 0; u < CPU_SETSIZE && pool_nnode < POOL_MAX_NODES; u++) {
+		if (!CPU_ISSET(u, &nodes))
+			continue;
+		pn = &pool_node[pool_nnode];
+		bprintf(fn, "/sys/devices/system/node/node%u/cpulist", u);
+		if (pool_numa_list(fn, &pn->cpus))
+			continue;	/* memory only node */
+		CPU_AND(&pn->cpus, &pn->cpus, &pool_allcpus);
+		pn->vsc = VSC_numa_New(NULL, &pn->vsc_seg, "node%u", u);
+		pool_nnode++;
+	}
+	if (pool_nnode == 0)
+		VSL(SLT_Error, 0, "thread_pool_numa: No NUMA nodes found");
+}
+
+static void
+pool_numa_bind(struct pool *pp, unsigned pool_no)
+{
+	const cpu_set_t *cs = &pool_allcpus;
+	struct pool_node *pn;
+
+	if (pp != NULL && pool_nnode > 0) {
+		pp->numa_node = pool_no % pool_nnode;
+		pn = &pool_node[pp->numa_node];
+		pp->numa_vsc = pn->vsc;
+		if (CPU_COUNT(&pn->cpus) > 0)
+			cs = &pn->cpus;
+	}
+	(void)pthread_setaffinity_np(pthread_self(), sizeof *cs, cs);
+}
+
+#else
+
+static void
+pool_numa_init(void)
+{
+}
+
+static void
+pool_numa_bind(struct pool *pp, unsigned pool_no)
+{
+	(void)pp;
+	(void)pool_no;
+}
+
+#endif
+
 /*--------------------------------------------------------------------
  * Add a thread pool
  */
@@ -140,6 +268,11 @@ pool_mkpool(unsigned pool_no)
 	ALLOC_OBJ(pp, POOL_MAGIC);
 	if (pp == NULL)
 		return (NULL);
+	pp->pool_no = pool_no;
+	pp->numa_node = -1;
+	pool_numa_bind(pp, pool_no);
+	if (pp->numa_vsc != NULL)
+		pp->numa_vsc->g_pools++;
 	pp->a_stat = calloc(1, sizeof *pp->a_stat);
 	AN(pp->a_stat);
 	pp->b_stat = calloc(1, sizeof *pp->b_stat);
@@ -158,6 +291,7 @@ pool_mkpool(unsigned pool_no)
 
 	SES_NewPool(pp, pool_no);
 	VCA_NewPool(pp);
+	pool_numa_bind(NULL, 0);
 
 	return (pp);
 }
@@ -182,6 +316,8 @@ pool_poolherder(void *priv)
 	THR_Init();
 	(void)priv;
 
+	pool_numa_init();
+
 	nwq = 0;
 	while (1) {
 		if (nwq < cache_param->wthread_pools) {
@@ -227,6 +363,8 @@ pool_poolherder(void *priv)
 			free(ppx->a_stat);
 			free(ppx->b_stat);
 			SES_DestroyPool(ppx);
+			if (ppx->numa_vsc != NULL)
+				ppx->numa_vsc->g_pools--;
 			FREE_OBJ(ppx);
 			VSC_C_main->pools--;
 		}
@@ -38,6 +38,7 @@ struct pool {
 #define POOL_MAGIC			0x606658fa
 	VTAILQ_ENTRY(pool)		list;
 	VTAILQ_HEAD(,poolsock)		poolsocks;
+	unsigned			pool_no;
 
 	int				die;
 	pthread_cond_t			herder_cond;
@@ -54,9 +55,14 @@ struct pool {
 	uintmax_t			rdropped;
 	uintmax_t			nqueued;
 	uintmax_t			ndequeued;
+	uintmax_t			npushed;
+	uintmax_t			nstolen;
 	struct VSC_main_wrk		*a_stat;
 	struct VSC_main_wrk		*b_stat;
 
+	int				numa_node;
+	struct VSC_numa			*numa_vsc;
+
 	struct mempool			*mpl_req;
 	struct mempool			*mpl_sess;
 	struct waiter			*waiter;
@@ -65,5 +71,6 @@ struct pool {
 void *pool_herder(void*);
 task_func_t pool_stat_summ;
 extern struct lock			pool_mtx;
+extern VTAILQ_HEAD(poolhead, pool)	pools;
 void VCA_NewPool(struct pool *);
 void VCA_DestroyPool(struct pool *);
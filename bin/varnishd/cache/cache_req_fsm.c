@@ -149,9 +149,7 @@ cnt_deliver(struct worker *wrk, struct req *req)
 
 	http_SetHeader(req->resp, "Via: 1.1 varnish (Varnish/6.2)");
 
-	if (cache_param->http_gzip_support &&
-	    ObjCheckFlag(req->wrk, req->objcore, OF_GZIPED) &&
-	    !RFC2616_Req_Gzip(req->http))
+	if (resp_Decode_Filter(req) != NULL)
 		RFC2616_Weaken_Etag(req->resp);
 
 	VCL_deliver_method(req->vcl, wrk, req, NULL, NULL);
@@ -457,6 +455,7 @@ cnt_lookup(struct worker *wrk, struct req *req)
 	struct objcore *oc, *busy;
 	enum lookup_e lr;
 	int had_objhead = 0;
+	vtim_real now;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
@@ -480,8 +479,12 @@ cnt_lookup(struct worker *wrk, struct req *req)
 		 */
 		return (REQ_FSM_DISEMBARK);
 	}
-	if (had_objhead)
-		VSLb_ts_req(req, "Waitinglist", W_TIM_real(wrk));
+	if (had_objhead) {
+		now = W_TIM_real(wrk);
+		wrk->stats->busy_wait_us +=
+		    (uint64_t)(1e6 * (now - req->t_prev));
+		VSLb_ts_req(req, "Waitinglist", now);
+	}
 
 	if (req->vcf != NULL) {
 		(void)req->vcf->func(req, NULL, NULL, 2);
@@ -521,6 +524,16 @@ cnt_lookup(struct worker *wrk, struct req *req)
 	req->objcore = oc;
 	AZ(oc->flags & OC_F_HFM);
 
+	if (req->esi_prefetch) {
+		/* Nothing to prefetch, vcl_hit{} is for the include */
+		if (busy != NULL) {
+			(void)HSH_DerefObjCore(wrk, &busy, 0);
+			VRY_Clear(req);
+		}
+		req->req_step = R_STP_DELIVER;
+		return (REQ_FSM_MORE);
+	}
+
 	VSLb(req->vsl, SLT_Hit, "%u %.6f %.6f %.6f",
 	    ObjGetXID(wrk, req->objcore),
 	    EXP_Dttl(req, req->objcore),
@@ -535,7 +548,8 @@ cnt_lookup(struct worker *wrk, struct req *req)
 			AZ(oc->flags & OC_F_HFM);
 			CHECK_OBJ_NOTNULL(busy->boc, BOC_MAGIC);
 			// XXX: shouldn't we go to miss?
-			VBF_Fetch(wrk, req, busy, oc, VBF_BACKGROUND);
+			VBF_Fetch(wrk, req, busy, oc,
+			    lr == HSH_HIT ? VBF_REFRESH : VBF_BACKGROUND);
 		} else {
 			(void)VRB_Ignore(req);// XXX: handle err
 		}
@@ -591,7 +605,8 @@ cnt_miss(struct worker *wrk, struct req *req)
 	VCL_miss_method(req->vcl, wrk, req, NULL, NULL);
 	switch (wrk->handling) {
 	case VCL_RET_FETCH:
-		wrk->stats->cache_miss++;
+		if (!req->esi_prefetch)
+			wrk->stats->cache_miss++;
 		VBF_Fetch(wrk, req, req->objcore, req->stale_oc, VBF_NORMAL);
 		if (req->stale_oc != NULL)
 			(void)HSH_DerefObjCore(wrk, &req->stale_oc, 0);
@@ -808,7 +823,7 @@ cnt_recv(struct worker *wrk, struct req *req)
 {
 	unsigned recv_handling;
 	struct VSHA256Context sha256ctx;
-	const char *ci, *cp, *endpname;
+	const char *ci, *cp, *endpname, *ae;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
@@ -864,8 +879,9 @@ cnt_recv(struct worker *wrk, struct req *req)
 	if (cache_param->http_gzip_support &&
 	     (recv_handling != VCL_RET_PIPE) &&
 	     (recv_handling != VCL_RET_PASS)) {
-		if (RFC2616_Req_Gzip(req->http)) {
-			http_ForceHeader(req->http, H_Accept_Encoding, "gzip");
+		ae = RFC2616_Req_Codings(req->http);
+		if (ae != NULL) {
+			http_ForceHeader(req->http, H_Accept_Encoding, ae);
 		} else {
 			http_Unset(req->http, H_Accept_Encoding);
 		}
@@ -977,6 +993,35 @@ cnt_purge(struct worker *wrk, struct req *req)
 	return (REQ_FSM_MORE);
 }
 
+/*--------------------------------------------------------------------
+ * ESI prefetch requests only go as far as getting the object looked up
+ * and, on a miss, the fetch started.  Delivery, and everything which
+ * would cause a private fetch, is left for the actual include.
+ */
+
+static int
+cnt_prefetch_done(struct worker *wrk, struct req *req)
+{
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	AN(req->esi_prefetch);
+
+	switch (req->req_step) {
+	case R_STP_TRANSPORT:
+	case R_STP_RECV:
+	case R_STP_LOOKUP:
+	case R_STP_MISS:
+		return (0);
+	default:
+		break;
+	}
+	AZ(req->stale_oc);
+	if (req->objcore != NULL)
+		(void)HSH_DerefObjCore(wrk, &req->objcore, HSH_RUSH_POLICY);
+	return (1);
+}
+
 /*--------------------------------------------------------------------
  * Central state engine dispatcher.
  *
@@ -1053,6 +1098,11 @@ CNT_Request(struct req *req)
 		CHECK_OBJ_ORNULL(wrk->nobjhead, OBJHEAD_MAGIC);
 		CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
 
+		if (req->esi_prefetch && cnt_prefetch_done(wrk, req)) {
+			nxt = REQ_FSM_DONE;
+			break;
+		}
+
 		switch (req->req_step) {
 #define REQ_STEP(l,u,arg) \
 		    case R_STP_##u: \
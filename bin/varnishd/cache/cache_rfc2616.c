@@ -231,7 +231,8 @@ RFC2616_Req_Gzip(const struct http *hp)
 	/*
 	 * "gzip" is the real thing, but the 'q' value must be nonzero.
 	 * We do not care a hoot if the client prefers some other
-	 * compression more than gzip: Varnish only does gzip.
+	 * compression more than gzip: objects are stored in one coding
+	 * only, and the client gets that if it accepts it at all.
 	 */
 	if (http_GetHdrQ(hp, H_Accept_Encoding, "gzip") > 0.)
 		return (1);
@@ -240,6 +241,37 @@ RFC2616_Req_Gzip(const struct http *hp)
 	return (0);
 }
 
+/*--------------------------------------------------------------------
+ * Boil the client's Accept-Encoding down to the codings we can deliver
+ * stored objects in, so that clients saying the same thing in different
+ * words all look alike.  Unless brotli or zstd support is enabled, this
+ * is just "gzip".  Returns NULL if none are acceptable.
+ */
+
+const char *
+RFC2616_Req_Codings(const struct http *hp)
+{
+	static const char * const ae[8] = {
+		NULL, "gzip", "br", "gzip, br",
+		"zstd", "gzip, zstd", "br, zstd", "gzip, br, zstd",
+	};
+	unsigned u = 0;
+
+	if (RFC2616_Req_Gzip(hp))
+		u |= 1;
+#ifdef HAVE_BROTLI
+	if (cache_param->http_brotli_support &&
+	    http_GetHdrQ(hp, H_Accept_Encoding, "br") > 0.)
+		u |= 2;
+#endif
+#ifdef HAVE_ZSTD
+	if (cache_param->http_zstd_support &&
+	    http_GetHdrQ(hp, H_Accept_Encoding, "zstd") > 0.)
+		u |= 4;
+#endif
+	return (ae[u]);
+}
+
 /*--------------------------------------------------------------------*/
 
 static inline int
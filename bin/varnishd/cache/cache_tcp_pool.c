@@ -27,6 +27,14 @@
  *
  * TCP connection pools.
  *
+ * The idle connections of a pool are split over backend_pool_shards
+ * sub-pools, each with its own lock.  A worker checks connections out
+ * of, and the connections it opens back into, the sub-pool of its thread
+ * pool, and only looks at the others when its own has nothing idle.
+ *
+ * With backend_idle_min set, a sub-pool which runs low on idle
+ * connections has a task top it up in the background.
+ *
  */
 
 #include "config.h"
@@ -45,6 +53,7 @@
 #include "cache_pool.h"
 
 struct conn_pool;
+struct vcp_shard;
 
 /*--------------------------------------------------------------------
  */
@@ -58,6 +67,7 @@ struct pfd {
 	uint8_t			state;
 	struct waited		waited[1];
 	struct conn_pool	*conn_pool;
+	struct vcp_shard	*shard;
 
 	pthread_cond_t		*cond;
 };
@@ -90,6 +100,20 @@ struct conn_pool {
 
 	VTAILQ_ENTRY(conn_pool)			list;
 	int					refcnt;
+	int					dying;
+	struct lock				mtx;
+
+	unsigned				nshard;
+	struct vcp_shard			*shard;
+
+	vtim_mono				holddown;
+	int					holddown_errno;
+};
+
+struct vcp_shard {
+	unsigned				magic;
+#define VCP_SHARD_MAGIC				0x6d1f0b52
+	struct conn_pool			*conn_pool;
 	struct lock				mtx;
 
 	VTAILQ_HEAD(, pfd)			connlist;
@@ -100,8 +124,8 @@ struct conn_pool {
 
 	int					n_used;
 
-	vtim_mono				holddown;
-	int					holddown_errno;
+	int					prewarming;
+	struct pool_task			prewarm_task;
 };
 
 struct tcp_pool {
@@ -153,6 +177,26 @@ PFD_RemoteName(const struct pfd *p, char *abuf, unsigned alen, char *pbuf,
 	p->conn_pool->methods->remote_name(p, abuf, alen, pbuf, plen);
 }
 
+/*--------------------------------------------------------------------
+ * Sub-pools
+ */
+
+static struct vcp_shard *
+vcp_shard(const struct conn_pool *cp, const struct worker *wrk)
+{
+	struct vcp_shard *vs;
+
+	CHECK_OBJ_NOTNULL(cp, CONN_POOL_MAGIC);
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(wrk->pool, POOL_MAGIC);
+	vs = &cp->shard[wrk->pool->pool_no % cp->nshard];
+	CHECK_OBJ(vs, VCP_SHARD_MAGIC);
+	return (vs);
+}
+
+static int vcp_prewarm_claim(struct vcp_shard *);
+static void vcp_prewarm_start(struct vcp_shard *);
+
 /*--------------------------------------------------------------------
  * Waiter-handler
  */
@@ -162,39 +206,50 @@ vcp_handle(struct waited *w, enum wait_event ev, vtim_real now)
 {
 	struct pfd *pfd;
 	struct conn_pool *cp;
+	struct vcp_shard *vs;
+	int start = 0;
 
 	CAST_OBJ_NOTNULL(pfd, w->priv1, PFD_MAGIC);
-	(void)ev;
 	(void)now;
 	CHECK_OBJ_NOTNULL(pfd->conn_pool, CONN_POOL_MAGIC);
 	cp = pfd->conn_pool;
+	vs = pfd->shard;
+	CHECK_OBJ_NOTNULL(vs, VCP_SHARD_MAGIC);
 
-	Lck_Lock(&cp->mtx);
+	Lck_Lock(&vs->mtx);
 
 	switch (pfd->state) {
 	case PFD_STATE_STOLEN:
 		pfd->state = PFD_STATE_USED;
-		VTAILQ_REMOVE(&cp->connlist, pfd, list);
+		VTAILQ_REMOVE(&vs->connlist, pfd, list);
 		AN(pfd->cond);
 		AZ(pthread_cond_signal(pfd->cond));
 		break;
 	case PFD_STATE_AVAIL:
 		cp->methods->close(pfd);
-		VTAILQ_REMOVE(&cp->connlist, pfd, list);
-		cp->n_conn--;
+		VTAILQ_REMOVE(&vs->connlist, pfd, list);
+		vs->n_conn--;
 		FREE_OBJ(pfd);
+		/*
+		 * Top up again after our own timeout, but not when the
+		 * backend closes on us, lest we hammer it with connects.
+		 */
+		if (ev == WAITER_TIMEOUT)
+			start = vcp_prewarm_claim(vs);
 		break;
 	case PFD_STATE_CLEANUP:
 		cp->methods->close(pfd);
-		cp->n_kill--;
-		VTAILQ_REMOVE(&cp->killlist, pfd, list);
+		vs->n_kill--;
+		VTAILQ_REMOVE(&vs->killlist, pfd, list);
 		memset(pfd, 0x11, sizeof *pfd);
 		free(pfd);
 		break;
 	default:
 		WRONG("Wrong pfd state");
 	}
-	Lck_Unlock(&cp->mtx);
+	Lck_Unlock(&vs->mtx);
+	if (start)
+		vcp_prewarm_start(vs);
 }
 
 /*--------------------------------------------------------------------
@@ -227,6 +282,8 @@ static void *
 VCP_New(struct conn_pool *cp, const void *id, void *priv,
     const struct cp_methods *cm)
 {
+	struct vcp_shard *vs;
+	unsigned u;
 
 	AN(cp);
 	AN(cm);
@@ -241,8 +298,20 @@ VCP_New(struct conn_pool *cp, const void *id, void *priv,
 	cp->refcnt = 1;
 	cp->holddown = 0;
 	Lck_New(&cp->mtx, lck_tcp_pool);
-	VTAILQ_INIT(&cp->connlist);
-	VTAILQ_INIT(&cp->killlist);
+
+	cp->nshard = cache_param->backend_pool_shards;
+	if (cp->nshard == 0)
+		cp->nshard = 1;
+	cp->shard = calloc(cp->nshard, sizeof *cp->shard);
+	AN(cp->shard);
+	for (u = 0; u < cp->nshard; u++) {
+		vs = &cp->shard[u];
+		vs->magic = VCP_SHARD_MAGIC;
+		vs->conn_pool = cp;
+		Lck_New(&vs->mtx, lck_tcp_pool);
+		VTAILQ_INIT(&vs->connlist);
+		VTAILQ_INIT(&vs->killlist);
+	}
 
 	Lck_Lock(&conn_pools_mtx);
 	VTAILQ_INSERT_HEAD(&conn_pools, cp, list);
@@ -270,10 +339,28 @@ VCP_AddRef(struct conn_pool *cp)
  * Release Conn pool, destroy if last reference.
  */
 
+static void
+vcp_kill_idle(struct vcp_shard *vs)
+{
+	struct pfd *pfd, *pfd2;
+
+	Lck_AssertHeld(&vs->mtx);
+	VTAILQ_FOREACH_SAFE(pfd, &vs->connlist, list, pfd2) {
+		VTAILQ_REMOVE(&vs->connlist, pfd, list);
+		vs->n_conn--;
+		assert(pfd->state == PFD_STATE_AVAIL);
+		pfd->state = PFD_STATE_CLEANUP;
+		(void)shutdown(pfd->fd, SHUT_WR);
+		VTAILQ_INSERT_TAIL(&vs->killlist, pfd, list);
+		vs->n_kill++;
+	}
+}
+
 static int
 VCP_Rel(struct conn_pool *cp)
 {
-	struct pfd *pfd, *pfd2;
+	struct vcp_shard *vs;
+	unsigned u;
 
 	CHECK_OBJ_NOTNULL(cp, CONN_POOL_MAGIC);
 
@@ -283,29 +370,36 @@ VCP_Rel(struct conn_pool *cp)
 		Lck_Unlock(&conn_pools_mtx);
 		return (1);
 	}
-	AZ(cp->n_used);
 	VTAILQ_REMOVE(&conn_pools, cp, list);
 	Lck_Unlock(&conn_pools_mtx);
 
-	Lck_Lock(&cp->mtx);
-	VTAILQ_FOREACH_SAFE(pfd, &cp->connlist, list, pfd2) {
-		VTAILQ_REMOVE(&cp->connlist, pfd, list);
-		cp->n_conn--;
-		assert(pfd->state == PFD_STATE_AVAIL);
-		pfd->state = PFD_STATE_CLEANUP;
-		(void)shutdown(pfd->fd, SHUT_WR);
-		VTAILQ_INSERT_TAIL(&cp->killlist, pfd, list);
-		cp->n_kill++;
+	cp->dying = 1;
+	for (u = 0; u < cp->nshard; u++) {
+		vs = &cp->shard[u];
+		CHECK_OBJ(vs, VCP_SHARD_MAGIC);
+		Lck_Lock(&vs->mtx);
+		vcp_kill_idle(vs);
+		Lck_Unlock(&vs->mtx);
 	}
-	while (cp->n_kill) {
-		Lck_Unlock(&cp->mtx);
-		(void)usleep(20000);
-		Lck_Lock(&cp->mtx);
+	for (u = 0; u < cp->nshard; u++) {
+		vs = &cp->shard[u];
+		Lck_Lock(&vs->mtx);
+		/* A pre-warm task may have slipped a connection in */
+		while (vs->n_kill || vs->prewarming || vs->n_conn) {
+			vcp_kill_idle(vs);
+			Lck_Unlock(&vs->mtx);
+			(void)usleep(20000);
+			Lck_Lock(&vs->mtx);
+		}
+		Lck_Unlock(&vs->mtx);
+		Lck_Delete(&vs->mtx);
+		AZ(vs->n_used);
+		AZ(vs->n_conn);
+		AZ(vs->n_kill);
 	}
-	Lck_Unlock(&cp->mtx);
+	free(cp->shard);
+	cp->shard = NULL;
 	Lck_Delete(&cp->mtx);
-	AZ(cp->n_conn);
-	AZ(cp->n_kill);
 	return (0);
 }
 
@@ -318,6 +412,7 @@ VCP_Recycle(const struct worker *wrk, struct pfd **pfdp)
 {
 	struct pfd *pfd;
 	struct conn_pool *cp;
+	struct vcp_shard *vs;
 	int i = 0;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
@@ -326,12 +421,14 @@ VCP_Recycle(const struct worker *wrk, struct pfd **pfdp)
 	CHECK_OBJ_NOTNULL(pfd, PFD_MAGIC);
 	cp = pfd->conn_pool;
 	CHECK_OBJ_NOTNULL(cp, CONN_POOL_MAGIC);
+	vs = pfd->shard;
+	CHECK_OBJ_NOTNULL(vs, VCP_SHARD_MAGIC);
 
 	assert(pfd->state == PFD_STATE_USED);
 	assert(pfd->fd > 0);
 
-	Lck_Lock(&cp->mtx);
-	cp->n_used--;
+	Lck_Lock(&vs->mtx);
+	vs->n_used--;
 
 	pfd->waited->priv1 = pfd;
 	pfd->waited->fd = pfd->fd;
@@ -346,13 +443,13 @@ VCP_Recycle(const struct worker *wrk, struct pfd **pfdp)
 		// XXX: stats
 		pfd = NULL;
 	} else {
-		VTAILQ_INSERT_HEAD(&cp->connlist, pfd, list);
+		VTAILQ_INSERT_HEAD(&vs->connlist, pfd, list);
 		i++;
 	}
 
 	if (pfd != NULL)
-		cp->n_conn++;
-	Lck_Unlock(&cp->mtx);
+		vs->n_conn++;
+	Lck_Unlock(&vs->mtx);
 
 	if (i && DO_DEBUG(DBG_VTC_MODE)) {
 		/*
@@ -455,83 +552,246 @@ VCP_Close(struct pfd **pfdp)
 {
 	struct pfd *pfd;
 	struct conn_pool *cp;
+	struct vcp_shard *vs;
 
 	pfd = *pfdp;
 	*pfdp = NULL;
 	CHECK_OBJ_NOTNULL(pfd, PFD_MAGIC);
 	cp = pfd->conn_pool;
 	CHECK_OBJ_NOTNULL(cp, CONN_POOL_MAGIC);
+	vs = pfd->shard;
+	CHECK_OBJ_NOTNULL(vs, VCP_SHARD_MAGIC);
 
 	assert(pfd->fd > 0);
 
-	Lck_Lock(&cp->mtx);
+	Lck_Lock(&vs->mtx);
 	assert(pfd->state == PFD_STATE_USED || pfd->state == PFD_STATE_STOLEN);
-	cp->n_used--;
+	vs->n_used--;
 	if (pfd->state == PFD_STATE_STOLEN) {
 		(void)shutdown(pfd->fd, SHUT_RDWR);
-		VTAILQ_REMOVE(&cp->connlist, pfd, list);
+		VTAILQ_REMOVE(&vs->connlist, pfd, list);
 		pfd->state = PFD_STATE_CLEANUP;
-		VTAILQ_INSERT_HEAD(&cp->killlist, pfd, list);
-		cp->n_kill++;
+		VTAILQ_INSERT_HEAD(&vs->killlist, pfd, list);
+		vs->n_kill++;
 	} else {
 		assert(pfd->state == PFD_STATE_USED);
 		cp->methods->close(pfd);
 		memset(pfd, 0x44, sizeof *pfd);
 		free(pfd);
 	}
-	Lck_Unlock(&cp->mtx);
+	Lck_Unlock(&vs->mtx);
 }
 
 /*--------------------------------------------------------------------
- * Get a connection, possibly recycled
+ * Open a fresh connection for a sub-pool, which must already have
+ * counted it in n_used.
  */
 
 static struct pfd *
-VCP_Get(struct conn_pool *cp, vtim_dur tmo, struct worker *wrk,
-    unsigned force_fresh, int *err)
+vcp_new_pfd(struct vcp_shard *vs, vtim_dur tmo, int *err)
 {
+	struct conn_pool *cp;
 	struct pfd *pfd;
 
+	CHECK_OBJ_NOTNULL(vs, VCP_SHARD_MAGIC);
+	cp = vs->conn_pool;
 	CHECK_OBJ_NOTNULL(cp, CONN_POOL_MAGIC);
-	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
-	AN(err);
 
-	*err = 0;
-	Lck_Lock(&cp->mtx);
-	pfd = VTAILQ_FIRST(&cp->connlist);
+	ALLOC_OBJ(pfd, PFD_MAGIC);
+	AN(pfd);
+	INIT_OBJ(pfd->waited, WAITED_MAGIC);
+	pfd->state = PFD_STATE_USED;
+	pfd->conn_pool = cp;
+	pfd->shard = vs;
+	pfd->fd = VCP_Open(cp, tmo, &pfd->priv, err);
+	if (pfd->fd < 0) {
+		FREE_OBJ(pfd);
+		Lck_Lock(&vs->mtx);
+		vs->n_used--;		// Nope, didn't work after all.
+		Lck_Unlock(&vs->mtx);
+	} else
+		VSC_C_main->backend_conn++;
+
+	return (pfd);
+}
+
+/*--------------------------------------------------------------------
+ * Take an idle connection from a sub-pool.  Other than our own we only
+ * try, a busy lock means somebody else is at it.
+ */
+
+static struct pfd *
+vcp_take(struct vcp_shard *vs, struct worker *wrk, int try)
+{
+	struct pfd *pfd;
+
+	CHECK_OBJ_NOTNULL(vs, VCP_SHARD_MAGIC);
+	if (try) {
+		if (vs->n_conn == 0 || Lck_Trylock(&vs->mtx))
+			return (NULL);
+	} else
+		Lck_Lock(&vs->mtx);
+	pfd = VTAILQ_FIRST(&vs->connlist);
 	CHECK_OBJ_ORNULL(pfd, PFD_MAGIC);
-	if (force_fresh || pfd == NULL || pfd->state == PFD_STATE_STOLEN)
+	if (pfd == NULL || pfd->state == PFD_STATE_STOLEN)
 		pfd = NULL;
 	else {
-		assert(pfd->conn_pool == cp);
+		assert(pfd->shard == vs);
 		assert(pfd->state == PFD_STATE_AVAIL);
-		VTAILQ_REMOVE(&cp->connlist, pfd, list);
-		VTAILQ_INSERT_TAIL(&cp->connlist, pfd, list);
-		cp->n_conn--;
+		VTAILQ_REMOVE(&vs->connlist, pfd, list);
+		VTAILQ_INSERT_TAIL(&vs->connlist, pfd, list);
+		vs->n_conn--;
+		vs->n_used++;
 		VSC_C_main->backend_reuse++;
 		pfd->state = PFD_STATE_STOLEN;
 		pfd->cond = &wrk->cond;
 	}
-	cp->n_used++;			// Opening mostly works
-	Lck_Unlock(&cp->mtx);
+	Lck_Unlock(&vs->mtx);
+	return (pfd);
+}
 
-	if (pfd != NULL)
+/*--------------------------------------------------------------------
+ * Pre-warming
+ *
+ * The backend_idle_min connections are split over the sub-pools, the
+ * first ones taking the remainder, and each sub-pool has at most one task
+ * opening connections for it.
+ */
+
+static unsigned
+vcp_prewarm_want(const struct vcp_shard *vs)
+{
+	const struct conn_pool *cp;
+	unsigned n;
+
+	cp = vs->conn_pool;
+	n = vs - cp->shard;
+	assert(n < cp->nshard);
+	return (cache_param->backend_idle_min / cp->nshard +
+	    (n < cache_param->backend_idle_min % cp->nshard ? 1 : 0));
+}
+
+static void v_matchproto_(task_func_t)
+vcp_prewarm_task(struct worker *wrk, void *priv)
+{
+	struct vcp_shard *vs;
+	struct conn_pool *cp;
+	struct pfd *pfd;
+	int err;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CAST_OBJ_NOTNULL(vs, priv, VCP_SHARD_MAGIC);
+	cp = vs->conn_pool;
+	CHECK_OBJ_NOTNULL(cp, CONN_POOL_MAGIC);
+
+	while (1) {
+		Lck_Lock(&vs->mtx);
+		AN(vs->prewarming);
+		if (cp->dying || vs->n_conn >= vcp_prewarm_want(vs)) {
+			vs->prewarming = 0;
+			Lck_Unlock(&vs->mtx);
+			return;
+		}
+		vs->n_used++;
+		Lck_Unlock(&vs->mtx);
+
+		pfd = vcp_new_pfd(vs, cache_param->connect_timeout, &err);
+		if (pfd == NULL) {
+			/* Next checkout or idle close tries again */
+			Lck_Lock(&vs->mtx);
+			vs->prewarming = 0;
+			Lck_Unlock(&vs->mtx);
+			return;
+		}
+		VCP_Recycle(wrk, &pfd);
+		VSC_C_main->backend_prewarm++;
+	}
+}
+
+/*
+ * Claim the pre-warming of a sub-pool, if it is due.  A claimed sub-pool
+ * will not be freed before the task is done with it.
+ */
+
+static int
+vcp_prewarm_claim(struct vcp_shard *vs)
+{
+	struct conn_pool *cp;
+
+	Lck_AssertHeld(&vs->mtx);
+	cp = vs->conn_pool;
+	CHECK_OBJ_NOTNULL(cp, CONN_POOL_MAGIC);
+	if (cp->dying || vs->prewarming || vs->n_conn >= vcp_prewarm_want(vs))
+		return (0);
+	vs->prewarming = 1;
+	return (1);
+}
+
+static void
+vcp_prewarm_start(struct vcp_shard *vs)
+{
+
+	CHECK_OBJ_NOTNULL(vs, VCP_SHARD_MAGIC);
+	AN(vs->prewarming);
+	vs->prewarm_task.func = vcp_prewarm_task;
+	vs->prewarm_task.priv = vs;
+	if (Pool_Task_Any(&vs->prewarm_task, TASK_QUEUE_BO) == 0)
+		return;
+	Lck_Lock(&vs->mtx);
+	vs->prewarming = 0;
+	Lck_Unlock(&vs->mtx);
+}
+
+static void
+vcp_prewarm(struct vcp_shard *vs)
+{
+	int start;
+
+	CHECK_OBJ_NOTNULL(vs, VCP_SHARD_MAGIC);
+	if (cache_param->backend_idle_min == 0)
+		return;
+	Lck_Lock(&vs->mtx);
+	start = vcp_prewarm_claim(vs);
+	Lck_Unlock(&vs->mtx);
+	if (start)
+		vcp_prewarm_start(vs);
+}
+
+/*--------------------------------------------------------------------
+ * Get a connection, possibly recycled
+ */
+
+static struct pfd *
+VCP_Get(struct conn_pool *cp, vtim_dur tmo, struct worker *wrk,
+    unsigned force_fresh, int *err)
+{
+	struct vcp_shard *vs;
+	struct pfd *pfd = NULL;
+	unsigned u, n;
+
+	CHECK_OBJ_NOTNULL(cp, CONN_POOL_MAGIC);
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	AN(err);
+
+	*err = 0;
+	vs = vcp_shard(cp, wrk);
+	if (!force_fresh) {
+		pfd = vcp_take(vs, wrk, 0);
+		n = vs - cp->shard;
+		for (u = 1; pfd == NULL && u < cp->nshard; u++)
+			pfd = vcp_take(&cp->shard[(n + u) % cp->nshard], wrk, 1);
+	}
+	if (pfd != NULL) {
+		vcp_prewarm(vs);
 		return (pfd);
+	}
 
-	ALLOC_OBJ(pfd, PFD_MAGIC);
-	AN(pfd);
-	INIT_OBJ(pfd->waited, WAITED_MAGIC);
-	pfd->state = PFD_STATE_USED;
-	pfd->conn_pool = cp;
-	pfd->fd = VCP_Open(cp, tmo, &pfd->priv, err);
-	if (pfd->fd < 0) {
-		FREE_OBJ(pfd);
-		Lck_Lock(&cp->mtx);
-		cp->n_used--;		// Nope, didn't work after all.
-		Lck_Unlock(&cp->mtx);
-	} else
-		VSC_C_main->backend_conn++;
+	Lck_Lock(&vs->mtx);
+	vs->n_used++;			// Opening mostly works
+	Lck_Unlock(&vs->mtx);
 
+	pfd = vcp_new_pfd(vs, tmo, err);
+	vcp_prewarm(vs);
 	return (pfd);
 }
 
@@ -541,28 +801,28 @@ VCP_Get(struct conn_pool *cp, vtim_dur tmo, struct worker *wrk,
 static int
 VCP_Wait(struct worker *wrk, struct pfd *pfd, vtim_real tmo)
 {
-	struct conn_pool *cp;
+	struct vcp_shard *vs;
 	int r;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	CHECK_OBJ_NOTNULL(pfd, PFD_MAGIC);
-	cp = pfd->conn_pool;
-	CHECK_OBJ_NOTNULL(cp, CONN_POOL_MAGIC);
+	vs = pfd->shard;
+	CHECK_OBJ_NOTNULL(vs, VCP_SHARD_MAGIC);
 	assert(pfd->cond == &wrk->cond);
-	Lck_Lock(&cp->mtx);
+	Lck_Lock(&vs->mtx);
 	while (pfd->state == PFD_STATE_STOLEN) {
-		r = Lck_CondWait(&wrk->cond, &cp->mtx, tmo);
+		r = Lck_CondWait(&wrk->cond, &vs->mtx, tmo);
 		if (r != 0) {
 			if (r == EINTR)
 				continue;
 			assert(r == ETIMEDOUT);
-			Lck_Unlock(&cp->mtx);
+			Lck_Unlock(&vs->mtx);
 			return (1);
 		}
 	}
 	assert(pfd->state == PFD_STATE_USED);
 	pfd->cond = NULL;
-	Lck_Unlock(&cp->mtx);
+	Lck_Unlock(&vs->mtx);
 
 	return (0);
 }
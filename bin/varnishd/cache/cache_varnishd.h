@@ -220,6 +220,12 @@ int VDP_DeliverObj(struct req *req);
 extern const struct vdp VDP_gunzip;
 extern const struct vdp VDP_esi;
 extern const struct vdp VDP_range;
+#ifdef HAVE_BROTLI
+extern const struct vdp VDP_unbrotli;
+#endif
+#ifdef HAVE_ZSTD
+extern const struct vdp VDP_unzstd;
+#endif
 
 /* cache_expire.c */
 void EXP_Init(void);
@@ -229,6 +235,7 @@ enum vbf_fetch_mode_e {
 	VBF_NORMAL = 0,
 	VBF_PASS = 1,
 	VBF_BACKGROUND = 2,
+	VBF_REFRESH = 3,
 };
 void VBF_Fetch(struct worker *wrk, struct req *req,
     struct objcore *oc, struct objcore *oldoc, enum vbf_fetch_mode_e);
@@ -248,6 +255,14 @@ extern const struct vfp VFP_gzip;
 extern const struct vfp VFP_testgunzip;
 extern const struct vfp VFP_esi;
 extern const struct vfp VFP_esi_gzip;
+#ifdef HAVE_BROTLI
+extern const struct vfp VFP_brotli;
+extern const struct vfp VFP_unbrotli;
+#endif
+#ifdef HAVE_ZSTD
+extern const struct vfp VFP_zstd;
+extern const struct vfp VFP_unzstd;
+#endif
 
 /* cache_http.c */
 void HTTP_Init(void);
@@ -404,6 +419,9 @@ void VRY_Prep(struct req *);
 void VRY_Clear(struct req *);
 enum vry_finish_flag { KEEP, DISCARD };
 void VRY_Finish(struct req *req, enum vry_finish_flag);
+uint64_t VRY_Sig(const uint8_t *vary, uint64_t *names);
+uint8_t *VRY_Names(const uint8_t *vary);
+int VRY_ReqSig(struct req *, const uint8_t *vary, uint64_t *sig);
 
 /* cache_vcl.c */
 VCL_BACKEND VCL_DefaultDirector(const struct vcl *);
@@ -444,6 +462,7 @@ void pan_privs(struct vsb *, const struct vrt_privs *);
 int VCL_StackVFP(struct vfp_ctx *, const struct vcl *, const char *);
 int VCL_StackVDP(struct req *, const struct vcl *, const char *);
 const char *resp_Get_Filter_List(struct req *req);
+const char *resp_Decode_Filter(struct req *req);
 
 /* cache_vrt_priv.c */
 extern struct vrt_privs cli_task_privs[1];
@@ -455,6 +474,12 @@ void VMOD_Panic(struct vsb *);
 /* cache_wrk.c */
 void WRK_Init(void);
 
+/* cache_xkey.c */
+void XKEY_Init(void);
+void XKEY_Insert(struct worker *, struct objcore *);
+void XKEY_DestroyObj(struct worker *, struct objcore *);
+unsigned XKEY_Purge(struct worker *, const char *keys);
+
 /* http1/cache_http1_pipe.c */
 void V1P_Init(void);
 
@@ -470,6 +495,7 @@ int STV_BanInfoNew(const uint8_t *ban, unsigned len);
 void STV_BanExport(const uint8_t *banlist, unsigned len);
 int STV_NewObject(struct worker *, struct objcore *,
     const struct stevedore *, unsigned len);
+int STV_FileRange(const void *ptr, size_t len, int *fdp, off_t *offp);
 
 
 #if WITH_PERSISTENT_STORAGE
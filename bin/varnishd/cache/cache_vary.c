@@ -275,6 +275,66 @@ VRY_Finish(struct req *req, enum vry_finish_flag flg)
 	req->vary_b = p;
 }
 
+/**********************************************************************
+ * Build a new entry in the predictive vary string at vsp, from the
+ * request header named in the vary entry.
+ *
+ * Return non-zero if there is not enough workspace.
+ */
+
+static int
+vry_build(struct req *req, const uint8_t *vary, uint8_t *vsp)
+{
+	const char *h, *e;
+	unsigned lh, ln;
+
+	ln = 2 + vary[2] + 2;
+	if (http_GetHdr(req->http, (const char*)(vary+2), &h)) {
+		/* Trim trailing space */
+		e = strchr(h, '\0');
+		while (e > h && vct_issp(e[-1]))
+			e--;
+		lh = e - h;
+		assert(lh < 0xffff);
+		ln += lh;
+	} else {
+		e = h = NULL;
+		lh = 0xffff;
+	}
+
+	if (vsp + ln + 3 >= req->vary_e) {
+		/*
+		 * Not enough space to build new entry
+		 * and put terminator behind it.
+		 */
+		return (1);
+	}
+
+	vbe16enc(vsp, (uint16_t)lh);
+	memcpy(vsp + 2, vary + 2, vary[2] + 2);
+	if (h != NULL)
+		memcpy(vsp + 2 + vsp[2] + 2, h, lh);
+	vsp[ln] = 0xff;
+	vsp[ln + 1] = 0xff;
+	vsp[ln + 2] = 0;
+	(void)VRY_Validate(vsp);
+	req->vary_l = vsp + ln + 3;
+	return (0);
+}
+
+static void
+vry_oflo(struct req *req)
+{
+	uint8_t *vsp = req->vary_b;
+
+	req->vary_l = NULL;
+	if (vsp + 2 < req->vary_e) {
+		vsp[0] = 0xff;
+		vsp[1] = 0xff;
+		vsp[2] = 0;
+	}
+}
+
 /**********************************************************************
  * Match vary strings, and build a new cached string if possible.
  *
@@ -286,9 +346,7 @@ int
 VRY_Match(struct req *req, const uint8_t *vary)
 {
 	uint8_t *vsp = req->vary_b;
-	const char *h, *e;
-	unsigned lh, ln;
-	int i, oflo = 0;
+	int i;
 
 	AN(vsp);
 	AN(vary);
@@ -297,8 +355,8 @@ VRY_Match(struct req *req, const uint8_t *vary)
 			/*
 			 * Too little workspace to find out
 			 */
-			oflo = 1;
-			break;
+			vry_oflo(req);
+			return (0);
 		}
 		i = vry_cmp(vary, vsp);
 		if (i == 1) {
@@ -306,41 +364,10 @@ VRY_Match(struct req *req, const uint8_t *vary)
 			 * Different header, build a new entry,
 			 * then compare again with that new entry.
 			 */
-
-			ln = 2 + vary[2] + 2;
-			i = http_GetHdr(req->http, (const char*)(vary+2), &h);
-			if (i) {
-				/* Trim trailing space */
-				e = strchr(h, '\0');
-				while (e > h && vct_issp(e[-1]))
-					e--;
-				lh = e - h;
-				assert(lh < 0xffff);
-				ln += lh;
-			} else {
-				e = h = NULL;
-				lh = 0xffff;
+			if (vry_build(req, vary, vsp)) {
+				vry_oflo(req);
+				return (0);
 			}
-
-			if (vsp + ln + 3 >= req->vary_e) {
-				/*
-				 * Not enough space to build new entry
-				 * and put terminator behind it.
-				 */
-				oflo = 1;
-				break;
-			}
-
-			vbe16enc(vsp, (uint16_t)lh);
-			memcpy(vsp + 2, vary + 2, vary[2] + 2);
-			if (h != NULL)
-				memcpy(vsp + 2 + vsp[2] + 2, h, lh);
-			vsp[ln] = 0xff;
-			vsp[ln + 1] = 0xff;
-			vsp[ln + 2] = 0;
-			(void)VRY_Validate(vsp);
-			req->vary_l = vsp + ln + 3;
-
 			i = vry_cmp(vary, vsp);
 			assert(i == 0 || i == 2);
 		}
@@ -353,18 +380,119 @@ VRY_Match(struct req *req, const uint8_t *vary)
 			return (0);
 		}
 	}
-	if (oflo) {
-		vsp = req->vary_b;
-		req->vary_l = NULL;
-		if (vsp + 2 < req->vary_e) {
-			vsp[0] = 0xff;
-			vsp[1] = 0xff;
-			vsp[2] = 0;
+	return (1);
+}
+
+/**********************************************************************
+ * Signatures for the vary index of objheads
+ *
+ * Vary strings with the same header names in the same order have the
+ * same names signature, and if the headers also have the same contents,
+ * the same signature.  The contents of Accept-Encoding are left out,
+ * because vry_cmp() ignores them with http_gzip_support, so objects with
+ * the same signature can still differ for VRY_Match().
+ */
+
+#define VRY_SIG_INIT	0xcbf29ce484222325ULL
+
+static uint64_t
+vry_hash(uint64_t h, const uint8_t *p, unsigned l)
+{
+
+	/* FNV-1a */
+	while (l-- > 0) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+static uint64_t
+vry_sig_entry(uint64_t h, const uint8_t *vary)
+{
+
+	if (!strcasecmp(H_Accept_Encoding, (const char*)vary + 2))
+		return (vry_hash(h, vary + 2, vary[2] + 2));
+	return (vry_hash(h, vary, VRY_Len(vary)));
+}
+
+/*
+ * Signature of the vary string of an object.  A NULL vary string, for
+ * objects without Vary, has the same signature as one without entries.
+ */
+
+uint64_t
+VRY_Sig(const uint8_t *vary, uint64_t *names)
+{
+	uint64_t h = VRY_SIG_INIT, n = VRY_SIG_INIT;
+
+	while (vary != NULL && vary[2]) {
+		n = vry_hash(n, vary + 2, vary[2] + 2);
+		h = vry_sig_entry(h, vary);
+		vary += VRY_Len(vary);
+	}
+	if (names != NULL)
+		*names = n;
+	return (h);
+}
+
+/*
+ * Copy of a vary string with the header names only, all headers absent,
+ * as the caller needs it for VRY_ReqSig() after the object is gone.
+ */
+
+uint8_t *
+VRY_Names(const uint8_t *vary)
+{
+	const uint8_t *p;
+	uint8_t *r, *q;
+	size_t l = 3;
+
+	for (p = vary; p != NULL && p[2]; p += VRY_Len(p))
+		l += 2 + p[2] + 2;
+	r = malloc(l);
+	if (r == NULL)
+		return (NULL);
+	q = r;
+	for (p = vary; p != NULL && p[2]; p += VRY_Len(p)) {
+		vbe16enc(q, 0xffff);
+		memcpy(q + 2, p + 2, p[2] + 2);
+		q += VRY_Len(q);
+	}
+	q[0] = 0xff;
+	q[1] = 0xff;
+	q[2] = 0;
+	assert(VRY_Validate(r) == l);
+	return (r);
+}
+
+/*
+ * Signature of the present request for the header names of a vary
+ * string, building the predictive vary string like VRY_Match() does.
+ *
+ * Return zero if we ran out of workspace.
+ */
+
+int
+VRY_ReqSig(struct req *req, const uint8_t *vary, uint64_t *sig)
+{
+	uint8_t *vsp = req->vary_b;
+	uint64_t h = VRY_SIG_INIT;
+
+	AN(vsp);
+	AN(sig);
+	while (vary != NULL && vary[2]) {
+		if (vsp + 2 >= req->vary_e ||
+		    (vry_cmp(vary, vsp) == 1 && vry_build(req, vary, vsp))) {
+			vry_oflo(req);
+			return (0);
 		}
-		return (0);
-	} else {
-		return (1);
+		h = vry_sig_entry(h, vsp);
+		vsp += VRY_Len(vsp);
+		vary += VRY_Len(vary);
 	}
+	*sig = h;
+	return (1);
 }
 
 /*
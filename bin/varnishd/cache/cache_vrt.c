@@ -788,6 +788,32 @@ VRT_purge(VRT_CTX, VCL_DURATION ttl, VCL_DURATION grace, VCL_DURATION keep)
 	    ctx->req->t_req, ttl, grace, keep));
 }
 
+/*--------------------------------------------------------------------
+ */
+
+VCL_INT
+VRT_purge_xkey(VRT_CTX, VCL_STRING keys)
+{
+	struct worker *wrk;
+
+	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+
+	if (ctx->req != NULL) {
+		CHECK_OBJ(ctx->req, REQ_MAGIC);
+		wrk = ctx->req->wrk;
+	} else if (ctx->bo != NULL) {
+		CHECK_OBJ(ctx->bo, BUSYOBJ_MAGIC);
+		wrk = ctx->bo->wrk;
+	} else {
+		VRT_fail(ctx, "xkey purge needs a client or backend transaction");
+		return (0);
+	}
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	if (keys == NULL)
+		return (0);
+	return (XKEY_Purge(wrk, keys));
+}
+
 /*--------------------------------------------------------------------
  */
 
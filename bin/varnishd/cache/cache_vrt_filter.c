@@ -236,6 +236,16 @@ VCL_VRT_Init(void)
 	VRT_AddVDP(NULL, &VDP_esi);
 	VRT_AddVDP(NULL, &VDP_gunzip);
 	VRT_AddVDP(NULL, &VDP_range);
+#ifdef HAVE_BROTLI
+	VRT_AddVFP(NULL, &VFP_brotli);
+	VRT_AddVFP(NULL, &VFP_unbrotli);
+	VRT_AddVDP(NULL, &VDP_unbrotli);
+#endif
+#ifdef HAVE_ZSTD
+	VRT_AddVFP(NULL, &VFP_zstd);
+	VRT_AddVFP(NULL, &VFP_unzstd);
+	VRT_AddVDP(NULL, &VDP_unzstd);
+#endif
 }
 
 /*--------------------------------------------------------------------
@@ -279,7 +289,7 @@ static void v_matchproto_(filter_list_t)
 vbf_default_filter_list(void *arg, struct vsb *vsb)
 {
 	const struct busyobj *bo;
-	const char *p;
+	const char *p, *recode = NULL;
 	int do_gzip, do_gunzip, is_gzip = 0, is_gunzip = 0;
 
 	CAST_OBJ_NOTNULL(bo, arg, BUSYOBJ_MAGIC);
@@ -297,6 +307,9 @@ vbf_default_filter_list(void *arg, struct vsb *vsb)
 	 *	"Content-Encoding: gzip"	--> object is gzip'ed.
 	 *	no Content-Encoding		--> object is not gzip'ed.
 	 *	anything else			--> do nothing wrt gzip
+	 *
+	 * beresp.do_brotli and beresp.do_zstd store the object in those
+	 * codings instead, from either of the first two classes.
 	 */
 
 	/* No body -> done */
@@ -306,11 +319,47 @@ vbf_default_filter_list(void *arg, struct vsb *vsb)
 	if (!cache_param->http_gzip_support)
 		do_gzip = do_gunzip = 0;
 
-	if (http_GetHdr(bo->beresp, H_Content_Encoding, &p))
+	if (http_GetHdr(bo->beresp, H_Content_Encoding, &p)) {
 		is_gzip = !strcasecmp(p, "gzip");
-	else
+		/* ESI needs to see the plain text */
+#ifdef HAVE_BROTLI
+		if (bo->do_esi && cache_param->http_gzip_support &&
+		    !strcasecmp(p, "br")) {
+			VSB_cat(vsb, " unbrotli");
+			is_gunzip = 1;
+		}
+#endif
+#ifdef HAVE_ZSTD
+		if (bo->do_esi && cache_param->http_gzip_support &&
+		    !strcasecmp(p, "zstd")) {
+			VSB_cat(vsb, " unzstd");
+			is_gunzip = 1;
+		}
+#endif
+	} else
 		is_gunzip = 1;
 
+	/*
+	 * ESI objects must be gzip or plain to be stitched together,
+	 * so they are never recoded.
+	 */
+	if (cache_param->http_gzip_support && !bo->do_esi) {
+#ifdef HAVE_ZSTD
+		if (bo->do_zstd && cache_param->http_zstd_support)
+			recode = " zstd";
+#endif
+#ifdef HAVE_BROTLI
+		if (bo->do_brotli && cache_param->http_brotli_support)
+			recode = " brotli";
+#endif
+	}
+	if (recode != NULL && (is_gzip || is_gunzip)) {
+		if (is_gzip)
+			VSB_cat(vsb, " gunzip");
+		VSB_cat(vsb, recode);
+		return;
+	}
+
 	/* We won't gunzip unless it is gzip'ed */
 	if (do_gunzip && !is_gzip)
 		do_gunzip = 0;
@@ -350,10 +399,37 @@ VBF_Get_Filter_List(struct busyobj *bo)
 /*--------------------------------------------------------------------
  */
 
+/*--------------------------------------------------------------------
+ * Which filter, if any, must decode the stored object for this client
+ */
+
+const char *
+resp_Decode_Filter(struct req *req)
+{
+
+	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
+	if (!cache_param->http_gzip_support)
+		return (NULL);
+	if (ObjCheckFlag(req->wrk, req->objcore, OF_GZIPED))
+		return (RFC2616_Req_Gzip(req->http) ? NULL : "gunzip");
+#ifdef HAVE_BROTLI
+	if (ObjCheckFlag(req->wrk, req->objcore, OF_BROTLI))
+		return (http_GetHdrQ(req->http, H_Accept_Encoding, "br") > 0. ?
+		    NULL : "unbrotli");
+#endif
+#ifdef HAVE_ZSTD
+	if (ObjCheckFlag(req->wrk, req->objcore, OF_ZSTD))
+		return (http_GetHdrQ(req->http, H_Accept_Encoding, "zstd") >
+		    0. ? NULL : "unzstd");
+#endif
+	return (NULL);
+}
+
 static void v_matchproto_(filter_list_t)
 resp_default_filter_list(void *arg, struct vsb *vsb)
 {
 	struct req *req;
+	const char *p;
 
 	CAST_OBJ_NOTNULL(req, arg, REQ_MAGIC);
 
@@ -361,10 +437,9 @@ resp_default_filter_list(void *arg, struct vsb *vsb)
 	    ObjHasAttr(req->wrk, req->objcore, OA_ESIDATA))
 		VSB_cat(vsb, " esi");
 
-	if (cache_param->http_gzip_support &&
-	    ObjCheckFlag(req->wrk, req->objcore, OF_GZIPED) &&
-	    !RFC2616_Req_Gzip(req->http))
-		VSB_cat(vsb, " gunzip");
+	p = resp_Decode_Filter(req);
+	if (p != NULL)
+		VSB_printf(vsb, " %s", p);
 
 	if (cache_param->http_range_support &&
 	    http_GetStatus(req->resp) == 200 &&
@@ -166,7 +166,13 @@ VRT_priv_top(VRT_CTX, const void *vmod_id)
 		NEEDLESS(return NULL);
 	}
 	CHECK_OBJ_NOTNULL(ctx->req, REQ_MAGIC);
-	req = ctx->req->topreq;
+	req = ctx->req;
+	if (req->privs_top != NULL) {
+		/* ESI prefetches run beside the top request, not in it */
+		CAST_OBJ_NOTNULL(vps, req->privs_top, VRT_PRIVS_MAGIC);
+		return (vrt_priv_dynamic(req->ws, vps, (uintptr_t)vmod_id));
+	}
+	req = req->topreq;
 	CAST_OBJ_NOTNULL(vps, req->privs, VRT_PRIVS_MAGIC);
 	return (vrt_priv_dynamic(req->ws, vps, (uintptr_t)vmod_id));
 }
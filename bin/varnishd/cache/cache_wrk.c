@@ -62,6 +62,8 @@
 
 #include "hash/hash_slinger.h"
 
+#include "VSC_numa.h"
+
 static void Pool_Work_Thread(struct pool *pp, struct worker *wrk);
 
 static uintmax_t reqpoolfail;
@@ -205,6 +207,92 @@ pool_getidleworker(struct pool *pp, enum task_prio prio)
 	return (wrk);
 }
 
+/*--------------------------------------------------------------------
+ * Work stealing between pools, see thread_pool_steal.
+ *
+ * Only client tasks move between pools: everything else is either tied
+ * to its pool or already scheduled from the reserve.  With NUMA placement,
+ * tasks stay on the node of their pool.  We never wait for
+ * another pool's lock (or the pool list) and only go through the pools
+ * which are not busy, so at worst a steal is missed.
+ */
+
+static int
+pool_push(struct pool *pp, const struct pool_task *task)
+{
+	struct pool *qp;
+	struct pool_task *pt;
+	struct worker *wrk = NULL;
+
+	CHECK_OBJ_NOTNULL(pp, POOL_MAGIC);
+	Lck_AssertHeld(&pp->mtx);
+	if (Lck_Trylock(&pool_mtx))
+		return (0);
+	VTAILQ_FOREACH(qp, &pools, list) {
+		if (qp == pp || qp->die || qp->numa_node != pp->numa_node ||
+		    qp->nidle <= pool_reserve())
+			continue;
+		if (Lck_Trylock(&qp->mtx))
+			continue;
+		if (qp->nidle > pool_reserve()) {
+			pt = VTAILQ_FIRST(&qp->idle_queue);
+			AN(pt);
+			AZ(pt->func);
+			CAST_OBJ_NOTNULL(wrk, pt->priv, WORKER_MAGIC);
+			VTAILQ_REMOVE(&qp->idle_queue, pt, list);
+			qp->nidle--;
+			wrk->task.func = task->func;
+			wrk->task.priv = task->priv;
+		}
+		Lck_Unlock(&qp->mtx);
+		if (wrk != NULL)
+			break;
+	}
+	Lck_Unlock(&pool_mtx);
+	if (wrk == NULL)
+		return (0);
+	// see signaling_note at the top for explanation
+	AZ(pthread_cond_signal(&wrk->cond));
+	pp->npushed++;
+	return (1);
+}
+
+static struct pool_task *
+pool_steal(struct pool *pp)
+{
+	struct pool *qp;
+	struct pool_task *tp = NULL;
+	int i;
+
+	CHECK_OBJ_NOTNULL(pp, POOL_MAGIC);
+	Lck_AssertHeld(&pp->mtx);
+	if (Lck_Trylock(&pool_mtx))
+		return (NULL);
+	VTAILQ_FOREACH(qp, &pools, list) {
+		if (qp == pp || qp->numa_node != pp->numa_node ||
+		    qp->lqueue == 0)
+			continue;
+		if (Lck_Trylock(&qp->mtx))
+			continue;
+		for (i = TASK_QUEUE_REQ; i <= TASK_QUEUE_STR; i++) {
+			tp = VTAILQ_FIRST(&qp->queues[i]);
+			if (tp != NULL) {
+				qp->lqueue--;
+				qp->ndequeued--;
+				VTAILQ_REMOVE(&qp->queues[i], tp, list);
+				break;
+			}
+		}
+		Lck_Unlock(&qp->mtx);
+		if (tp != NULL)
+			break;
+	}
+	Lck_Unlock(&pool_mtx);
+	if (tp != NULL)
+		pp->nstolen++;
+	return (tp);
+}
+
 /*--------------------------------------------------------------------
  * Special scheduling:  If no thread can be found, the current thread
  * will be prepared for rescheduling instead.
@@ -292,6 +380,12 @@ Pool_Task(struct pool *pp, struct pool_task *task, enum task_prio prio)
 		return (0);
 	}
 
+	if (cache_param->wthread_steal && TASK_QUEUE_CLIENT(prio) &&
+	    pool_push(pp, task)) {
+		Lck_Unlock(&pp->mtx);
+		return (0);
+	}
+
 	/*
 	 * queue limits only apply to client threads - all other
 	 * work is vital and needs do be done at the earliest
@@ -365,6 +459,10 @@ Pool_Work_Thread(struct pool *pp, struct worker *wrk)
 		    (wrk->stats->summs >= cache_param->wthread_stats_rate))
 			pool_addstat(pp->a_stat, wrk->stats);
 
+		if (tp == NULL && cache_param->wthread_steal &&
+		    prio_lim == TASK_QUEUE_END)
+			tp = pool_steal(pp);
+
 		if (tp != NULL) {
 			wrk->stats->summs++;
 		} else if (pp->b_stat != NULL && pp->a_stat->summs) {
@@ -477,6 +575,8 @@ pool_breed(struct pool *qp)
 		Lck_Lock(&pool_mtx);
 		VSC_C_main->threads++;
 		VSC_C_main->threads_created++;
+		if (qp->numa_vsc != NULL)
+			qp->numa_vsc->g_threads++;
 		Lck_Unlock(&pool_mtx);
 		VTIM_sleep(cache_param->wthread_add_delay);
 	}
@@ -556,17 +656,22 @@ pool_herder(void *priv)
 		delay = cache_param->wthread_timeout;
 		assert(pp->nthr >= wthread_min);
 
+		Lck_Lock(&pp->mtx);
+		/* XXX: unsafe counters */
+		VSC_C_main->sess_queued += pp->nqueued;
+		VSC_C_main->sess_dropped += pp->sdropped;
+		VSC_C_main->req_dropped += pp->rdropped;
+		VSC_C_main->sess_pushed += pp->npushed;
+		VSC_C_main->sess_stolen += pp->nstolen;
+		pp->nqueued = pp->sdropped = pp->rdropped = 0;
+		pp->npushed = pp->nstolen = 0;
+		Lck_Unlock(&pp->mtx);
+
 		if (pp->nthr > wthread_min) {
 
 			t_idle = VTIM_real() - cache_param->wthread_timeout;
 
 			Lck_Lock(&pp->mtx);
-			/* XXX: unsafe counters */
-			VSC_C_main->sess_queued += pp->nqueued;
-			VSC_C_main->sess_dropped += pp->sdropped;
-			VSC_C_main->req_dropped += pp->rdropped;
-			pp->nqueued = pp->sdropped = pp->rdropped = 0;
-
 			wrk = NULL;
 			pt = VTAILQ_LAST(&pp->idle_queue, taskhead);
 			if (pt != NULL) {
@@ -594,6 +699,8 @@ pool_herder(void *priv)
 				Lck_Lock(&pool_mtx);
 				VSC_C_main->threads--;
 				VSC_C_main->threads_destroyed++;
+				if (pp->numa_vsc != NULL)
+					pp->numa_vsc->g_threads--;
 				Lck_Unlock(&pool_mtx);
 				delay = cache_param->wthread_destroy_delay;
 			} else if (delay < cache_param->wthread_destroy_delay)
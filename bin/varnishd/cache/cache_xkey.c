@@ -0,0 +1,335 @@
+/*-
+ * Copyright (c) 2019 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Surrogate key index
+ *
+ * Objects are tagged with surrogate keys by the backend (or VCL) through
+ * the "xkey" response header, which holds a list of keys separated by
+ * whitespace or commas.  Each key is hashed into one of the shards, where
+ * a tree maps the digest to the list of objcores carrying that key, so
+ * purging a key only ever touches the objects tagged with it, no matter
+ * how many objects the cache holds.
+ *
+ * The index holds no references.  An objcore unhooks itself from its
+ * keys in HSH_DerefObjCore() once the last reference is gone, and that
+ * takes the shard lock, so anything found under the shard lock is still
+ * there to be looked at.  Lock order is shard before objhead.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "cache_varnishd.h"
+#include "cache_objhead.h"
+
+#include "hash/hash_slinger.h"
+#include "vcli_serve.h"
+#include "vct.h"
+#include "vsha256.h"
+#include "vtree.h"
+
+#define XKEY_NSHARD	64
+#define XKEY_BATCH	64
+
+struct xkey_hook;
+
+struct xkey_key {
+	unsigned			magic;
+#define XKEY_KEY_MAGIC			0x5b3c9f0e
+	unsigned char			digest[VSHA256_LEN];
+	VRBT_ENTRY(xkey_key)		entry;
+	VTAILQ_HEAD(, xkey_hook)	hooks;
+};
+
+struct xkey_hook {
+	unsigned			magic;
+#define XKEY_HOOK_MAGIC			0x1d8e4a67
+	struct objcore			*oc;
+	struct xkey_key			*key;
+	struct xkey_hook		*next;		/* per objcore */
+	VTAILQ_ENTRY(xkey_hook)		list;		/* per key */
+};
+
+VRBT_HEAD(xkey_tree, xkey_key);
+
+struct xkey_shard {
+	struct lock			mtx;
+	struct xkey_tree		tree;
+};
+
+static struct xkey_shard xkey_shards[XKEY_NSHARD];
+
+static const char H_xkey[] = "\005xkey:";
+
+static inline int
+xkey_cmp(const struct xkey_key *k1, const struct xkey_key *k2)
+{
+
+	return (memcmp(k1->digest, k2->digest, sizeof k1->digest));
+}
+
+VRBT_PROTOTYPE_STATIC(xkey_tree, xkey_key, entry, xkey_cmp)
+VRBT_GENERATE_STATIC(xkey_tree, xkey_key, entry, xkey_cmp)
+
+/*--------------------------------------------------------------------
+ * Pick the next key out of a list, returns zero at the end of it.
+ */
+
+static int
+xkey_next(const char **pp, const char **b, const char **e)
+{
+	const char *p;
+
+	p = *pp;
+	while (*p != '\0' && (vct_islws(*p) || *p == ','))
+		p++;
+	if (*p == '\0')
+		return (0);
+	*b = p;
+	while (*p != '\0' && !vct_islws(*p) && *p != ',')
+		p++;
+	*e = p;
+	*pp = p;
+	return (1);
+}
+
+static struct xkey_shard *
+xkey_digest(const char *b, const char *e, struct xkey_key *k)
+{
+	VSHA256_CTX sha;
+
+	assert(e > b);
+	VSHA256_Init(&sha);
+	VSHA256_Update(&sha, b, e - b);
+	VSHA256_Final(k->digest, &sha);
+	return (&xkey_shards[k->digest[0] % XKEY_NSHARD]);
+}
+
+/*--------------------------------------------------------------------
+ * Hook a freshly fetched object onto the keys in its xkey headers.
+ *
+ * Called while the object is still busy, so nobody else looks at
+ * oc->xkey until it is purged or destroyed.
+ */
+
+void
+XKEY_Insert(struct worker *wrk, struct objcore *oc)
+{
+	struct xkey_key needle, *k, *k2;
+	struct xkey_hook *h, *h2;
+	struct xkey_shard *xs;
+	const char *hp, *p, *b, *e;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	AN(oc->flags & OC_F_BUSY);
+	AZ(oc->xkey);
+
+	HTTP_FOREACH_PACK(wrk, oc, hp) {
+		if (strncasecmp(hp, H_xkey + 1, H_xkey[0]))
+			continue;
+		p = hp + H_xkey[0];
+		while (xkey_next(&p, &b, &e)) {
+			xs = xkey_digest(b, e, &needle);
+			ALLOC_OBJ(h, XKEY_HOOK_MAGIC);
+			AN(h);
+			h->oc = oc;
+			ALLOC_OBJ(k2, XKEY_KEY_MAGIC);
+			AN(k2);
+
+			Lck_Lock(&xs->mtx);
+			k = VRBT_FIND(xkey_tree, &xs->tree, &needle);
+			if (k == NULL) {
+				k = k2;
+				k2 = NULL;
+				memcpy(k->digest, needle.digest,
+				    sizeof k->digest);
+				VTAILQ_INIT(&k->hooks);
+				AZ(VRBT_INSERT(xkey_tree, &xs->tree, k));
+				wrk->stats->n_xkey++;
+			}
+			CHECK_OBJ(k, XKEY_KEY_MAGIC);
+			for (h2 = oc->xkey; h2 != NULL; h2 = h2->next)
+				if (h2->key == k)
+					break;
+			if (h2 == NULL) {
+				h->key = k;
+				VTAILQ_INSERT_TAIL(&k->hooks, h, list);
+				h->next = oc->xkey;
+				oc->xkey = h;
+				h = NULL;
+			}
+			Lck_Unlock(&xs->mtx);
+
+			/* Duplicate key on the same object */
+			if (h != NULL)
+				FREE_OBJ(h);
+			if (k2 != NULL)
+				FREE_OBJ(k2);
+		}
+	}
+}
+
+/*--------------------------------------------------------------------
+ * The objcore is going away, drop it from all its keys.
+ */
+
+void
+XKEY_DestroyObj(struct worker *wrk, struct objcore *oc)
+{
+	struct xkey_hook *h;
+	struct xkey_key *k;
+	struct xkey_shard *xs;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	AZ(oc->refcnt);
+
+	while (oc->xkey != NULL) {
+		h = oc->xkey;
+		CHECK_OBJ_NOTNULL(h, XKEY_HOOK_MAGIC);
+		assert(h->oc == oc);
+		oc->xkey = h->next;
+		k = h->key;
+		CHECK_OBJ_NOTNULL(k, XKEY_KEY_MAGIC);
+		xs = &xkey_shards[k->digest[0] % XKEY_NSHARD];
+
+		Lck_Lock(&xs->mtx);
+		VTAILQ_REMOVE(&k->hooks, h, list);
+		if (VTAILQ_EMPTY(&k->hooks)) {
+			VRBT_REMOVE(xkey_tree, &xs->tree, k);
+			wrk->stats->n_xkey--;
+		} else
+			k = NULL;
+		Lck_Unlock(&xs->mtx);
+
+		FREE_OBJ(h);
+		if (k != NULL)
+			FREE_OBJ(k);
+	}
+}
+
+/*--------------------------------------------------------------------
+ * Kill all objects tagged with any of the keys in the list.
+ *
+ * References are collected in batches under the shard lock, and the
+ * objects are killed after dropping it.  Objects which are busy or
+ * already dying are skipped, so every round makes progress.
+ */
+
+unsigned
+XKEY_Purge(struct worker *wrk, const char *keys)
+{
+	struct objcore *ocs[XKEY_BATCH], *oc;
+	struct objhead *oh;
+	struct xkey_key needle, *k;
+	struct xkey_hook *h;
+	struct xkey_shard *xs;
+	const char *p, *b, *e;
+	unsigned n, u, n_tot = 0;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	AN(keys);
+
+	p = keys;
+	while (xkey_next(&p, &b, &e)) {
+		xs = xkey_digest(b, e, &needle);
+		do {
+			n = 0;
+			Lck_Lock(&xs->mtx);
+			k = VRBT_FIND(xkey_tree, &xs->tree, &needle);
+			if (k != NULL) {
+				CHECK_OBJ(k, XKEY_KEY_MAGIC);
+				VTAILQ_FOREACH(h, &k->hooks, list) {
+					CHECK_OBJ_NOTNULL(h, XKEY_HOOK_MAGIC);
+					oc = h->oc;
+					CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+					oh = oc->objhead;
+					CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+					Lck_Lock(&oh->mtx);
+					if (oc->refcnt > 0 && !(oc->flags &
+					    (OC_F_BUSY | OC_F_DYING))) {
+						oc->refcnt++;
+						ocs[n++] = oc;
+					}
+					Lck_Unlock(&oh->mtx);
+					if (n == XKEY_BATCH)
+						break;
+				}
+			}
+			Lck_Unlock(&xs->mtx);
+
+			for (u = 0; u < n; u++) {
+				HSH_Kill(ocs[u]);
+				(void)HSH_DerefObjCore(wrk, &ocs[u], 0);
+			}
+			n_tot += n;
+		} while (n == XKEY_BATCH);
+	}
+	Pool_PurgeStat(n_tot);
+	return (n_tot);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void v_matchproto_(cli_func_t)
+ccf_xkey_purge(struct cli *cli, const char * const *av, void *priv)
+{
+	struct worker wrk[1];
+	struct VSC_main_wrk ds;
+	unsigned n = 0;
+	int i;
+
+	(void)priv;
+
+	INIT_OBJ(wrk, WORKER_MAGIC);
+	memset(&ds, 0, sizeof ds);
+	wrk->stats = &ds;
+	for (i = 2; av[i] != NULL; i++)
+		n += XKEY_Purge(wrk, av[i]);
+	HSH_Cleanup(wrk);
+	Pool_Sumstat(wrk);
+	VCLI_Out(cli, "Purged %u objects", n);
+}
+
+static struct cli_proto xkey_cmds[] = {
+	{ CLICMD_XKEY_PURGE,			"", ccf_xkey_purge },
+	{ NULL }
+};
+
+/*--------------------------------------------------------------------*/
+
+void
+XKEY_Init(void)
+{
+	unsigned u;
+
+	for (u = 0; u < XKEY_NSHARD; u++) {
+		Lck_New(&xkey_shards[u].mtx, lck_xkey);
+		VRBT_INIT(&xkey_shards[u].tree);
+	}
+	CLI_AddFuncs(xkey_cmds);
+}
@@ -109,6 +109,8 @@ struct params {
 	unsigned		wthread_stats_rate;
 	ssize_t			wthread_stacksize;
 	unsigned		wthread_queue_limit;
+	unsigned		wthread_steal;
+	unsigned		wthread_numa;
 
 	struct vre_limits	vre_limits;
 
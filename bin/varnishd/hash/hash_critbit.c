@@ -26,12 +26,22 @@
  * SUCH DAMAGE.
  *
  * A Crit Bit tree based hash
+ *
+ * The digests are spread over HCB_NROOT independent trees by their first
+ * byte, each with its own lock, so that inserts and deletes in different
+ * trees do not serialize.
+ *
+ * Lookups walk the trees without holding a lock, so deleted nodes and
+ * objheads can only be freed once no lookup can still be looking at them.
+ * Each thread announces the epoch in which it started a lookup, and the
+ * cleaner only frees what was deleted before the oldest epoch still in use.
  */
 
 // #define PHK
 
 #include "config.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 
 #include "cache/cache_varnishd.h"
@@ -41,6 +51,8 @@
 #include "vmb.h"
 #include "vtim.h"
 
+#define HCB_NROOT		256
+
 static struct lock hcb_mtx;
 
 /*---------------------------------------------------------------------
@@ -101,16 +113,38 @@ struct hcb_y {
 #define HCB_BIT_Y		(1<<1)
 
 struct hcb_root {
+	unsigned		magic;
+#define HCB_ROOT_MAGIC		0x3b8c0a5e
+	struct lock		mtx;
 	volatile uintptr_t	origo;
+	VSTAILQ_HEAD(, hcb_y)	cool_y;
+	VTAILQ_HEAD(, objhead)	cool_h;
 };
 
-static struct hcb_root	hcb_root;
+static struct hcb_root	hcb_root[HCB_NROOT];
 
-static VSTAILQ_HEAD(, hcb_y)	cool_y = VSTAILQ_HEAD_INITIALIZER(cool_y);
 static VSTAILQ_HEAD(, hcb_y)	dead_y = VSTAILQ_HEAD_INITIALIZER(dead_y);
-static VTAILQ_HEAD(, objhead)	cool_h = VTAILQ_HEAD_INITIALIZER(cool_h);
 static VTAILQ_HEAD(, objhead)	dead_h = VTAILQ_HEAD_INITIALIZER(dead_h);
 
+/*---------------------------------------------------------------------
+ * Per thread epoch, zero when the thread is not in a lookup.
+ * The list is protected by hcb_mtx, and only ever grows, slots of
+ * threads which went away are reused.
+ */
+
+struct hcb_epoch {
+	unsigned		magic;
+#define HCB_EPOCH_MAGIC		0x6e0f3a2d
+	volatile uint64_t	epoch;
+	volatile int		busy;
+	VTAILQ_ENTRY(hcb_epoch)	list;
+};
+
+static VTAILQ_HEAD(, hcb_epoch) hcb_epochs =
+    VTAILQ_HEAD_INITIALIZER(hcb_epochs);
+static volatile uint64_t	hcb_epoch_cur = 1;
+static pthread_key_t		hcb_epoch_key;
+
 /*---------------------------------------------------------------------
  * Pointer accessor functions
  */
@@ -280,6 +314,7 @@ hcb_delete(struct hcb_root *r, const struct objhead *oh)
 	volatile uintptr_t *p;
 	unsigned s;
 
+	Lck_AssertHeld(&r->mtx);
 	if (r->origo == hcb_r_node(oh)) {
 		r->origo = 0;
 		return;
@@ -296,7 +331,7 @@ hcb_delete(struct hcb_root *r, const struct objhead *oh)
 		assert(s < 2);
 		if (y->leaf[s] == hcb_r_node(oh)) {
 			*p = y->leaf[1 - s];
-			VSTAILQ_INSERT_TAIL(&cool_y, y, list);
+			VSTAILQ_INSERT_TAIL(&r->cool_y, y, list);
 			return;
 		}
 		p = &y->leaf[s];
@@ -305,26 +340,117 @@ hcb_delete(struct hcb_root *r, const struct objhead *oh)
 
 /*--------------------------------------------------------------------*/
 
+static void
+hcb_epoch_free(void *priv)
+{
+	struct hcb_epoch *ep;
+
+	CAST_OBJ_NOTNULL(ep, priv, HCB_EPOCH_MAGIC);
+	ep->epoch = 0;
+	VWMB();
+	ep->busy = 0;
+}
+
+static struct hcb_epoch *
+hcb_epoch_get(void)
+{
+	struct hcb_epoch *ep;
+
+	ep = pthread_getspecific(hcb_epoch_key);
+	if (ep != NULL)
+		return (ep);
+	Lck_Lock(&hcb_mtx);
+	VTAILQ_FOREACH(ep, &hcb_epochs, list)
+		if (!ep->busy)
+			break;
+	if (ep == NULL) {
+		ALLOC_OBJ(ep, HCB_EPOCH_MAGIC);
+		AN(ep);
+		VTAILQ_INSERT_TAIL(&hcb_epochs, ep, list);
+	}
+	AZ(ep->epoch);
+	ep->busy = 1;
+	Lck_Unlock(&hcb_mtx);
+	AZ(pthread_setspecific(hcb_epoch_key, ep));
+	return (ep);
+}
+
+static void
+hcb_epoch_enter(struct hcb_epoch *ep)
+{
+
+	CHECK_OBJ_NOTNULL(ep, HCB_EPOCH_MAGIC);
+	AZ(ep->epoch);
+	ep->epoch = hcb_epoch_cur;
+	VMB();
+}
+
+static void
+hcb_epoch_leave(struct hcb_epoch *ep)
+{
+
+	CHECK_OBJ_NOTNULL(ep, HCB_EPOCH_MAGIC);
+	AN(ep->epoch);
+	VMB();
+	ep->epoch = 0;
+}
+
+/*---------------------------------------------------------------------
+ * Can nothing deleted before epoch e still be seen by a lookup ?
+ */
+
+static int
+hcb_epoch_quiet(uint64_t e)
+{
+	struct hcb_epoch *ep;
+	uint64_t u;
+	int retval = 1;
+
+	Lck_Lock(&hcb_mtx);
+	VTAILQ_FOREACH(ep, &hcb_epochs, list) {
+		u = ep->epoch;
+		if (u != 0 && u <= e) {
+			retval = 0;
+			break;
+		}
+	}
+	Lck_Unlock(&hcb_mtx);
+	return (retval);
+}
+
+/*--------------------------------------------------------------------*/
+
 static void * v_matchproto_(bgthread_t)
 hcb_cleaner(struct worker *wrk, void *priv)
 {
 	struct hcb_y *y, *y2;
 	struct objhead *oh, *oh2;
+	struct hcb_root *root;
+	uint64_t dead_epoch = 0;
+	unsigned u;
 
 	(void)priv;
 	while (1) {
-		VSTAILQ_FOREACH_SAFE(y, &dead_y, list, y2) {
-			VSTAILQ_REMOVE_HEAD(&dead_y, list);
-			FREE_OBJ(y);
+		if (hcb_epoch_quiet(dead_epoch)) {
+			VSTAILQ_FOREACH_SAFE(y, &dead_y, list, y2) {
+				VSTAILQ_REMOVE_HEAD(&dead_y, list);
+				FREE_OBJ(y);
+			}
+			VTAILQ_FOREACH_SAFE(oh, &dead_h, hoh_list, oh2) {
+				VTAILQ_REMOVE(&dead_h, oh, hoh_list);
+				HSH_DeleteObjHead(wrk, oh);
+			}
+			for (u = 0; u < HCB_NROOT; u++) {
+				root = &hcb_root[u];
+				Lck_Lock(&root->mtx);
+				VSTAILQ_CONCAT(&dead_y, &root->cool_y);
+				VTAILQ_CONCAT(&dead_h, &root->cool_h, hoh_list);
+				Lck_Unlock(&root->mtx);
+			}
+			/* Lookups from now on cannot find what is dead */
+			dead_epoch = hcb_epoch_cur++;
+			VMB();
 		}
-		VTAILQ_FOREACH_SAFE(oh, &dead_h, hoh_list, oh2) {
-			VTAILQ_REMOVE(&dead_h, oh, hoh_list);
-			HSH_DeleteObjHead(wrk, oh);
-		}
-		Lck_Lock(&hcb_mtx);
-		VSTAILQ_CONCAT(&dead_y, &cool_y);
-		VTAILQ_CONCAT(&dead_h, &cool_h, hoh_list);
-		Lck_Unlock(&hcb_mtx);
 		Pool_Sumstat(wrk);
 		VTIM_sleep(cache_param->critbit_cooloff);
 	}
@@ -337,18 +463,29 @@ static void v_matchproto_(hash_start_f)
 hcb_start(void)
 {
 	struct objhead *oh = NULL;
+	struct hcb_root *root;
 	pthread_t tp;
+	unsigned u;
 
 	(void)oh;
 	Lck_New(&hcb_mtx, lck_hcb);
-	WRK_BgThread(&tp, "hcb-cleaner", hcb_cleaner, NULL);
-	memset(&hcb_root, 0, sizeof hcb_root);
+	AZ(pthread_key_create(&hcb_epoch_key, hcb_epoch_free));
+	memset(hcb_root, 0, sizeof hcb_root);
+	for (u = 0; u < HCB_NROOT; u++) {
+		root = &hcb_root[u];
+		root->magic = HCB_ROOT_MAGIC;
+		Lck_New(&root->mtx, lck_hcb);
+		VSTAILQ_INIT(&root->cool_y);
+		VTAILQ_INIT(&root->cool_h);
+	}
 	hcb_build_bittbl();
+	WRK_BgThread(&tp, "hcb-cleaner", hcb_cleaner, NULL);
 }
 
 static int v_matchproto_(hash_deref_f)
 hcb_deref(struct worker *wrk, struct objhead *oh)
 {
+	struct hcb_root *root;
 	int r;
 
 	(void)wrk;
@@ -357,10 +494,11 @@ hcb_deref(struct worker *wrk, struct objhead *oh)
 	assert(oh->refcnt > 0);
 	r = --oh->refcnt;
 	if (oh->refcnt == 0) {
-		Lck_Lock(&hcb_mtx);
-		hcb_delete(&hcb_root, oh);
-		VTAILQ_INSERT_TAIL(&cool_h, oh, hoh_list);
-		Lck_Unlock(&hcb_mtx);
+		root = &hcb_root[oh->digest[0] % HCB_NROOT];
+		Lck_Lock(&root->mtx);
+		hcb_delete(root, oh);
+		VTAILQ_INSERT_TAIL(&root->cool_h, oh, hoh_list);
+		Lck_Unlock(&root->mtx);
 	}
 	Lck_Unlock(&oh->mtx);
 #ifdef PHK
@@ -373,6 +511,8 @@ static struct objhead * v_matchproto_(hash_lookup_f)
 hcb_lookup(struct worker *wrk, const void *digest, struct objhead **noh)
 {
 	struct objhead *oh;
+	struct hcb_root *root;
+	struct hcb_epoch *ep;
 	struct hcb_y *y;
 	unsigned u;
 
@@ -382,11 +522,20 @@ hcb_lookup(struct worker *wrk, const void *digest, struct objhead **noh)
 		CHECK_OBJ_NOTNULL(*noh, OBJHEAD_MAGIC);
 		assert((*noh)->refcnt == 1);
 	}
+	root = &hcb_root[((const uint8_t *)digest)[0] % HCB_NROOT];
+	CHECK_OBJ(root, HCB_ROOT_MAGIC);
+
+	/*
+	 * Until we hold a reference, the objhead we find may be deleted
+	 * under us, the epoch keeps the cleaner from freeing it.
+	 */
+	ep = hcb_epoch_get();
+	hcb_epoch_enter(ep);
 
 	/* First try in read-only mode without holding a lock */
 
 	wrk->stats->hcb_nolock++;
-	oh = hcb_insert(wrk, &hcb_root, digest, NULL);
+	oh = hcb_insert(wrk, root, digest, NULL);
 	if (oh != NULL) {
 		Lck_Lock(&oh->mtx);
 		/*
@@ -396,6 +545,7 @@ hcb_lookup(struct worker *wrk, const void *digest, struct objhead **noh)
 		u = oh->refcnt;
 		if (u > 0) {
 			oh->refcnt++;
+			hcb_epoch_leave(ep);
 			return (oh);
 		}
 		Lck_Unlock(&oh->mtx);
@@ -404,21 +554,21 @@ hcb_lookup(struct worker *wrk, const void *digest, struct objhead **noh)
 	while (1) {
 		/* No luck, try with lock held, so we can modify tree */
 		CAST_OBJ_NOTNULL(y, wrk->nhashpriv, HCB_Y_MAGIC);
-		Lck_Lock(&hcb_mtx);
-		VSC_C_main->hcb_lock++;
-		oh = hcb_insert(wrk, &hcb_root, digest, noh);
-		Lck_Unlock(&hcb_mtx);
+		Lck_Lock(&root->mtx);
+		wrk->stats->hcb_lock++;
+		oh = hcb_insert(wrk, root, digest, noh);
+		Lck_Unlock(&root->mtx);
 
 		if (oh == NULL)
-			return (NULL);
+			break;
 
 		Lck_Lock(&oh->mtx);
 
 		CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
 		if (noh != NULL && *noh == NULL) {
 			assert(oh->refcnt > 0);
-			VSC_C_main->hcb_insert++;
-			return (oh);
+			wrk->stats->hcb_insert++;
+			break;
 		}
 		/*
 		 * A refcount of zero indicates that the tree changed
@@ -427,10 +577,12 @@ hcb_lookup(struct worker *wrk, const void *digest, struct objhead **noh)
 		u = oh->refcnt;
 		if (u > 0) {
 			oh->refcnt++;
-			return (oh);
+			break;
 		}
 		Lck_Unlock(&oh->mtx);
 	}
+	hcb_epoch_leave(ep);
+	return (oh);
 }
 
 static void v_matchproto_(hash_prep_f)
@@ -40,6 +40,16 @@
 #include "config.h"
 
 #include <sys/uio.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#  include <sys/sendfile.h>
+#endif
+#if defined(HAVE_SENDFILE) && (defined(__linux__) || defined(__FreeBSD__))
+#  define V1L_SENDFILE 1
+#  ifdef __linux__
+#    include <sys/ioctl.h>
+#    include <linux/sockios.h>
+#  endif
+#endif
 #include "cache/cache_varnishd.h"
 
 #include <stdio.h>
@@ -65,8 +75,13 @@ struct v1l {
 	ssize_t			cnt;	/* Flushed byte count */
 	struct ws		*ws;
 	uintptr_t		res;
+	unsigned		sendfile;
 };
 
+#ifdef V1L_SENDFILE
+static void v1l_sendfile_drain(struct v1l *);
+#endif
+
 /*--------------------------------------------------------------------
  * for niov == 0, reserve the ws for max number of iovs
  * otherwise, up to niov
@@ -134,6 +149,12 @@ V1L_Close(struct worker *wrk, uint64_t *cnt)
 	v1l = wrk->v1l;
 	wrk->v1l = NULL;
 	CHECK_OBJ_NOTNULL(v1l, V1L_MAGIC);
+#ifdef V1L_SENDFILE
+	if (v1l->sendfile && *v1l->wfd >= 0) {
+		v1l_sendfile_drain(v1l);
+		u = v1l->werr;
+	}
+#endif
 	*cnt = v1l->cnt;
 	if (v1l->ws->r)
 		WS_Release(v1l->ws, 0);
@@ -242,10 +263,117 @@ V1L_Flush(const struct worker *wrk)
 	return (v1l->werr);
 }
 
+/*--------------------------------------------------------------------
+ * Send a range of a storage file straight from the page cache.
+ *
+ * Only used when no chunk framing is pending, the caller has flushed
+ * everything queued before the range, and the bytes are known to be
+ * the mapped contents of fd at off.
+ */
+
+#ifdef V1L_SENDFILE
+
+static ssize_t
+v1l_sendfile1(int sfd, int fd, off_t off, size_t len)
+{
+#if defined(__linux__)
+	return (sendfile(sfd, fd, &off, len));
+#else
+	off_t sbytes = 0;
+
+	/* SF_SYNC: return once the pages are no longer in use */
+	if (sendfile(fd, sfd, off, len, NULL, &sbytes, SF_SYNC) < 0 &&
+	    sbytes == 0)
+		return (-1);
+	return (sbytes);
+#endif
+}
+
+static void
+v1l_sendfile(struct v1l *v1l, int fd, off_t off, ssize_t len)
+{
+	ssize_t i, l;
+
+	l = len;
+	while (1) {
+		i = v1l_sendfile1(*v1l->wfd, fd, off, l);
+		if (i > 0)
+			v1l->sendfile = 1;
+		if (i <= 0) {
+			v1l->werr++;
+			VSLb(v1l->vsl, SLT_Debug,
+			    "Sendfile error, retval = %zd, len = %zd, errno = %s",
+			    i, l, vstrerror(errno));
+			return;
+		}
+		v1l->cnt += i;
+		off += i;
+		l -= i;
+		if (l == 0)
+			return;
+
+		if (VTIM_real() - v1l->t0 > cache_param->send_timeout) {
+			VSLb(v1l->vsl, SLT_Debug,
+			    "Hit total send timeout, "
+			    "wrote = %zd/%zd; not retrying",
+			    len - l, len);
+			v1l->werr++;
+			return;
+		}
+
+		VSLb(v1l->vsl, SLT_Debug,
+		    "Hit idle send timeout, wrote = %zd/%zd; retrying",
+		    len - l, len);
+	}
+}
+
+/*--------------------------------------------------------------------
+ * The socket buffer refers to the pages of the file until the peer has
+ * acknowledged them, but the storage is free for reuse as soon as the
+ * object is released.  Wait for the send queue to drain before V1L_Close()
+ * returns, while our caller still holds the object.  If the peer does
+ * not keep up, the connection is reset rather than closed, which throws
+ * the queued data away.
+ */
+
+static void
+v1l_sendfile_drain(struct v1l *v1l)
+{
+#ifdef __linux__
+	struct linger lin;
+	double d = 1e-3;
+	int n;
+
+	while (1) {
+		if (ioctl(*v1l->wfd, SIOCOUTQ, &n) < 0 || n == 0)
+			return;
+		if (VTIM_real() - v1l->t0 > cache_param->send_timeout)
+			break;
+		VTIM_sleep(d);
+		if (d < .1)
+			d *= 2;
+	}
+	VSLb(v1l->vsl, SLT_Debug,
+	    "Hit total send timeout, %d bytes sent from file unacknowledged",
+	    n);
+	v1l->werr++;
+	lin.l_onoff = 1;
+	lin.l_linger = 0;
+	(void)setsockopt(*v1l->wfd, SOL_SOCKET, SO_LINGER, &lin, sizeof lin);
+#else
+	(void)v1l;	/* SF_SYNC has already waited */
+#endif
+}
+#endif
+
 size_t
 V1L_Write(const struct worker *wrk, const void *ptr, ssize_t len)
 {
 	struct v1l *v1l;
+#ifdef V1L_SENDFILE
+	int fd;
+	off_t off;
+#endif
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	v1l = wrk->v1l;
@@ -255,6 +383,17 @@ V1L_Write(const struct worker *wrk, const void *ptr, ssize_t len)
 		return (0);
 	if (len == -1)
 		len = strlen(ptr);
+#ifdef V1L_SENDFILE
+	if (v1l->ciov == v1l->siov && cache_param->sendfile_threshold > 0 &&
+	    len >= cache_param->sendfile_threshold &&
+	    STV_FileRange(ptr, len, &fd, &off)) {
+		if (V1L_Flush(wrk) == 0) {
+			v1l_sendfile(v1l, fd, off, len);
+			wrk->stats->s_sendfile_bytes += len;
+		}
+		return (len);
+	}
+#endif
 	assert(v1l->niov < v1l->siov);
 	v1l->iov[v1l->niov].iov_base = TRUST_ME(ptr);
 	v1l->iov[v1l->niov].iov_len = len;
@@ -165,6 +165,11 @@ struct h2_sess {
 	struct h2h_decode		*decode;
 	struct vht_table		dectbl[1];
 
+	/* Response header encoding, serialized by H2_Send_Get() */
+	struct vht_table		enctbl[1];
+	uint32_t			enctbl_size;	/* as last announced */
+	int				enctbl_flush;
+
 	unsigned			rxf_len;
 	unsigned			rxf_type;
 	unsigned			rxf_flags;
@@ -194,6 +199,8 @@ vtr_sess_panic_f h2_sess_panic;
 vtr_deliver_f h2_deliver;
 vtr_minimal_response_f h2_minimal_response;
 #endif /* TRANSPORT_MAGIC */
+void h2_enc_literal(struct vsb *, const char *name, size_t nl,
+    const char *val, size_t vl);
 
 /* http2/cache_http2_hpack.c */
 struct h2h_decode {
@@ -202,6 +209,9 @@ struct h2h_decode {
 
 	h2_error			error;
 	enum vhd_ret_e			vhd_ret;
+	struct http			*hp;
+	struct vht_table		*tbl;
+	int				resp;
 	char				*out;
 	char				*reset;
 	size_t				out_l;
@@ -210,6 +220,11 @@ struct h2h_decode {
 	struct vhd_decode		vhd[1];
 };
 
+void h2h_decode_http_init(struct h2h_decode *, struct http *,
+    struct vht_table *, int resp);
+h2_error h2h_decode_http_fini(struct h2h_decode *);
+h2_error h2h_decode_http_bytes(struct h2h_decode *, const uint8_t *,
+    size_t);
 void h2h_decode_init(const struct h2_sess *h2);
 h2_error h2h_decode_fini(const struct h2_sess *h2);
 h2_error h2h_decode_bytes(struct h2_sess *h2, const uint8_t *ptr,
@@ -218,6 +233,7 @@ h2_error h2h_decode_bytes(struct h2_sess *h2, const uint8_t *ptr,
 /* cache_http2_send.c */
 void H2_Send_Get(struct worker *, struct h2_sess *, struct h2_req *);
 void H2_Send_Rel(struct h2_sess *, const struct h2_req *);
+h2_error h2_errcheck(const struct h2_req *, const struct h2_sess *);
 
 void H2_Send_Frame(struct worker *, struct h2_sess *,
     h2_frame type, uint8_t flags, uint32_t len, uint32_t stream,
@@ -232,9 +248,25 @@ struct h2_req * h2_new_req(const struct worker *, struct h2_sess *,
 void h2_del_req(struct worker *, const struct h2_req *);
 void h2_kill_req(struct worker *, struct h2_sess *, struct h2_req *, h2_error);
 int h2_rxframe(struct worker *, struct h2_sess *);
+h2_error h2_streamerror(uint32_t);
 h2_error h2_set_setting(struct h2_sess *, const uint8_t *);
+const struct h2_setting_s *h2_setting_lookup(uint16_t);
 void h2_req_body(struct req*);
 task_func_t h2_do_req;
 #ifdef TRANSPORT_MAGIC
 vtr_req_fail_f h2_req_fail;
 #endif
+
+/* http2/cache_http2_fetch.c */
+struct v2f_pool;
+struct v2f_stream;
+struct pfd;
+struct tcp_pool;
+struct v2f_pool *V2F_NewPool(struct tcp_pool *);
+void V2F_DelPool(struct v2f_pool **);
+struct v2f_stream *V2F_Open(struct v2f_pool *, vtim_dur, struct worker *,
+    struct busyobj *, int *err);
+struct pfd *V2F_Pfd(const struct v2f_stream *);
+int V2F_GetHdrs(struct worker *, struct busyobj *, const char *abuf,
+    const char *pbuf);
+int V2F_Finish(struct v2f_stream **);
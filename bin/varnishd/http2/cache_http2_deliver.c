@@ -59,6 +59,32 @@ static const struct hpack_static hp_static[] = {
 
 static const struct hpack_static *hp_idx[256];
 
+struct hpack_huffman {
+	uint32_t		code;
+	uint8_t			len;
+};
+
+static const struct hpack_huffman hp_huf[256] = {
+#define HPH(c, h, l) [c] = { h, l },
+#include "tbl/vhp_huffman.h"
+};
+
+/* Headers whose values rarely repeat, not worth a dynamic table entry */
+static const char * const hp_noindex[] = {
+	"age",
+	"content-length",
+	"content-range",
+	"date",
+	"etag",
+	"expires",
+	"last-modified",
+	"set-cookie",
+	"x-varnish",
+	NULL
+};
+
+#define HP_DYN_FIRST	62	/* First dynamic table index */
+
 void
 V2D_Init(void)
 {
@@ -182,20 +208,201 @@ h2_minimal_response(struct req *req, uint16_t status)
 static void
 h2_enc_len(struct vsb *vsb, unsigned bits, unsigned val, uint8_t b0)
 {
-	assert(bits < 8);
-	unsigned mask = (1U << bits) - 1U;
-
-	if (val >= mask) {
-		VSB_putc(vsb, b0 | (uint8_t)mask);
-		val -= mask;
-		while (val >= 128) {
-			VSB_putc(vsb, 0x80 | ((uint8_t)val & 0x7f));
-			val >>= 7;
-		}
+	unsigned mask;
+
+	assert(bits > 0 && bits < 8);
+	mask = (1U << bits) - 1U;
+	AZ(b0 & mask);
+
+	if (val < mask) {
+		VSB_putc(vsb, b0 | (uint8_t)val);
+		return;
+	}
+	VSB_putc(vsb, b0 | (uint8_t)mask);
+	val -= mask;
+	while (val >= 128) {
+		VSB_putc(vsb, 0x80 | ((uint8_t)val & 0x7f));
+		val >>= 7;
 	}
 	VSB_putc(vsb, (uint8_t)val);
 }
 
+/*
+ * Emit a string literal, Huffman coded if that makes it shorter.
+ */
+
+static void
+h2_enc_str(struct vsb *vsb, const char *s, ssize_t l, int lower, int huff)
+{
+	const struct hpack_huffman *hh;
+	uint64_t bits = 0, acc = 0;
+	unsigned n = 0;
+	ssize_t u;
+	uint8_t c;
+
+	if (huff) {
+		for (u = 0; u < l; u++) {
+			c = (uint8_t)s[u];
+			if (lower)
+				c = (uint8_t)tolower(c);
+			bits += hp_huf[c].len;
+		}
+		huff = (bits + 7) / 8 < (uint64_t)l;
+	}
+	if (!huff) {
+		h2_enc_len(vsb, 7, l, 0);
+		for (u = 0; u < l; u++)
+			VSB_putc(vsb, lower ? tolower(s[u]) : s[u]);
+		return;
+	}
+
+	h2_enc_len(vsb, 7, (bits + 7) / 8, 0x80);
+	for (u = 0; u < l; u++) {
+		c = (uint8_t)s[u];
+		if (lower)
+			c = (uint8_t)tolower(c);
+		hh = &hp_huf[c];
+		AN(hh->len);
+		acc = (acc << hh->len) | hh->code;
+		n += hh->len;
+		while (n >= 8) {
+			n -= 8;
+			VSB_putc(vsb, (uint8_t)(acc >> n));
+		}
+	}
+	if (n > 0)	/* Pad with the most significant bits of EOS */
+		VSB_putc(vsb, (uint8_t)((acc << (8 - n)) | (0xff >> n)));
+}
+
+/*
+ * Look for the header in the dynamic table.  Returns the index of a
+ * full match, or zero with *nidx set to the newest entry with the same
+ * name, if any.
+ */
+
+static unsigned
+h2_enc_lookup(const struct vht_table *tbl, const char *name, size_t nl,
+    const char *val, size_t vl, unsigned *nidx)
+{
+	const char *p;
+	size_t l;
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(tbl, VHT_TABLE_MAGIC);
+	AN(nidx);
+	for (u = HP_DYN_FIRST; u < HP_DYN_FIRST + tbl->n; u++) {
+		p = VHT_LookupName(tbl, u, &l);
+		if (l != nl || strncasecmp(p, name, l))
+			continue;
+		p = VHT_LookupValue(tbl, u, &l);
+		if (l == vl && !memcmp(p, val, l))
+			return (u);
+		if (*nidx == 0)
+			*nidx = u;
+	}
+	return (0);
+}
+
+static void
+h2_enc_insert(struct vht_table *tbl, unsigned nidx, const char *name,
+    size_t nl, const char *val, size_t vl)
+{
+	char buf[64];
+	size_t l, u;
+
+	if (nidx > 0) {
+		AZ(VHT_NewEntry_Indexed(tbl, nidx));
+	} else {
+		VHT_NewEntry(tbl);
+		while (nl > 0) {
+			l = nl < sizeof buf ? nl : sizeof buf;
+			for (u = 0; u < l; u++)
+				buf[u] = (char)tolower(name[u]);
+			VHT_AppendName(tbl, buf, l);
+			name += l;
+			nl -= l;
+		}
+	}
+	VHT_AppendValue(tbl, val, vl);
+}
+
+static int
+h2_enc_noindex(const char *name, size_t nl)
+{
+	const char * const *p;
+
+	for (p = hp_noindex; *p != NULL; p++)
+		if (strlen(*p) == nl && !strncasecmp(*p, name, nl))
+			return (1);
+	return (0);
+}
+
+/*
+ * Emit a header as a literal without indexing, with the name from the
+ * static table where possible.  Such header blocks leave the dynamic
+ * table alone, which is what the backend side wants, as it does not
+ * keep any encoder state.
+ */
+
+void
+h2_enc_literal(struct vsb *vsb, const char *name, size_t nl,
+    const char *val, size_t vl)
+{
+	const struct hpack_static *hps;
+	int i;
+
+	AN(name);
+	assert(nl > 0);
+	for (hps = hp_idx[tolower(*name)]; hps != NULL && hps->idx > 0;
+	    hps++) {
+		i = strncasecmp(hps->name, name, nl);
+		if (i == 0)
+			i = (uint8_t)hps->name[nl] - ':';
+		if (i < 0)
+			continue;
+		if (i > 0)
+			hps = NULL;
+		break;
+	}
+	if (hps != NULL && hps->idx > 0) {
+		h2_enc_len(vsb, 4, hps->idx, 0x00);
+	} else {
+		VSB_putc(vsb, 0x00);
+		h2_enc_str(vsb, name, nl, 1, 1);
+	}
+	h2_enc_str(vsb, val, vl, 0, 1);
+}
+
+/*
+ * Announce changes of the dynamic table size at the start of the
+ * header block.  After a header block was dropped, the table is
+ * emptied on both ends by announcing a size of zero first.
+ */
+
+static void
+h2_enc_tblsize(struct vsb *resp, struct h2_sess *h2)
+{
+	struct vht_table *tbl;
+	uint32_t sz;
+
+	tbl = h2->enctbl;
+	CHECK_OBJ_NOTNULL(tbl, VHT_TABLE_MAGIC);
+	sz = h2->remote_settings.header_table_size;
+	if (sz > tbl->protomax)
+		sz = tbl->protomax;
+	if (h2->enctbl_flush) {
+		h2_enc_len(resp, 5, 0, 0x20);
+		AZ(VHT_SetMaxTableSize(tbl, 0));
+		h2->enctbl_size = 0;
+		h2->enctbl_flush = 0;
+	}
+	if (sz != h2->enctbl_size) {
+		h2_enc_len(resp, 5, sz, 0x20);
+		AZ(VHT_SetMaxTableSize(tbl, sz));
+		h2->enctbl_size = sz;
+	}
+}
+
 /*
  * Hand-crafted-H2-HEADERS-R-Us:
  *
@@ -215,11 +422,13 @@ static const uint8_t h2_500_resp[] = {
 };
 
 static int
-h2_build_headers(struct vsb *resp, struct req *req)
+h2_build_headers(struct vsb *resp, struct req *req, struct h2_sess *h2,
+    int dyn)
 {
-	unsigned u, l;
-	int i;
+	unsigned u, l, idx, nidx;
+	int i, ins;
 	struct http *hp;
+	struct vht_table *tbl = NULL;
 	const char *r;
 	const struct hpack_static *hps;
 	uint8_t buf[6];
@@ -233,6 +442,11 @@ h2_build_headers(struct vsb *resp, struct req *req)
 
 	AN(VSB_new(resp, req->ws->f, l, VSB_FIXEDLEN));
 
+	if (dyn) {
+		tbl = h2->enctbl;
+		h2_enc_tblsize(resp, h2);
+	}
+
 	l = h2_status(buf, req->resp->status);
 	VSB_bcat(resp, buf, l);
 
@@ -254,27 +468,57 @@ h2_build_headers(struct vsb *resp, struct req *req)
 				hps = NULL;
 			break;
 		}
-		if (hps != NULL) {
-			VSLb(req->vsl, SLT_Debug,
-			    "HP {%d, \"%s\", \"%s\"} <%s>",
-			    hps->idx, hps->name, hps->val, hp->hd[u].b);
-			h2_enc_len(resp, 4, hps->idx, 0x10);
-		} else {
-			VSB_putc(resp, 0x10);
-			sz--;
-			h2_enc_len(resp, 7, sz, 0);
-			for (sz1 = 0; sz1 < sz; sz1++)
-				VSB_putc(resp, tolower(hp->hd[u].b[sz1]));
-
+		sz--;
+
+		sz1 = 1;
+		while (vct_islws(r[sz1]))
+			sz1++;
+		r += sz1;
+
+		if (!dyn) {
+			if (hps != NULL) {
+				VSLb(req->vsl, SLT_Debug,
+				    "HP {%d, \"%s\", \"%s\"} <%s>",
+				    hps->idx, hps->name, hps->val,
+				    hp->hd[u].b);
+				h2_enc_len(resp, 4, hps->idx, 0x10);
+			} else {
+				VSB_putc(resp, 0x10);
+				h2_enc_str(resp, hp->hd[u].b, sz, 1, 0);
+			}
+			h2_enc_str(resp, r, hp->hd[u].e - r, 0, 0);
+			continue;
 		}
 
-		while (vct_islws(*++r))
+		nidx = 0;
+		idx = h2_enc_lookup(tbl, hp->hd[u].b, sz,
+		    r, hp->hd[u].e - r, &nidx);
+		if (idx > 0) {
+			h2_enc_len(resp, 7, idx, 0x80);
 			continue;
-		sz = hp->hd[u].e - r;
-		h2_enc_len(resp, 7, sz, 0);
-		VSB_bcat(resp, r, sz);
+		}
+		if (hps != NULL)
+			nidx = hps->idx;
+
+		ins = !h2_enc_noindex(hp->hd[u].b, sz) &&
+		    sz + (hp->hd[u].e - r) + VHT_ENTRY_SIZE <= tbl->maxsize;
+		if (ins && nidx > 0)
+			h2_enc_len(resp, 6, nidx, 0x40);
+		else if (nidx > 0)
+			h2_enc_len(resp, 4, nidx, 0x10);
+		else
+			VSB_putc(resp, ins ? 0x40 : 0x10);
+		if (nidx == 0)
+			h2_enc_str(resp, hp->hd[u].b, sz, 1, 1);
+		h2_enc_str(resp, r, hp->hd[u].e - r, 0, 1);
+		if (ins)
+			h2_enc_insert(tbl, nidx, hp->hd[u].b, sz,
+			    r, hp->hd[u].e - r);
 	}
-	return (VSB_finish(resp));
+	i = VSB_finish(resp);
+	if (i && dyn)
+		h2->enctbl_flush = 1;
+	return (i);
 }
 
 void v_matchproto_(vtr_deliver_f)
@@ -285,6 +529,7 @@ h2_deliver(struct req *req, struct boc *boc, int sendbody)
 	struct sess *sp;
 	struct h2_req *r2;
 	struct vsb resp;
+	int dyn;
 
 	CHECK_OBJ_NOTNULL(req, REQ_MAGIC);
 	CHECK_OBJ_ORNULL(boc, BOC_MAGIC);
@@ -295,7 +540,15 @@ h2_deliver(struct req *req, struct boc *boc, int sendbody)
 
 	VSLb(req->vsl, SLT_RespProtocol, "HTTP/2.0");
 
-	if (h2_build_headers(&resp, req)) {
+	/*
+	 * The encoder table must be updated in the order blocks are sent,
+	 * and not at all for a stream which is already dead.
+	 */
+	H2_Send_Get(req->wrk, r2->h2sess, r2);
+	dyn = r2->h2sess->enctbl->magic != 0 &&
+	    h2_errcheck(r2, r2->h2sess) == 0;
+
+	if (h2_build_headers(&resp, req, r2->h2sess, dyn)) {
 		// We ran out of workspace, return minimal 500
 		WS_MarkOverflow(req->ws);
 		VSLb(req->vsl, SLT_Error, "workspace_client overflow");
@@ -315,7 +568,6 @@ h2_deliver(struct req *req, struct boc *boc, int sendbody)
 
 	r2->t_send = req->t_prev;
 
-	H2_Send_Get(req->wrk, r2->h2sess, r2);
 	H2_Send(req->wrk, r2, H2_F_HEADERS,
 	    (sendbody ? 0 : H2FF_HEADERS_END_STREAM) | H2FF_HEADERS_END_HEADERS,
 	    sz, r);
@@ -0,0 +1,1511 @@
+/*-
+ * Copyright (c) 2019 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Backend fetches over HTTP/2 with prior knowledge ("h2c")
+ *
+ * Every h2c backend has a v2f_pool with a few connections, each of which
+ * carries up to backend_h2_max_streams concurrent fetches.  A connection
+ * has a thread of its own which reads and dispatches the incoming frames,
+ * the fetches write their HEADERS and DATA frames themselves, serialized
+ * by the tx lock of the connection.
+ *
+ * The rx thread decodes the response headers straight into the beresp of
+ * the fetch, which sits waiting for them and keeps its hands off bo->ws
+ * and bo->vsl until they are complete.  DATA frames are queued on the
+ * stream and handed to the fetch by the V2F VFP, which credits the flow
+ * control windows back to the backend as the body is consumed, so no more
+ * than backend_h2_window bytes are ever buffered for one stream.
+ *
+ * The rx thread must never block on the tx lock: a fetch stuck writing to
+ * a backend which is itself stuck writing to us would deadlock the pair.
+ * Control frames the rx thread owes the backend (SETTINGS and PING acks,
+ * connection window updates) are queued instead, and sent by whoever
+ * holds the tx lock when releasing it.
+ */
+
+#include "config.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <poll.h>
+#include <stdlib.h>
+
+#include "cache/cache_varnishd.h"
+#include "cache/cache_filter.h"
+#include "cache/cache_tcp_pool.h"
+
+#include "http2/cache_http2.h"
+
+#include "vct.h"
+#include "vend.h"
+#include "vtcp.h"
+#include "vtim.h"
+
+#define V2F_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define V2F_FRAME		16384	/* Our SETTINGS_MAX_FRAME_SIZE */
+#define V2F_MAX_OPENED		(1U << 30)	/* Stream ids per connection */
+
+enum v2f_frame_e {
+#define H2_FRAME(l,u,t,f,...)	V2F_##u = t,
+#include "tbl/h2_frames.h"
+};
+
+static const struct h2_settings v2f_proto_settings = {
+#define H2_SETTING(U,l,v,d,...) . l = d,
+#include "tbl/h2_settings.h"
+};
+
+struct v2f_chunk {
+	VTAILQ_ENTRY(v2f_chunk)	list;
+	uint8_t			*ptr;
+	size_t			len;
+};
+
+enum v2f_hdrs_e {
+	V2F_HDRS_WAIT = 0,
+	V2F_HDRS_DECODING,
+	V2F_HDRS_DONE,
+	V2F_HDRS_GONE,		/* The fetch stopped waiting */
+};
+
+struct v2f_stream {
+	unsigned		magic;
+#define V2F_STREAM_MAGIC	0x4f0bd22e
+	uint32_t		id;
+	struct v2f_conn		*conn;
+	VTAILQ_ENTRY(v2f_stream) list;
+	struct busyobj		*bo;
+	uintptr_t		ws_snap;
+	enum v2f_hdrs_e		hdrs;
+	uint16_t		status;
+	int			end_stream;
+	h2_error		error;
+	uint64_t		hdrbytes;
+	int64_t			t_window;
+	size_t			r_credit;
+	VTAILQ_HEAD(, v2f_chunk) data;
+	pthread_cond_t		cond;
+};
+
+struct v2f_conn {
+	unsigned		magic;
+#define V2F_CONN_MAGIC		0x9d2e71a3
+	struct v2f_pool		*pool;
+	VTAILQ_ENTRY(v2f_conn)	list;
+	struct pfd		*pfd;
+	int			fd;
+	struct lock		txmtx;
+	int			tx_err;
+
+	/* Protected by the pool lock */
+	int			connecting;
+	int			conn_err;
+	int			dead;
+	int			rx_done;
+	unsigned		n_streams;
+	unsigned		n_opened;
+	uint32_t		next_id;
+	vtim_real		t_used;
+	VTAILQ_HEAD(, v2f_stream) streams;
+	struct h2_settings	remote;
+	int64_t			t_window;
+	size_t			r_credit;
+	size_t			window;
+	unsigned		tx_acks;
+	int			tx_ping;
+	uint8_t			ping[8];
+	pthread_cond_t		cond;
+
+	/* Only used by the rx thread */
+	uint8_t			*rxbuf;
+	uint32_t		hdr_id;
+	int			hdr_end_stream;
+	vtim_real		hdr_t0;
+	struct v2f_stream	*hdr_stream;
+	enum vhd_ret_e		skip_ret;
+	struct h2h_decode	decode[1];
+	struct vhd_decode	skip[1];
+	struct vht_table	dectbl[1];
+};
+
+struct v2f_pool {
+	unsigned		magic;
+#define V2F_POOL_MAGIC		0x36e1d2cf
+	struct lock		mtx;
+	struct tcp_pool		*tcp_pool;
+	VTAILQ_HEAD(, v2f_conn)	conns;
+	unsigned		n_conn;
+};
+
+/*--------------------------------------------------------------------
+ * Write out frames, must hold the tx lock
+ */
+
+static int
+v2f_writev(int fd, struct iovec *iov, int niov)
+{
+	ssize_t l;
+
+	while (niov > 0) {
+		l = writev(fd, iov, niov);
+		if (l < 0 && errno == EINTR)
+			continue;
+		if (l <= 0)
+			return (-1);
+		while (niov > 0 && (size_t)l >= iov->iov_len) {
+			l -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if (niov > 0) {
+			iov->iov_base = (char *)iov->iov_base + l;
+			iov->iov_len -= l;
+		}
+	}
+	return (0);
+}
+
+static int
+v2f_tx(struct v2f_conn *vc, enum v2f_frame_e type, uint8_t flags,
+    uint32_t stream, uint32_t len, const void *ptr)
+{
+	uint8_t hdr[9];
+	struct iovec iov[2];
+
+	CHECK_OBJ_NOTNULL(vc, V2F_CONN_MAGIC);
+	Lck_AssertHeld(&vc->txmtx);
+	assert(len < (1U << 24));
+	if (vc->tx_err)
+		return (-1);
+	vbe32enc(hdr, len << 8);
+	hdr[3] = (uint8_t)type;
+	hdr[4] = flags;
+	vbe32enc(hdr + 5, stream);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof hdr;
+	iov[1].iov_base = TRUST_ME(ptr);
+	iov[1].iov_len = len;
+	if (v2f_writev(vc->fd, iov, len > 0 ? 2 : 1)) {
+		/* Wake up the rx thread, it fails the streams */
+		vc->tx_err = 1;
+		(void)shutdown(vc->fd, SHUT_RDWR);
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+v2f_tx_u32(struct v2f_conn *vc, enum v2f_frame_e type, uint32_t stream,
+    uint32_t val)
+{
+	uint8_t buf[4];
+
+	vbe32enc(buf, val);
+	return (v2f_tx(vc, type, 0, stream, sizeof buf, buf));
+}
+
+/* Send the control frames the rx thread queued for us */
+
+static void
+v2f_tx_flush(struct v2f_conn *vc)
+{
+	struct v2f_pool *vp;
+	uint8_t ping[8];
+	unsigned acks;
+	size_t credit = 0;
+	int tx_ping;
+
+	vp = vc->pool;
+	Lck_AssertHeld(&vc->txmtx);
+	Lck_Lock(&vp->mtx);
+	acks = vc->tx_acks;
+	vc->tx_acks = 0;
+	tx_ping = vc->tx_ping;
+	vc->tx_ping = 0;
+	memcpy(ping, vc->ping, sizeof ping);
+	if (vc->r_credit >= vc->window / 2) {
+		credit = vc->r_credit;
+		vc->r_credit = 0;
+	}
+	Lck_Unlock(&vp->mtx);
+
+	while (acks-- > 0)
+		(void)v2f_tx(vc, V2F_SETTINGS, H2FF_SETTINGS_ACK, 0, 0, NULL);
+	if (tx_ping)
+		(void)v2f_tx(vc, V2F_PING, H2FF_PING_ACK, 0, sizeof ping, ping);
+	if (credit > 0)
+		(void)v2f_tx_u32(vc, V2F_WINDOW_UPDATE, 0, credit);
+}
+
+static int
+v2f_tx_want(struct v2f_conn *vc)
+{
+	int r;
+
+	Lck_Lock(&vc->pool->mtx);
+	r = vc->tx_acks > 0 || vc->tx_ping ||
+	    vc->r_credit >= vc->window / 2;
+	Lck_Unlock(&vc->pool->mtx);
+	return (r);
+}
+
+static void
+v2f_tx_rel(struct v2f_conn *vc)
+{
+
+	do {
+		v2f_tx_flush(vc);
+		Lck_Unlock(&vc->txmtx);
+	} while (v2f_tx_want(vc) && !Lck_Trylock(&vc->txmtx));
+}
+
+/*--------------------------------------------------------------------
+ * Stream and connection bookkeeping, all under the pool lock
+ */
+
+static struct v2f_stream *
+v2f_find(const struct v2f_conn *vc, uint32_t id)
+{
+	struct v2f_stream *s;
+
+	Lck_AssertHeld(&vc->pool->mtx);
+	VTAILQ_FOREACH(s, &vc->streams, list) {
+		CHECK_OBJ_NOTNULL(s, V2F_STREAM_MAGIC);
+		if (s->id == id)
+			return (s);
+	}
+	return (NULL);
+}
+
+static void
+v2f_fail(struct v2f_stream *s, h2_error h2e)
+{
+
+	CHECK_OBJ_NOTNULL(s, V2F_STREAM_MAGIC);
+	Lck_AssertHeld(&s->conn->pool->mtx);
+	AN(h2e);
+	if (s->error == NULL)
+		s->error = h2e;
+	AZ(pthread_cond_signal(&s->cond));
+	AZ(pthread_cond_broadcast(&s->conn->cond));
+}
+
+static int
+v2f_usable(const struct v2f_conn *vc)
+{
+	unsigned max;
+
+	CHECK_OBJ_NOTNULL(vc, V2F_CONN_MAGIC);
+	Lck_AssertHeld(&vc->pool->mtx);
+	max = cache_param->backend_h2_max_streams;
+	if (vc->remote.max_concurrent_streams < max)
+		max = vc->remote.max_concurrent_streams;
+	return (!vc->dead && vc->n_streams < max &&
+	    vc->n_opened < V2F_MAX_OPENED);
+}
+
+static struct v2f_stream *
+v2f_new_stream(struct v2f_conn *vc, struct busyobj *bo)
+{
+	struct v2f_stream *s;
+
+	Lck_AssertHeld(&vc->pool->mtx);
+	ALLOC_OBJ(s, V2F_STREAM_MAGIC);
+	AN(s);
+	s->conn = vc;
+	s->bo = bo;
+	s->t_window = vc->remote.initial_window_size;
+	VTAILQ_INIT(&s->data);
+	AZ(pthread_cond_init(&s->cond, NULL));
+	VTAILQ_INSERT_TAIL(&vc->streams, s, list);
+	vc->n_streams++;
+	vc->n_opened++;
+	return (s);
+}
+
+/* Returns non-zero if the connection is ours to free */
+
+static int
+v2f_del_stream(struct v2f_conn *vc, struct v2f_stream *s)
+{
+
+	Lck_AssertHeld(&vc->pool->mtx);
+	CHECK_OBJ_NOTNULL(s, V2F_STREAM_MAGIC);
+	VTAILQ_REMOVE(&vc->streams, s, list);
+	assert(vc->n_streams > 0);
+	vc->n_streams--;
+	vc->t_used = VTIM_real();
+	AZ(pthread_cond_destroy(&s->cond));
+	FREE_OBJ(s);
+	return (vc->rx_done && vc->n_streams == 0);
+}
+
+static void
+v2f_conn_free(struct v2f_conn *vc)
+{
+	struct v2f_pool *vp;
+
+	CHECK_OBJ_NOTNULL(vc, V2F_CONN_MAGIC);
+	vp = vc->pool;
+	AZ(vc->n_streams);
+	if (vc->pfd != NULL)
+		VTP_Close(&vc->pfd);
+	AZ(vc->pfd);
+	VHT_Fini(vc->dectbl);
+	free(vc->rxbuf);
+	AZ(pthread_cond_destroy(&vc->cond));
+	Lck_Delete(&vc->txmtx);
+	FREE_OBJ(vc);
+
+	Lck_Lock(&vp->mtx);
+	assert(vp->n_conn > 0);
+	vp->n_conn--;
+	Lck_Unlock(&vp->mtx);
+}
+
+/*--------------------------------------------------------------------
+ * The rx side of a connection
+ */
+
+static int
+v2f_read(int fd, uint8_t *buf, size_t len)
+{
+	ssize_t l;
+
+	while (len > 0) {
+		l = read(fd, buf, len);
+		if (l < 0 && errno == EINTR)
+			continue;
+		if (l <= 0)
+			return (-1);
+		buf += l;
+		len -= l;
+	}
+	return (0);
+}
+
+static uint16_t
+v2f_status(const struct http *hp)
+{
+	const char *b;
+
+	b = hp->hd[HTTP_HDR_STATUS].b;
+	if (b == NULL || hp->hd[HTTP_HDR_STATUS].e - b != 3)
+		return (0);
+	if (!vct_isdigit(b[0]) || !vct_isdigit(b[1]) || !vct_isdigit(b[2]))
+		return (0);
+	if (b[0] == '0')
+		return (0);
+	return ((b[0] - '0') * 100 + (b[1] - '0') * 10 + (b[2] - '0'));
+}
+
+/*
+ * Header blocks nobody waits for (trailers, streams we gave up on) still
+ * have to go through the decoder, to keep its dynamic table in step with
+ * the backend's.
+ */
+
+static h2_error
+v2f_rx_skip(struct v2f_conn *vc, const uint8_t *in, size_t in_l)
+{
+	char buf[256];
+	size_t in_u = 0, out_u;
+
+	do {
+		out_u = 0;
+		vc->skip_ret = VHD_Decode(vc->skip, vc->dectbl, in, in_l,
+		    &in_u, buf, sizeof buf, &out_u);
+	} while (vc->skip_ret > VHD_MORE);
+	if (vc->skip_ret < 0)
+		return (H2CE_COMPRESSION_ERROR);
+	return (0);
+}
+
+static h2_error
+v2f_rx_hdrblock(struct v2f_conn *vc, const uint8_t *in, size_t in_l,
+    int end)
+{
+	struct v2f_pool *vp;
+	struct v2f_stream *s;
+	struct busyobj *bo;
+	h2_error h2e, ret = NULL;
+	uint16_t status = 0;
+
+	vp = vc->pool;
+	s = vc->hdr_stream;
+	if (s == NULL) {
+		h2e = v2f_rx_skip(vc, in, in_l);
+		if (h2e != NULL || !end)
+			return (h2e);
+		vc->hdr_id = 0;
+		if (vc->skip_ret != VHD_OK)
+			return (H2CE_COMPRESSION_ERROR);
+		return (0);
+	}
+
+	CHECK_OBJ_NOTNULL(s, V2F_STREAM_MAGIC);
+	bo = s->bo;
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	s->hdrbytes += in_l;
+	h2e = h2h_decode_http_bytes(vc->decode, in, in_l);
+	if (h2e == NULL && !end)
+		return (0);
+
+	/*
+	 * Decoding stops at the first bad header, the dynamic table is
+	 * lost after that, so anything but running out of workspace (which
+	 * h2h_decode_http_fini() reports) takes the connection down.
+	 */
+	if (h2e != NULL) {
+		(void)h2h_decode_http_fini(vc->decode);
+		ret = H2CE_COMPRESSION_ERROR;
+	} else
+		h2e = h2h_decode_http_fini(vc->decode);
+	vc->hdr_id = 0;
+	vc->hdr_stream = NULL;
+
+	if (h2e == NULL) {
+		status = v2f_status(bo->beresp);
+		if (status < 100 || (status < 200 && vc->hdr_end_stream))
+			h2e = H2SE_PROTOCOL_ERROR;
+	}
+	if (h2e == NULL && status < 200) {
+		/* Interim response, wait for the real one */
+		WS_Reset(bo->ws, s->ws_snap);
+		HTTP_Setup(bo->beresp, bo->ws, bo->vsl, SLT_BerespMethod);
+	}
+
+	Lck_Lock(&vp->mtx);
+	if (h2e != NULL) {
+		s->hdrs = V2F_HDRS_WAIT;
+		v2f_fail(s, h2e);
+	} else if (status < 200) {
+		s->hdrs = V2F_HDRS_WAIT;
+	} else {
+		s->hdrs = V2F_HDRS_DONE;
+		s->status = status;
+		if (vc->hdr_end_stream)
+			s->end_stream = 1;
+		AZ(pthread_cond_signal(&s->cond));
+	}
+	Lck_Unlock(&vp->mtx);
+
+	if (h2e != NULL && h2e->connection)
+		return (h2e);
+	return (ret);
+}
+
+static h2_error
+v2f_rx_headers(struct v2f_conn *vc, uint8_t flags, uint32_t stream,
+    uint8_t *p, size_t l)
+{
+	struct v2f_stream *s;
+	size_t pad = 0;
+
+	if (stream == 0)
+		return (H2CE_PROTOCOL_ERROR);
+	if (flags & H2FF_HEADERS_PADDED) {
+		if (l < 1)
+			return (H2CE_PROTOCOL_ERROR);
+		pad = *p++;
+		l--;
+	}
+	if (flags & H2FF_HEADERS_PRIORITY) {
+		if (l < 5)
+			return (H2CE_PROTOCOL_ERROR);
+		p += 5;
+		l -= 5;
+	}
+	if (pad > l)
+		return (H2CE_PROTOCOL_ERROR);
+	l -= pad;
+
+	vc->hdr_id = stream;
+	vc->hdr_end_stream = (flags & H2FF_HEADERS_END_STREAM) != 0;
+	vc->hdr_t0 = VTIM_real();
+
+	Lck_Lock(&vc->pool->mtx);
+	s = v2f_find(vc, stream);
+	if (s != NULL && s->hdrs == V2F_HDRS_WAIT && s->error == NULL)
+		s->hdrs = V2F_HDRS_DECODING;
+	else if (s != NULL && vc->hdr_end_stream) {
+		/* Trailers, which we do not keep */
+		s->end_stream = 1;
+		AZ(pthread_cond_signal(&s->cond));
+		s = NULL;
+	} else
+		s = NULL;
+	Lck_Unlock(&vc->pool->mtx);
+
+	vc->hdr_stream = s;
+	if (s != NULL)
+		h2h_decode_http_init(vc->decode, s->bo->beresp, vc->dectbl, 1);
+	else
+		VHD_Init(vc->skip);
+	return (v2f_rx_hdrblock(vc, p, l,
+	    (flags & H2FF_HEADERS_END_HEADERS) != 0));
+}
+
+static h2_error
+v2f_rx_data(struct v2f_conn *vc, uint8_t flags, uint32_t stream,
+    const uint8_t *p, size_t len)
+{
+	struct v2f_stream *s;
+	struct v2f_chunk *ch;
+	size_t l, pad = 0;
+
+	if (stream == 0)
+		return (H2CE_PROTOCOL_ERROR);
+	l = len;
+	if (flags & H2FF_DATA_PADDED) {
+		if (l < 1)
+			return (H2CE_PROTOCOL_ERROR);
+		pad = *p++;
+		l--;
+		if (pad > l)
+			return (H2CE_PROTOCOL_ERROR);
+		l -= pad;
+	}
+
+	ch = NULL;
+	if (l > 0) {
+		ch = malloc(sizeof *ch + l);
+		AN(ch);
+		ch->ptr = (void *)(ch + 1);
+		ch->len = l;
+		memcpy(ch->ptr, p, l);
+	}
+
+	Lck_Lock(&vc->pool->mtx);
+	s = v2f_find(vc, stream);
+	if (s == NULL || s->error != NULL || s->hdrs == V2F_HDRS_GONE) {
+		/* Nobody wants it, give the window straight back */
+		vc->r_credit += len;
+		free(ch);
+	} else if (s->hdrs != V2F_HDRS_DONE) {
+		vc->r_credit += len;
+		free(ch);
+		v2f_fail(s, H2SE_PROTOCOL_ERROR);
+	} else {
+		/* Padding is never consumed, credit it now */
+		s->r_credit += len - l;
+		vc->r_credit += len - l;
+		if (ch != NULL)
+			VTAILQ_INSERT_TAIL(&s->data, ch, list);
+		if (flags & H2FF_DATA_END_STREAM)
+			s->end_stream = 1;
+		AZ(pthread_cond_signal(&s->cond));
+	}
+	Lck_Unlock(&vc->pool->mtx);
+	return (0);
+}
+
+static h2_error
+v2f_rx_settings(struct v2f_conn *vc, uint8_t flags, uint32_t stream,
+    const uint8_t *p, size_t l)
+{
+	const struct h2_setting_s *hs;
+	struct v2f_stream *s;
+	uint32_t y;
+
+	if (stream != 0)
+		return (H2CE_PROTOCOL_ERROR);
+	if (flags & H2FF_SETTINGS_ACK)
+		return (l == 0 ? 0 : H2CE_FRAME_SIZE_ERROR);
+	if (l % 6 != 0)
+		return (H2CE_FRAME_SIZE_ERROR);
+
+	Lck_Lock(&vc->pool->mtx);
+	for (; l > 0; l -= 6, p += 6) {
+		hs = h2_setting_lookup(vbe16dec(p));
+		if (hs == NULL)
+			continue;		// rfc7540,l,2181,2182
+		y = vbe32dec(p + 2);
+		if (y < hs->minval || y > hs->maxval) {
+			Lck_Unlock(&vc->pool->mtx);
+			return (hs->range_error != NULL ?
+			    hs->range_error : H2CE_PROTOCOL_ERROR);
+		}
+		if (hs == H2_SET_INITIAL_WINDOW_SIZE)
+			VTAILQ_FOREACH(s, &vc->streams, list)
+				s->t_window += (int64_t)y -
+				    vc->remote.initial_window_size;
+		hs->setfunc(&vc->remote, y);
+	}
+	vc->tx_acks++;
+	AZ(pthread_cond_broadcast(&vc->cond));
+	Lck_Unlock(&vc->pool->mtx);
+	return (0);
+}
+
+static h2_error
+v2f_rx_window_update(struct v2f_conn *vc, uint32_t stream,
+    const uint8_t *p, size_t l)
+{
+	struct v2f_stream *s;
+	uint32_t wu;
+	h2_error h2e = NULL;
+
+	if (l != 4)
+		return (H2CE_FRAME_SIZE_ERROR);
+	wu = vbe32dec(p) & ~(1U << 31);
+	Lck_Lock(&vc->pool->mtx);
+	if (stream == 0) {
+		vc->t_window += wu;
+		if (wu == 0)
+			h2e = H2CE_PROTOCOL_ERROR;
+		else if (vc->t_window >= (1LL << 31))
+			h2e = H2CE_FLOW_CONTROL_ERROR;
+		AZ(pthread_cond_broadcast(&vc->cond));
+	} else {
+		s = v2f_find(vc, stream);
+		if (s != NULL) {
+			s->t_window += wu;
+			if (wu == 0)
+				v2f_fail(s, H2SE_PROTOCOL_ERROR);
+			else if (s->t_window >= (1LL << 31))
+				v2f_fail(s, H2SE_FLOW_CONTROL_ERROR);
+			else
+				AZ(pthread_cond_broadcast(&vc->cond));
+		}
+	}
+	Lck_Unlock(&vc->pool->mtx);
+	return (h2e);
+}
+
+static h2_error
+v2f_rx_frame(struct v2f_conn *vc, enum v2f_frame_e type, uint8_t flags,
+    uint32_t stream, uint8_t *p, size_t l)
+{
+	struct v2f_stream *s;
+	uint32_t last;
+
+	if (vc->hdr_id != 0) {
+		if (type != V2F_CONTINUATION || stream != vc->hdr_id)
+			return (H2CE_PROTOCOL_ERROR);	// rfc7540,l,1859,1863
+		return (v2f_rx_hdrblock(vc, p, l,
+		    (flags & H2FF_CONTINUATION_END_HEADERS) != 0));
+	}
+
+	switch (type) {
+	case V2F_DATA:
+		return (v2f_rx_data(vc, flags, stream, p, l));
+	case V2F_HEADERS:
+		return (v2f_rx_headers(vc, flags, stream, p, l));
+	case V2F_SETTINGS:
+		return (v2f_rx_settings(vc, flags, stream, p, l));
+	case V2F_WINDOW_UPDATE:
+		return (v2f_rx_window_update(vc, stream, p, l));
+	case V2F_RST_STREAM:
+		if (stream == 0)
+			return (H2CE_PROTOCOL_ERROR);
+		if (l != 4)
+			return (H2CE_FRAME_SIZE_ERROR);
+		Lck_Lock(&vc->pool->mtx);
+		s = v2f_find(vc, stream);
+		if (s != NULL)
+			v2f_fail(s, h2_streamerror(vbe32dec(p)));
+		Lck_Unlock(&vc->pool->mtx);
+		return (0);
+	case V2F_PING:
+		if (stream != 0)
+			return (H2CE_PROTOCOL_ERROR);
+		if (l != 8)
+			return (H2CE_FRAME_SIZE_ERROR);
+		if (flags & H2FF_PING_ACK)
+			return (0);
+		Lck_Lock(&vc->pool->mtx);
+		memcpy(vc->ping, p, sizeof vc->ping);
+		vc->tx_ping = 1;
+		Lck_Unlock(&vc->pool->mtx);
+		return (0);
+	case V2F_GOAWAY:
+		if (stream != 0)
+			return (H2CE_PROTOCOL_ERROR);
+		if (l < 8)
+			return (H2CE_FRAME_SIZE_ERROR);
+		last = vbe32dec(p) & ~(1U << 31);
+		Lck_Lock(&vc->pool->mtx);
+		vc->dead = 1;
+		/* The backend never saw these, they can be retried */
+		VTAILQ_FOREACH(s, &vc->streams, list)
+			if (s->id > last)
+				v2f_fail(s, H2SE_REFUSED_STREAM);
+		Lck_Unlock(&vc->pool->mtx);
+		return (0);
+	case V2F_PUSH_PROMISE:
+		/* We said SETTINGS_ENABLE_PUSH=0 */
+		return (H2CE_PROTOCOL_ERROR);
+	case V2F_CONTINUATION:
+		return (H2CE_PROTOCOL_ERROR);
+	default:
+		/* PRIORITY and unknown frames */
+		return (0);
+	}
+}
+
+/*
+ * Wait for the next frame.  Connections without streams are closed after
+ * backend_idle_timeout, and header blocks must not stall halfway.
+ */
+
+static int
+v2f_rx_wait(struct v2f_conn *vc)
+{
+	struct pollfd pfd[1];
+	vtim_real now;
+	int i, quit;
+
+	while (1) {
+		pfd->fd = vc->fd;
+		pfd->events = POLLIN;
+		i = poll(pfd, 1, 1000);
+		if (i > 0)
+			return (0);
+		if (i < 0 && errno != EINTR)
+			return (-1);
+		now = VTIM_real();
+		if (vc->hdr_id != 0 &&
+		    now - vc->hdr_t0 > cache_param->between_bytes_timeout)
+			return (-1);
+		Lck_Lock(&vc->pool->mtx);
+		if (vc->n_streams == 0 &&
+		    now - vc->t_used > cache_param->backend_idle_timeout)
+			vc->dead = 1;
+		quit = vc->dead && vc->n_streams == 0;
+		Lck_Unlock(&vc->pool->mtx);
+		if (quit)
+			return (-1);
+	}
+}
+
+static void *
+v2f_rx_thread(void *priv)
+{
+	struct v2f_conn *vc;
+	struct v2f_pool *vp;
+	struct v2f_stream *s;
+	uint8_t hdr[9];
+	uint32_t len, stream;
+	h2_error h2e = NULL;
+	int free_it;
+
+	CAST_OBJ_NOTNULL(vc, priv, V2F_CONN_MAGIC);
+	vp = vc->pool;
+	CHECK_OBJ_NOTNULL(vp, V2F_POOL_MAGIC);
+	THR_SetName("backend-h2");
+	THR_Init();
+
+	while (h2e == NULL) {
+		if (v2f_rx_wait(vc) || v2f_read(vc->fd, hdr, sizeof hdr))
+			break;
+		len = vbe32dec(hdr) >> 8;
+		stream = vbe32dec(hdr + 5) & ~(1U << 31);
+		if (len > V2F_FRAME) {
+			h2e = H2CE_FRAME_SIZE_ERROR;
+			break;
+		}
+		if (v2f_read(vc->fd, vc->rxbuf, len))
+			break;
+		h2e = v2f_rx_frame(vc, (enum v2f_frame_e)hdr[3], hdr[4],
+		    stream, vc->rxbuf, len);
+		if (v2f_tx_want(vc) && !Lck_Trylock(&vc->txmtx))
+			v2f_tx_rel(vc);
+	}
+
+	if (vc->hdr_stream != NULL)
+		(void)h2h_decode_http_fini(vc->decode);
+	if (h2e != NULL) {
+		VSL(SLT_Debug, 0, "H2 backend connection error %s", h2e->name);
+		if (!Lck_Trylock(&vc->txmtx)) {
+			(void)v2f_tx_u32(vc, V2F_GOAWAY, 0, 0);
+			Lck_Unlock(&vc->txmtx);
+		}
+	} else
+		h2e = H2CE_INTERNAL_ERROR;
+
+	Lck_Lock(&vp->mtx);
+	vc->dead = 1;
+	vc->rx_done = 1;
+	VTAILQ_REMOVE(&vp->conns, vc, list);
+	if (vc->hdr_stream != NULL)
+		vc->hdr_stream->hdrs = V2F_HDRS_WAIT;
+	VTAILQ_FOREACH(s, &vc->streams, list)
+		v2f_fail(s, h2e);
+	AZ(pthread_cond_broadcast(&vc->cond));
+	free_it = vc->n_streams == 0;
+	Lck_Unlock(&vp->mtx);
+	if (free_it)
+		v2f_conn_free(vc);
+	return (NULL);
+}
+
+/*--------------------------------------------------------------------
+ * A new connection goes on the pool list before it is even connected,
+ * so fetches arriving meanwhile queue up on it instead of opening more
+ * connections of their own.
+ */
+
+static struct v2f_conn *
+v2f_conn_new(struct v2f_pool *vp)
+{
+	struct v2f_conn *vc;
+
+	Lck_AssertHeld(&vp->mtx);
+	ALLOC_OBJ(vc, V2F_CONN_MAGIC);
+	AN(vc);
+	vc->pool = vp;
+	vc->fd = -1;
+	vc->connecting = 1;
+	Lck_New(&vc->txmtx, lck_backend_h2);
+	AZ(pthread_cond_init(&vc->cond, NULL));
+	VTAILQ_INIT(&vc->streams);
+	vc->remote = v2f_proto_settings;
+	vc->t_window = v2f_proto_settings.initial_window_size;
+	vc->window = cache_param->backend_h2_window;
+	vc->next_id = 1;
+	vc->t_used = VTIM_real();
+	vc->rxbuf = malloc(V2F_FRAME);
+	AN(vc->rxbuf);
+	AZ(VHT_Init(vc->dectbl, v2f_proto_settings.header_table_size));
+	VTAILQ_INSERT_HEAD(&vp->conns, vc, list);
+	vp->n_conn++;
+	return (vc);
+}
+
+/* Connect and greet the backend, without the pool lock */
+
+static int
+v2f_conn_open(struct v2f_conn *vc, vtim_dur tmo, struct worker *wrk,
+    int *err)
+{
+	struct iovec iov[1];
+	uint8_t settings[12];
+	int i;
+
+	CHECK_OBJ_NOTNULL(vc, V2F_CONN_MAGIC);
+	AN(vc->connecting);
+	vc->pfd = VTP_Get(vc->pool->tcp_pool, tmo, wrk, 1, err);
+	if (vc->pfd == NULL)
+		return (-1);
+	vc->fd = *PFD_Fd(vc->pfd);
+	VTCP_blocking(vc->fd);
+	VTCP_set_read_timeout(vc->fd, cache_param->between_bytes_timeout);
+
+	vbe16enc(settings, H2_SET_ENABLE_PUSH->ident);
+	vbe32enc(settings + 2, 0);
+	vbe16enc(settings + 6, H2_SET_INITIAL_WINDOW_SIZE->ident);
+	vbe32enc(settings + 8, vc->window);
+
+	iov->iov_base = TRUST_ME(V2F_PREFACE);
+	iov->iov_len = sizeof V2F_PREFACE - 1;
+	Lck_Lock(&vc->txmtx);
+	i = v2f_writev(vc->fd, iov, 1);
+	if (i == 0)
+		i = v2f_tx(vc, V2F_SETTINGS, 0, 0, sizeof settings, settings);
+	if (i == 0 && vc->window > vc->t_window)
+		i = v2f_tx_u32(vc, V2F_WINDOW_UPDATE, 0,
+		    vc->window - vc->t_window);
+	Lck_Unlock(&vc->txmtx);
+	if (i != 0) {
+		*err = errno;
+		return (-1);
+	}
+	VSC_C_main->backend_h2_conn++;
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * Check out a stream on a connection to the backend, opening a new
+ * connection if all of them are at their stream limit.
+ */
+
+struct v2f_stream *
+V2F_Open(struct v2f_pool *vp, vtim_dur tmo, struct worker *wrk,
+    struct busyobj *bo, int *err)
+{
+	struct v2f_conn *vc;
+	struct v2f_stream *s;
+	pthread_t thr;
+	int i, free_it;
+
+	CHECK_OBJ_NOTNULL(vp, V2F_POOL_MAGIC);
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	AN(err);
+
+	Lck_Lock(&vp->mtx);
+	VTAILQ_FOREACH(vc, &vp->conns, list)
+		if (v2f_usable(vc))
+			break;
+	if (vc != NULL) {
+		/* Our stream keeps the connection around while we wait */
+		s = v2f_new_stream(vc, bo);
+		while (vc->connecting)
+			(void)Lck_CondWait(&vc->cond, &vp->mtx, 0);
+		if (vc->conn_err == 0) {
+			Lck_Unlock(&vp->mtx);
+			return (s);
+		}
+		*err = vc->conn_err;
+		free_it = v2f_del_stream(vc, s);
+		Lck_Unlock(&vp->mtx);
+		if (free_it)
+			v2f_conn_free(vc);
+		return (NULL);
+	}
+	vc = v2f_conn_new(vp);
+	s = v2f_new_stream(vc, bo);
+	Lck_Unlock(&vp->mtx);
+
+	i = v2f_conn_open(vc, tmo, wrk, err);
+
+	Lck_Lock(&vp->mtx);
+	vc->connecting = 0;
+	if (i != 0) {
+		vc->conn_err = *err != 0 ? *err : EIO;
+		vc->dead = 1;
+		vc->rx_done = 1;
+		VTAILQ_REMOVE(&vp->conns, vc, list);
+	}
+	AZ(pthread_cond_broadcast(&vc->cond));
+	free_it = i != 0 && v2f_del_stream(vc, s);
+	Lck_Unlock(&vp->mtx);
+	if (free_it)
+		v2f_conn_free(vc);
+	if (i != 0)
+		return (NULL);
+	AZ(pthread_create(&thr, NULL, v2f_rx_thread, vc));
+	AZ(pthread_detach(thr));
+	return (s);
+}
+
+struct pfd *
+V2F_Pfd(const struct v2f_stream *s)
+{
+
+	CHECK_OBJ_NOTNULL(s, V2F_STREAM_MAGIC);
+	CHECK_OBJ_NOTNULL(s->conn, V2F_CONN_MAGIC);
+	return (s->conn->pfd);
+}
+
+/*--------------------------------------------------------------------
+ * Build the request header block.  Literals without indexing only, so
+ * concurrent fetches can encode without sharing any state.
+ */
+
+/* Connection specific headers are not allowed in H/2 */
+static const char * const v2f_skip_hdrs[] = {
+	H_Host,		/* Sent as :authority */
+	H_Connection,
+	H_Keep_Alive,
+	H_Transfer_Encoding,
+	H_Upgrade,
+	H_TE,
+	NULL
+};
+
+static int
+v2f_skip_hdr(const char *b)
+{
+	const char * const *h;
+
+	for (h = v2f_skip_hdrs; *h != NULL; h++)
+		if (!strncasecmp(b, *h + 1, **h))
+			return (1);
+	return (0);
+}
+
+static struct vsb *
+v2f_hdrblock(const struct http *hp)
+{
+	struct vsb *vsb;
+	const char *p, *q;
+	size_t l;
+	unsigned u;
+
+	vsb = VSB_new_auto();
+	AN(vsb);
+	p = hp->hd[HTTP_HDR_METHOD].b;
+	h2_enc_literal(vsb, ":method", 7, p, hp->hd[HTTP_HDR_METHOD].e - p);
+	h2_enc_literal(vsb, ":scheme", 7, "http", 4);
+	if (http_GetHdr(hp, H_Host, &p))
+		h2_enc_literal(vsb, ":authority", 10, p, strlen(p));
+	p = hp->hd[HTTP_HDR_URL].b;
+	h2_enc_literal(vsb, ":path", 5, p, hp->hd[HTTP_HDR_URL].e - p);
+
+	for (u = HTTP_HDR_FIRST; u < hp->nhd; u++) {
+		p = hp->hd[u].b;
+		if (p == NULL || v2f_skip_hdr(p))
+			continue;	// rfc7540,l,2999,3006
+		q = strchr(p, ':');
+		AN(q);
+		l = q - p;
+		q++;
+		while (q < hp->hd[u].e && vct_islws(*q))
+			q++;
+		h2_enc_literal(vsb, p, l, q, hp->hd[u].e - q);
+	}
+	AZ(VSB_finish(vsb));
+	return (vsb);
+}
+
+/* Send the header block, in as many frames as the backend wants */
+
+static int
+v2f_tx_hdrblock(struct v2f_conn *vc, uint32_t stream, const struct vsb *vsb,
+    int end_stream)
+{
+	enum v2f_frame_e type = V2F_HEADERS;
+	const char *p;
+	ssize_t l, len;
+	uint8_t flags;
+	int i = 0;
+
+	Lck_AssertHeld(&vc->txmtx);
+	p = VSB_data(vsb);
+	len = VSB_len(vsb);
+	do {
+		l = len;
+		if (l > (ssize_t)vc->remote.max_frame_size)
+			l = vc->remote.max_frame_size;
+		flags = 0;
+		if (type == V2F_HEADERS && end_stream)
+			flags |= H2FF_HEADERS_END_STREAM;
+		if (l == len)
+			flags |= H2FF_HEADERS_END_HEADERS;
+		i = v2f_tx(vc, type, flags, stream, l, p);
+		type = V2F_CONTINUATION;
+		p += l;
+		len -= l;
+	} while (i == 0 && len > 0);
+	return (i);
+}
+
+/*--------------------------------------------------------------------
+ * Send the request body, as far as the flow control windows allow
+ */
+
+static ssize_t
+v2f_tx_window(struct v2f_stream *s, ssize_t l)
+{
+	struct v2f_conn *vc;
+	struct v2f_pool *vp;
+	vtim_real tmo;
+
+	vc = s->conn;
+	vp = vc->pool;
+	tmo = VTIM_real() + s->bo->htc->between_bytes_timeout;
+	Lck_Lock(&vp->mtx);
+	while (s->error == NULL && (s->t_window <= 0 || vc->t_window <= 0))
+		if (Lck_CondWait(&vc->cond, &vp->mtx, tmo) == ETIMEDOUT)
+			break;
+	if (s->error != NULL || s->t_window <= 0 || vc->t_window <= 0) {
+		l = -1;
+	} else {
+		if (l > s->t_window)
+			l = s->t_window;
+		if (l > vc->t_window)
+			l = vc->t_window;
+		if (l > (ssize_t)vc->remote.max_frame_size)
+			l = vc->remote.max_frame_size;
+		s->t_window -= l;
+		vc->t_window -= l;
+	}
+	Lck_Unlock(&vp->mtx);
+	return (l);
+}
+
+static int v_matchproto_(objiterate_f)
+v2f_iter_req_body(void *priv, unsigned flush, const void *ptr, ssize_t l)
+{
+	struct v2f_stream *s;
+	const char *p = ptr;
+	ssize_t n;
+	int i;
+
+	CAST_OBJ_NOTNULL(s, priv, V2F_STREAM_MAGIC);
+	(void)flush;
+
+	while (l > 0) {
+		n = v2f_tx_window(s, l);
+		if (n < 0)
+			return (-1);
+		Lck_Lock(&s->conn->txmtx);
+		i = v2f_tx(s->conn, V2F_DATA, 0, s->id, n, p);
+		v2f_tx_rel(s->conn);
+		if (i)
+			return (-1);
+		s->bo->acct.bereq_bodybytes += n;
+		p += n;
+		l -= n;
+	}
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * The body VFP
+ */
+
+static enum vfp_status v_matchproto_(vfp_pull_f)
+v2f_pull(struct vfp_ctx *vfc, struct vfp_entry *vfe, void *p, ssize_t *lp)
+{
+	struct v2f_stream *s;
+	struct v2f_conn *vc;
+	struct v2f_pool *vp;
+	struct v2f_chunk *ch;
+	ssize_t l = 0, n;
+	size_t credit = 0;
+	vtim_real tmo;
+	h2_error h2e;
+	int end, want;
+
+	CHECK_OBJ_NOTNULL(vfc, VFP_CTX_MAGIC);
+	CHECK_OBJ_NOTNULL(vfe, VFP_ENTRY_MAGIC);
+	CAST_OBJ_NOTNULL(s, vfe->priv1, V2F_STREAM_MAGIC);
+	AN(p);
+	AN(lp);
+	vc = s->conn;
+	vp = vc->pool;
+
+	tmo = VTIM_real() + s->bo->htc->between_bytes_timeout;
+	Lck_Lock(&vp->mtx);
+	while (VTAILQ_EMPTY(&s->data) && !s->end_stream && s->error == NULL)
+		if (Lck_CondWait(&s->cond, &vp->mtx, tmo) == ETIMEDOUT)
+			break;
+	while (l < *lp && (ch = VTAILQ_FIRST(&s->data)) != NULL) {
+		n = *lp - l;
+		if ((size_t)n > ch->len)
+			n = ch->len;
+		memcpy((char *)p + l, ch->ptr, n);
+		ch->ptr += n;
+		ch->len -= n;
+		l += n;
+		if (ch->len == 0) {
+			VTAILQ_REMOVE(&s->data, ch, list);
+			free(ch);
+		}
+	}
+	s->r_credit += l;
+	vc->r_credit += l;
+	if (!s->end_stream && s->r_credit >= vc->window / 2) {
+		credit = s->r_credit;
+		s->r_credit = 0;
+	}
+	want = credit > 0 || vc->r_credit >= vc->window / 2;
+	end = s->end_stream && VTAILQ_EMPTY(&s->data);
+	h2e = s->error;
+	Lck_Unlock(&vp->mtx);
+
+	if (want) {
+		Lck_Lock(&vc->txmtx);
+		if (credit > 0)
+			(void)v2f_tx_u32(vc, V2F_WINDOW_UPDATE, s->id, credit);
+		v2f_tx_rel(vc);
+	}
+
+	*lp = l;
+	if (end)
+		return (VFP_END);
+	if (l > 0)
+		return (VFP_OK);
+	if (h2e != NULL)
+		return (VFP_Error(vfc, "H2 backend stream error %s",
+		    h2e->name));
+	return (VFP_Error(vfc, "backend read timeout"));
+}
+
+static const struct vfp v2f_vfp = {
+	.name = "V2F",
+	.pull = v2f_pull,
+};
+
+/*--------------------------------------------------------------------
+ * Send the request and wait for the response headers
+ *
+ * Return value:
+ *	 0 success
+ *	 1 failure which can be retried on another stream
+ *	-1 failure
+ */
+
+int
+V2F_GetHdrs(struct worker *wrk, struct busyobj *bo, const char *abuf,
+    const char *pbuf)
+{
+	struct v2f_stream *s;
+	struct v2f_conn *vc;
+	struct v2f_pool *vp;
+	struct http_conn *htc;
+	struct vfp_entry *vfe;
+	struct vsb *vsb;
+	enum v2f_hdrs_e hdrs;
+	vtim_real t_bereq;
+	ssize_t cl;
+	h2_error h2e;
+	int i = 0, body, refused, tmo;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	htc = bo->htc;
+	CHECK_OBJ_NOTNULL(htc, HTTP_CONN_MAGIC);
+	CAST_OBJ_NOTNULL(s, htc->priv, V2F_STREAM_MAGIC);
+	CHECK_OBJ_ORNULL(bo->req, REQ_MAGIC);
+	vc = s->conn;
+	vp = vc->pool;
+
+	VSLb(bo->vsl, SLT_BackendStart, "%s %s", abuf, pbuf);
+	VSC_C_main->backend_req++;
+
+	body = bo->req != NULL &&
+	    bo->req->req_body_status != REQ_BODY_NONE;
+	vsb = v2f_hdrblock(bo->bereq);
+	bo->acct.bereq_hdrbytes += VSB_len(vsb);
+
+	/*
+	 * From here until the headers are in, the rx thread may be
+	 * decoding into bo->beresp, and we leave bo->ws and bo->vsl alone.
+	 */
+	s->ws_snap = WS_Snapshot(bo->ws);
+	refused = 0;
+	Lck_Lock(&vc->txmtx);
+	Lck_Lock(&vp->mtx);
+	if (vc->dead) {
+		refused = 1;
+	} else {
+		/* Stream ids must go out in order, hence the tx lock */
+		s->id = vc->next_id;
+		vc->next_id += 2;
+	}
+	Lck_Unlock(&vp->mtx);
+	if (!refused)
+		i = v2f_tx_hdrblock(vc, s->id, vsb, !body);
+	v2f_tx_rel(vc);
+	VSB_destroy(&vsb);
+	if (refused) {
+		VSLb(bo->vsl, SLT_FetchError, "backend connection going away");
+		htc->doclose = SC_REM_CLOSE;
+		return (1);
+	}
+
+	if (i == 0 && body) {
+		i = VRB_Iterate(bo->req, v2f_iter_req_body, s) < 0 ? -1 : 0;
+		if (i == 0) {
+			Lck_Lock(&vc->txmtx);
+			i = v2f_tx(vc, V2F_DATA, H2FF_DATA_END_STREAM,
+			    s->id, 0, NULL);
+			v2f_tx_rel(vc);
+		}
+	}
+	t_bereq = W_TIM_real(wrk);
+
+	/*
+	 * A header block being decoded must be waited out in any case.
+	 * Past the deadline, the connection is taken down, which makes
+	 * the rx thread drop the block and let go of the stream.
+	 */
+	tmo = 0;
+	Lck_Lock(&vp->mtx);
+	while (s->hdrs == V2F_HDRS_DECODING || (i == 0 &&
+	    s->hdrs == V2F_HDRS_WAIT && s->error == NULL)) {
+		if (tmo) {
+			(void)Lck_CondWait(&s->cond, &vp->mtx, 0);
+			continue;
+		}
+		if (Lck_CondWait(&s->cond, &vp->mtx,
+		    t_bereq + htc->first_byte_timeout) != ETIMEDOUT)
+			continue;
+		tmo = 1;
+		if (s->hdrs == V2F_HDRS_WAIT)
+			break;
+		vc->dead = 1;
+		(void)shutdown(vc->fd, SHUT_RDWR);
+	}
+	if (s->hdrs == V2F_HDRS_WAIT)
+		s->hdrs = V2F_HDRS_GONE;
+	hdrs = s->hdrs;
+	h2e = s->error;
+	Lck_Unlock(&vp->mtx);
+	VSLb_ts_busyobj(bo, "Bereq", t_bereq);
+
+	if (hdrs != V2F_HDRS_DONE || tmo) {
+		if (i != 0 && bo->req != NULL &&
+		    bo->req->req_body_status == REQ_BODY_FAIL) {
+			VSLb(bo->vsl, SLT_FetchError,
+			    "req.body read error: %d (%s)",
+			    errno, vstrerror(errno));
+			bo->req->doclose = SC_RX_BODY;
+			htc->doclose = SC_TX_ERROR;
+		} else if (h2e != NULL && !tmo) {
+			VSLb(bo->vsl, SLT_FetchError,
+			    "H2 backend stream error %s", h2e->name);
+			htc->doclose = SC_RX_BAD;
+		} else if (i != 0) {
+			VSLb(bo->vsl, SLT_FetchError,
+			    "backend write error: %d (%s)",
+			    errno, vstrerror(errno));
+			htc->doclose = SC_TX_ERROR;
+		} else {
+			VSLb(bo->vsl, SLT_FetchError, "first byte timeout");
+			htc->doclose = SC_RX_TIMEOUT;
+		}
+		return (h2e == H2SE_REFUSED_STREAM ? 1 : -1);
+	}
+
+	/*
+	 * The backend may answer (and end the stream) before it has seen
+	 * all of the request body, that is not our problem anymore.
+	 */
+	bo->acct.beresp_hdrbytes += s->hdrbytes;
+	http_PutResponse(bo->beresp, "HTTP/2.0", s->status, NULL);
+	http_Proto(bo->beresp);
+
+	cl = http_GetContentLength(bo->beresp);
+	if (cl < -1) {
+		VSLb(bo->vsl, SLT_FetchError, "http format error");
+		htc->doclose = SC_RX_JUNK;
+		return (-1);
+	}
+	htc->content_length = cl;
+	Lck_Lock(&vp->mtx);
+	if (s->end_stream && VTAILQ_EMPTY(&s->data))
+		htc->body_status = BS_NONE;
+	else if (cl == 0)
+		htc->body_status = BS_NONE;
+	else if (cl > 0)
+		htc->body_status = BS_LENGTH;
+	else
+		htc->body_status = BS_EOF;
+	Lck_Unlock(&vp->mtx);
+	RFC2616_Response_Body(wrk, bo);
+
+	assert(bo->vfc->resp == bo->beresp);
+	if (htc->body_status != BS_NONE && htc->body_status != BS_ERROR) {
+		vfe = VFP_Push(bo->vfc, &v2f_vfp);
+		if (vfe == NULL) {
+			VSLb(bo->vsl, SLT_FetchError, "overflow");
+			htc->doclose = SC_RX_OVERFLOW;
+			return (-1);
+		}
+		vfe->priv1 = s;
+	}
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * Give the stream back, resetting it if the response did not complete.
+ * Returns non-zero if the connection stays in service.
+ */
+
+int
+V2F_Finish(struct v2f_stream **sp)
+{
+	struct v2f_stream *s;
+	struct v2f_conn *vc;
+	struct v2f_pool *vp;
+	struct v2f_chunk *ch;
+	int rst, alive, rx_done, free_it;
+
+	TAKE_OBJ_NOTNULL(s, sp, V2F_STREAM_MAGIC);
+	vc = s->conn;
+	CHECK_OBJ_NOTNULL(vc, V2F_CONN_MAGIC);
+	vp = vc->pool;
+
+	Lck_Lock(&vp->mtx);
+	assert(s->hdrs != V2F_HDRS_DECODING);
+	rst = s->id != 0 && !s->end_stream && s->error == NULL &&
+	    !vc->rx_done;
+	while ((ch = VTAILQ_FIRST(&s->data)) != NULL) {
+		VTAILQ_REMOVE(&s->data, ch, list);
+		vc->r_credit += ch->len;
+		free(ch);
+	}
+	alive = !vc->dead;
+	rx_done = vc->rx_done;
+	Lck_Unlock(&vp->mtx);
+
+	/* Our stream keeps the connection from being freed under us */
+	if (rst) {
+		Lck_Lock(&vc->txmtx);
+		(void)v2f_tx_u32(vc, V2F_RST_STREAM, s->id,
+		    H2SE_CANCEL->val);
+		v2f_tx_rel(vc);
+	} else if (!rx_done && v2f_tx_want(vc) &&
+	    !Lck_Trylock(&vc->txmtx)) {
+		v2f_tx_rel(vc);
+	}
+
+	Lck_Lock(&vp->mtx);
+	free_it = v2f_del_stream(vc, s);
+	Lck_Unlock(&vp->mtx);
+
+	if (free_it)
+		v2f_conn_free(vc);
+	return (alive);
+}
+
+/*--------------------------------------------------------------------*/
+
+struct v2f_pool *
+V2F_NewPool(struct tcp_pool *tp)
+{
+	struct v2f_pool *vp;
+
+	AN(tp);
+	ALLOC_OBJ(vp, V2F_POOL_MAGIC);
+	AN(vp);
+	Lck_New(&vp->mtx, lck_backend_h2);
+	VTAILQ_INIT(&vp->conns);
+	vp->tcp_pool = tp;
+	return (vp);
+}
+
+/*
+ * All fetches are done by now, tell the rx threads to close their
+ * connections and wait for them to be gone.
+ */
+
+void
+V2F_DelPool(struct v2f_pool **vpp)
+{
+	struct v2f_pool *vp;
+	struct v2f_conn *vc;
+
+	TAKE_OBJ_NOTNULL(vp, vpp, V2F_POOL_MAGIC);
+	Lck_Lock(&vp->mtx);
+	VTAILQ_FOREACH(vc, &vp->conns, list) {
+		AZ(vc->n_streams);
+		vc->dead = 1;
+		(void)shutdown(vc->fd, SHUT_RDWR);
+	}
+	while (vp->n_conn > 0) {
+		Lck_Unlock(&vp->mtx);
+		(void)usleep(10000);
+		Lck_Lock(&vp->mtx);
+	}
+	Lck_Unlock(&vp->mtx);
+	Lck_Delete(&vp->mtx);
+	FREE_OBJ(vp);
+}
@@ -90,7 +90,7 @@ h2h_checkhdr(const struct http *hp, const char *b, size_t namelen, size_t len)
 }
 
 static h2_error
-h2h_addhdr(struct http *hp, char *b, size_t namelen, size_t len)
+h2h_addhdr(struct http *hp, char *b, size_t namelen, size_t len, int resp)
 {
 	/* XXX: This might belong in cache/cache_http.c */
 	unsigned n;
@@ -105,7 +105,19 @@ h2h_addhdr(struct http *hp, char *b, size_t namelen, size_t len)
 		return (H2SE_ENHANCE_YOUR_CALM);
 	}
 
-	if (b[0] == ':') {
+	if (b[0] == ':' && resp) {
+		/* Responses only have the one pseudo-header */
+		if (!strncmp(b, ":status: ", namelen)) {
+			b += namelen;
+			len -= namelen;
+			n = HTTP_HDR_STATUS;
+		} else {
+			VSLb(hp->vsl, SLT_BogoHeader,
+			    "Unknown pseudo-header: %.*s",
+			    (int)(len > 20 ? 20 : len), b);
+			return (H2SE_PROTOCOL_ERROR);	// rfc7540,l,3073,3075
+		}
+	} else if (b[0] == ':') {
 		/* Match H/2 pseudo headers */
 		/* XXX: Should probably have some include tbl for
 		   pseudo-headers */
@@ -163,28 +175,47 @@ h2h_addhdr(struct http *hp, char *b, size_t namelen, size_t len)
 	return (0);
 }
 
+/*
+ * Decode a header block into an arbitrary struct http, using the given
+ * dynamic table.  The h2h_decode_{init,fini,bytes}() functions below
+ * are the client side request wrappers, the backend side (which decodes
+ * responses) calls these directly.
+ */
+
 void
-h2h_decode_init(const struct h2_sess *h2)
+h2h_decode_http_init(struct h2h_decode *d, struct http *hp,
+    struct vht_table *tbl, int resp)
 {
-	struct h2h_decode *d;
 
-	CHECK_OBJ_NOTNULL(h2, H2_SESS_MAGIC);
-	CHECK_OBJ_NOTNULL(h2->new_req, REQ_MAGIC);
-	CHECK_OBJ_NOTNULL(h2->new_req->http, HTTP_MAGIC);
-	AN(h2->decode);
-	d = h2->decode;
+	AN(d);
+	CHECK_OBJ_NOTNULL(hp, HTTP_MAGIC);
+	CHECK_OBJ_NOTNULL(tbl, VHT_TABLE_MAGIC);
 	INIT_OBJ(d, H2H_DECODE_MAGIC);
 	VHD_Init(d->vhd);
-	d->out_l = WS_ReserveAll(h2->new_req->http->ws);
+	d->hp = hp;
+	d->tbl = tbl;
+	d->resp = resp;
+	d->out_l = WS_ReserveAll(hp->ws);
 	/*
 	 * Can't do any work without any buffer
 	 * space. Require non-zero size.
 	 */
 	XXXAN(d->out_l);
-	d->out = h2->new_req->http->ws->f;
+	d->out = hp->ws->f;
 	d->reset = d->out;
 }
 
+void
+h2h_decode_init(const struct h2_sess *h2)
+{
+
+	CHECK_OBJ_NOTNULL(h2, H2_SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(h2->new_req, REQ_MAGIC);
+	AN(h2->decode);
+	h2h_decode_http_init(h2->decode, h2->new_req->http,
+	    TRUST_ME(h2->dectbl), 0);
+}
+
 /* Possible error returns:
  *
  * H2E_COMPRESSION_ERROR: Lost compression state due to incomplete header
@@ -194,20 +225,17 @@ h2h_decode_init(const struct h2_sess *h2)
  * is a stream level error.
  */
 h2_error
-h2h_decode_fini(const struct h2_sess *h2)
+h2h_decode_http_fini(struct h2h_decode *d)
 {
 	h2_error ret;
-	struct h2h_decode *d;
 
-	CHECK_OBJ_NOTNULL(h2, H2_SESS_MAGIC);
-	d = h2->decode;
-	CHECK_OBJ_NOTNULL(h2->new_req, REQ_MAGIC);
 	CHECK_OBJ_NOTNULL(d, H2H_DECODE_MAGIC);
-	WS_ReleaseP(h2->new_req->http->ws, d->out);
+	CHECK_OBJ_NOTNULL(d->hp, HTTP_MAGIC);
+	WS_ReleaseP(d->hp->ws, d->out);
 	if (d->vhd_ret != VHD_OK) {
 		/* HPACK header block didn't finish at an instruction
 		   boundary */
-		VSLb(h2->new_req->http->vsl, SLT_BogoHeader,
+		VSLb(d->hp->vsl, SLT_BogoHeader,
 		    "HPACK compression error/fini (%s)", VHD_Error(d->vhd_ret));
 		ret = H2CE_COMPRESSION_ERROR;
 	} else
@@ -216,6 +244,15 @@ h2h_decode_fini(const struct h2_sess *h2)
 	return (ret);
 }
 
+h2_error
+h2h_decode_fini(const struct h2_sess *h2)
+{
+
+	CHECK_OBJ_NOTNULL(h2, H2_SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(h2->new_req, REQ_MAGIC);
+	return (h2h_decode_http_fini(h2->decode));
+}
+
 /* Possible error returns:
  *
  * H2E_COMPRESSION_ERROR: Lost compression state due to invalid header
@@ -224,20 +261,16 @@ h2h_decode_fini(const struct h2_sess *h2)
  * H2E_PROTOCOL_ERROR: Malformed header or duplicate pseudo-header.
  */
 h2_error
-h2h_decode_bytes(struct h2_sess *h2, const uint8_t *in, size_t in_l)
+h2h_decode_http_bytes(struct h2h_decode *d, const uint8_t *in, size_t in_l)
 {
 	struct http *hp;
-	struct h2h_decode *d;
 	size_t in_u = 0;
 
-	CHECK_OBJ_NOTNULL(h2, H2_SESS_MAGIC);
-	CHECK_OBJ_NOTNULL(h2->new_req, REQ_MAGIC);
-	hp = h2->new_req->http;
+	CHECK_OBJ_NOTNULL(d, H2H_DECODE_MAGIC);
+	hp = d->hp;
 	CHECK_OBJ_NOTNULL(hp, HTTP_MAGIC);
 	CHECK_OBJ_NOTNULL(hp->ws, WS_MAGIC);
 	AN(hp->ws->r);
-	d = h2->decode;
-	CHECK_OBJ_NOTNULL(d, H2H_DECODE_MAGIC);
 
 	/* Only H2E_ENHANCE_YOUR_CALM indicates that we should continue
 	   processing. Other errors should have been returned and handled
@@ -247,7 +280,7 @@ h2h_decode_bytes(struct h2_sess *h2, const uint8_t *in, size_t in_l)
 	while (1) {
 		AN(d->out);
 		assert(d->out_u <= d->out_l);
-		d->vhd_ret = VHD_Decode(d->vhd, h2->dectbl, in, in_l, &in_u,
+		d->vhd_ret = VHD_Decode(d->vhd, d->tbl, in, in_l, &in_u,
 		    d->out, d->out_l, &d->out_u);
 
 		if (d->vhd_ret < 0) {
@@ -293,7 +326,8 @@ h2h_decode_bytes(struct h2_sess *h2, const uint8_t *in, size_t in_l)
 			    d->out_u);
 			if (d->error)
 				break;
-			d->error = h2h_addhdr(hp, d->out, d->namelen, d->out_u);
+			d->error = h2h_addhdr(hp, d->out, d->namelen, d->out_u,
+			    d->resp);
 			if (d->error)
 				break;
 			d->out[d->out_u++] = '\0'; /* Zero guard */
@@ -327,3 +361,14 @@ h2h_decode_bytes(struct h2_sess *h2, const uint8_t *in, size_t in_l)
 			       complete header block */
 	return (d->error);
 }
+
+h2_error
+h2h_decode_bytes(struct h2_sess *h2, const uint8_t *in, size_t in_l)
+{
+
+	CHECK_OBJ_NOTNULL(h2, H2_SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(h2->new_req, REQ_MAGIC);
+	CHECK_OBJ_NOTNULL(h2->decode, H2H_DECODE_MAGIC);
+	assert(h2->decode->hp == h2->new_req->http);
+	return (h2h_decode_http_bytes(h2->decode, in, in_l));
+}
@@ -96,7 +96,7 @@ static const h2_error stream_errors[] = {
 
 #define NSTREAMERRORS (sizeof(stream_errors)/sizeof(stream_errors[0]))
 
-static h2_error
+h2_error
 h2_streamerror(uint32_t u)
 {
 	if (u < NSTREAMERRORS && stream_errors[u] != NULL)
@@ -431,6 +431,15 @@ static const struct h2_setting_s * const h2_setting_tbl[] = {
 
 #define H2_SETTING_TBL_LEN (sizeof(h2_setting_tbl)/sizeof(h2_setting_tbl[0]))
 
+const struct h2_setting_s *
+h2_setting_lookup(uint16_t x)
+{
+
+	if (x >= H2_SETTING_TBL_LEN)
+		return (NULL);
+	return (h2_setting_tbl[x]);
+}
+
 static void
 h2_win_adjust(const struct h2_sess *h2, uint32_t oldval, uint32_t newval)
 {
@@ -467,7 +476,8 @@ h2_set_setting(struct h2_sess *h2, const uint8_t *d)
 
 	x = vbe16dec(d);
 	y = vbe32dec(d + 2);
-	if (x >= H2_SETTING_TBL_LEN || h2_setting_tbl[x] == NULL) {
+	s = h2_setting_lookup(x);
+	if (s == NULL) {
 		// rfc7540,l,2181,2182
 		Lck_Lock(&h2->sess->mtx);
 		VSLb(h2->vsl, SLT_Debug,
@@ -475,8 +485,6 @@ h2_set_setting(struct h2_sess *h2, const uint8_t *d)
 		Lck_Unlock(&h2->sess->mtx);
 		return (0);
 	}
-	s = h2_setting_tbl[x];
-	AN(s);
 	if (y < s->minval || y > s->maxval) {
 		Lck_Lock(&h2->sess->mtx);
 		VSLb(h2->vsl, SLT_Debug, "H2SETTING invalid %s=0x%08x",
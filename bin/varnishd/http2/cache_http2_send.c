@@ -188,7 +188,7 @@ h2_win_charge(struct h2_req *r2, const struct h2_sess *h2, uint32_t w)
 	h2->req0->t_window -= w;
 }
 
-static h2_error
+h2_error
 h2_errcheck(const struct h2_req *r2, const struct h2_sess *h2)
 {
 	CHECK_OBJ_NOTNULL(r2, H2_REQ_MAGIC);
@@ -273,8 +273,12 @@ H2_Send(struct worker *wrk, struct h2_req *r2,
 
 	assert(VTAILQ_FIRST(&h2->txqueue) == r2);
 
-	if (h2_errcheck(r2, h2))
+	if (h2_errcheck(r2, h2)) {
+		/* The peer never sees the encoder table changes */
+		if (ftyp == H2_F_HEADERS)
+			h2->enctbl_flush = 1;
 		return;
+	}
 
 	AN(ftyp);
 	AZ(flags & ~(ftyp->flags));
@@ -129,6 +129,16 @@ h2_init_sess(const struct worker *wrk, struct sess *sp,
 
 		AZ(VHT_Init(h2->dectbl,
 			h2->local_settings.header_table_size));
+		if (cache_param->h2_encoder_table_size > 0) {
+			AZ(VHT_Init(h2->enctbl,
+				cache_param->h2_encoder_table_size));
+			/* The client starts out with the default size */
+			h2->enctbl_size =
+			    H2_proto_settings.header_table_size;
+			if (h2->enctbl->protomax > h2->enctbl_size)
+				AZ(VHT_SetMaxTableSize(h2->enctbl,
+				    h2->enctbl_size));
+		}
 
 		SES_Reserve_proto_priv(sp, &up);
 		*up = (uintptr_t)h2;
@@ -149,6 +159,8 @@ h2_del_sess(struct worker *wrk, struct h2_sess *h2, enum sess_close reason)
 	assert(VTAILQ_EMPTY(&h2->streams));
 
 	VHT_Fini(h2->dectbl);
+	if (h2->enctbl->magic != 0)
+		VHT_Fini(h2->enctbl);
 	AZ(pthread_cond_destroy(h2->winupd_cond));
 	req = h2->srq;
 	AZ(req->ws->r);
@@ -48,6 +48,12 @@
 
 #include "mgt/mgt_param.h"
 
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(__linux__)
+#  define NUMA_FLAGS	(EXPERIMENTAL | MUST_RESTART)
+#else
+#  define NUMA_FLAGS	NOT_IMPLEMENTED
+#endif
+
 /*--------------------------------------------------------------------
  * The min/max values automatically update the opposites appropriate
  * limit, so they don't end up crossing.
@@ -217,6 +223,28 @@ struct parspec WRK_parspec[] = {
 		"be dropped instead of queued.",
 		EXPERIMENTAL,
 		"20", "" },
+	{ "thread_pool_steal", tweak_bool, &mgt_param.wthread_steal,
+		NULL, NULL,
+		"Let thread pools lend idle threads to each other.\n"
+		"\n"
+		"A new request which finds no idle thread in its own pool "
+		"is handed to an idle thread of another pool, and threads "
+		"running out of work take requests queued in other pools "
+		"before going idle.  Threads kept in reserve (see "
+		"thread_pool_reserve) are never lent out.",
+		EXPERIMENTAL,
+		"off", "bool" },
+	{ "thread_pool_numa", tweak_bool, &mgt_param.wthread_numa,
+		NULL, NULL,
+		"Bind thread pools to NUMA nodes.\n"
+		"\n"
+		"Pools are assigned to the NUMA nodes round robin, and all "
+		"threads of a pool, including its acceptors, are restricted "
+		"to the CPUs of its node.  Workspaces and the memory pools "
+		"of a pool are thereby allocated on its node.  Set "
+		"thread_pools to a multiple of the number of nodes.",
+		NUMA_FLAGS,
+		"off", "bool" },
 	{ "thread_pool_stack",
 		tweak_bytes, &mgt_param.wthread_stacksize,
 		NULL, NULL,
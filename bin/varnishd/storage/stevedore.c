@@ -127,6 +127,64 @@ STV_close(void)
 	}
 }
 
+/*-------------------------------------------------------------------
+ * Stevedores which mmap(2) a file register the mappings here, so that
+ * delivery can hand object data straight from the file to sendfile(2).
+ *
+ * Registration happens from the open method, before any worker threads
+ * run, so lookups need no locking.  Mappings which do not fit in the
+ * table are not found by STV_FileRange(), and their data is written
+ * like any other memory.
+ */
+
+#define STV_FILE_RANGES	64
+
+static struct stv_file_range {
+	const char	*ptr;
+	size_t		len;
+	int		fd;
+	off_t		off;
+} stv_file_range[STV_FILE_RANGES];
+static unsigned stv_n_file_range;
+
+int
+STV_AddFileRange(const void *ptr, size_t len, int fd, off_t off)
+{
+	struct stv_file_range *fr;
+
+	ASSERT_CLI();
+	AN(ptr);
+	assert(fd >= 0);
+	if (stv_n_file_range == STV_FILE_RANGES)
+		return (-1);
+	fr = &stv_file_range[stv_n_file_range++];
+	fr->ptr = ptr;
+	fr->len = len;
+	fr->fd = fd;
+	fr->off = off;
+	return (0);
+}
+
+int
+STV_FileRange(const void *ptr, size_t len, int *fdp, off_t *offp)
+{
+	const struct stv_file_range *fr;
+	const char *p = ptr;
+	unsigned u;
+
+	AN(fdp);
+	AN(offp);
+	for (u = 0; u < stv_n_file_range; u++) {
+		fr = &stv_file_range[u];
+		if (p < fr->ptr || p + len > fr->ptr + fr->len)
+			continue;
+		*fdp = fr->fd;
+		*offp = fr->off + (p - fr->ptr);
+		return (1);
+	}
+	return (0);
+}
+
 /*-------------------------------------------------------------------
  * Notify the stevedores of BAN related events. A non-zero return
  * value indicates that the stevedore is unable to persist the
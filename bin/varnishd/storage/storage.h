@@ -60,6 +60,14 @@ struct storage {
 	unsigned		space;
 };
 
+/* LRU eviction policies --------------------------------------------*/
+
+enum lru_policy {
+	LRU_POLICY_LRU = 0,
+	LRU_POLICY_CLOCK,
+	LRU_POLICY_S3FIFO,
+};
+
 /* Prototypes --------------------------------------------------------*/
 
 typedef void storage_init_f(struct stevedore *, int ac, char * const *av);
@@ -111,6 +119,7 @@ struct stevedore {
 
 	/* Only if LRU is used */
 	struct lru		*lru;
+	enum lru_policy		lru_policy;
 
 #define VRTSTVVAR(nm, vtype, ctype, dval) stv_var_##nm *var_##nm;
 #include "tbl/vrt_stv_var.h"
@@ -135,9 +144,11 @@ int STV__iter(struct stevedore ** const );
 int STV_GetFile(const char *fn, int *fdp, const char **fnp, const char *ctx);
 uintmax_t STV_FileSize(int fd, const char *size, unsigned *granularity,
     const char *ctx);
+int STV_AddFileRange(const void *ptr, size_t len, int fd, off_t off);
 
 /*--------------------------------------------------------------------*/
-struct lru *LRU_Alloc(void);
+int LRU_Arg(struct stevedore *, int ac, char * const *av, const char *ctx);
+struct lru *LRU_Alloc(const struct stevedore *);
 void LRU_Free(struct lru **);
 void LRU_Add(struct objcore *, vtim_real now);
 void LRU_Remove(struct objcore *);
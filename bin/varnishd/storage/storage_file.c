@@ -103,6 +103,7 @@ struct smf_sc {
 	struct smfhead		order;
 	struct smfhead		free[NBUCKET];
 	struct smfhead		used;
+	uintmax_t		nosendfile;
 };
 
 /*--------------------------------------------------------------------*/
@@ -117,6 +118,7 @@ smf_init(struct stevedore *parent, int ac, char * const *av)
 	int advice = MADV_RANDOM;
 
 	AZ(av[ac]);
+	ac = LRU_Arg(parent, ac, av, "-sfile");
 
 	size = NULL;
 	page_size = getpagesize();
@@ -384,6 +386,8 @@ smf_open_chunk(struct smf_sc *sc, off_t sz, off_t off, off_t *fail, off_t *sum)
 			(void)madvise(p, sz, sc->advice);
 			(*sum) += sz;
 			new_smf(sc, p, off, sz);
+			if (STV_AddFileRange(p, sz, sc->fd, off))
+				sc->nosendfile += sz;
 			return;
 		}
 	}
@@ -408,7 +412,7 @@ smf_open(struct stevedore *st)
 	off_t sum = 0;
 
 	ASSERT_CLI();
-	st->lru = LRU_Alloc();
+	st->lru = LRU_Alloc(st);
 	if (lck_smf == NULL)
 		lck_smf = Lck_CreateClass(NULL, "smf");
 	CAST_OBJ_NOTNULL(sc, st->priv, SMF_SC_MAGIC);
@@ -419,6 +423,9 @@ smf_open(struct stevedore *st)
 	Lck_Unlock(&sc->mtx);
 	printf("SMF.%s mmap'ed %ju bytes of %ju\n",
 	    st->ident, (uintmax_t)sum, sc->filesize);
+	if (sc->nosendfile > 0)
+		printf("SMF.%s %ju bytes in too many chunks for sendfile\n",
+		    st->ident, sc->nosendfile);
 
 	/* XXX */
 	if (sum < MINPAGES * (off_t)getpagesize())
@@ -26,42 +26,173 @@
  * SUCH DAMAGE.
  *
  * Least-Recently-Used logic for freeing space in stevedores.
+ *
+ * Three eviction policies are implemented on top of the (sharded) lists:
+ *
+ * lru:    Classic LRU, objects are moved to the tail of the list when
+ *         they are used, at most once per lru_interval.
+ *
+ * clock:  Objects are never moved on use, only a reference bit is set
+ *         without taking any lock.  When space is needed the "hand"
+ *         walks from the head of the list, giving referenced objects
+ *         a second chance by clearing the bit and moving them to the
+ *         tail.
+ *
+ * s3fifo: New objects go into a small FIFO queue, and are promoted
+ *         to the main queue if they are used before they reach its
+ *         head.  The main queue is a CLOCK with a two bit frequency
+ *         counter.  One-hit-wonders are thus evicted quickly without
+ *         disturbing the established working set.  Unlike the
+ *         original S3-FIFO we keep no ghost queue of evicted objects.
  */
 
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cache/cache_varnishd.h"
 #include "cache/cache_objhead.h"
+#include "common/heritage.h"
 
 #include "storage/storage.h"
 
-struct lru {
+#include "VSC_lru.h"
+
+#define LRU_Q_MAIN		0
+#define LRU_Q_SMALL		1
+
+/* Share of the objects on a shard the s3fifo small queue may hold */
+#define LRU_SMALL_PCT		10
+
+static const struct lru_policy_name {
+	const char		*name;
+	enum lru_policy		policy;
+	uint8_t			ref_max;
+} lru_policies[] = {
+	{ "lru",	LRU_POLICY_LRU,		0 },
+	{ "clock",	LRU_POLICY_CLOCK,	1 },
+	{ "s3fifo",	LRU_POLICY_S3FIFO,	3 },
+	{ NULL,		LRU_POLICY_LRU,		0 }
+};
+
+struct lru_shard {
 	unsigned		magic;
-#define LRU_MAGIC		0x3fec7bb0
+#define LRU_SHARD_MAGIC		0x5e1a7b23
 	VTAILQ_HEAD(,objcore)	lru_head;
+	VTAILQ_HEAD(,objcore)	small_head;
+	unsigned		n_obj;
+	unsigned		n_small;
 	struct lock		mtx;
+	struct VSC_lru		*vsc;
+	struct vsc_seg		*vsc_seg;
+};
+
+struct lru {
+	unsigned		magic;
+#define LRU_MAGIC		0x3fec7bb0
+	enum lru_policy		policy;
+	uint8_t			ref_max;
+	unsigned		nshard;
+	unsigned		next;
+	struct lru_shard	*shard;
 };
 
-static struct lru *
+static struct lru_shard *
+lru_shard(const struct lru *lru, const struct objcore *oc)
+{
+	uintptr_t u;
+
+	CHECK_OBJ_NOTNULL(lru, LRU_MAGIC);
+	if (lru->nshard == 1)
+		return (&lru->shard[0]);
+
+	/*
+	 * The objcore address is stable for the lifetime of the object,
+	 * mix it up a bit so allocator alignment does not bias the shard.
+	 */
+	u = (uintptr_t)oc >> 4;
+	u ^= u >> 17;
+	u *= 0x9e3779b1U;
+	return (&lru->shard[(u >> 7) % lru->nshard]);
+}
+
+static struct lru_shard *
 lru_get(const struct objcore *oc)
 {
+	struct lru_shard *ls;
+
 	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
 	CHECK_OBJ_NOTNULL(oc->stobj->stevedore, STEVEDORE_MAGIC);
-	CHECK_OBJ_NOTNULL(oc->stobj->stevedore->lru, LRU_MAGIC);
-	return (oc->stobj->stevedore->lru);
+	ls = lru_shard(oc->stobj->stevedore->lru, oc);
+	CHECK_OBJ_NOTNULL(ls, LRU_SHARD_MAGIC);
+	return (ls);
+}
+
+/*--------------------------------------------------------------------
+ * Consume a trailing "policy=<name>" argument to a storage backend.
+ * Returns the number of remaining arguments.
+ */
+
+int
+LRU_Arg(struct stevedore *stv, int ac, char * const *av, const char *ctx)
+{
+	const struct lru_policy_name *lp;
+	const char *p;
+
+	ASSERT_MGT();
+	CHECK_OBJ_NOTNULL(stv, STEVEDORE_MAGIC);
+	AN(ctx);
+	AZ(av[ac]);
+
+	if (ac == 0 || strncmp(av[ac - 1], "policy=", 7))
+		return (ac);
+	p = av[ac - 1] + 7;
+	for (lp = lru_policies; lp->name != NULL; lp++)
+		if (!strcmp(p, lp->name))
+			break;
+	if (lp->name == NULL)
+		ARGV_ERR("(%s) unknown policy \"%s\" "
+		    "(must be lru, clock or s3fifo)\n", ctx, p);
+	stv->lru_policy = lp->policy;
+	return (ac - 1);
 }
 
+/*--------------------------------------------------------------------*/
+
 struct lru *
-LRU_Alloc(void)
+LRU_Alloc(const struct stevedore *stv)
 {
+	const struct lru_policy_name *lp;
 	struct lru *lru;
+	struct lru_shard *ls;
+	unsigned u;
 
+	CHECK_OBJ_NOTNULL(stv, STEVEDORE_MAGIC);
+	AN(stv->ident);
 	ALLOC_OBJ(lru, LRU_MAGIC);
 	AN(lru);
-	VTAILQ_INIT(&lru->lru_head);
-	Lck_New(&lru->mtx, lck_lru);
+	for (lp = lru_policies; lp->name != NULL; lp++)
+		if (lp->policy == stv->lru_policy)
+			break;
+	AN(lp->name);
+	lru->policy = lp->policy;
+	lru->ref_max = lp->ref_max;
+	lru->nshard = cache_param->lru_shards;
+	if (lru->nshard == 0)
+		lru->nshard = 1;
+	lru->shard = calloc(lru->nshard, sizeof *lru->shard);
+	AN(lru->shard);
+	for (u = 0; u < lru->nshard; u++) {
+		ls = &lru->shard[u];
+		ls->magic = LRU_SHARD_MAGIC;
+		VTAILQ_INIT(&ls->lru_head);
+		VTAILQ_INIT(&ls->small_head);
+		Lck_New(&ls->mtx, lck_lru);
+		ls->vsc = VSC_lru_New(NULL, &ls->vsc_seg,
+		    "%s.%u", stv->ident, u);
+	}
 	return (lru);
 }
 
@@ -69,19 +200,28 @@ void
 LRU_Free(struct lru **pp)
 {
 	struct lru *lru;
+	struct lru_shard *ls;
+	unsigned u;
 
 	TAKE_OBJ_NOTNULL(lru, pp, LRU_MAGIC);
-	Lck_Lock(&lru->mtx);
-	AN(VTAILQ_EMPTY(&lru->lru_head));
-	Lck_Unlock(&lru->mtx);
-	Lck_Delete(&lru->mtx);
+	for (u = 0; u < lru->nshard; u++) {
+		ls = &lru->shard[u];
+		CHECK_OBJ(ls, LRU_SHARD_MAGIC);
+		Lck_Lock(&ls->mtx);
+		AN(VTAILQ_EMPTY(&ls->lru_head));
+		AN(VTAILQ_EMPTY(&ls->small_head));
+		Lck_Unlock(&ls->mtx);
+		Lck_Delete(&ls->mtx);
+		VSC_lru_Destroy(&ls->vsc_seg);
+	}
+	free(lru->shard);
 	FREE_OBJ(lru);
 }
 
 void
 LRU_Add(struct objcore *oc, vtim_real now)
 {
-	struct lru *lru;
+	struct lru_shard *ls;
 
 	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
 
@@ -91,19 +231,28 @@ LRU_Add(struct objcore *oc, vtim_real now)
 	AZ(oc->boc);
 	AN(isnan(oc->last_lru));
 	AZ(isnan(now));
-	lru = lru_get(oc);
-	CHECK_OBJ_NOTNULL(lru, LRU_MAGIC);
-	Lck_Lock(&lru->mtx);
-	VTAILQ_INSERT_TAIL(&lru->lru_head, oc, lru_list);
+	ls = lru_get(oc);
+	oc->lru_ref = 0;
+	Lck_Lock(&ls->mtx);
+	if (oc->stobj->stevedore->lru->policy == LRU_POLICY_S3FIFO) {
+		VTAILQ_INSERT_TAIL(&ls->small_head, oc, lru_list);
+		oc->lru_queue = LRU_Q_SMALL;
+		ls->n_small++;
+	} else {
+		VTAILQ_INSERT_TAIL(&ls->lru_head, oc, lru_list);
+		oc->lru_queue = LRU_Q_MAIN;
+	}
 	oc->last_lru = now;
 	AZ(isnan(oc->last_lru));
-	Lck_Unlock(&lru->mtx);
+	ls->vsc->g_objects = ++ls->n_obj;
+	ls->vsc->g_small = ls->n_small;
+	Lck_Unlock(&ls->mtx);
 }
 
 void
 LRU_Remove(struct objcore *oc)
 {
-	struct lru *lru;
+	struct lru_shard *ls;
 
 	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
 
@@ -111,19 +260,28 @@ LRU_Remove(struct objcore *oc)
 		return;
 
 	AZ(oc->boc);
-	lru = lru_get(oc);
-	CHECK_OBJ_NOTNULL(lru, LRU_MAGIC);
-	Lck_Lock(&lru->mtx);
+	ls = lru_get(oc);
+	Lck_Lock(&ls->mtx);
 	AZ(isnan(oc->last_lru));
-	VTAILQ_REMOVE(&lru->lru_head, oc, lru_list);
+	if (oc->lru_queue == LRU_Q_SMALL) {
+		VTAILQ_REMOVE(&ls->small_head, oc, lru_list);
+		AN(ls->n_small);
+		ls->n_small--;
+	} else {
+		VTAILQ_REMOVE(&ls->lru_head, oc, lru_list);
+	}
 	oc->last_lru = NAN;
-	Lck_Unlock(&lru->mtx);
+	AN(ls->n_obj);
+	ls->vsc->g_objects = --ls->n_obj;
+	ls->vsc->g_small = ls->n_small;
+	Lck_Unlock(&ls->mtx);
 }
 
 void v_matchproto_(objtouch_f)
 LRU_Touch(struct worker *wrk, struct objcore *oc, vtim_real now)
 {
 	struct lru *lru;
+	struct lru_shard *ls;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
@@ -131,68 +289,251 @@ LRU_Touch(struct worker *wrk, struct objcore *oc, vtim_real now)
 	if (oc->flags & OC_F_PRIVATE || isnan(oc->last_lru))
 		return;
 
+	lru = oc->stobj->stevedore->lru;
+	CHECK_OBJ_NOTNULL(lru, LRU_MAGIC);
+
+	if (lru->policy != LRU_POLICY_LRU) {
+		/*
+		 * The reference count is only a hint to the eviction
+		 * hand, so we update it without locking and accept the
+		 * occasional lost update.  Only write when it changes to
+		 * not dirty the cache line on every hit.
+		 * The delivery of the fetch which created the object also
+		 * touches it, that does not count as a reference.
+		 */
+		if (oc->hits > 0 && oc->lru_ref < lru->ref_max)
+			oc->lru_ref++;
+		return;
+	}
+
 	/*
-	 * To avoid the exphdl->mtx becoming a hotspot, we only
+	 * To avoid the lru->mtx becoming a hotspot, we only
 	 * attempt to move objects if they have not been moved
 	 * recently and if the lock is available.  This optimization
 	 * obviously leaves the LRU list imperfectly sorted.
+	 * With lru_shards > 1 the lock is only shared with the
+	 * objects which hash to the same shard.
 	 */
 
 	if (now - oc->last_lru < cache_param->lru_interval)
 		return;
 
-	lru = lru_get(oc);
-	CHECK_OBJ_NOTNULL(lru, LRU_MAGIC);
+	ls = lru_shard(lru, oc);
+	CHECK_OBJ_NOTNULL(ls, LRU_SHARD_MAGIC);
 
-	if (Lck_Trylock(&lru->mtx))
+	if (Lck_Trylock(&ls->mtx)) {
+		ls->vsc->c_skipped++;	// racy, but only for statistics
 		return;
+	}
 
 	if (!isnan(oc->last_lru)) {
-		VTAILQ_REMOVE(&lru->lru_head, oc, lru_list);
-		VTAILQ_INSERT_TAIL(&lru->lru_head, oc, lru_list);
-		VSC_C_main->n_lru_moved++;
+		VTAILQ_REMOVE(&ls->lru_head, oc, lru_list);
+		VTAILQ_INSERT_TAIL(&ls->lru_head, oc, lru_list);
+		wrk->stats->n_lru_moved++;
+		ls->vsc->c_moved++;
 		oc->last_lru = now;
 	}
-	Lck_Unlock(&lru->mtx);
+	Lck_Unlock(&ls->mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Try to snipe one candidate, which the caller has already moved to
+ * the tail of its queue.
+ */
+
+static int
+lru_snipe(struct worker *wrk, struct lru_shard *ls, struct objcore *oc)
+{
+
+	Lck_AssertHeld(&ls->mtx);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	AZ(isnan(oc->last_lru));
+
+	VSLb(wrk->vsl, SLT_ExpKill, "LRU_Cand p=%p f=0x%x r=%d",
+	    oc, oc->flags, oc->refcnt);
+
+	if (!HSH_Snipe(wrk, oc))
+		return (0);
+	wrk->stats->n_lru_nuked++;
+	ls->vsc->c_nuked++;
+	return (1);
+}
+
+/*--------------------------------------------------------------------
+ * Attempt to nuke the oldest object on one LRU shard which isn't in use.
+ */
+
+static struct objcore *
+lru_nuke_lru(struct worker *wrk, struct lru_shard *ls)
+{
+	struct objcore *oc, *oc2;
+
+	VTAILQ_FOREACH_SAFE(oc, &ls->lru_head, lru_list, oc2) {
+		if (lru_snipe(wrk, ls, oc)) {
+			VTAILQ_REMOVE(&ls->lru_head, oc, lru_list);
+			VTAILQ_INSERT_TAIL(&ls->lru_head, oc, lru_list);
+			break;
+		}
+	}
+	return (oc);
+}
+
+/*--------------------------------------------------------------------
+ * Sweep the clock hand, which for us is the head of the list, until we
+ * find an unreferenced object which isn't in use.  Every object is
+ * visited at most twice, once to clear its reference and once more to
+ * attempt to nuke it.
+ */
+
+static struct objcore *
+lru_nuke_clock(struct worker *wrk, struct lru_shard *ls)
+{
+	struct objcore *oc;
+	unsigned n;
+
+	for (n = 2 * ls->n_obj; n > 0; n--) {
+		oc = VTAILQ_FIRST(&ls->lru_head);
+		if (oc == NULL)
+			break;
+		VTAILQ_REMOVE(&ls->lru_head, oc, lru_list);
+		VTAILQ_INSERT_TAIL(&ls->lru_head, oc, lru_list);
+		if (oc->lru_ref > 0) {
+			oc->lru_ref = 0;
+			ls->vsc->c_moved++;
+			continue;
+		}
+		if (lru_snipe(wrk, ls, oc))
+			return (oc);
+	}
+	return (NULL);
+}
+
+/*--------------------------------------------------------------------
+ * S3-FIFO: Evict from the small queue while it holds more than its
+ * share, promoting used objects to the main queue, otherwise run the
+ * clock on the main queue with the frequency counter.
+ */
+
+static struct objcore *
+lru_nuke_s3fifo(struct worker *wrk, struct lru_shard *ls)
+{
+	struct objcore *oc;
+	unsigned n;
+
+	for (n = 2 * ls->n_obj; n > 0; n--) {
+		if (ls->n_small > 0 &&
+		    (ls->n_small * 100 >= ls->n_obj * LRU_SMALL_PCT ||
+		    VTAILQ_EMPTY(&ls->lru_head))) {
+			oc = VTAILQ_FIRST(&ls->small_head);
+			CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+			assert(oc->lru_queue == LRU_Q_SMALL);
+			VTAILQ_REMOVE(&ls->small_head, oc, lru_list);
+			if (oc->lru_ref > 0) {
+				oc->lru_ref = 0;
+				oc->lru_queue = LRU_Q_MAIN;
+				ls->n_small--;
+				VTAILQ_INSERT_TAIL(&ls->lru_head, oc, lru_list);
+				ls->vsc->c_promoted++;
+				continue;
+			}
+			VTAILQ_INSERT_TAIL(&ls->small_head, oc, lru_list);
+		} else {
+			oc = VTAILQ_FIRST(&ls->lru_head);
+			if (oc == NULL)
+				break;
+			assert(oc->lru_queue == LRU_Q_MAIN);
+			VTAILQ_REMOVE(&ls->lru_head, oc, lru_list);
+			VTAILQ_INSERT_TAIL(&ls->lru_head, oc, lru_list);
+			if (oc->lru_ref > 0) {
+				oc->lru_ref--;
+				ls->vsc->c_moved++;
+				continue;
+			}
+		}
+		if (lru_snipe(wrk, ls, oc))
+			return (oc);
+	}
+	return (NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+static struct objcore *
+lru_nuke_shard(struct worker *wrk, const struct lru *lru,
+    struct lru_shard *ls)
+{
+	struct objcore *oc;
+
+	CHECK_OBJ_NOTNULL(ls, LRU_SHARD_MAGIC);
+	Lck_Lock(&ls->mtx);
+	switch (lru->policy) {
+	case LRU_POLICY_CLOCK:
+		oc = lru_nuke_clock(wrk, ls);
+		break;
+	case LRU_POLICY_S3FIFO:
+		oc = lru_nuke_s3fifo(wrk, ls);
+		break;
+	default:
+		oc = lru_nuke_lru(wrk, ls);
+		break;
+	}
+	if (oc == NULL)
+		ls->vsc->c_nuke_fail++;
+	ls->vsc->g_small = ls->n_small;
+	Lck_Unlock(&ls->mtx);
+	return (oc);
 }
 
 /*--------------------------------------------------------------------
  * Attempt to make space by nuking the oldest object on the LRU list
  * which isn't in use.
+ *
+ * With multiple shards, the lru policy starts with the shard holding
+ * the least recently used object, the others just take turns.  If
+ * every object on that shard is busy we try the next one.
+ *
  * Returns: 1: did, 0: didn't;
  */
 
 int
 LRU_NukeOne(struct worker *wrk, struct lru *lru)
 {
-	struct objcore *oc, *oc2;
+	struct objcore *oc = NULL;
+	struct lru_shard *ls;
+	vtim_real t, oldest = NAN;
+	unsigned u, n, first;
 
 	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
 	CHECK_OBJ_NOTNULL(lru, LRU_MAGIC);
 
 	if (wrk->strangelove-- <= 0) {
 		VSLb(wrk->vsl, SLT_ExpKill, "LRU reached nuke_limit");
-		VSC_C_main->n_lru_limited++;
+		wrk->stats->n_lru_limited++;
 		return (0);
 	}
 
-	/* Find the first currently unused object on the LRU.  */
-	Lck_Lock(&lru->mtx);
-	VTAILQ_FOREACH_SAFE(oc, &lru->lru_head, lru_list, oc2) {
-		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
-		AZ(isnan(oc->last_lru));
-
-		VSLb(wrk->vsl, SLT_ExpKill, "LRU_Cand p=%p f=0x%x r=%d",
-		    oc, oc->flags, oc->refcnt);
-
-		if (HSH_Snipe(wrk, oc)) {
-			VSC_C_main->n_lru_nuked++; // XXX per lru ?
-			VTAILQ_REMOVE(&lru->lru_head, oc, lru_list);
-			VTAILQ_INSERT_TAIL(&lru->lru_head, oc, lru_list);
-			break;
+	/* The hint is racy, it only serves to spread the load */
+	first = lru->nshard > 1 ? lru->next++ % lru->nshard : 0;
+
+	if (lru->nshard > 1 && lru->policy == LRU_POLICY_LRU) {
+		for (n = 0; n < lru->nshard; n++) {
+			u = (first + n) % lru->nshard;
+			ls = &lru->shard[u];
+			Lck_Lock(&ls->mtx);
+			oc = VTAILQ_FIRST(&ls->lru_head);
+			t = oc != NULL ? oc->last_lru : NAN;
+			Lck_Unlock(&ls->mtx);
+			if (!isnan(t) && (isnan(oldest) || t < oldest)) {
+				oldest = t;
+				first = u;
+			}
 		}
+		oc = NULL;
 	}
-	Lck_Unlock(&lru->mtx);
+
+	for (n = 0; oc == NULL && n < lru->nshard; n++)
+		oc = lru_nuke_shard(wrk, lru,
+		    &lru->shard[(first + n) % lru->nshard]);
 
 	if (oc == NULL) {
 		VSLb(wrk->vsl, SLT_ExpKill, "LRU_Fail");
@@ -27,6 +27,26 @@
  * SUCH DAMAGE.
  *
  * Storage method based on malloc(3)
+ *
+ * To keep allocation and freeing off the stevedore-wide lock, the
+ * accounting is split into stripes, one per CPU.  Where the CPU cannot
+ * be told, each thread sticks to one stripe instead.
+ *
+ * Each stripe reserves space from the stevedore in batches ("credit")
+ * and allocates from that, and it collects the statistics deltas which
+ * are folded into the VSC counters whenever the stevedore lock is taken
+ * for credit anyway, after SMA_FLUSH operations, and by a background
+ * thread every SMA_FLUSH_INTERVAL so the counters settle when idle.
+ *
+ * Segments whose size is exactly one of the size classes, which is the
+ * case for fetch_chunksize'd allocations and most small ones, are
+ * returned to the stripe they were allocated from when freed, and kept
+ * there for reuse up to a limit, so that the memory they occupy is
+ * bounded and visible in the g_cache counter.  Sizes are never rounded
+ * up, the space of a segment is exactly what was asked for.
+ * Only when a stripe runs out of credit and the stevedore has no more
+ * space, the stripes give back their credit and cached segments, one
+ * stripe at a time until the allocation fits.
  */
 
 #include "config.h"
@@ -34,23 +54,73 @@
 #include "cache/cache_varnishd.h"
 #include "common/heritage.h"
 
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "storage/storage.h"
 #include "storage/storage_simple.h"
 
 #include "vnum.h"
+#include "vtim.h"
 
 #include "VSC_sma.h"
 
+/*
+ * Size classes: 16 byte steps up to 1KB, then eight classes per power
+ * of two up to SMA_CLASS_MAX.
+ */
+#define SMA_CLASS_SMALL		1024
+#define SMA_CLASS_MAX		65536
+#define SMA_NCLASS		(SMA_CLASS_SMALL / 16 + 6 * 8)
+
+#define SMA_MAX_STRIPES		64
+#define SMA_FLUSH		64
+#define SMA_FLUSH_INTERVAL	0.1
+
+/* Upper limits, scaled down for small stevedores */
+#define SMA_CREDIT		(256 * 1024)
+#define SMA_CACHE		(1024 * 1024)
+
+VTAILQ_HEAD(sma_head, storage);
+
+struct sma_delta {
+	uint64_t		c_req;
+	uint64_t		c_fail;
+	uint64_t		c_bytes;
+	uint64_t		c_freed;
+	uint64_t		c_cache_hit;
+	int64_t			g_alloc;
+	int64_t			g_bytes;
+	int64_t			g_space;
+	int64_t			g_cache;
+};
+
+struct sma_stripe {
+	unsigned		magic;
+#define SMA_STRIPE_MAGIC	0x5d2b4e1f
+	struct lock		mtx;
+	size_t			credit;
+	size_t			cached;
+	unsigned		nops;
+	struct sma_delta	d;
+	struct sma_head		cache[SMA_NCLASS];
+};
+
 struct sma_sc {
 	unsigned		magic;
 #define SMA_SC_MAGIC		0x1ac8a345
 	struct lock		sma_mtx;
 	size_t			sma_max;
 	size_t			sma_alloc;
+	size_t			credit_max;
+	size_t			cache_max;
 	struct VSC_sma		*stats;
+	unsigned		nstripe;
+	struct sma_stripe	*stripe;
+	pthread_t		flusher;
 };
 
 struct sma {
@@ -58,36 +128,254 @@ struct sma {
 #define SMA_MAGIC		0x69ae9bb9
 	struct storage		s;
 	size_t			sz;
+	unsigned		cls;
 	struct sma_sc		*sc;
+	struct sma_stripe	*stripe;
 };
 
-static struct VSC_lck *lck_sma;
+static struct VSC_lck *lck_sma, *lck_sma_stripe;
+static pthread_key_t sma_stripe_key;
+static unsigned sma_nthread;
+
+/*--------------------------------------------------------------------
+ * Map a size to its class.  Returns SMA_NCLASS for sizes which are not
+ * exactly a class size, those are not cached.
+ */
+
+static unsigned
+sma_class(size_t sz)
+{
+	size_t b, step;
+	unsigned cls;
+
+	AN(sz);
+	if (sz <= SMA_CLASS_SMALL) {
+		if (sz & 15)
+			return (SMA_NCLASS);
+		return ((unsigned)(sz / 16 - 1));
+	}
+	if (sz > SMA_CLASS_MAX)
+		return (SMA_NCLASS);
+	cls = SMA_CLASS_SMALL / 16;
+	for (b = SMA_CLASS_SMALL; sz > 2 * b; b *= 2)
+		cls += 8;
+	step = b / 8;
+	if ((sz - b) % step)
+		return (SMA_NCLASS);
+	cls += (unsigned)((sz - b) / step) - 1;
+	assert(cls < SMA_NCLASS);
+	return (cls);
+}
+
+/*--------------------------------------------------------------------*/
+
+static struct sma_stripe *
+sma_get_stripe(const struct sma_sc *sc)
+{
+	uintptr_t u;
+#ifdef HAVE_SCHED_GETCPU
+	int cpu;
+
+	cpu = sched_getcpu();
+	if (cpu >= 0)
+		return (&sc->stripe[(unsigned)cpu % sc->nstripe]);
+#endif
+
+	u = (uintptr_t)pthread_getspecific(sma_stripe_key);
+	if (u == 0) {
+		/* Racy, we only care about spreading the threads */
+		u = ++sma_nthread;
+		AZ(pthread_setspecific(sma_stripe_key, (void *)u));
+	}
+	return (&sc->stripe[u % sc->nstripe]);
+}
+
+/*--------------------------------------------------------------------
+ * Fold a stripe's statistics into the VSC counters.
+ */
+
+static void
+sma_flush_locked(const struct sma_sc *sc, struct sma_stripe *ss)
+{
+	struct VSC_sma *vsc;
+
+	Lck_AssertHeld(&sc->sma_mtx);
+	Lck_AssertHeld(&ss->mtx);
+	vsc = sc->stats;
+	vsc->c_req += ss->d.c_req;
+	vsc->c_fail += ss->d.c_fail;
+	vsc->c_bytes += ss->d.c_bytes;
+	vsc->c_freed += ss->d.c_freed;
+	vsc->c_cache_hit += ss->d.c_cache_hit;
+	vsc->g_alloc += (uint64_t)ss->d.g_alloc;
+	vsc->g_bytes += (uint64_t)ss->d.g_bytes;
+	if (sc->sma_max != SIZE_MAX)
+		vsc->g_space += (uint64_t)ss->d.g_space;
+	vsc->g_cache += (uint64_t)ss->d.g_cache;
+	memset(&ss->d, 0, sizeof ss->d);
+	ss->nops = 0;
+}
+
+static void
+sma_flush(struct sma_sc *sc, struct sma_stripe *ss)
+{
+
+	Lck_AssertHeld(&ss->mtx);
+	if (++ss->nops < SMA_FLUSH)
+		return;
+	Lck_Lock(&sc->sma_mtx);
+	sma_flush_locked(sc, ss);
+	Lck_Unlock(&sc->sma_mtx);
+}
+
+static void * v_matchproto_(bgthread_t)
+sma_flusher(struct worker *wrk, void *priv)
+{
+	struct sma_sc *sc;
+	struct sma_stripe *ss;
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CAST_OBJ_NOTNULL(sc, priv, SMA_SC_MAGIC);
+	while (1) {
+		VTIM_sleep(SMA_FLUSH_INTERVAL);
+		for (u = 0; u < sc->nstripe; u++) {
+			ss = &sc->stripe[u];
+			/* Unlocked peek, a stripe missed now is caught next */
+			if (ss->nops == 0)
+				continue;
+			Lck_Lock(&ss->mtx);
+			Lck_Lock(&sc->sma_mtx);
+			sma_flush_locked(sc, ss);
+			Lck_Unlock(&sc->sma_mtx);
+			Lck_Unlock(&ss->mtx);
+		}
+	}
+	NEEDLESS(return (NULL));
+}
+
+/*--------------------------------------------------------------------
+ * Get at least sz bytes of credit for a stripe.
+ */
+
+static int
+sma_refill(struct sma_sc *sc, struct sma_stripe *ss, size_t sz)
+{
+	size_t want;
+	int retval = 0;
+
+	Lck_AssertHeld(&ss->mtx);
+	assert(ss->credit < sz);
+	Lck_Lock(&sc->sma_mtx);
+	want = sz - ss->credit;
+	if (sc->sma_max - sc->sma_alloc >= want + sc->credit_max)
+		want += sc->credit_max;
+	if (sc->sma_max - sc->sma_alloc >= want) {
+		sc->sma_alloc += want;
+		ss->credit += want;
+		retval = 1;
+	}
+	sma_flush_locked(sc, ss);
+	Lck_Unlock(&sc->sma_mtx);
+	return (retval);
+}
+
+/*--------------------------------------------------------------------
+ * Make a stripe give back its credit and cached segments.
+ */
+
+static void
+sma_reclaim(struct sma_sc *sc, struct sma_stripe *ss)
+{
+	struct sma_head tofree;
+	struct storage *st, *st2;
+	struct sma *sma;
+	unsigned c;
+
+	CHECK_OBJ_NOTNULL(ss, SMA_STRIPE_MAGIC);
+	VTAILQ_INIT(&tofree);
+	Lck_Lock(&ss->mtx);
+	for (c = 0; c < SMA_NCLASS; c++)
+		VTAILQ_CONCAT(&tofree, &ss->cache[c], list);
+	ss->d.g_cache -= (int64_t)ss->cached;
+	ss->d.g_space += (int64_t)ss->cached;
+	Lck_Lock(&sc->sma_mtx);
+	assert(sc->sma_alloc >= ss->credit + ss->cached);
+	sc->sma_alloc -= ss->credit + ss->cached;
+	sma_flush_locked(sc, ss);
+	Lck_Unlock(&sc->sma_mtx);
+	ss->credit = 0;
+	ss->cached = 0;
+	Lck_Unlock(&ss->mtx);
+	VTAILQ_FOREACH_SAFE(st, &tofree, list, st2) {
+		CAST_OBJ_NOTNULL(sma, st->priv, SMA_MAGIC);
+		free(sma->s.ptr);
+		free(sma);
+	}
+}
+
+/*--------------------------------------------------------------------*/
 
 static struct storage * v_matchproto_(sml_alloc_f)
 sma_alloc(const struct stevedore *st, size_t size)
 {
 	struct sma_sc *sma_sc;
+	struct sma_stripe *ss;
+	struct storage *s;
 	struct sma *sma = NULL;
+	unsigned cls, u, n;
 	void *p;
 
 	CAST_OBJ_NOTNULL(sma_sc, st->priv, SMA_SC_MAGIC);
-	Lck_Lock(&sma_sc->sma_mtx);
-	sma_sc->stats->c_req++;
-	if (sma_sc->sma_alloc + size > sma_sc->sma_max) {
-		sma_sc->stats->c_fail++;
-		size = 0;
-	} else {
-		sma_sc->sma_alloc += size;
-		sma_sc->stats->c_bytes += size;
-		sma_sc->stats->g_alloc++;
-		sma_sc->stats->g_bytes += size;
-		if (sma_sc->sma_max != SIZE_MAX)
-			sma_sc->stats->g_space -= size;
+	ss = sma_get_stripe(sma_sc);
+	CHECK_OBJ_NOTNULL(ss, SMA_STRIPE_MAGIC);
+	cls = sma_class(size);
+
+	Lck_Lock(&ss->mtx);
+	ss->d.c_req++;
+	if (cls < SMA_NCLASS) {
+		s = VTAILQ_FIRST(&ss->cache[cls]);
+		if (s != NULL) {
+			VTAILQ_REMOVE(&ss->cache[cls], s, list);
+			CAST_OBJ_NOTNULL(sma, s->priv, SMA_MAGIC);
+			assert(sma->sz == size);
+			assert(ss->cached >= size);
+			ss->cached -= size;
+			ss->d.c_cache_hit++;
+			ss->d.c_bytes += size;
+			ss->d.g_alloc++;
+			ss->d.g_bytes += (int64_t)size;
+			ss->d.g_cache -= (int64_t)size;
+			sma_flush(sma_sc, ss);
+			Lck_Unlock(&ss->mtx);
+			s->len = 0;
+			return (s);
+		}
 	}
-	Lck_Unlock(&sma_sc->sma_mtx);
 
-	if (size == 0)
+	/* Reclaim from the other stripes first, our own last */
+	u = (unsigned)(ss - sma_sc->stripe);
+	n = 0;
+	while (ss->credit < size && !sma_refill(sma_sc, ss, size)) {
+		if (n++ == sma_sc->nstripe)
+			break;
+		Lck_Unlock(&ss->mtx);
+		sma_reclaim(sma_sc, &sma_sc->stripe[(u + n) % sma_sc->nstripe]);
+		Lck_Lock(&ss->mtx);
+	}
+	if (ss->credit < size) {
+		ss->d.c_fail++;
+		sma_flush(sma_sc, ss);
+		Lck_Unlock(&ss->mtx);
 		return (NULL);
+	}
+	ss->credit -= size;
+	ss->d.c_bytes += size;
+	ss->d.g_alloc++;
+	ss->d.g_bytes += (int64_t)size;
+	ss->d.g_space -= (int64_t)size;
+	sma_flush(sma_sc, ss);
+	Lck_Unlock(&ss->mtx);
 
 	/*
 	 * Do not collaps the sma allocation with sma->s.ptr: it is not
@@ -105,22 +393,24 @@ sma_alloc(const struct stevedore *st, size_t size)
 			free(p);
 	}
 	if (sma == NULL) {
-		Lck_Lock(&sma_sc->sma_mtx);
+		Lck_Lock(&ss->mtx);
 		/*
 		 * XXX: Not nice to have counters go backwards, but we do
 		 * XXX: Not want to pick up the lock twice just for stats.
 		 */
-		sma_sc->stats->c_fail++;
-		sma_sc->sma_alloc -= size;
-		sma_sc->stats->c_bytes -= size;
-		sma_sc->stats->g_alloc--;
-		sma_sc->stats->g_bytes -= size;
-		if (sma_sc->sma_max != SIZE_MAX)
-			sma_sc->stats->g_space += size;
-		Lck_Unlock(&sma_sc->sma_mtx);
+		ss->credit += size;
+		ss->d.c_fail++;
+		ss->d.c_bytes -= size;
+		ss->d.g_alloc--;
+		ss->d.g_bytes -= (int64_t)size;
+		ss->d.g_space += (int64_t)size;
+		sma_flush(sma_sc, ss);
+		Lck_Unlock(&ss->mtx);
 		return (NULL);
 	}
 	sma->sc = sma_sc;
+	sma->stripe = ss;
+	sma->cls = cls;
 	sma->sz = size;
 	sma->s.priv = sma;
 	sma->s.len = 0;
@@ -133,31 +423,74 @@ static void v_matchproto_(sml_free_f)
 sma_free(struct storage *s)
 {
 	struct sma_sc *sma_sc;
+	struct sma_stripe *ss;
 	struct sma *sma;
+	size_t give = 0;
 
 	CHECK_OBJ_NOTNULL(s, STORAGE_MAGIC);
 	CAST_OBJ_NOTNULL(sma, s->priv, SMA_MAGIC);
 	sma_sc = sma->sc;
+	ss = sma->stripe;
+	CHECK_OBJ_NOTNULL(ss, SMA_STRIPE_MAGIC);
 	assert(sma->sz == sma->s.space);
-	Lck_Lock(&sma_sc->sma_mtx);
-	sma_sc->sma_alloc -= sma->sz;
-	sma_sc->stats->g_alloc--;
-	sma_sc->stats->g_bytes -= sma->sz;
-	sma_sc->stats->c_freed += sma->sz;
-	if (sma_sc->sma_max != SIZE_MAX)
-		sma_sc->stats->g_space += sma->sz;
-	Lck_Unlock(&sma_sc->sma_mtx);
+
+	Lck_Lock(&ss->mtx);
+	ss->d.c_freed += sma->sz;
+	ss->d.g_alloc--;
+	ss->d.g_bytes -= (int64_t)sma->sz;
+	if (sma->cls < SMA_NCLASS &&
+	    ss->cached + sma->sz <= sma_sc->cache_max) {
+		VTAILQ_INSERT_HEAD(&ss->cache[sma->cls], s, list);
+		ss->cached += sma->sz;
+		ss->d.g_cache += (int64_t)sma->sz;
+		sma_flush(sma_sc, ss);
+		Lck_Unlock(&ss->mtx);
+		return;
+	}
+	ss->credit += sma->sz;
+	ss->d.g_space += (int64_t)sma->sz;
+	if (ss->credit > 2 * sma_sc->credit_max) {
+		give = ss->credit - sma_sc->credit_max;
+		ss->credit -= give;
+		Lck_Lock(&sma_sc->sma_mtx);
+		sma_sc->sma_alloc -= give;
+		sma_flush_locked(sma_sc, ss);
+		Lck_Unlock(&sma_sc->sma_mtx);
+	} else {
+		sma_flush(sma_sc, ss);
+	}
+	Lck_Unlock(&ss->mtx);
 	free(sma->s.ptr);
 	free(sma);
 }
 
+/*--------------------------------------------------------------------
+ * Credit held by the stripes is not in use, cached segments are.
+ */
+
+static size_t
+sma_credit(const struct sma_sc *sma_sc)
+{
+	size_t credit = 0;
+	unsigned u;
+
+	/* Unlocked, the result is approximate anyway */
+	for (u = 0; u < sma_sc->nstripe; u++)
+		credit += sma_sc->stripe[u].credit;
+	return (credit);
+}
+
 static VCL_BYTES v_matchproto_(stv_var_used_space)
 sma_used_space(const struct stevedore *st)
 {
 	struct sma_sc *sma_sc;
+	size_t credit;
 
 	CAST_OBJ_NOTNULL(sma_sc, st->priv, SMA_SC_MAGIC);
-	return (sma_sc->sma_alloc);
+	credit = sma_credit(sma_sc);
+	if (credit > sma_sc->sma_alloc)
+		return (0);
+	return (sma_sc->sma_alloc - credit);
 }
 
 static VCL_BYTES v_matchproto_(stv_var_free_space)
@@ -166,7 +499,7 @@ sma_free_space(const struct stevedore *st)
 	struct sma_sc *sma_sc;
 
 	CAST_OBJ_NOTNULL(sma_sc, st->priv, SMA_SC_MAGIC);
-	return (sma_sc->sma_max - sma_sc->sma_alloc);
+	return (sma_sc->sma_max - sma_used_space(st));
 }
 
 static void
@@ -184,6 +517,7 @@ sma_init(struct stevedore *parent, int ac, char * const *av)
 	parent->priv = sc;
 
 	AZ(av[ac]);
+	ac = LRU_Arg(parent, ac, av, "-smalloc");
 	if (ac > 1)
 		ARGV_ERR("(-smalloc) too many arguments\n");
 
@@ -206,16 +540,51 @@ static void v_matchproto_(storage_open_f)
 sma_open(struct stevedore *st)
 {
 	struct sma_sc *sma_sc;
+	struct sma_stripe *ss;
+	long ncpu;
+	unsigned u, c;
 
 	ASSERT_CLI();
-	st->lru = LRU_Alloc();
-	if (lck_sma == NULL)
+	st->lru = LRU_Alloc(st);
+	if (lck_sma == NULL) {
 		lck_sma = Lck_CreateClass(NULL, "sma");
+		lck_sma_stripe = Lck_CreateClass(NULL, "sma_stripe");
+		AZ(pthread_key_create(&sma_stripe_key, NULL));
+	}
 	CAST_OBJ_NOTNULL(sma_sc, st->priv, SMA_SC_MAGIC);
 	Lck_New(&sma_sc->sma_mtx, lck_sma);
 	sma_sc->stats = VSC_sma_New(NULL, NULL, st->ident);
 	if (sma_sc->sma_max != SIZE_MAX)
 		sma_sc->stats->g_space = sma_sc->sma_max;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	if (ncpu > SMA_MAX_STRIPES)
+		ncpu = SMA_MAX_STRIPES;
+	sma_sc->nstripe = (unsigned)ncpu;
+
+	/*
+	 * Each stripe may hold credit and cached segments, keep that
+	 * to a small fraction of the stevedore.
+	 */
+	sma_sc->credit_max = sma_sc->sma_max / (sma_sc->nstripe * 64);
+	if (sma_sc->credit_max > SMA_CREDIT)
+		sma_sc->credit_max = SMA_CREDIT;
+	sma_sc->cache_max = sma_sc->sma_max / (sma_sc->nstripe * 64);
+	if (sma_sc->cache_max > SMA_CACHE)
+		sma_sc->cache_max = SMA_CACHE;
+
+	sma_sc->stripe = calloc(sma_sc->nstripe, sizeof *sma_sc->stripe);
+	AN(sma_sc->stripe);
+	for (u = 0; u < sma_sc->nstripe; u++) {
+		ss = &sma_sc->stripe[u];
+		ss->magic = SMA_STRIPE_MAGIC;
+		Lck_New(&ss->mtx, lck_sma_stripe);
+		for (c = 0; c < SMA_NCLASS; c++)
+			VTAILQ_INIT(&ss->cache[c]);
+	}
+	WRK_BgThread(&sma_sc->flusher, "sma-flush", sma_flusher, sma_sc);
 }
 
 const struct stevedore sma_stevedore = {
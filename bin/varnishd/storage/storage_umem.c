@@ -297,6 +297,7 @@ smu_init(struct stevedore *parent, int ac, char * const *av)
 	parent->priv = sc;
 
 	AZ(av[ac]);
+	ac = LRU_Arg(parent, ac, av, "-sumem");
 	if (ac > 1)
 		ARGV_ERR("(-sumem) too many arguments\n");
 
@@ -395,7 +396,7 @@ smu_open(struct stevedore *st)
 	char ident[strlen(st->ident) + 1];
 
 	ASSERT_CLI();
-	st->lru = LRU_Alloc();
+	st->lru = LRU_Alloc(st);
 	if (lck_smu == NULL)
 		lck_smu = Lck_CreateClass(NULL, "smu");
 	CAST_OBJ_NOTNULL(smu_sc, st->priv, SMU_SC_MAGIC);
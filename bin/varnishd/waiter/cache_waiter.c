@@ -34,34 +34,12 @@
 
 #include <stdlib.h>
 
-#include "binary_heap.h"
-
 #include "waiter/waiter.h"
 #include "waiter/waiter_priv.h"
 #include "waiter/mgt_waiter.h"
+#include "vtim.h"
 
-static int v_matchproto_(binheap_cmp_t)
-waited_cmp(void *priv, const void *a, const void *b)
-{
-	const struct waiter *ww;
-	const struct waited *aa, *bb;
-
-	CAST_OBJ_NOTNULL(ww, priv, WAITER_MAGIC);
-	CAST_OBJ_NOTNULL(aa, a, WAITED_MAGIC);
-	CAST_OBJ_NOTNULL(bb, b, WAITED_MAGIC);
-
-	return (Wait_When(aa) < Wait_When(bb));
-}
-
-static void v_matchproto_(binheap_update_t)
-waited_update(void *priv, void *p, unsigned u)
-{
-	struct waited *pp;
-
-	(void)priv;
-	CAST_OBJ_NOTNULL(pp, p, WAITED_MAGIC);
-	pp->idx = u;
-}
+#define WAIT_TICK	0.01
 
 /**********************************************************************/
 
@@ -72,55 +50,58 @@ Wait_Call(const struct waiter *w, struct waited *wp,
 	CHECK_OBJ_NOTNULL(w, WAITER_MAGIC);
 	CHECK_OBJ_NOTNULL(wp, WAITED_MAGIC);
 	AN(wp->func);
-	assert(wp->idx == BINHEAP_NOIDX);
+	AZ(VTW_Armed(&wp->timer));
 	wp->func(wp, ev, now);
 }
 
 /**********************************************************************/
 
 void
-Wait_HeapInsert(const struct waiter *w, struct waited *wp)
+Wait_TimerInsert(const struct waiter *w, struct waited *wp)
 {
 	CHECK_OBJ_NOTNULL(w, WAITER_MAGIC);
 	CHECK_OBJ_NOTNULL(wp, WAITED_MAGIC);
-	assert(wp->idx == BINHEAP_NOIDX);
-	binheap_insert(w->heap, wp);
+	AZ(VTW_Armed(&wp->timer));
+	wp->timer.priv = wp;
+	VTW_Insert(w->wheel, &wp->timer, Wait_When(wp));
 }
 
-/*
- * XXX: wp is const because otherwise FlexeLint complains.  However, *wp
- * XXX: will actually change as a result of calling this function, via
- * XXX: the pointer stored in the bin-heap.  I can see how this const
- * XXX: could maybe confuse a compilers optimizer, but I do not expect
- * XXX: any harm to come from it.  Caveat Emptor.
- */
-
 int
-Wait_HeapDelete(const struct waiter *w, const struct waited *wp)
+Wait_TimerDelete(const struct waiter *w, struct waited *wp)
 {
 	CHECK_OBJ_NOTNULL(w, WAITER_MAGIC);
 	CHECK_OBJ_NOTNULL(wp, WAITED_MAGIC);
-	if (wp->idx == BINHEAP_NOIDX)
-		return (0);
-	binheap_delete(w->heap, wp->idx);
-	return (1);
+	return (VTW_Delete(w->wheel, &wp->timer));
 }
 
+/*
+ * Return a waited which has timed out by now, or NULL and the earliest
+ * time one can, INFINITY if there are none.
+ */
+
 double
-Wait_HeapDue(const struct waiter *w, struct waited **wpp)
+Wait_TimerDue(const struct waiter *w, double now, struct waited **wpp)
 {
+	struct vtw_timer *t;
 	struct waited *wp;
+	double when;
 
-	wp = binheap_root(w->heap);
-	CHECK_OBJ_ORNULL(wp, WAITED_MAGIC);
-	if (wp == NULL) {
-		if (wpp != NULL)
-			*wpp = NULL;
-		return (0);
+	CHECK_OBJ_NOTNULL(w, WAITER_MAGIC);
+	while ((t = VTW_Due(w->wheel, now)) != NULL) {
+		CAST_OBJ_NOTNULL(wp, t->priv, WAITED_MAGIC);
+		when = Wait_When(wp);
+		if (when <= now + WAIT_TICK) {
+			if (wpp != NULL)
+				*wpp = wp;
+			return (when);
+		}
+		/* The timeout was raised after the timer was armed */
+		AN(VTW_Delete(w->wheel, t));
+		VTW_Insert(w->wheel, t, when);
 	}
 	if (wpp != NULL)
-		*wpp = wp;
-	return (Wait_When(wp));
+		*wpp = NULL;
+	return (VTW_Next(w->wheel));
 }
 
 /**********************************************************************/
@@ -134,7 +115,7 @@ Wait_Enter(const struct waiter *w, struct waited *wp)
 	assert(wp->fd > 0);			// stdin never comes here
 	AN(wp->func);
 	AN(wp->tmo);
-	wp->idx = BINHEAP_NOIDX;
+	memset(&wp->timer, 0, sizeof wp->timer);
 	return (w->impl->enter(w->priv, wp));
 }
 
@@ -167,7 +148,7 @@ Waiter_New(void)
 	w->priv = (void*)(w + 1);
 	w->impl = waiter;
 	VTAILQ_INIT(&w->waithead);
-	w->heap = binheap_new(w, waited_cmp, waited_update);
+	w->wheel = VTW_New(WAIT_TICK, VTIM_real());
 
 	waiter->init(w);
 
@@ -181,8 +162,9 @@ Waiter_Destroy(struct waiter **wp)
 
 	TAKE_OBJ_NOTNULL(w, wp, WAITER_MAGIC);
 
-	AZ(binheap_root(w->heap));
+	AZ(VTW_Count(w->wheel));
 	AN(w->impl->fini);
 	w->impl->fini(w);
+	VTW_Destroy(&w->wheel);
 	FREE_OBJ(w);
 }
@@ -94,9 +94,9 @@ vwe_thread(void *priv)
 			 * XXX: We could avoid many syscalls here if we were
 			 * XXX: allowed to just close the fd's on timeout.
 			 */
-			then = Wait_HeapDue(w, &wp);
+			then = Wait_TimerDue(w, now, &wp);
 			if (wp == NULL) {
-				vwe->next = now + 100;
+				vwe->next = fmin(then, now + 100);
 				break;
 			} else if (then > now) {
 				vwe->next = then;
@@ -105,7 +105,7 @@ vwe_thread(void *priv)
 			CHECK_OBJ_NOTNULL(wp, WAITED_MAGIC);
 			AZ(epoll_ctl(vwe->epfd, EPOLL_CTL_DEL, wp->fd, NULL));
 			vwe->nwaited--;
-			AN(Wait_HeapDelete(w, wp));
+			AN(Wait_TimerDelete(w, wp));
 			Lck_Unlock(&vwe->mtx);
 			Wait_Call(w, wp, WAITER_TIMEOUT, now);
 		}
@@ -129,7 +129,7 @@ vwe_thread(void *priv)
 			}
 			CAST_OBJ_NOTNULL(wp, ep->data.ptr, WAITED_MAGIC);
 			Lck_Lock(&vwe->mtx);
-			active = Wait_HeapDelete(w, wp);
+			active = Wait_TimerDelete(w, wp);
 			Lck_Unlock(&vwe->mtx);
 			if (!active) {
 				VSL(SLT_Debug, wp->fd, "epoll: spurious event");
@@ -169,7 +169,7 @@ vwe_enter(void *priv, struct waited *wp)
 	ee.data.ptr = wp;
 	Lck_Lock(&vwe->mtx);
 	vwe->nwaited++;
-	Wait_HeapInsert(vwe->waiter, wp);
+	Wait_TimerInsert(vwe->waiter, wp);
 	AZ(epoll_ctl(vwe->epfd, EPOLL_CTL_ADD, wp->fd, &ee));
 	/* If the epoll isn't due before our timeout, poke it via the pipe */
 	if (Wait_When(wp) < vwe->next)
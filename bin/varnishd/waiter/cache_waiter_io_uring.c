@@ -0,0 +1,301 @@
+/*-
+ * Copyright (c) 2019 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Linux io_uring(7) waiter
+ *
+ * Every waited fd gets a oneshot IORING_OP_POLL_ADD, which the kernel
+ * disarms by itself when it fires, so where epoll needs an ADD and a DEL
+ * syscall per wait, we need at most one submission.  Submissions made
+ * while the waiter thread is busy reaping completions are not pushed to
+ * the kernel right away, the thread submits them in one go before it
+ * goes back to sleep.
+ *
+ * A timed out fd is removed from the heap and gets an IORING_OP_POLL_REMOVE,
+ * but its owner is only called once the cancelled poll completes: until
+ * then the kernel still holds the poll, and the fd must not be closed
+ * from under it.
+ */
+
+//lint -e{766}
+#include "config.h"
+
+#if defined(HAVE_LIBURING)
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <liburing.h>
+
+#include "cache/cache_varnishd.h"
+
+#include "waiter/waiter.h"
+#include "waiter/waiter_priv.h"
+#include "vtim.h"
+
+#ifndef POLLRDHUP
+#  define POLLRDHUP 0
+#endif
+
+#define VWU_ENTRIES	4096
+
+struct vwu {
+	unsigned		magic;
+#define VWU_MAGIC		0x52f1ae33
+	struct io_uring		ring;
+	struct waiter		*waiter;
+	pthread_t		thread;
+	double			next;
+	unsigned		nwaited;
+	int			busy;
+	int			die;
+	struct lock		mtx;
+};
+
+/*--------------------------------------------------------------------
+ * Must be called with the lock held, the submission queue is only ever
+ * touched under it.
+ */
+
+static struct io_uring_sqe *
+vwu_sqe(struct vwu *vwu)
+{
+	struct io_uring_sqe *sqe;
+
+	Lck_AssertHeld(&vwu->mtx);
+	sqe = io_uring_get_sqe(&vwu->ring);
+	if (sqe == NULL) {
+		assert(io_uring_submit(&vwu->ring) > 0);
+		sqe = io_uring_get_sqe(&vwu->ring);
+	}
+	AN(sqe);
+	return (sqe);
+}
+
+static void
+vwu_poke(struct vwu *vwu)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = vwu_sqe(vwu);
+	io_uring_prep_nop(sqe);
+	io_uring_sqe_set_data(sqe, vwu);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void *
+vwu_thread(void *priv)
+{
+	struct io_uring_cqe *cqe;
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	struct waited *wp;
+	struct waiter *w;
+	double now, then;
+	unsigned head, n;
+	int i, active;
+	struct vwu *vwu;
+
+	CAST_OBJ_NOTNULL(vwu, priv, VWU_MAGIC);
+	w = vwu->waiter;
+	CHECK_OBJ_NOTNULL(w, WAITER_MAGIC);
+	THR_SetName("cache-io_uring");
+	THR_Init();
+
+	now = VTIM_real();
+	while (1) {
+		Lck_Lock(&vwu->mtx);
+		if (vwu->nwaited == 0 && vwu->die) {
+			Lck_Unlock(&vwu->mtx);
+			break;
+		}
+		while (1) {
+			then = Wait_TimerDue(w, now, &wp);
+			if (wp == NULL) {
+				vwu->next = fmin(then, now + 100);
+				break;
+			} else if (then > now) {
+				vwu->next = then;
+				break;
+			}
+			CHECK_OBJ_NOTNULL(wp, WAITED_MAGIC);
+			AN(Wait_TimerDelete(w, wp));
+			sqe = vwu_sqe(vwu);
+			io_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, -1, wp, 0, 0);
+			io_uring_sqe_set_data(sqe, vwu);
+		}
+		then = vwu->next - now;
+		assert(then > 0);
+		vwu->busy = 0;
+		if (io_uring_sq_ready(&vwu->ring) > 0)
+			assert(io_uring_submit(&vwu->ring) > 0);
+		Lck_Unlock(&vwu->mtx);
+
+		ts.tv_sec = (long long)floor(then);
+		ts.tv_nsec = (long long)(1e9 * (then - ts.tv_sec));
+		i = io_uring_wait_cqe_timeout(&vwu->ring, &cqe, &ts);
+		assert(i == 0 || i == -ETIME || i == -EINTR);
+
+		Lck_Lock(&vwu->mtx);
+		vwu->busy = 1;
+		Lck_Unlock(&vwu->mtx);
+
+		now = VTIM_real();
+		n = 0;
+		io_uring_for_each_cqe(&vwu->ring, head, cqe) {
+			n++;
+			if (io_uring_cqe_get_data(cqe) == vwu)
+				continue;
+			CAST_OBJ_NOTNULL(wp, io_uring_cqe_get_data(cqe),
+			    WAITED_MAGIC);
+			Lck_Lock(&vwu->mtx);
+			active = Wait_TimerDelete(w, wp);
+			vwu->nwaited--;
+			Lck_Unlock(&vwu->mtx);
+			if (!active)
+				Wait_Call(w, wp, WAITER_TIMEOUT, now);
+			else if (cqe->res > 0 && (cqe->res & POLLIN))
+				Wait_Call(w, wp, WAITER_ACTION, now);
+			else
+				Wait_Call(w, wp, WAITER_REMCLOSE, now);
+		}
+		io_uring_cq_advance(&vwu->ring, n);
+	}
+	io_uring_queue_exit(&vwu->ring);
+	return (NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+static int v_matchproto_(waiter_enter_f)
+vwu_enter(void *priv, struct waited *wp)
+{
+	struct vwu *vwu;
+	struct io_uring_sqe *sqe;
+
+	CAST_OBJ_NOTNULL(vwu, priv, VWU_MAGIC);
+	Lck_Lock(&vwu->mtx);
+	vwu->nwaited++;
+	Wait_TimerInsert(vwu->waiter, wp);
+	sqe = vwu_sqe(vwu);
+	io_uring_prep_poll_add(sqe, wp->fd, POLLIN | POLLRDHUP);
+	io_uring_sqe_set_data(sqe, wp);
+	if (!vwu->busy) {
+		/* If the waiter isn't due before our timeout, poke it */
+		if (Wait_When(wp) < vwu->next)
+			vwu_poke(vwu);
+		assert(io_uring_submit(&vwu->ring) > 0);
+	}
+	Lck_Unlock(&vwu->mtx);
+	return (0);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void v_matchproto_(waiter_init_f)
+vwu_init(struct waiter *w)
+{
+	struct vwu *vwu;
+
+	CHECK_OBJ_NOTNULL(w, WAITER_MAGIC);
+	vwu = w->priv;
+	INIT_OBJ(vwu, VWU_MAGIC);
+	vwu->waiter = w;
+
+	AZ(io_uring_queue_init(VWU_ENTRIES, &vwu->ring, 0));
+	/*
+	 * Waiting with a timeout must not take a submission queue entry,
+	 * VWU_Check() made sure of this at startup.
+	 */
+	AN(vwu->ring.features & IORING_FEAT_EXT_ARG);
+	Lck_New(&vwu->mtx, lck_waiter);
+
+	AZ(pthread_create(&vwu->thread, NULL, vwu_thread, vwu));
+}
+
+/*--------------------------------------------------------------------
+ * It is the callers responsibility to trigger all fd's waited on to
+ * fail somehow.
+ */
+
+static void v_matchproto_(waiter_fini_f)
+vwu_fini(struct waiter *w)
+{
+	struct vwu *vwu;
+	void *vp;
+
+	CAST_OBJ_NOTNULL(vwu, w->priv, VWU_MAGIC);
+
+	Lck_Lock(&vwu->mtx);
+	vwu->die = 1;
+	vwu_poke(vwu);
+	assert(io_uring_submit(&vwu->ring) > 0);
+	Lck_Unlock(&vwu->mtx);
+	AZ(pthread_join(vwu->thread, &vp));
+	Lck_Delete(&vwu->mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Called from the manager when -W io_uring is given, so that a kernel
+ * which cannot do what we need is refused at startup, not by a panic in
+ * the child.
+ */
+
+const char *
+VWU_Check(void)
+{
+	static char buf[128];
+	struct io_uring ring;
+	unsigned features;
+	int i;
+
+	i = io_uring_queue_init(2, &ring, 0);
+	if (i < 0) {
+		bprintf(buf, "io_uring_queue_init() failed: %s",
+		    vstrerror(-i));
+		return (buf);
+	}
+	features = ring.features;
+	io_uring_queue_exit(&ring);
+	if (!(features & IORING_FEAT_EXT_ARG))
+		return ("the kernel does not support IORING_FEAT_EXT_ARG "
+		    "(Linux 5.11 or later)");
+	return (NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+#include "waiter/mgt_waiter.h"
+
+const struct waiter_impl waiter_io_uring = {
+	.name =		"io_uring",
+	.init =		vwu_init,
+	.fini =		vwu_fini,
+	.enter =	vwu_enter,
+	.size =		sizeof(struct vwu),
+};
+
+#endif /* defined(HAVE_LIBURING) */
@@ -86,9 +86,9 @@ vwk_thread(void *priv)
 			 * XXX: We could avoid many syscalls here if we were
 			 * XXX: allowed to just close the fd's on timeout.
 			 */
-			then = Wait_HeapDue(w, &wp);
+			then = Wait_TimerDue(w, now, &wp);
 			if (wp == NULL) {
-				vwk->next = now + 100;
+				vwk->next = fmin(then, now + 100);
 				break;
 			} else if (then > now) {
 				vwk->next = then;
@@ -97,7 +97,7 @@ vwk_thread(void *priv)
 			CHECK_OBJ_NOTNULL(wp, WAITED_MAGIC);
 			EV_SET(ke, wp->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
 			AZ(kevent(vwk->kq, ke, 1, NULL, 0, NULL));
-			AN(Wait_HeapDelete(w, wp));
+			AN(Wait_TimerDelete(w, wp));
 			Lck_Unlock(&vwk->mtx);
 			Wait_Call(w, wp, WAITER_TIMEOUT, now);
 		}
@@ -117,7 +117,7 @@ vwk_thread(void *priv)
 			}
 			CAST_OBJ_NOTNULL(wp, ke[j].udata, WAITED_MAGIC);
 			Lck_Lock(&vwk->mtx);
-			AN(Wait_HeapDelete(w, wp));
+			AN(Wait_TimerDelete(w, wp));
 			Lck_Unlock(&vwk->mtx);
 			vwk->nwaited--;
 			if (kp->flags & EV_EOF)
@@ -146,7 +146,7 @@ vwk_enter(void *priv, struct waited *wp)
 	EV_SET(&ke, wp->fd, EVFILT_READ, EV_ADD|EV_ONESHOT, 0, 0, wp);
 	Lck_Lock(&vwk->mtx);
 	vwk->nwaited++;
-	Wait_HeapInsert(vwk->waiter, wp);
+	Wait_TimerInsert(vwk->waiter, wp);
 	AZ(kevent(vwk->kq, &ke, 1, NULL, 0, NULL));
 
 	/* If the kqueue isn't due before our timeout, poke it via the pipe */
@@ -107,7 +107,7 @@ VSL(SLT_Debug, wp->fd, "ADD");
 	vwp->pollfd[vwp->hpoll].events = POLLIN;
 	vwp->idx[vwp->hpoll] = wp;
 	vwp->hpoll++;
-	Wait_HeapInsert(vwp->waiter, wp);
+	Wait_TimerInsert(vwp->waiter, wp);
 }
 
 static void
@@ -167,11 +167,14 @@ vwp_main(void *priv)
 	w = vwp->waiter;
 
 	while (1) {
-		then = Wait_HeapDue(w, &wp);
-		if (wp == NULL)
+		now = VTIM_real();
+		then = Wait_TimerDue(w, now, &wp);
+		if (wp != NULL)
+			i = (int)fmax(0., ceil(1e3 * (then - now)));
+		else if (isinf(then))
 			i = -1;
 		else
-			i = (int)floor(1e3 * (then - VTIM_real()));
+			i = (int)ceil(1e3 * (then - now));
 		assert(vwp->hpoll > 0);
 		AN(vwp->pollfd);
 		v = poll(vwp->pollfd, vwp->hpoll, i);
@@ -184,19 +187,19 @@ vwp_main(void *priv)
 			wp = vwp->idx[i];
 			CHECK_OBJ_NOTNULL(wp, WAITED_MAGIC);
 
-			if (v == 0 && Wait_HeapDue(w, NULL) > now)
+			if (v == 0 && Wait_TimerDue(w, now, NULL) > now)
 				break;
 			if (vwp->pollfd[i].revents)
 				v--;
 			then = Wait_When(wp);
 			if (then <= now) {
-				AN(Wait_HeapDelete(w, wp));
+				AN(Wait_TimerDelete(w, wp));
 				Wait_Call(w, wp, WAITER_TIMEOUT, now);
 				vwp_del(vwp, i);
 			} else if (vwp->pollfd[i].revents & POLLIN) {
 				assert(wp->fd > 0);
 				assert(wp->fd == vwp->pollfd[i].fd);
-				AN(Wait_HeapDelete(w, wp));
+				AN(Wait_TimerDelete(w, wp));
 				Wait_Call(w, wp, WAITER_ACTION, now);
 				vwp_del(vwp, i);
 			} else {
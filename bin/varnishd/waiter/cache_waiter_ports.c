@@ -114,7 +114,7 @@ vws_port_ev(struct vws *vws, struct waiter *w, port_event_t *ev, double now)
 		CAST_OBJ_NOTNULL(wp, ev->portev_user, WAITED_MAGIC);
 		assert(wp->fd >= 0);
 		vws->nwaited++;
-		Wait_HeapInsert(vws->waiter, wp);
+		Wait_TimerInsert(vws->waiter, wp);
 		vws_add(vws, wp->fd, wp);
 	} else {
 		assert(ev->portev_source == PORT_SOURCE_FD);
@@ -128,7 +128,7 @@ vws_port_ev(struct vws *vws, struct waiter *w, port_event_t *ev, double now)
 		 *          threadID=129476&tstart=0
 		 */
 		vws_del(vws, wp->fd);
-		AN(Wait_HeapDelete(w, wp));
+		AN(Wait_TimerDelete(w, wp));
 		Wait_Call(w, wp, ev->portev_events & POLLERR ?
 		    WAITER_REMCLOSE : WAITER_ACTION,
 		    now);
@@ -158,9 +158,9 @@ vws_thread(void *priv)
 
 	while (!vws->die) {
 		while (1) {
-			then = Wait_HeapDue(w, &wp);
+			then = Wait_TimerDue(w, now, &wp);
 			if (wp == NULL) {
-				vws->next = now + max_t;
+				vws->next = fmin(then, now + max_t);
 				break;
 			} else if (then > now) {
 				vws->next = then;
@@ -168,7 +168,7 @@ vws_thread(void *priv)
 			}
 			CHECK_OBJ_NOTNULL(wp, WAITED_MAGIC);
 			vws_del(vws, wp->fd);
-			AN(Wait_HeapDelete(w, wp));
+			AN(Wait_TimerDelete(w, wp));
 			Wait_Call(w, wp, WAITER_TIMEOUT, now);
 		}
 		then = vws->next - now;
@@ -29,6 +29,9 @@
  */
 
 #include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "mgt/mgt.h"
@@ -53,4 +56,12 @@ Wait_config(const char *arg)
 		waiter = MGT_Pick(waiter_choice, arg, "waiter");
 	else
 		waiter = waiter_choice[0].ptr;
+#if defined(HAVE_LIBURING)
+	if (waiter == &waiter_io_uring) {
+		const char *err = VWU_Check();
+
+		if (err != NULL)
+			ARGV_ERR("Waiter io_uring cannot be used: %s\n", err);
+	}
+#endif
 }
@@ -38,3 +38,8 @@ extern struct waiter_impl const * waiter;
 #include "tbl/waiters.h"
 
 void Wait_config(const char *arg);
+
+#if defined(HAVE_LIBURING)
+/* cache_waiter_io_uring.c */
+const char *VWU_Check(void);
+#endif
@@ -58,7 +58,7 @@ struct waited {
 	unsigned		magic;
 #define WAITED_MAGIC		0x1743992d
 	int			fd;
-	unsigned		idx;
+	struct vtw_timer	timer;
 	void			*priv1;
 	uintptr_t		priv2;
 	waiter_handle_f		*func;
@@ -30,7 +30,7 @@
  */
 
 struct waited;
-struct binheap;
+struct vtw;
 
 struct waiter {
 	unsigned			magic;
@@ -40,7 +40,7 @@ struct waiter {
 	VTAILQ_HEAD(,waited)		waithead;
 
 	void				*priv;
-	struct binheap			*heap;
+	struct vtw			*wheel;
 };
 
 typedef void waiter_init_f(struct waiter *);
@@ -76,6 +76,6 @@ Wait_When(const struct waited *wp)
 
 void Wait_Call(const struct waiter *, struct waited *,
     enum wait_event ev, double now);
-void Wait_HeapInsert(const struct waiter *, struct waited *);
-int Wait_HeapDelete(const struct waiter *, const struct waited *);
-double Wait_HeapDue(const struct waiter *, struct waited **);
+void Wait_TimerInsert(const struct waiter *, struct waited *);
+int Wait_TimerDelete(const struct waiter *, struct waited *);
+double Wait_TimerDue(const struct waiter *, double now, struct waited **);
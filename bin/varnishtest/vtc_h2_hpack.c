@@ -311,6 +311,13 @@ HPK_DecHdr(struct hpk_iter *iter, struct hpk_hdr *header)
 	int must_index = 0;
 	assert(iter);
 	assert(iter->buf < iter->end);
+	/* Dynamic Table Size Updates, at the start of a header block */
+	/* XXX if under max allowed value */
+	while (*iter->buf >> 5 == 1) {
+		if (hpk_more != num_decode(&num, iter, 5))
+			return (hpk_err);
+		(void)HPK_ResizeTbl(iter->ctx, num);
+	}
 	/* Indexed Header Field */
 	if (*iter->buf & 128) {
 		header->t = hpk_idx;
@@ -355,13 +362,7 @@ HPK_DecHdr(struct hpk_iter *iter, struct hpk_hdr *header)
 		header->t = hpk_never;
 		pref = 4;
 	}
-	/* Dynamic Table Size Update */
-	/* XXX if under max allowed value */
-	else if (*iter->buf >> 5 == 1) {
-		if (hpk_done != num_decode(&num, iter, 5))
-			return (hpk_err);
-		return (HPK_ResizeTbl(iter->ctx, num));
-	} else {
+	else {
 		return (hpk_err);
 	}
 
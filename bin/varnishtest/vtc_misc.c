@@ -405,6 +405,12 @@ dns_works(void)
  * persistent_storage
  *        Varnish was built with the deprecated persistent storage.
  *
+ * brotli
+ *        Varnish was built with the brotli filters.
+ *
+ * zstd
+ *        Varnish was built with the zstd filters.
+ *
  * Be careful with ignore_unknown_macro, because it may cause a test with a
  * misspelled macro to fail silently. You should only need it if you must
  * run a test with strings of the form "${...}".
@@ -416,6 +422,18 @@ static const unsigned with_persistent_storage = 1;
 static const unsigned with_persistent_storage = 0;
 #endif
 
+#ifdef HAVE_BROTLI
+static const unsigned with_brotli = 1;
+#else
+static const unsigned with_brotli = 0;
+#endif
+
+#ifdef HAVE_ZSTD
+static const unsigned with_zstd = 1;
+#else
+static const unsigned with_zstd = 0;
+#endif
+
 void v_matchproto_(cmd_f)
 cmd_feature(CMD_ARGS)
 {
@@ -465,6 +483,8 @@ cmd_feature(CMD_ARGS)
 		FEATURE("user_vcache", getpwnam("vcache") != NULL);
 		FEATURE("group_varnish", getgrnam("varnish") != NULL);
 		FEATURE("persistent_storage", with_persistent_storage);
+		FEATURE("brotli", with_brotli);
+		FEATURE("zstd", with_zstd);
 
 		if (!strcmp(*av, "disable_aslr")) {
 			good = 1;
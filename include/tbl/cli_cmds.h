@@ -68,6 +68,16 @@ CLI_CMD(BAN_LIST,
 	0, 0
 )
 
+CLI_CMD(XKEY_PURGE,
+	"xkey.purge",
+	"xkey.purge <key> [<key> ...]",
+	"Purge all objects tagged with any of the surrogate keys.",
+	"  Objects are tagged with surrogate keys through the ``xkey``"
+	" response header, which holds a list of keys separated by"
+	" whitespace or commas.",
+	1, -1
+)
+
 CLI_CMD(VCL_LOAD,
 	"vcl.load",
 	"vcl.load <configname> <filename> [auto|cold|warm]",
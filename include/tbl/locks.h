@@ -30,6 +30,7 @@
 /*lint -save -e525 -e539 */
 
 LOCK(backend)
+LOCK(backend_h2)
 LOCK(ban)
 LOCK(busyobj)
 LOCK(cli)
@@ -48,6 +49,7 @@ LOCK(vxid)
 LOCK(waiter)
 LOCK(wq)
 LOCK(wstat)
+LOCK(xkey)
 #undef LOCK
 
 /*lint -restore */
@@ -58,6 +58,8 @@
   OBJ_FLAG(CHGCE,	chgce,		(1<<2))
   OBJ_FLAG(IMSCAND,	imscand,	(1<<3))
   OBJ_FLAG(ESIPROC,	esiproc,	(1<<4))
+  OBJ_FLAG(BROTLI,	brotli,		(1<<5))
+  OBJ_FLAG(ZSTD,		zstd,		(1<<6))
   #undef OBJ_FLAG
 #endif
 
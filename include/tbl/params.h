@@ -235,6 +235,23 @@ PARAM(
 	/* func */	NULL
 )
 
+PARAM(
+	/* name */	ban_lurker_threads,
+	/* typ */	uint,
+	/* min */	"1",
+	/* max */	NULL,
+	/* default */	"1",
+	/* units */	"threads",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"How many bans the ban lurker tests in parallel.  Above one, the "
+	"objects of each ban are tested by a thread taken from the worker "
+	"pools, and every such thread sleeps ${ban_lurker_sleep} after "
+	"examining ${ban_lurker_batch} objects.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
 PARAM(
 	/* name */	first_byte_timeout,
 	/* typ */	timeout,
@@ -285,6 +302,77 @@ PARAM(
 	/* func */	NULL
 )
 
+PARAM(
+	/* name */	backend_idle_min,
+	/* typ */	uint,
+	/* min */	"0",
+	/* max */	NULL,
+	/* default */	"0",
+	/* units */	"connections",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"Minimum number of idle connections to keep open to each backend.\n"
+	"Whenever a backend has fewer idle connections than this, new ones "
+	"are opened in the background, so that a burst of fetches after an "
+	"idle period does not have to wait for connects.  Connections still "
+	"time out after backend_idle_timeout, and are then opened anew.\n"
+	"Zero disables pre-warming.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
+PARAM(
+	/* name */	backend_pool_shards,
+	/* typ */	uint,
+	/* min */	"1",
+	/* max */	"64",
+	/* default */	"1",
+	/* units */	"shards",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"Number of sub-pools the idle connections to a backend are split "
+	"into.  Each thread pool checks connections out of and back into "
+	"its own sub-pool, and only takes from the others when its own is "
+	"empty, so fetches do not all contend on one lock.\n"
+	"Only affects connection pools created after the change.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
+PARAM(
+	/* name */	backend_h2_max_streams,
+	/* typ */	uint,
+	/* min */	"1",
+	/* max */	NULL,
+	/* default */	"100",
+	/* units */	"streams",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"Maximum number of concurrent fetches on one connection to an h2c "
+	"backend.  When all connections are at this limit, or at the "
+	"backend's own SETTINGS_MAX_CONCURRENT_STREAMS, a new connection is "
+	"opened.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
+PARAM(
+	/* name */	backend_h2_window,
+	/* typ */	bytes_u,
+	/* min */	"65535b",
+	/* max */	"2147483647b",
+	/* default */	"1M",
+	/* units */	"bytes",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"HTTP/2 flow control window we offer h2c backends, per stream and "
+	"per connection.  This much of a response body can be in flight "
+	"before the fetch has to consume it.\n"
+	"Only affects connections opened after the change.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
 PARAM(
 	/* name */	backend_local_error_holddown,
 	/* typ */	timeout,
@@ -329,7 +417,7 @@ PARAM(
 	/* typ */	bytes_u,
 	/* min */	"128b",
 	/* max */	"99999999b",
-	/* default */	"48k",
+	/* default */	"64k",
 	/* units */	"bytes",
 	/* flags */	0,
 	/* s-text */
@@ -405,14 +493,16 @@ PARAM(
 PARAM(
 	/* name */	critbit_cooloff,
 	/* typ */	timeout,
-	/* min */	"60.000",
+	/* min */	"0.100",
 	/* max */	"254.000",
-	/* default */	"180.000",
+	/* default */	"1.000",
 	/* units */	"seconds",
 	/* flags */	WIZARD,
 	/* s-text */
-	"How long the critbit hasher keeps deleted objheads on the cooloff "
-	"list.",
+	"How often the critbit hasher frees deleted objheads.\n"
+	"Deleted objheads are only freed once no lookup which started "
+	"before they were deleted is still running, this is how long "
+	"they may wait on the cooloff list in addition to that.",
 	/* l-text */	"",
 	/* func */	NULL
 )
@@ -620,6 +710,36 @@ PARAM(
 	/* func */	NULL
 )
 
+PARAM(
+	/* name */	brotli_quality,
+	/* typ */	uint,
+	/* min */	"0",
+	/* max */	"11",
+	/* default */	"5",
+	/* units */	NULL,
+	/* flags */	0,
+	/* s-text */
+	"Brotli compression quality: 0=fast, 11=best.\n"
+	"Qualities above 9 are very slow and better left for content "
+	"which is compressed once and delivered many times.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
+PARAM(
+	/* name */	zstd_level,
+	/* typ */	uint,
+	/* min */	"1",
+	/* max */	"19",
+	/* default */	"3",
+	/* units */	NULL,
+	/* flags */	0,
+	/* s-text */
+	"Zstandard compression level: 1=fast, 19=best.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
 PARAM(
 	/* name */	http_gzip_support,
 	/* typ */	bool,
@@ -640,13 +760,51 @@ PARAM(
 	"header removed. For more information on how gzip is implemented "
 	"please see the chapter on gzip in the Varnish reference.\n"
 	"\n"
-	"When gzip support is disabled the variables beresp.do_gzip and "
-	"beresp.do_gunzip have no effect in VCL.",
+	"When gzip support is disabled the variables beresp.do_gzip, "
+	"beresp.do_gunzip, beresp.do_brotli and beresp.do_zstd have no "
+	"effect in VCL.",
 	/* XXX: what about the effect on beresp.filters? */
 	/* l-text */	"",
 	/* func */	NULL
 )
 
+PARAM(
+	/* name */	http_brotli_support,
+	/* typ */	bool,
+	/* min */	NULL,
+	/* max */	NULL,
+	/* default */	"off",
+	/* units */	"bool",
+	/* flags */	0,
+	/* s-text */
+	"Enable brotli support, if varnishd was built with it and "
+	"http_gzip_support is enabled. Clients indicating support for "
+	"brotli keep \"br\" in their Accept-Encoding, for instance:\n"
+	"  Accept-Encoding: gzip, br\n"
+	"\n"
+	"When disabled, beresp.do_brotli has no effect in VCL.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
+PARAM(
+	/* name */	http_zstd_support,
+	/* typ */	bool,
+	/* min */	NULL,
+	/* max */	NULL,
+	/* default */	"off",
+	/* units */	"bool",
+	/* flags */	0,
+	/* s-text */
+	"Enable zstd support, if varnishd was built with it and "
+	"http_gzip_support is enabled. Clients indicating support for "
+	"zstd keep \"zstd\" in their Accept-Encoding.\n"
+	"\n"
+	"When disabled, beresp.do_zstd has no effect in VCL.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
 PARAM(
 	/* name */	http_max_hdr,
 	/* typ */	uint,
@@ -807,6 +965,64 @@ PARAM(
 	/* func */	NULL
 )
 
+PARAM(
+	/* name */	lru_shards,
+	/* typ */	uint,
+	/* min */	"1",
+	/* max */	"64",
+	/* default */	"1",
+	/* units */	"shards",
+	/* flags */	MUST_RESTART| EXPERIMENTAL,
+	/* s-text */
+	"Number of LRU shards per storage backend.\n"
+	"Objects are spread over this many independently locked LRU "
+	"lists, so that LRU updates and nuking from many threads do not "
+	"contend on a single lock.  When space is needed, the shard with "
+	"the least recently used object is nuked from first.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
+PARAM(
+	/* name */	exp_shards,
+	/* typ */	uint,
+	/* min */	"1",
+	/* max */	"64",
+	/* default */	"1",
+	/* units */	"shards",
+	/* flags */	MUST_RESTART| EXPERIMENTAL,
+	/* s-text */
+	"Number of expiry shards.\n"
+	"Objects are spread over this many timer heaps, each with its own "
+	"inbox, lock and expiry thread, so that inserting and rearming "
+	"objects does not contend on a single lock and expiry keeps up "
+	"with many short lived objects.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
+PARAM(
+	/* name */	esi_prefetch,
+	/* typ */	uint,
+	/* min */	"0",
+	/* max */	"32",
+	/* default */	"0",
+	/* units */	"includes",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"How many esi:includes ahead of the one being delivered are looked "
+	"up, and fetched on a miss, from other worker threads.\n"
+	"Includes are still delivered one at a time in document order, "
+	"but the objects for the following includes are already in cache "
+	"or being fetched by then.  Prefetches run VCL up to vcl_miss{} "
+	"and are skipped for anything which would not be a cache lookup.  "
+	"They have their own PRIV_TOP and are not counted as hits or "
+	"misses.\n"
+	"Zero disables prefetching.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
 PARAM(
 	/* name */	max_esi_depth,
 	/* typ */	uint,
@@ -994,6 +1210,57 @@ PARAM(
 	/* func */	NULL
 )
 
+PARAM(
+	/* name */	refresh_ahead,
+	/* typ */	timeout,
+	/* min */	"0.000",
+	/* max */	NULL,
+	/* default */	"0.000",
+	/* units */	"seconds",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"Refresh popular objects this long before their TTL runs out.\n"
+	"A cache hit on an object with less TTL left than this, and with "
+	"at least ${refresh_ahead_hits} hits, is delivered as usual and "
+	"also starts a background fetch, which revalidates the object "
+	"with a conditional request when it can.\n"
+	"Zero disables refreshing ahead of expiry.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
+PARAM(
+	/* name */	refresh_ahead_hits,
+	/* typ */	uint,
+	/* min */	"0",
+	/* max */	NULL,
+	/* default */	"2",
+	/* units */	"hits",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"How many hits an object must have had before it is refreshed "
+	"ahead of expiry.  See ${refresh_ahead}.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
+PARAM(
+	/* name */	refresh_ahead_backend,
+	/* typ */	uint,
+	/* min */	"0",
+	/* max */	NULL,
+	/* default */	"10",
+	/* units */	"connections",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"How many refresh ahead fetches a single backend may have in "
+	"progress.  A refresh over this limit is abandoned and the object "
+	"is left to expire as usual.\n"
+	"Zero means no limit other than the backend's max_connections.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
 PARAM(
 	/* name */	rush_exponent,
 	/* typ */	uint,
@@ -1040,6 +1307,34 @@ PARAM(
 )
 #undef XYZZY
 
+#if defined(XYZZY)
+  #error "Temporary macro XYZZY already defined"
+#endif
+
+#if defined(HAVE_SENDFILE)
+  #define XYZZY EXPERIMENTAL
+#else
+  #define XYZZY NOT_IMPLEMENTED
+#endif
+PARAM(
+	/* name */	sendfile_threshold,
+	/* typ */	bytes,
+	/* min */	"0b",
+	/* max */	NULL,
+	/* default */	"128k",
+	/* units */	"bytes",
+	/* flags */	XYZZY,
+	/* s-text */
+	"HTTP1 responses send stretches of object data at least this big "
+	"with sendfile(2) rather than writev(2), if the data is in file "
+	"storage, unmodified by delivery processors and the response is "
+	"not chunked.\n"
+	"Zero disables the use of sendfile(2).",
+	/* l-text */	"",
+	/* func */	NULL
+)
+#undef XYZZY
+
 PARAM(
 	/* name */	shortlived,
 	/* typ */	timeout,
@@ -1458,6 +1753,24 @@ PARAM(
 	/* func */	NULL
 )
 
+PARAM(
+	/* name */	vary_index,
+	/* typ */	uint,
+	/* min */	"0",
+	/* max */	NULL,
+	/* default */	"16",
+	/* units */	"objects",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"Index the variants of a hash entry once it holds this many "
+	"objects and one of them has a Vary header.  Lookups on an "
+	"indexed hash entry only examine the objects of the variant the "
+	"request matches, instead of all of them.\n"
+	"Zero disables the index.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
 #if 0
 /* actual location mgt_param_tbl.c */
 PARAM(
@@ -1657,6 +1970,23 @@ PARAM(
 	/* func */	NULL
 )
 
+PARAM(
+	/* name */	waitinglist_handoff,
+	/* typ */	bool,
+	/* min */	NULL,
+	/* max */	NULL,
+	/* default */	"off",
+	/* units */	"bool",
+	/* flags */	EXPERIMENTAL,
+	/* s-text */
+	"Hand a busy object over to the requests waiting for it once it "
+	"starts streaming.  Instead of being rushed to look the object up "
+	"again, the requests which would hit it get it directly, and only "
+	"the others are rushed.",
+	/* l-text */	"",
+	/* func */	NULL
+)
+
 #if 0
 /* see mgt_waiter.c */
 PARAM(
@@ -1794,6 +2124,27 @@ PARAM(
 	/* func */      NULL
 )
 
+PARAM(
+	/* name */      h2_encoder_table_size,
+	/* typ */       bytes_u,
+	/* min */       "0b",
+	/* max */       "64k",
+	/* default */   "0b",
+	/* units */     "bytes",
+	/* flags */     EXPERIMENTAL,
+	/* s-text */
+	"HTTP2 HPACK encoder table size.\n"
+	"Upper bound for the dynamic table used to compress response\n"
+	"headers on each HTTP2 connection, further limited by the\n"
+	"header table size announced by the client.  Headers which\n"
+	"repeat across responses are then sent as table references,\n"
+	"and header strings are Huffman coded where that is shorter.\n"
+	"Zero only uses the static table and sends plain strings.\n"
+	"Changes take effect on new connections.",
+	/* l-text */    "",
+	/* func */      NULL
+)
+
 PARAM(
        /* name */      h2_max_concurrent_streams,
        /* typ */       uint,
@@ -42,6 +42,10 @@
   WAITER(epoll)
 #endif
 
+#if defined(HAVE_LIBURING)
+  WAITER(io_uring)
+#endif
+
 WAITER(poll)
 #undef WAITER
 
@@ -54,6 +54,9 @@
  * unreleased (planned for 2019-09-15)
  *	[cache.h] WS_ReserveAll() added
  *	[cache.h] WS_Reserve(ws, 0) deprecated
+ *	[cache.h] struct objcore.xkey added
+ *	VRT_purge_xkey() added
+ *	struct vrt_backend.h2c added
  * 9.0 (2019-03-15)
  *	Make 'len' in vmod_priv 'long'
  *	HTTP_Copy() removed
@@ -322,7 +325,8 @@ extern const void * const vrt_magic_string_unset;
 	vtim_dur			first_byte_timeout;	\
 	vtim_dur			between_bytes_timeout;	\
 	unsigned			max_connections;	\
-	unsigned			proxy_header;
+	unsigned			proxy_header;		\
+	unsigned			h2c;
 
 #define VRT_BACKEND_HANDLE()			\
 	do {					\
@@ -337,6 +341,7 @@ extern const void * const vrt_magic_string_unset;
 		DN(between_bytes_timeout);	\
 		DN(max_connections);		\
 		DN(proxy_header);		\
+		DN(h2c);			\
 	} while(0)
 
 struct vrt_backend {
@@ -443,6 +448,7 @@ VCL_BYTES VRT_CacheReqBody(VRT_CTX, VCL_BYTES maxsize);
 const char *VRT_regsub(VRT_CTX, int all, const char *, void *, const char *);
 VCL_VOID VRT_ban_string(VRT_CTX, VCL_STRING);
 VCL_INT VRT_purge(VRT_CTX, VCL_DURATION, VCL_DURATION, VCL_DURATION);
+VCL_INT VRT_purge_xkey(VRT_CTX, VCL_STRING);
 VCL_VOID VRT_synth(VRT_CTX, VCL_INT, VCL_STRING);
 VCL_VOID VRT_hit_for_pass(VRT_CTX, VCL_DURATION);
 
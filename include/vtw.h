@@ -0,0 +1,78 @@
+/*-
+ * Copyright (c) 2019 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Hierarchical timer wheel
+ *
+ * Timers are kept in lists by the tick they are due in, four levels
+ * of 256 lists each, so inserting and deleting a timer are O(1).  The
+ * first level has a list per tick, each higher level a list per 256
+ * lists of the level below, which are spread out over it as the wheel
+ * turns.  Timers never fire early, and at most one tick late.
+ *
+ * The wheel does no locking.
+ */
+
+struct vtw;
+
+struct vtw_timer {
+	VLIST_ENTRY(vtw_timer)	list;
+	void			*priv;
+	uint64_t		tick;
+	unsigned		slot;
+#define VTW_NOSLOT		0
+};
+
+struct vtw *VTW_New(double tick, double now);
+void VTW_Destroy(struct vtw **);
+unsigned VTW_Count(const struct vtw *);
+
+void VTW_Insert(struct vtw *, struct vtw_timer *, double when);
+	/*
+	 * Arm a timer, its priv must be set.
+	 */
+
+int VTW_Delete(struct vtw *, struct vtw_timer *);
+	/*
+	 * Disarm a timer, returns zero if it was not armed.
+	 */
+
+struct vtw_timer *VTW_Due(struct vtw *, double now);
+	/*
+	 * Turn the wheel to now, and return a timer which is due, or NULL.
+	 * The timer stays armed until it is deleted.
+	 */
+
+double VTW_Next(const struct vtw *);
+	/*
+	 * The earliest time a timer can be due, never later than when the
+	 * first timer is due.  Zero if a timer is due now, INFINITY if
+	 * there are no timers.
+	 */
+
+static inline int
+VTW_Armed(const struct vtw_timer *t)
+{
+	return (t->slot != VTW_NOSLOT);
+}
@@ -0,0 +1,389 @@
+/*-
+ * Copyright (c) 2019 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Hierarchical timer wheel, see vtw.h
+ *
+ * A timer due in tick T goes on the lowest level L where T and the
+ * tick the wheel is at are less than 256 lists apart, counting in
+ * units of 256^L ticks.  When the wheel turns into a new unit at level
+ * L, the list of that unit is spread out over the levels below it.
+ * Timers too far ahead for the top level wait in its last list, and
+ * go there again each time it comes around.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vdef.h"
+
+#include "vas.h"
+#include "miniobj.h"
+#include "vqueue.h"
+#include "vtw.h"
+
+#define VTW_BITS	8
+#define VTW_SLOTS	(1U << VTW_BITS)
+#define VTW_MASK	((uint64_t)VTW_SLOTS - 1)
+#define VTW_LEVELS	4
+#define VTW_MAPW	(VTW_SLOTS / 64)
+
+#define VTW_DUE		1
+#define VTW_SLOT0	2
+
+VLIST_HEAD(vtw_list, vtw_timer);
+
+struct vtw {
+	unsigned		magic;
+#define VTW_MAGIC		0x2c7b1e4d
+	unsigned		n;
+	double			tick;
+	uint64_t		cur;		/* First tick not turned */
+	uint64_t		map[VTW_LEVELS][VTW_MAPW];
+	struct vtw_list		due;
+	struct vtw_list		slot[VTW_LEVELS][VTW_SLOTS];
+};
+
+/*--------------------------------------------------------------------*/
+
+static int
+vtw_empty(const struct vtw *w, unsigned l)
+{
+	unsigned u;
+
+	for (u = 0; u < VTW_MAPW; u++)
+		if (w->map[l][u])
+			return (0);
+	return (1);
+}
+
+static void
+vtw_place(struct vtw *w, struct vtw_timer *t)
+{
+	unsigned l, s;
+	uint64_t i;
+
+	if (t->tick < w->cur) {
+		VLIST_INSERT_HEAD(&w->due, t, list);
+		t->slot = VTW_DUE;
+		return;
+	}
+	for (l = 0; l < VTW_LEVELS; l++) {
+		s = l * VTW_BITS;
+		if ((t->tick >> s) - (w->cur >> s) <= VTW_MASK)
+			break;
+	}
+	if (l < VTW_LEVELS) {
+		i = (t->tick >> s) & VTW_MASK;
+	} else {
+		l = VTW_LEVELS - 1;
+		s = l * VTW_BITS;
+		i = ((w->cur >> s) + VTW_MASK) & VTW_MASK;
+	}
+	VLIST_INSERT_HEAD(&w->slot[l][i], t, list);
+	w->map[l][i >> 6] |= (uint64_t)1 << (i & 63);
+	t->slot = VTW_SLOT0 + l * VTW_SLOTS + (unsigned)i;
+}
+
+static void
+vtw_unlink(struct vtw *w, struct vtw_timer *t)
+{
+	unsigned l, i;
+
+	assert(t->slot != VTW_NOSLOT);
+	VLIST_REMOVE(t, list);
+	if (t->slot >= VTW_SLOT0) {
+		l = (t->slot - VTW_SLOT0) / VTW_SLOTS;
+		i = (t->slot - VTW_SLOT0) % VTW_SLOTS;
+		assert(l < VTW_LEVELS);
+		if (VLIST_EMPTY(&w->slot[l][i]))
+			w->map[l][i >> 6] &= ~((uint64_t)1 << (i & 63));
+	}
+	t->slot = VTW_NOSLOT;
+}
+
+static void
+vtw_spread(struct vtw *w, unsigned l)
+{
+	struct vtw_timer *t;
+	struct vtw_list *head;
+
+	head = &w->slot[l][(w->cur >> (l * VTW_BITS)) & VTW_MASK];
+	while ((t = VLIST_FIRST(head)) != NULL) {
+		vtw_unlink(w, t);
+		vtw_place(w, t);
+	}
+}
+
+/* Turn the current tick, or skip ahead over empty ones */
+
+static void
+vtw_turn(struct vtw *w, uint64_t target)
+{
+	struct vtw_timer *t;
+	struct vtw_list *head;
+	uint64_t step;
+	unsigned l;
+
+	for (l = 0; l < VTW_LEVELS && vtw_empty(w, l); l++)
+		continue;
+	if (l == VTW_LEVELS) {
+		w->cur = target + 1;
+		return;
+	}
+	if (l > 0) {
+		step = (uint64_t)1 << (l * VTW_BITS);
+		if (w->cur & (step - 1)) {
+			w->cur = (w->cur | (step - 1)) + 1;
+			if (w->cur > target + 1)
+				w->cur = target + 1;
+			return;
+		}
+	}
+
+	for (l = VTW_LEVELS - 1; l > 0; l--) {
+		step = (uint64_t)1 << (l * VTW_BITS);
+		if (!(w->cur & (step - 1)))
+			vtw_spread(w, l);
+	}
+	head = &w->slot[0][w->cur & VTW_MASK];
+	while ((t = VLIST_FIRST(head)) != NULL) {
+		assert(t->tick == w->cur);
+		vtw_unlink(w, t);
+		VLIST_INSERT_HEAD(&w->due, t, list);
+		t->slot = VTW_DUE;
+	}
+	w->cur++;
+}
+
+static uint64_t
+vtw_tick(const struct vtw *w, double when)
+{
+	double d;
+
+	d = when / w->tick;
+	if (!(d > 0.))
+		return (0);
+	if (d >= 0x1p62)
+		return ((uint64_t)1 << 62);
+	return ((uint64_t)ceil(d));
+}
+
+/*--------------------------------------------------------------------*/
+
+struct vtw *
+VTW_New(double tick, double now)
+{
+	struct vtw *w;
+	unsigned l, i;
+
+	assert(tick > 0.);
+	ALLOC_OBJ(w, VTW_MAGIC);
+	AN(w);
+	w->tick = tick;
+	w->cur = vtw_tick(w, now);
+	VLIST_INIT(&w->due);
+	for (l = 0; l < VTW_LEVELS; l++)
+		for (i = 0; i < VTW_SLOTS; i++)
+			VLIST_INIT(&w->slot[l][i]);
+	return (w);
+}
+
+void
+VTW_Destroy(struct vtw **wp)
+{
+	struct vtw *w;
+
+	TAKE_OBJ_NOTNULL(w, wp, VTW_MAGIC);
+	AZ(w->n);
+	FREE_OBJ(w);
+}
+
+unsigned
+VTW_Count(const struct vtw *w)
+{
+
+	CHECK_OBJ_NOTNULL(w, VTW_MAGIC);
+	return (w->n);
+}
+
+void
+VTW_Insert(struct vtw *w, struct vtw_timer *t, double when)
+{
+
+	CHECK_OBJ_NOTNULL(w, VTW_MAGIC);
+	AN(t);
+	AN(t->priv);
+	assert(t->slot == VTW_NOSLOT);
+	t->tick = vtw_tick(w, when);
+	vtw_place(w, t);
+	w->n++;
+}
+
+int
+VTW_Delete(struct vtw *w, struct vtw_timer *t)
+{
+
+	CHECK_OBJ_NOTNULL(w, VTW_MAGIC);
+	AN(t);
+	if (t->slot == VTW_NOSLOT)
+		return (0);
+	vtw_unlink(w, t);
+	assert(w->n > 0);
+	w->n--;
+	return (1);
+}
+
+struct vtw_timer *
+VTW_Due(struct vtw *w, double now)
+{
+	uint64_t target;
+
+	CHECK_OBJ_NOTNULL(w, VTW_MAGIC);
+	target = vtw_tick(w, now);
+	/* vtw_tick() rounds up, but "now" must be past the tick */
+	if (target > 0 && target * w->tick > now)
+		target--;
+	while (VLIST_EMPTY(&w->due) && w->cur <= target)
+		vtw_turn(w, target);
+	return (VLIST_FIRST(&w->due));
+}
+
+double
+VTW_Next(const struct vtw *w)
+{
+	uint64_t b, d, i, t, best = UINT64_MAX;
+	unsigned l, s;
+
+	CHECK_OBJ_NOTNULL(w, VTW_MAGIC);
+	if (!VLIST_EMPTY(&w->due))
+		return (0.);
+	for (l = 0; l < VTW_LEVELS; l++) {
+		s = l * VTW_BITS;
+		b = w->cur >> s;
+		/* Above the first level, the current unit is spread out */
+		d = (l == 0 || !(w->cur & (((uint64_t)1 << s) - 1))) ? 0 : 1;
+		for (; d < VTW_SLOTS; d++) {
+			i = (b + d) & VTW_MASK;
+			if (w->map[l][i >> 6] & ((uint64_t)1 << (i & 63)))
+				break;
+		}
+		if (d == VTW_SLOTS)
+			continue;
+		t = (b + d) << s;
+		if (t < best)
+			best = t;
+	}
+	if (best == UINT64_MAX)
+		return (INFINITY);
+	return (best * w->tick);
+}
+
+#ifdef VTW_TEST
+/*
+ * Run a wheel against a brute force model, with timers from one tick
+ * to beyond the top level, and time going forward in small and big
+ * steps.
+ */
+
+#include <stdio.h>
+
+#define N	20000
+#define TICK	1e-3
+
+static struct vtw_timer timer[N];
+static double when[N];
+
+static void
+check(const struct vtw *w, double now)
+{
+	double next, first = INFINITY;
+	unsigned u, n = 0;
+
+	for (u = 0; u < N; u++) {
+		if (!VTW_Armed(&timer[u]))
+			continue;
+		n++;
+		/* Due timers must have been returned */
+		assert(when[u] > now - TICK);
+		if (when[u] < first)
+			first = when[u];
+	}
+	assert(n == VTW_Count(w));
+	next = VTW_Next(w);
+	assert(next > now);
+	assert(next <= first + TICK * 1.001);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct vtw_timer *t;
+	struct vtw *w;
+	double now = 1.5e9, dt;
+	unsigned u, i, fired = 0;
+
+	(void)argc;
+	srand48(1);
+	w = VTW_New(TICK, now);
+	for (u = 0; u < N; u++)
+		timer[u].priv = &when[u];
+
+	for (i = 0; i < 2000; i++) {
+		for (u = 0; u < N / 10; u++) {
+			t = &timer[lrand48() % N];
+			if (VTW_Armed(t)) {
+				AN(VTW_Delete(w, t));
+				continue;
+			}
+			dt = ldexp(drand48(), (int)(lrand48() % 36)) * TICK;
+			*(double *)t->priv = now + dt;
+			VTW_Insert(w, t, now + dt);
+		}
+		if (i % 10 == 9)
+			now += ldexp(drand48(), (int)(lrand48() % 30)) * TICK;
+		else
+			now += drand48() * 10 * TICK;
+		while ((t = VTW_Due(w, now)) != NULL) {
+			/* Never early */
+			assert(*(double *)t->priv <= now);
+			AN(VTW_Delete(w, t));
+			AZ(VTW_Delete(w, t));
+			fired++;
+		}
+		check(w, now);
+	}
+	for (u = 0; u < N; u++)
+		(void)VTW_Delete(w, &timer[u]);
+	AZ(VTW_Next(w) < INFINITY);
+	VTW_Destroy(&w);
+	AZ(w);
+	printf("%s: OK (%u timers fired)\n", *argv, fired);
+	return (0);
+}
+#endif
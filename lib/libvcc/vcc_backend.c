@@ -299,6 +299,8 @@ vcc_ParseHostDef(struct vcc *tl, const struct token *t_be, const char *vgcname)
 	struct token *t_port = NULL;
 	struct token *t_path = NULL;
 	struct token *t_hosthdr = NULL;
+	struct token *t_h2c = NULL;
+	struct token *t_proxy = NULL;
 	struct symbol *pb;
 	struct token *t_did = NULL;
 	struct fld_spec *fs;
@@ -319,6 +321,7 @@ vcc_ParseHostDef(struct vcc *tl, const struct token *t_be, const char *vgcname)
 	    "?probe",
 	    "?max_connections",
 	    "?proxy_header",
+	    "?protocol",
 	    NULL);
 
 	SkipToken(tl, '{');
@@ -411,6 +414,7 @@ vcc_ParseHostDef(struct vcc *tl, const struct token *t_be, const char *vgcname)
 			SkipToken(tl, ';');
 			Fb(tl, 0, "\t.max_connections = %u,\n", u);
 		} else if (vcc_IdIs(t_field, "proxy_header")) {
+			t_proxy = t_field;
 			t_val = tl->t;
 			u = vcc_UintVal(tl);
 			ERRCHK(tl);
@@ -422,6 +426,20 @@ vcc_ParseHostDef(struct vcc *tl, const struct token *t_be, const char *vgcname)
 			}
 			SkipToken(tl, ';');
 			Fb(tl, 0, "\t.proxy_header = %u,\n", u);
+		} else if (vcc_IdIs(t_field, "protocol")) {
+			ExpectErr(tl, CSTR);
+			assert(tl->t->dec != NULL);
+			if (!strcmp(tl->t->dec, "h2c")) {
+				t_h2c = t_field;
+				Fb(tl, 0, "\t.h2c = 1,\n");
+			} else if (strcmp(tl->t->dec, "HTTP/1.1")) {
+				VSB_printf(tl->sb, ".protocol must be"
+				    " \"HTTP/1.1\" or \"h2c\"\n");
+				vcc_ErrWhere(tl, tl->t);
+				return;
+			}
+			vcc_NextToken(tl);
+			SkipToken(tl, ';');
 		} else if (vcc_IdIs(t_field, "probe") && tl->t->tok == '{') {
 			vcc_ParseProbeSpec(tl, NULL, &p);
 			Fb(tl, 0, "\t.probe = %s,\n", p);
@@ -455,6 +473,13 @@ vcc_ParseHostDef(struct vcc *tl, const struct token *t_be, const char *vgcname)
 	vcc_FieldsOk(tl, fs);
 	ERRCHK(tl);
 
+	if (t_h2c != NULL && t_proxy != NULL) {
+		VSB_printf(tl->sb,
+		    ".proxy_header cannot be used with .protocol = \"h2c\"\n");
+		vcc_ErrWhere(tl, t_proxy);
+		return;
+	}
+
 	if (t_host == NULL && t_path == NULL) {
 		VSB_printf(tl->sb, "Expected .host or .path.\n");
 		vcc_ErrWhere(tl, t_be);
@@ -1269,6 +1269,12 @@ local void lm_init (s)
 /* For 80x86 and 680x0, an optimized version will be provided in match.asm or
  * match.S. The code will be functionally equivalent.
  */
+#if !defined(UNALIGNED_OK) && defined(__GNUC__) && defined(__LP64__) && \
+    defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   /* Compare eight bytes at a time, the result is the same */
+#  define LONGEST_MATCH64
+#endif
+
 local uInt longest_match(s, cur_match)
     deflate_state *s;
     IPos cur_match;                             /* current match */
@@ -1361,6 +1367,38 @@ local uInt longest_match(s, cur_match)
         len = (MAX_MATCH - 1) - (int)(strend-scan);
         scan = strend - (MAX_MATCH-1);
 
+#elif defined(LONGEST_MATCH64)
+
+        if (match[best_len]   != scan_end  ||
+            match[best_len-1] != scan_end1 ||
+            *match            != *scan     ||
+            match[1]          != scan[1])      continue;
+
+        /* As below, scan[2] and match[2] are equal, so start at
+         * strstart+3.  The first differing byte is found from the lowest
+         * set bit of the xor, and as below, the last load reaches
+         * strstart+258 but no further.
+         */
+        Assert(scan[2] == match[2], "match[2]?");
+        scan += 3, match += 3;
+        do {
+            unsigned long sw, mw;
+
+            zmemcpy(&sw, scan, sizeof sw);
+            zmemcpy(&mw, match, sizeof mw);
+            if ((sw ^= mw) != 0) {
+                scan += __builtin_ctzl(sw) >> 3;
+                break;
+            }
+            scan += sizeof sw, match += sizeof mw;
+        } while (scan < strend);
+
+        Assert(scan <= s->window+(unsigned)(s->window_size-1), "wild scan");
+
+        len = MAX_MATCH - (int)(strend - scan);
+        if (len > MAX_MATCH) len = MAX_MATCH;
+        scan = strend - MAX_MATCH;
+
 #else /* UNALIGNED_OK */
 
         if (match[best_len]   != scan_end  ||
@@ -8,4 +8,14 @@
    subject to change. Applications should only use zlib.h.
  */
 
+/* inflate() only calls inflate_fast() with at least this much available */
+#if defined(__GNUC__) && defined(__LP64__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define INFLATE_FAST64
+#  define INFLATE_FAST_MIN_INPUT 8
+#else
+#  define INFLATE_FAST_MIN_INPUT 6
+#endif
+#define INFLATE_FAST_MIN_OUTPUT 258
+
 void ZLIB_INTERNAL inflate_fast OF((z_streamp strm, unsigned start));
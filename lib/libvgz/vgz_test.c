@@ -0,0 +1,280 @@
+/*-
+ * Copyright (c) 2019 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Check the libvgz CRC and inflate/deflate fast paths against plain
+ * implementations and a round trip, and with -b, benchmark them.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zutil.h"
+
+#define BUFSZ	(1 << 22)
+
+static unsigned char buf[BUFSZ];
+static unsigned char zbuf[BUFSZ + (BUFSZ >> 8)];
+static unsigned char obuf[BUFSZ];
+
+static const char * const words[] = {
+	"<div class=\"", "item", "\">", "</div>\n", "<a href=\"/", "foo/",
+	"bar", ".html\">", "</a>", " ", "Varnish", "Cache", "the", "of",
+	"{\"id\": ", ", \"name\": \"", "\"}, ", "\n\t\t",
+};
+
+static int ec;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + 1e-9 * ts.tv_nsec);
+}
+
+/*
+ * Fill buf with markup-like text, then incompressible bytes and runs,
+ * so all of literals, long and short distance and overlapping matches
+ * get exercised.
+ */
+
+static void
+fill(void)
+{
+	uint32_t x = 1;
+	size_t l, u, w;
+
+	for (l = 0; l < BUFSZ * 3 / 4; l += w) {
+		x = x * 1103515245 + 12345;
+		u = (x >> 16) % (sizeof words / sizeof *words);
+		w = strlen(words[u]);
+		if (w > BUFSZ * 3 / 4 - l)
+			w = BUFSZ * 3 / 4 - l;
+		memcpy(buf + l, words[u], w);
+	}
+	for (; l < BUFSZ * 7 / 8; l++) {
+		x = x * 1103515245 + 12345;
+		buf[l] = x >> 16;
+	}
+	for (; l < BUFSZ; l += w) {
+		x = x * 1103515245 + 12345;
+		w = 1 + (x >> 16) % 300;
+		if (w > BUFSZ - l)
+			w = BUFSZ - l;
+		memset(buf + l, x >> 8, w);
+	}
+}
+
+/**********************************************************************/
+
+static uLong
+crc_ref(uLong crc, const unsigned char *p, size_t l)
+{
+	int k;
+
+	crc ^= 0xffffffffUL;
+	while (l--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xedb88320UL : crc >> 1;
+	}
+	return (crc ^ 0xffffffffUL);
+}
+
+static void
+test_crc(const char *name)
+{
+	size_t l, o;
+	uLong a, b, c;
+
+	for (o = 0; o < 16; o++) {
+		for (l = 0; l < 1100; l++) {
+			a = crc32(l, buf + o, l);
+			b = crc_ref(l, buf + o, l);
+			if (a != b) {
+				printf("crc32 (%s) differs at %zu+%zu\n",
+				    name, o, l);
+				ec++;
+				return;
+			}
+		}
+	}
+	c = crc32(0, buf, BUFSZ);
+	if (c != crc_ref(0, buf, BUFSZ)) {
+		printf("crc32 (%s) differs at %d bytes\n", name, BUFSZ);
+		ec++;
+	}
+	for (l = 0; l < BUFSZ; l = l * 3 + 1) {
+		a = crc32(0, buf, l);
+		b = crc32(0, buf + l, BUFSZ - l);
+		if (crc32_combine(a, b, BUFSZ - l) != c) {
+			printf("crc32_combine differs at %zu\n", l);
+			ec++;
+		}
+	}
+}
+
+/**********************************************************************/
+
+static size_t
+vgz_compress(int level, size_t len)
+{
+	z_stream z;
+
+	memset(&z, 0, sizeof z);
+	if (deflateInit2(&z, level, Z_DEFLATED, 31, 9, Z_DEFAULT_STRATEGY))
+		abort();
+	z.next_in = buf;
+	z.avail_in = len;
+	z.next_out = zbuf;
+	z.avail_out = sizeof zbuf;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+		abort();
+	(void)deflateEnd(&z);
+	return (z.total_out);
+}
+
+static size_t
+vgz_decompress(size_t zlen, size_t ichunk, size_t ochunk)
+{
+	z_stream z;
+	size_t i = 0, o = 0;
+	int r;
+
+	memset(&z, 0, sizeof z);
+	if (inflateInit2(&z, 31))
+		abort();
+	do {
+		if (z.avail_in == 0) {
+			z.next_in = zbuf + i;
+			z.avail_in = zlen - i < ichunk ? zlen - i : ichunk;
+			i += z.avail_in;
+		}
+		if (z.avail_out == 0) {
+			z.next_out = obuf + o;
+			z.avail_out = BUFSZ - o < ochunk ? BUFSZ - o : ochunk;
+			o += z.avail_out;
+		}
+		r = inflate(&z, Z_NO_FLUSH);
+	} while (r == Z_OK || (r == Z_BUF_ERROR && i < zlen));
+	(void)inflateEnd(&z);
+	if (r != Z_STREAM_END)
+		return (0);
+	return (z.total_out);
+}
+
+static void
+test_roundtrip(void)
+{
+	static const size_t chunks[][2] = {
+		{ BUFSZ, BUFSZ },
+		{ 1000, 4096 },
+		{ 7, 300 },
+		{ 1, 1 },
+	};
+	size_t zlen, len, u;
+	int level;
+
+	for (level = 1; level <= 9; level += 4) {
+		zlen = vgz_compress(level, BUFSZ);
+		for (u = 0; u < sizeof chunks / sizeof *chunks; u++) {
+			/* Byte at a time is slow, cut it short */
+			len = chunks[u][0] == 1 ? 1 << 16 : BUFSZ;
+			if (len < BUFSZ)
+				zlen = vgz_compress(level, len);
+			memset(obuf, 0, sizeof obuf);
+			if (vgz_decompress(zlen, chunks[u][0],
+			    chunks[u][1]) != len || memcmp(obuf, buf, len)) {
+				printf("level %d, chunks %zu/%zu: "
+				    "round trip failed\n", level,
+				    chunks[u][0], chunks[u][1]);
+				ec++;
+			}
+		}
+	}
+}
+
+/**********************************************************************/
+
+static void
+bench(const char *name)
+{
+	double t0, t1;
+	size_t zlen;
+	uLong c = 0;
+	int u;
+
+	t0 = now();
+	for (u = 0; u < 16; u++)
+		c = crc32(c, buf, BUFSZ);
+	t1 = now();
+	printf("crc32 (%s) %37.1f MB/s\n", name,
+	    16. * BUFSZ / (t1 - t0) * 1e-6);
+
+	t0 = now();
+	for (u = 0; u < 100000; u++)
+		c = crc32_combine(c, u, 1 + u * 7);
+	t1 = now();
+	printf("crc32_combine %40.1f ns/op\n", (t1 - t0) * 1e4);
+
+	t0 = now();
+	zlen = vgz_compress(Z_DEFAULT_COMPRESSION, BUFSZ);
+	t1 = now();
+	printf("deflate %46.1f MB/s\n", BUFSZ / (t1 - t0) * 1e-6);
+
+	t0 = now();
+	for (u = 0; u < 8; u++)
+		(void)vgz_decompress(zlen, 1 << 15, 1 << 15);
+	t1 = now();
+	printf("inflate %46.1f MB/s\n", 8. * BUFSZ / (t1 - t0) * 1e-6);
+}
+
+int
+main(int argc, char **argv)
+{
+
+	(void)argv;
+	fill();
+#ifdef VGZ_PCLMUL
+	vgz_crc32_simd = 0;
+	test_crc("table");
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		bench("table");
+	vgz_crc32_simd = -1;
+	test_crc("best");
+#else
+	test_crc("table");
+#endif
+	test_roundtrip();
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		bench("best");
+	if (!ec)
+		printf("OK\n");
+	return (ec > 0);
+}
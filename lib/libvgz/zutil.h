@@ -233,6 +233,11 @@ extern z_const char * const z_errmsg[10]; /* indexed by 2-zlib_error */
    void ZLIB_INTERNAL zmemzero OF((Bytef* dest, uInt len));
 #endif
 
+#ifdef VGZ_PCLMUL
+   /* -1 until probed, 0 for the tables only, 1 for PCLMULQDQ */
+   extern int ZLIB_INTERNAL vgz_crc32_simd;
+#endif
+
 /* Diagnostic functions */
 #ifdef ZLIB_DEBUG
 #  include <stdio.h>
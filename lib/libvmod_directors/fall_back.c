@@ -64,15 +64,23 @@ vmod_fallback_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag,
 {
 	struct vmod_directors_fallback *fb;
 	struct vdir *vd;
+	const struct vdir_snap *snap;
+	struct vbitmap *healthy;
 	VCL_BACKEND be;
 	VCL_BOOL h;
 	unsigned u, nh;
+	double tw;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(fb, dir->priv, VMOD_DIRECTORS_FALLBACK_MAGIC);
 	CAST_OBJ_NOTNULL(vd, fb->vd, VDIR_MAGIC);
 
+	snap = vdir_enter(vd);
+	char healthy_spc[VBITMAP_SZ(snap->n_backend)];
+	healthy = vbit_init(healthy_spc, sizeof healthy_spc);
+	nh = vdir_health(ctx, vd, snap, healthy, &tw);
+
 	if (pflag) {
 		if (jflag) {
 			VSB_cat(vsb, "{\n");
@@ -86,13 +94,11 @@ vmod_fallback_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag,
 		}
 	}
 
-	vdir_rdlock(vd);
-	vdir_update_health(ctx, vd);
-	for (u = 0; pflag && u < vd->n_backend; u++) {
-		be = vd->backend[u];
+	for (u = 0; pflag && u < snap->n_backend; u++) {
+		be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 
-		h = vbit_test(vd->healthy, u);
+		h = vbit_test(healthy, u);
 
 		if (jflag) {
 			if (u)
@@ -123,9 +129,9 @@ vmod_fallback_list(VRT_CTX, VCL_BACKEND dir, struct vsb *vsb, int pflag,
 			VSB_cat(vsb, "\n");
 		}
 	}
-	nh = vd->n_healthy;
-	u = vd->n_backend;
-	vdir_unlock(vd);
+	u = snap->n_backend;
+	vdir_leave();
+	vbit_destroy(healthy);
 
 	if (jflag && (pflag)) {
 		VSB_cat(vsb, "\n");
@@ -149,27 +155,36 @@ static VCL_BACKEND v_matchproto_(vdi_resolve_f)
 vmod_fallback_resolve(VRT_CTX, VCL_BACKEND dir)
 {
 	struct vmod_directors_fallback *fb;
-	unsigned u;
+	const struct vdir_snap *snap;
+	unsigned u, cur;
 	VCL_BACKEND be = NULL;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(fb, dir->priv, VMOD_DIRECTORS_FALLBACK_MAGIC);
 
-	vdir_wrlock(fb->vd);
-	if (!fb->st)
-		fb->cur = 0;
-	for (u = 0; u < fb->vd->n_backend; u++) {
-		be = fb->vd->backend[fb->cur];
+	snap = vdir_enter(fb->vd);
+	/*
+	 * fb->cur is a hint, which racing threads and remove_backend may
+	 * change under us: we work on a copy and only ever index with it
+	 * once it is inside our snapshot.
+	 */
+	cur = fb->st ? fb->cur : 0;
+	if (cur >= snap->n_backend)
+		cur = 0;
+	for (u = 0; u < snap->n_backend; u++) {
+		be = snap->backend[cur];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 		if (VRT_Healthy(ctx, be, NULL))
 			break;
-		if (++fb->cur == fb->vd->n_backend)
-			fb->cur = 0;
+		if (++cur == snap->n_backend)
+			cur = 0;
 	}
-	vdir_unlock(fb->vd);
-	if (u == fb->vd->n_backend)
+	if (u == snap->n_backend)
 		be = NULL;
+	if (fb->cur != cur)
+		fb->cur = cur;
+	vdir_leave();
 	return (be);
 }
 
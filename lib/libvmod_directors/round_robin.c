@@ -70,6 +70,7 @@ static VCL_BACKEND v_matchproto_(vdi_resolve_f)
 vmod_rr_resolve(VRT_CTX, VCL_BACKEND dir)
 {
 	struct vmod_directors_round_robin *rr;
+	const struct vdir_snap *snap;
 	unsigned u;
 	VCL_BACKEND be = NULL;
 	unsigned nxt;
@@ -77,18 +78,19 @@ vmod_rr_resolve(VRT_CTX, VCL_BACKEND dir)
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(rr, dir->priv, VMOD_DIRECTORS_ROUND_ROBIN_MAGIC);
-	vdir_rdlock(rr->vd);
-	for (u = 0; u < rr->vd->n_backend; u++) {
-		nxt = rr->nxt % rr->vd->n_backend;
+	snap = vdir_enter(rr->vd);
+	/* rr->nxt is a hint, losing an update to a racing thread is fine */
+	for (u = 0; u < snap->n_backend; u++) {
+		nxt = rr->nxt % snap->n_backend;
 		rr->nxt = nxt + 1;
-		be = rr->vd->backend[nxt];
+		be = snap->backend[nxt];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 		if (VRT_Healthy(ctx, be, NULL))
 			break;
 	}
-	vdir_unlock(rr->vd);
-	if (u == rr->vd->n_backend)
+	if (u == snap->n_backend)
 		be = NULL;
+	vdir_leave();
 	return (be);
 }
 
@@ -34,25 +34,179 @@
 #include "cache/cache.h"
 
 #include "vbm.h"
+#include "vmb.h"
 #include "vsb.h"
 
 #include "vdir.h"
 
+/*--------------------------------------------------------------------
+ * Epoch based reclamation of snapshots
+ *
+ * Every thread which looks at a snapshot has a reader record, in which
+ * it notes the global epoch while it is inside.  A replaced snapshot is
+ * stamped with the epoch current at the time, and can be freed once no
+ * reader is inside with an epoch at or below that stamp.
+ *
+ * Readers nest when a director picks through another director, only the
+ * outermost vdir_enter() sets the epoch.
+ */
+
+struct vdir_reader {
+	unsigned				magic;
+#define VDIR_READER_MAGIC			0x4c0e7a5d
+	unsigned				depth;
+	uint64_t				epoch;
+	VTAILQ_ENTRY(vdir_reader)		list;
+};
+
+static pthread_mutex_t vdir_mtx = PTHREAD_MUTEX_INITIALIZER;
+static VTAILQ_HEAD(, vdir_reader) vdir_readers =
+    VTAILQ_HEAD_INITIALIZER(vdir_readers);
+static pthread_key_t vdir_key;
+static unsigned vdir_refcnt;
+static uint64_t vdir_epoch = 1;
+
+static void
+vdir_reader_fini(void *priv)
+{
+	struct vdir_reader *rdr;
+
+	/* The record may be gone already if the last vdir went away */
+	AZ(pthread_mutex_lock(&vdir_mtx));
+	VTAILQ_FOREACH(rdr, &vdir_readers, list)
+		if (rdr == priv)
+			break;
+	if (rdr != NULL) {
+		CHECK_OBJ(rdr, VDIR_READER_MAGIC);
+		AZ(rdr->depth);
+		VTAILQ_REMOVE(&vdir_readers, rdr, list);
+		FREE_OBJ(rdr);
+	}
+	AZ(pthread_mutex_unlock(&vdir_mtx));
+}
+
+static struct vdir_reader *
+vdir_reader(void)
+{
+	struct vdir_reader *rdr;
+
+	rdr = pthread_getspecific(vdir_key);
+	if (rdr != NULL) {
+		CHECK_OBJ(rdr, VDIR_READER_MAGIC);
+		return (rdr);
+	}
+	ALLOC_OBJ(rdr, VDIR_READER_MAGIC);
+	AN(rdr);
+	AZ(pthread_mutex_lock(&vdir_mtx));
+	VTAILQ_INSERT_TAIL(&vdir_readers, rdr, list);
+	AZ(pthread_mutex_unlock(&vdir_mtx));
+	AZ(pthread_setspecific(vdir_key, rdr));
+	return (rdr);
+}
+
+const struct vdir_snap *
+vdir_enter(const struct vdir *vd)
+{
+	struct vdir_reader *rdr;
+	const struct vdir_snap *snap;
+
+	CHECK_OBJ_NOTNULL(vd, VDIR_MAGIC);
+	rdr = vdir_reader();
+	if (rdr->depth++ == 0) {
+		rdr->epoch = vdir_epoch;
+		/* Our epoch must be visible before we look at the snapshot */
+		VMB();
+	}
+	snap = vd->snap;
+	CHECK_OBJ_NOTNULL(snap, VDIR_SNAP_MAGIC);
+	return (snap);
+}
+
+void
+vdir_leave(void)
+{
+	struct vdir_reader *rdr;
+
+	rdr = pthread_getspecific(vdir_key);
+	CHECK_OBJ_NOTNULL(rdr, VDIR_READER_MAGIC);
+	assert(rdr->depth > 0);
+	if (--rdr->depth == 0) {
+		VMB();
+		rdr->epoch = 0;
+	}
+}
+
+/*--------------------------------------------------------------------*/
+
+static struct vdir_snap *
+vdir_snap_new(unsigned n)
+{
+	struct vdir_snap *snap;
+	size_t sz;
+
+	sz = sizeof *snap + n * (sizeof *snap->weight + sizeof *snap->backend);
+	snap = calloc(1, sz);
+	AN(snap);
+	snap->magic = VDIR_SNAP_MAGIC;
+	snap->n_backend = n;
+	snap->weight = (void *)(snap + 1);
+	snap->backend = (void *)(snap->weight + n);
+	return (snap);
+}
+
+static void
+vdir_snap_free(struct vdir_snap **snapp)
+{
+	struct vdir_snap *snap;
+
+	TAKE_OBJ_NOTNULL(snap, snapp, VDIR_SNAP_MAGIC);
+	free(snap);
+}
+
+/*
+ * Replace the snapshot and free those retired snapshots which no reader can
+ * see any more.  Must be called with vd->mtx held.
+ */
+
 static void
-vdir_expand(struct vdir *vd, unsigned n)
+vdir_publish(struct vdir *vd, struct vdir_snap *snap)
 {
+	struct vdir_snap *old, *old2;
+	struct vdir_reader *rdr;
+	uint64_t oldest;
+
 	CHECK_OBJ_NOTNULL(vd, VDIR_MAGIC);
+	CHECK_OBJ_NOTNULL(snap, VDIR_SNAP_MAGIC);
+	old = vd->snap;
+	CHECK_OBJ_NOTNULL(old, VDIR_SNAP_MAGIC);
+
+	/* The snapshot must be complete before anybody can see it */
+	VWMB();
+	vd->snap = snap;
+	VMB();
+
+	AZ(pthread_mutex_lock(&vdir_mtx));
+	old->retired = vdir_epoch++;
+	VTAILQ_INSERT_TAIL(&vd->retired, old, list);
+	VMB();
+	oldest = vdir_epoch;
+	VTAILQ_FOREACH(rdr, &vdir_readers, list) {
+		CHECK_OBJ(rdr, VDIR_READER_MAGIC);
+		if (rdr->epoch != 0 && rdr->epoch < oldest)
+			oldest = rdr->epoch;
+	}
+	AZ(pthread_mutex_unlock(&vdir_mtx));
 
-	vd->backend = realloc(vd->backend, n * sizeof *vd->backend);
-	AN(vd->backend);
-	vd->weight = realloc(vd->weight, n * sizeof *vd->weight);
-	AN(vd->weight);
-	if (n > vd->healthy->nbits)
-		vbit_expand(vd->healthy, n);
-	AN(vd->healthy);
-	vd->l_backend = n;
+	VTAILQ_FOREACH_SAFE(old, &vd->retired, list, old2) {
+		if (old->retired >= oldest)
+			continue;
+		VTAILQ_REMOVE(&vd->retired, old, list);
+		vdir_snap_free(&old);
+	}
 }
 
+/*--------------------------------------------------------------------*/
+
 void
 vdir_new(VRT_CTX, struct vdir **vdp, const char *vcl_name,
     const struct vdi_methods *m, void *priv)
@@ -64,56 +218,64 @@ vdir_new(VRT_CTX, struct vdir **vdp, const char *vcl_name,
 	AN(vcl_name);
 	AN(vdp);
 	AZ(*vdp);
+
+	AZ(pthread_mutex_lock(&vdir_mtx));
+	if (vdir_refcnt++ == 0)
+		AZ(pthread_key_create(&vdir_key, vdir_reader_fini));
+	AZ(pthread_mutex_unlock(&vdir_mtx));
+
 	ALLOC_OBJ(vd, VDIR_MAGIC);
 	AN(vd);
 	*vdp = vd;
-	AZ(pthread_rwlock_init(&vd->mtx, NULL));
+	AZ(pthread_mutex_init(&vd->mtx, NULL));
+	VTAILQ_INIT(&vd->retired);
+	vd->snap = vdir_snap_new(0);
 	vd->dir = VRT_AddDirector(ctx, m, priv, "%s", vcl_name);
-	vd->healthy = vbit_new(8);
-	AN(vd->healthy);
 }
 
 void
 vdir_delete(struct vdir **vdp)
 {
 	struct vdir *vd;
+	struct vdir_snap *snap;
+	struct vdir_reader *rdr;
 
 	TAKE_OBJ_NOTNULL(vd, vdp, VDIR_MAGIC);
 
 	AZ(vd->dir);
-	free(vd->backend);
-	free(vd->weight);
-	AZ(pthread_rwlock_destroy(&vd->mtx));
-	vbit_destroy(vd->healthy);
+	while (!VTAILQ_EMPTY(&vd->retired)) {
+		snap = VTAILQ_FIRST(&vd->retired);
+		VTAILQ_REMOVE(&vd->retired, snap, list);
+		vdir_snap_free(&snap);
+	}
+	vdir_snap_free(&vd->snap);
+	AZ(pthread_mutex_destroy(&vd->mtx));
 	FREE_OBJ(vd);
-}
-
-void
-vdir_rdlock(struct vdir *vd)
-{
-	CHECK_OBJ_NOTNULL(vd, VDIR_MAGIC);
-	AZ(pthread_rwlock_rdlock(&vd->mtx));
-}
-
-void
-vdir_wrlock(struct vdir *vd)
-{
-	CHECK_OBJ_NOTNULL(vd, VDIR_MAGIC);
-	AZ(pthread_rwlock_wrlock(&vd->mtx));
-}
 
-void
-vdir_unlock(struct vdir *vd)
-{
-	CHECK_OBJ_NOTNULL(vd, VDIR_MAGIC);
-	AZ(pthread_rwlock_unlock(&vd->mtx));
+	/*
+	 * Once the last vdir is gone, nobody can be inside, and the key
+	 * goes away lest its destructor outlives the vmod.
+	 */
+	AZ(pthread_mutex_lock(&vdir_mtx));
+	assert(vdir_refcnt > 0);
+	if (--vdir_refcnt == 0) {
+		while (!VTAILQ_EMPTY(&vdir_readers)) {
+			rdr = VTAILQ_FIRST(&vdir_readers);
+			CHECK_OBJ(rdr, VDIR_READER_MAGIC);
+			AZ(rdr->depth);
+			VTAILQ_REMOVE(&vdir_readers, rdr, list);
+			FREE_OBJ(rdr);
+		}
+		AZ(pthread_key_delete(vdir_key));
+	}
+	AZ(pthread_mutex_unlock(&vdir_mtx));
 }
 
-
 void
 vdir_add_backend(VRT_CTX, struct vdir *vd, VCL_BACKEND be, double weight)
 {
-	unsigned u;
+	struct vdir_snap *old, *snap;
+	unsigned n;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(vd, VDIR_MAGIC);
@@ -123,19 +285,23 @@ vdir_add_backend(VRT_CTX, struct vdir *vd, VCL_BACKEND be, double weight)
 		return;
 	}
 	AN(be);
-	vdir_wrlock(vd);
-	if (vd->n_backend >= vd->l_backend)
-		vdir_expand(vd, vd->l_backend + 16);
-	assert(vd->n_backend < vd->l_backend);
-	u = vd->n_backend++;
-	vd->backend[u] = be;
-	vd->weight[u] = weight;
-	vdir_unlock(vd);
+	AZ(pthread_mutex_lock(&vd->mtx));
+	old = vd->snap;
+	CHECK_OBJ_NOTNULL(old, VDIR_SNAP_MAGIC);
+	n = old->n_backend;
+	snap = vdir_snap_new(n + 1);
+	memcpy(snap->backend, old->backend, n * sizeof *snap->backend);
+	memcpy(snap->weight, old->weight, n * sizeof *snap->weight);
+	snap->backend[n] = be;
+	snap->weight[n] = weight;
+	vdir_publish(vd, snap);
+	AZ(pthread_mutex_unlock(&vd->mtx));
 }
 
 void
 vdir_remove_backend(VRT_CTX, struct vdir *vd, VCL_BACKEND be, unsigned *cur)
 {
+	struct vdir_snap *old, *snap;
 	unsigned u, n;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
@@ -146,32 +312,42 @@ vdir_remove_backend(VRT_CTX, struct vdir *vd, VCL_BACKEND be, unsigned *cur)
 		return;
 	}
 	CHECK_OBJ(be, DIRECTOR_MAGIC);
-	vdir_wrlock(vd);
-	for (u = 0; u < vd->n_backend; u++)
-		if (vd->backend[u] == be)
+	AZ(pthread_mutex_lock(&vd->mtx));
+	old = vd->snap;
+	CHECK_OBJ_NOTNULL(old, VDIR_SNAP_MAGIC);
+	for (u = 0; u < old->n_backend; u++)
+		if (old->backend[u] == be)
 			break;
-	if (u == vd->n_backend) {
-		vdir_unlock(vd);
+	if (u == old->n_backend) {
+		AZ(pthread_mutex_unlock(&vd->mtx));
 		return;
 	}
-	n = (vd->n_backend - u) - 1;
-	memmove(&vd->backend[u], &vd->backend[u+1], n * sizeof(vd->backend[0]));
-	memmove(&vd->weight[u], &vd->weight[u+1], n * sizeof(vd->weight[0]));
-	vd->n_backend--;
-
+	snap = vdir_snap_new(old->n_backend - 1);
+	n = (old->n_backend - u) - 1;
+	memcpy(snap->backend, old->backend, u * sizeof *snap->backend);
+	memcpy(snap->weight, old->weight, u * sizeof *snap->weight);
+	memcpy(&snap->backend[u], &old->backend[u + 1],
+	    n * sizeof *snap->backend);
+	memcpy(&snap->weight[u], &old->weight[u + 1],
+	    n * sizeof *snap->weight);
+
+	/* *cur is a hint which readers update without the lock */
 	if (cur) {
-		assert(*cur <= vd->n_backend);
+		if (*cur > snap->n_backend)
+			*cur = 0;
 		if (u < *cur)
 			(*cur)--;
-		else if (*cur == vd->n_backend)
+		else if (*cur == snap->n_backend)
 			*cur = 0;
 	}
-	vdir_unlock(vd);
+	vdir_publish(vd, snap);
+	AZ(pthread_mutex_unlock(&vd->mtx));
 }
 
 VCL_BOOL
 vdir_any_healthy(VRT_CTX, struct vdir *vd, VCL_TIME *changed)
 {
+	const struct vdir_snap *snap;
 	unsigned retval = 0;
 	VCL_BACKEND be;
 	unsigned u;
@@ -179,11 +355,11 @@ vdir_any_healthy(VRT_CTX, struct vdir *vd, VCL_TIME *changed)
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(vd, VDIR_MAGIC);
-	vdir_rdlock(vd);
+	snap = vdir_enter(vd);
 	if (changed != NULL)
 		*changed = 0;
-	for (u = 0; u < vd->n_backend; u++) {
-		be = vd->backend[u];
+	for (u = 0; u < snap->n_backend; u++) {
+		be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 		retval = VRT_Healthy(ctx, be, &c);
 		if (changed != NULL && c > *changed)
@@ -191,7 +367,7 @@ vdir_any_healthy(VRT_CTX, struct vdir *vd, VCL_TIME *changed)
 		if (retval)
 			break;
 	}
-	vdir_unlock(vd);
+	vdir_leave();
 	return (retval);
 }
 
@@ -199,21 +375,28 @@ void
 vdir_list(VRT_CTX, struct vdir *vd, struct vsb *vsb, int pflag, int jflag,
     int weight)
 {
+	const struct vdir_snap *snap;
+	struct vbitmap *healthy;
 	VCL_BACKEND be;
 	VCL_BOOL h;
 	unsigned u, nh;
-	double w;
+	double w, tw;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(vd, VDIR_MAGIC);
 
+	snap = vdir_enter(vd);
+	char healthy_spc[VBITMAP_SZ(snap->n_backend)];
+	healthy = vbit_init(healthy_spc, sizeof healthy_spc);
+	nh = vdir_health(ctx, vd, snap, healthy, &tw);
+
 	if (pflag) {
 		if (jflag) {
 			VSB_cat(vsb, "{\n");
 			VSB_indent(vsb, 2);
 			if (weight)
 				VSB_printf(vsb, "\"total_weight\": %f,\n",
-				    vd->total_weight);
+				    tw);
 			VSB_cat(vsb, "\"backends\": {\n");
 			VSB_indent(vsb, 2);
 		} else {
@@ -221,15 +404,13 @@ vdir_list(VRT_CTX, struct vdir *vd, struct vsb *vsb, int pflag, int jflag,
 		}
 	}
 
-	vdir_rdlock(vd);
-	vdir_update_health(ctx, vd);
-	for (u = 0; pflag && u < vd->n_backend; u++) {
-		be = vd->backend[u];
+	for (u = 0; pflag && u < snap->n_backend; u++) {
+		be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 
-		h = vbit_test(vd->healthy, u);
+		h = vbit_test(healthy, u);
 
-		w = h ? vd->weight[u] : 0.0;
+		w = h ? snap->weight[u] : 0.0;
 
 		if (jflag) {
 			if (u)
@@ -252,16 +433,16 @@ vdir_list(VRT_CTX, struct vdir *vd, struct vsb *vsb, int pflag, int jflag,
 			VSB_cat(vsb, be->vcl_name);
 			if (weight)
 				VSB_printf(vsb, "\t%6.2f%%\t",
-				    100 * w / vd->total_weight);
+				    100 * w / tw);
 			else
 				VSB_cat(vsb, "\t-\t");
 			VSB_cat(vsb, h ? "healthy" : "sick");
 			VSB_cat(vsb, "\n");
 		}
 	}
-	nh = vd->n_healthy;
-	u = vd->n_backend;
-	vdir_unlock(vd);
+	u = snap->n_backend;
+	vdir_leave();
+	vbit_destroy(healthy);
 
 	if (jflag && (pflag)) {
 		VSB_cat(vsb, "\n");
@@ -282,67 +463,57 @@ vdir_list(VRT_CTX, struct vdir *vd, struct vsb *vsb, int pflag, int jflag,
 }
 
 /*
- * iterate backends and update
- * - healthy bitmap
- * - number of healthy backends
- * - total_weight
- * - last change time of the VCL_BACKEND
+ * iterate the backends of a snapshot and
+ * - fill the healthy bitmap
+ * - sum up the total weight of the healthy backends
+ * - update the last change time of the VCL_BACKEND
  *
- * must be called under the vdir lock (read or write).
- *
- * A write lock is required if consistency between the individual attributes is
- * a must, e.g. when total_weight is required to be the exact sum of the weights
- *
- * The read lock is safe because add_backend expands the healthy bitmap and all
- * other members are atomic and may be used if consistency is not required.
+ * returns the number of healthy backends.  The bitmap is the caller's and
+ * must have room for snap->n_backend bits, so a pick works on a consistent
+ * view even if the health changes under its feet.
  */
-void
-vdir_update_health(VRT_CTX, struct vdir *vd)
+unsigned
+vdir_health(VRT_CTX, const struct vdir *vd, const struct vdir_snap *snap,
+    struct vbitmap *healthy, double *tw)
 {
 	VCL_TIME c, changed = 0;
-	VCL_BOOL h;
 	VCL_BACKEND be;
 	unsigned u, nh = 0;
-	double tw = 0.0;
-	struct vbitmap *healthy;
 
 	CHECK_OBJ_NOTNULL(vd, VDIR_MAGIC);
-	healthy = vd->healthy;
-	for (u = 0; u < vd->n_backend; u++) {
-		be = vd->backend[u];
+	CHECK_OBJ_NOTNULL(snap, VDIR_SNAP_MAGIC);
+	AN(healthy);
+	assert(healthy->nbits >= snap->n_backend);
+	AN(tw);
+	*tw = 0.0;
+	for (u = 0; u < snap->n_backend; u++) {
+		be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 		c = 0;
-		h = VRT_Healthy(ctx, vd->backend[u], &c);
-		if (h) {
+		if (VRT_Healthy(ctx, be, &c)) {
+			vbit_set(healthy, u);
 			nh++;
-			tw += vd->weight[u];
+			*tw += snap->weight[u];
 		}
 		if (c > changed)
 			changed = c;
-		if (h != vbit_test(healthy, u)) {
-			if (h)
-				vbit_set(healthy, u);
-			else
-				vbit_clr(healthy, u);
-		}
 	}
 	VRT_SetChanged(vd->dir, changed);
-	vd->total_weight = tw;
-	vd->n_healthy = nh;
+	return (nh);
 }
 
 static unsigned
-vdir_pick_by_weight(const struct vdir *vd, double w)
+vdir_pick_by_weight(const struct vdir_snap *snap,
+    const struct vbitmap *healthy, double w)
 {
-	const struct vbitmap *healthy = vd->healthy;
 	double a = 0.0;
 	unsigned u;
 
 	AN(healthy);
-	for (u = 0; u < vd->n_backend; u++) {
+	for (u = 0; u < snap->n_backend; u++) {
 		if (! vbit_test(healthy, u))
 			continue;
-		a += vd->weight[u];
+		a += snap->weight[u];
 		if (w < a)
 			return (u);
 	}
@@ -352,19 +523,25 @@ vdir_pick_by_weight(const struct vdir *vd, double w)
 VCL_BACKEND
 vdir_pick_be(VRT_CTX, struct vdir *vd, double w)
 {
+	const struct vdir_snap *snap;
+	struct vbitmap *healthy;
 	unsigned u;
+	double tw;
 	VCL_BACKEND be = NULL;
 
 	CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
 	CHECK_OBJ_NOTNULL(vd, VDIR_MAGIC);
-	vdir_wrlock(vd);
-	vdir_update_health(ctx, vd);
-	if (vd->total_weight > 0.0) {
-		u = vdir_pick_by_weight(vd, w * vd->total_weight);
-		assert(u < vd->n_backend);
-		be = vd->backend[u];
+	snap = vdir_enter(vd);
+	char healthy_spc[VBITMAP_SZ(snap->n_backend)];
+	healthy = vbit_init(healthy_spc, sizeof healthy_spc);
+	(void)vdir_health(ctx, vd, snap, healthy, &tw);
+	if (tw > 0.0) {
+		u = vdir_pick_by_weight(snap, healthy, w * tw);
+		assert(u < snap->n_backend);
+		be = snap->backend[u];
 		CHECK_OBJ_NOTNULL(be, DIRECTOR_MAGIC);
 	}
-	vdir_unlock(vd);
+	vdir_leave();
+	vbit_destroy(healthy);
 	return (be);
 }
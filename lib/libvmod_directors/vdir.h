@@ -28,29 +28,44 @@
 
 struct vbitmap;
 
-struct vdir {
+/*
+ * The backends of a director are kept in an immutable snapshot, which is
+ * replaced as a whole by add_backend and remove_backend.  Readers bracket
+ * their use of it with vdir_enter() and vdir_leave() and never lock, an
+ * old snapshot is only freed once every thread which might still see it
+ * has left.
+ */
+
+struct vdir_snap {
 	unsigned				magic;
-#define VDIR_MAGIC				0x99f4b726
+#define VDIR_SNAP_MAGIC				0x0bd2a1c5
 	unsigned				n_backend;
-	unsigned				l_backend;
-	unsigned				n_healthy;
-	pthread_rwlock_t			mtx;
-	VCL_BACKEND				*backend;
+	uint64_t				retired;
+	VTAILQ_ENTRY(vdir_snap)			list;
 	double					*weight;
-	double					total_weight;
+	VCL_BACKEND				*backend;
+};
+
+VTAILQ_HEAD(vdir_snap_head, vdir_snap);
+
+struct vdir {
+	unsigned				magic;
+#define VDIR_MAGIC				0x99f4b726
+	pthread_mutex_t				mtx;
+	struct vdir_snap			*snap;
+	struct vdir_snap_head			retired;
 	VCL_BACKEND				dir;
-	struct vbitmap				*healthy;
 };
 
 void vdir_new(VRT_CTX, struct vdir **vdp, const char *vcl_name,
     const struct vdi_methods *, void *priv);
 void vdir_delete(struct vdir **vdp);
-void vdir_rdlock(struct vdir *vd);
-void vdir_wrlock(struct vdir *vd);
-void vdir_unlock(struct vdir *vd);
+const struct vdir_snap *vdir_enter(const struct vdir *vd);
+void vdir_leave(void);
 void vdir_add_backend(VRT_CTX, struct vdir *, VCL_BACKEND, double weight);
 void vdir_remove_backend(VRT_CTX, struct vdir *, VCL_BACKEND, unsigned *cur);
 VCL_BOOL vdir_any_healthy(VRT_CTX, struct vdir *, VCL_TIME *);
 void vdir_list(VRT_CTX, struct vdir *, struct vsb *, int, int, int);
-void vdir_update_health(VRT_CTX, struct vdir *);
+unsigned vdir_health(VRT_CTX, const struct vdir *, const struct vdir_snap *,
+    struct vbitmap *, double *);
 VCL_BACKEND vdir_pick_be(VRT_CTX, struct vdir *, double w);
@@ -226,6 +226,12 @@ vmod_rollback(VRT_CTX, VCL_HTTP hp)
 	VRT_Rollback(ctx, hp);
 }
 
+VCL_INT v_matchproto_(td_std_purge_xkey)
+vmod_purge_xkey(VRT_CTX, VCL_STRING keys)
+{
+	return (VRT_purge_xkey(ctx, keys));
+}
+
 VCL_VOID v_matchproto_(td_std_timestamp)
 vmod_timestamp(VRT_CTX, VCL_STRING label)
 {